@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * event_loop_bench.cpp - Call dispatch latency and throughput of the event loop
+ *
+ * Usage: event_loop_bench [calls]
+ *
+ * Compares the EventLoop call queue against the previous implementation, which
+ * queued std::function objects in a mutex-protected std::list and broke out of
+ * the event base loop for every call.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <thread>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+
+#include "event_loop.h"
+#include "stats.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/*
+ * The list and mutex based call queue that EventLoop used to implement.
+ *
+ * event_base_loop() clears the break flag when it starts, so a call queued
+ * while the previous batch is being dispatched doesn't wake the loop up. A
+ * 1ms tick bounds the resulting delay, which then shows up as latency instead
+ * of stalling the benchmark.
+ */
+class ListEventLoop
+{
+public:
+	ListEventLoop()
+	{
+		evthread_use_pthreads();
+		event_ = event_base_new();
+
+		struct timeval tv = { 0, 1000 };
+		tick_ = event_new(event_, -1, EV_PERSIST,
+				  [](int, short, void *base) {
+					  event_base_loopbreak(static_cast<struct event_base *>(base));
+				  }, event_);
+		event_add(tick_, &tv);
+	}
+
+	~ListEventLoop()
+	{
+		event_free(tick_);
+		event_base_free(event_);
+	}
+
+	int exec()
+	{
+		exit_.store(false, std::memory_order_release);
+
+		while (!exit_.load(std::memory_order_acquire)) {
+			dispatchCalls();
+			event_base_loop(event_, EVLOOP_NO_EXIT_ON_EMPTY);
+		}
+
+		return 0;
+	}
+
+	void exit()
+	{
+		exit_.store(true, std::memory_order_release);
+		event_base_loopbreak(event_);
+	}
+
+	void callLater(const std::function<void()> &func)
+	{
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			calls_.push_back(func);
+		}
+
+		event_base_loopbreak(event_);
+	}
+
+private:
+	void dispatchCalls()
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		for (auto iter = calls_.begin(); iter != calls_.end(); ) {
+			std::function<void()> call = std::move(*iter);
+
+			iter = calls_.erase(iter);
+
+			locker.unlock();
+			call();
+			locker.lock();
+		}
+	}
+
+	struct event_base *event_;
+	struct event *tick_;
+	std::atomic<bool> exit_;
+
+	std::list<std::function<void()>> calls_;
+	std::mutex lock_;
+};
+
+struct Run {
+	LatencyStats latency;
+	unsigned int remaining;
+};
+
+/*
+ * Queue calls from a producer thread, pacing them by interval, and record the
+ * delay between queueing and dispatch of each call. Returns the wall time from
+ * the first call being queued to the last one being run.
+ */
+template<typename Loop>
+std::chrono::duration<double> run(Loop &loop, Run &result, unsigned int calls,
+				  std::chrono::microseconds interval)
+{
+	result.latency.reset();
+	result.remaining = calls;
+
+	Clock::time_point start = Clock::now();
+
+	std::thread producer([&loop, &result, calls, interval]() {
+		Run *ctx = &result;
+		Loop *target = &loop;
+		Clock::time_point next = Clock::now();
+
+		for (unsigned int i = 0; i < calls; ++i) {
+			if (interval.count()) {
+				next += interval;
+				while (Clock::now() < next)
+					std::this_thread::yield();
+			}
+
+			Clock::time_point queued = Clock::now();
+			loop.callLater([ctx, target, queued]() {
+				ctx->latency.record(Clock::now() - queued);
+				if (!--ctx->remaining)
+					target->exit();
+			});
+		}
+	});
+
+	loop.exec();
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+
+	producer.join();
+
+	return elapsed;
+}
+
+template<typename Loop>
+void report(const char *name, Loop &loop, unsigned int calls)
+{
+	Run result;
+
+	/* Paced calls, as when completing camera requests. */
+	run(loop, result, std::min(calls, 20000U), std::chrono::microseconds(50));
+	std::cout << std::setw(8) << name << "  paced  ";
+	result.latency.report(std::cout);
+
+	/* Back-to-back calls, to measure the cost of queueing and dispatch. */
+	std::chrono::duration<double> elapsed =
+		run(loop, result, calls, std::chrono::microseconds(0));
+	std::cout << std::setw(8) << name << "  burst  ";
+	result.latency.report(std::cout);
+	std::cout << std::setw(8) << name << "  burst  "
+		  << std::fixed << std::setprecision(2)
+		  << calls / elapsed.count() / 1e6 << " Mcalls/s" << std::endl;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	unsigned int calls = 1000000;
+
+	if (argc > 1)
+		calls = std::max(1, atoi(argv[1]));
+
+	{
+		ListEventLoop loop;
+		report("list", loop, calls);
+	}
+
+	{
+		EventLoop loop;
+		report("ring", loop, calls);
+	}
+
+	return 0;
+}
@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * hotpath_bench.cpp - Benchmark of the per-frame hot paths, without a camera
+ *
+ * Usage: hotpath_bench [frames] [output.json]
+ *
+ * Runs the JPEG encoder, the raw frame writes of FileSink, the event loop call
+ * dispatch, the mapping of frame buffers and the luma block sums of the motion
+ * detector on synthetic YUV420 frames, and
+ * prints the results as JSON. The results are also written to output.json
+ * when given, to be compared between builds.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <libcamera/framebuffer.h>
+
+#include "event_loop.h"
+#include "file_writer.h"
+#include "image.h"
+#include "jpeg_encoder.h"
+#include "pixel_convert.h"
+#include "stats.h"
+#include "synthetic_frame.h"
+
+/*
+ * Count the heap allocations of all threads, to catch allocations per frame.
+ * The operators are kept out of line, as compilers warn about free() being
+ * called on memory from operator new once they are inlined.
+ */
+static std::atomic<uint64_t> heapAllocations{ 0 };
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Resolution {
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+const Resolution resolutions[] = {
+	{ "640x480", 640, 480 },
+	{ "1280x720", 1280, 720 },
+	{ "1920x1080", 1920, 1080 },
+};
+
+struct Result {
+	std::string name;
+	std::string resolution;
+	unsigned int frames;
+	double seconds;
+	size_t frameSize;
+	uint64_t allocations;
+	LatencyStats latency;
+};
+
+/* Frames, or calls, per second and payload throughput of a run */
+void writeResult(std::ostream &out, const Result &result)
+{
+	double fps = result.frames / result.seconds;
+	auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+
+	out << "    { \"name\": \"" << result.name << "\""
+	    << ", \"resolution\": \"" << result.resolution << "\""
+	    << std::fixed << std::setprecision(1)
+	    << ", \"frames\": " << result.frames
+	    << ", \"frames_per_s\": " << fps
+	    << ", \"mb_per_s\": " << fps * result.frameSize / 1e6
+	    << ", \"p50_us\": " << us(result.latency.percentile(50))
+	    << ", \"p99_us\": " << us(result.latency.percentile(99))
+	    << std::setprecision(2)
+	    << ", \"allocations_per_frame\": "
+	    << static_cast<double>(result.allocations) / result.frames
+	    << " }";
+}
+
+/*
+ * Compress with a single worker, as each JpegSink worker does. The encoder
+ * is warmed up first, later frames must not allocate memory.
+ */
+void benchJpeg(Result &result, const Resolution &res,
+	       const std::vector<uint8_t> &pixels)
+{
+	JpegEncoder encoder(1);
+	encoder.configure(res.width, res.height);
+
+	JpegEncoder::Frame frame;
+	frame.width = res.width;
+	frame.height = res.height;
+	frame.y = pixels.data();
+	frame.u = frame.y + res.width * res.height;
+	frame.v = frame.u + res.width * res.height / 4;
+	frame.stride = res.width;
+	frame.chromaStride = res.width / 2;
+
+	std::vector<uint8_t> output;
+	output.reserve(JpegEncoder::maxOutputSize(res.width, res.height));
+	encoder.encode(frame, output);
+
+	uint64_t heap = heapAllocations.load();
+	uint64_t encoderAllocations = encoder.allocations();
+	Clock::time_point start = Clock::now();
+
+	for (unsigned int i = 0; i < result.frames; ++i) {
+		Clock::time_point begin = Clock::now();
+		encoder.encode(frame, output);
+		result.latency.record(Clock::now() - begin);
+	}
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.allocations = heapAllocations.load() - heap
+			   + encoder.allocations() - encoderAllocations;
+}
+
+struct WriteContext {
+	Clock::time_point begin;
+	LatencyStats *latency;
+};
+
+/*
+ * Append the planes of each frame to a file through the FileWriter, as
+ * FileSink does, and measure the time from submission to completion. The
+ * file cycles through 4 frame slots to bound its size.
+ */
+void benchWrite(Result &result, const Resolution &res,
+		const std::vector<uint8_t> &pixels, const std::string &dir)
+{
+	std::string path = dir + "/hotpath_bench.raw";
+	int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "failed to open " << path << ": "
+			  << strerror(errno) << std::endl;
+		return;
+	}
+
+	std::unique_ptr<FileWriter> writer = FileWriter::create();
+	result.name = std::string("write-") + writer->name();
+
+	/* Contexts are reused once all the batches have been recycled. */
+	std::vector<WriteContext> contexts(32, { {}, &result.latency });
+	size_t lumaSize = res.width * res.height;
+	size_t chromaSize = lumaSize / 4;
+
+	auto written = [](void *arg, int ret) {
+		WriteContext *context = static_cast<WriteContext *>(arg);
+		if (ret < 0)
+			std::cerr << "write error: " << strerror(-ret) << std::endl;
+		context->latency->record(Clock::now() - context->begin);
+	};
+
+	uint64_t heap = heapAllocations.load();
+	Clock::time_point start = Clock::now();
+
+	for (unsigned int i = 0; i < result.frames; ++i) {
+		uint64_t offset = (i % 4) * pixels.size();
+		const FileWriter::Write writes[3] = {
+			{ fd, offset, pixels.data(), lumaSize },
+			{ fd, offset + lumaSize, pixels.data() + lumaSize, chromaSize },
+			{ fd, offset + lumaSize + chromaSize,
+			  pixels.data() + lumaSize + chromaSize, chromaSize },
+		};
+
+		WriteContext &context = contexts[i % contexts.size()];
+		context.begin = Clock::now();
+		writer->write(writes, 3, written, &context);
+	}
+
+	writer->wait();
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.allocations = heapAllocations.load() - heap;
+
+	close(fd);
+	unlink(path.c_str());
+}
+
+struct DispatchContext {
+	EventLoop *loop;
+	LatencyStats *latency;
+	std::atomic<unsigned int> dispatched;
+};
+
+/*
+ * Queue calls from another thread, as libcamera completes requests, 4 at a
+ * time as for a request with as many buffers, and measure the delay until the
+ * event loop runs them.
+ */
+void benchDispatch(Result &result)
+{
+	constexpr unsigned int kCallsPerFrame = 4;
+
+	EventLoop loop;
+	DispatchContext ctx = { &loop, &result.latency, { 0 } };
+	unsigned int calls = result.frames * kCallsPerFrame;
+
+	/* Warm up the loop, the call queue doesn't allocate afterwards. */
+	loop.callLater([&loop] { loop.exit(); });
+	loop.exec();
+
+	uint64_t heap = heapAllocations.load();
+	Clock::time_point start = Clock::now();
+
+	std::thread producer([&] {
+		for (unsigned int i = 0; i < result.frames; ++i) {
+			for (unsigned int j = 0; j < kCallsPerFrame; ++j) {
+				Clock::time_point begin = Clock::now();
+				loop.callLater([&ctx, begin, calls] {
+					ctx.latency->record(Clock::now() - begin);
+					if (ctx.dispatched.fetch_add(1) + 1 == calls)
+						ctx.loop->exit();
+				});
+			}
+
+			while (ctx.dispatched.load() < (i + 1) * kCallsPerFrame)
+				std::this_thread::yield();
+		}
+	});
+
+	loop.exec();
+	producer.join();
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.allocations = heapAllocations.load() - heap;
+	result.frames = calls;
+	result.frameSize = 0;
+}
+
+/*
+ * Map and unmap a 3-plane frame buffer backed by a memfd, as BufferCache
+ * does for each buffer allocated for the camera.
+ */
+void benchMap(Result &result, const Resolution &res,
+	      const std::vector<uint8_t> &pixels)
+{
+	int fd = memfd_create("hotpath_bench", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, pixels.size()) < 0) {
+		std::cerr << "failed to create memfd: " << strerror(errno)
+			  << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	unsigned int lumaSize = res.width * res.height;
+	unsigned int chromaSize = lumaSize / 4;
+	libcamera::SharedFD shared(std::move(fd));
+
+	std::vector<libcamera::FrameBuffer::Plane> planes(3);
+	for (unsigned int i = 0; i < 3; ++i) {
+		planes[i].fd = shared;
+		planes[i].offset = i ? lumaSize + (i - 1) * chromaSize : 0;
+		planes[i].length = i ? chromaSize : lumaSize;
+	}
+
+	libcamera::FrameBuffer buffer(planes);
+
+	uint64_t heap = heapAllocations.load();
+	Clock::time_point start = Clock::now();
+
+	for (unsigned int i = 0; i < result.frames; ++i) {
+		Clock::time_point begin = Clock::now();
+		std::unique_ptr<Image> image =
+			Image::fromFrameBuffer(&buffer, Image::MapMode::ReadOnly);
+		if (!image)
+			return;
+		image.reset();
+		result.latency.record(Clock::now() - begin);
+	}
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.allocations = heapAllocations.load() - heap;
+}
+
+/*
+ * Sum the luma blocks of a frame as MotionDetector does, one row out of 2,
+ * with the kernels of an instruction set.
+ */
+void benchMotion(Result &result, const Resolution &res,
+		 const std::vector<uint8_t> &pixels, convert::Isa isa)
+{
+	convert::Isa previous = convert::isa();
+	if (!convert::setIsa(isa))
+		return;
+
+	result.name = std::string("motion-") + convert::isaName(isa);
+
+	const convert::ConstPlane luma = { pixels.data(), res.width };
+	std::vector<uint32_t> sums((res.width / convert::kBlockSize) *
+				   (res.height / convert::kBlockSize));
+
+	uint64_t heap = heapAllocations.load();
+	Clock::time_point start = Clock::now();
+
+	for (unsigned int i = 0; i < result.frames; ++i) {
+		Clock::time_point begin = Clock::now();
+		convert::sumBlocks(luma, res.width, res.height, 2, sums.data());
+		result.latency.record(Clock::now() - begin);
+	}
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.allocations = heapAllocations.load() - heap;
+
+	convert::setIsa(previous);
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	unsigned int frames = 100;
+	const char *outputPath = nullptr;
+
+	if (argc > 1)
+		frames = std::max(1, atoi(argv[1]));
+	if (argc > 2)
+		outputPath = argv[2];
+
+	/* Write to tmpfs, to measure the write path rather than the disk. */
+	std::string dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+
+	std::vector<std::unique_ptr<Result>> results;
+	auto add = [&](const char *name, const char *resolution, size_t frameSize) {
+		results.push_back(std::make_unique<Result>());
+		Result &result = *results.back();
+		result.name = name;
+		result.resolution = resolution;
+		result.frames = frames;
+		result.seconds = 0;
+		result.frameSize = frameSize;
+		result.allocations = 0;
+		return &result;
+	};
+
+	for (const Resolution &res : resolutions) {
+		std::vector<uint8_t> pixels = syntheticFrame(res.width, res.height);
+
+		benchJpeg(*add("jpeg", res.name, pixels.size()), res, pixels);
+		benchWrite(*add("write", res.name, pixels.size()), res, pixels, dir);
+		benchMap(*add("map", res.name, pixels.size()), res, pixels);
+
+		for (convert::Isa isa : { convert::Isa::Scalar, convert::bestIsa() })
+			benchMotion(*add("motion", res.name, res.width * res.height),
+				    res, pixels, isa);
+	}
+
+	benchDispatch(*add("dispatch", "", 0));
+
+	std::ostringstream json;
+	json << "{\n  \"benchmarks\": [\n";
+	bool first = true;
+	for (const std::unique_ptr<Result> &result : results) {
+		/* Skip the runs that failed to set up. */
+		if (!result->seconds)
+			continue;
+
+		if (!first)
+			json << ",\n";
+		first = false;
+		writeResult(json, *result);
+	}
+	json << "\n  ]\n}\n";
+
+	std::cout << json.str();
+
+	if (outputPath) {
+		std::ofstream file(outputPath);
+		file << json.str();
+		if (!file) {
+			std::cerr << "failed to write " << outputPath << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
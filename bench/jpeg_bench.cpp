@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_bench.cpp - Scaling benchmark of the strip-parallel JPEG encoder
+ *
+ * Usage: jpeg_bench [max-workers] [frames]
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "jpeg_encoder.h"
+#include "synthetic_frame.h"
+
+namespace {
+
+struct Resolution {
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+const Resolution resolutions[] = {
+	{ "800x600", 800, 600 },
+	{ "1080p", 1920, 1080 },
+	{ "4K", 3840, 2160 },
+};
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	unsigned int maxWorkers = std::max(1U, std::thread::hardware_concurrency());
+	unsigned int frames = 20;
+
+	if (argc > 1)
+		maxWorkers = std::max(1, atoi(argv[1]));
+	if (argc > 2)
+		frames = std::max(1, atoi(argv[2]));
+
+	std::cout << std::setw(10) << "frame" << std::setw(9) << "workers"
+		  << std::setw(10) << "fps" << std::setw(10) << "MB/s"
+		  << std::setw(10) << "speedup" << std::endl;
+
+	for (const Resolution &res : resolutions) {
+		std::vector<uint8_t> pixels = syntheticFrame(res.width, res.height);
+
+		JpegEncoder::Frame frame;
+		frame.width = res.width;
+		frame.height = res.height;
+		frame.y = pixels.data();
+		frame.u = frame.y + res.width * res.height;
+		frame.v = frame.u + res.width * res.height / 4;
+		frame.stride = res.width;
+		frame.chromaStride = res.width / 2;
+
+		std::vector<uint8_t> output;
+		double baseline = 0;
+
+		for (unsigned int workers = 1; workers <= maxWorkers; ++workers) {
+			JpegEncoder encoder(workers);
+
+			/* Warm up the pool and size the output buffer. */
+			encoder.encode(frame, output);
+
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned int i = 0; i < frames; ++i)
+				encoder.encode(frame, output);
+			std::chrono::duration<double> elapsed =
+				std::chrono::steady_clock::now() - start;
+
+			double fps = frames / elapsed.count();
+			if (workers == 1)
+				baseline = fps;
+
+			std::cout << std::setw(10) << res.name
+				  << std::setw(9) << workers
+				  << std::setw(10) << std::fixed << std::setprecision(1) << fps
+				  << std::setw(10) << fps * pixels.size() / 1e6
+				  << std::setw(10) << std::setprecision(2) << fps / baseline
+				  << std::endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * synthetic_frame.h - Generated YUV420 frames for the benchmarks
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Fill a YUV420 frame with gradients and some noise, so that the entropy
+ * coder has a realistic amount of work to do.
+ */
+inline std::vector<uint8_t> syntheticFrame(unsigned int width, unsigned int height)
+{
+	std::vector<uint8_t> frame(width * height * 3 / 2);
+	uint8_t *y = frame.data();
+	uint8_t *u = y + width * height;
+	uint8_t *v = u + width * height / 4;
+	unsigned int seed = 1;
+
+	for (unsigned int row = 0; row < height; ++row) {
+		for (unsigned int col = 0; col < width; ++col) {
+			seed = seed * 1103515245 + 12345;
+			y[row * width + col] = (col + row) / 8 + (seed >> 28);
+		}
+	}
+
+	for (unsigned int row = 0; row < height / 2; ++row) {
+		for (unsigned int col = 0; col < width / 2; ++col) {
+			u[row * width / 2 + col] = 128 + col / 16;
+			v[row * width / 2 + col] = 128 - row / 16;
+		}
+	}
+
+	return frame;
+}
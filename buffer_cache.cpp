@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * buffer_cache.cpp - Persistent mappings of frame buffers
+ */
+
+#include <errno.h>
+
+#include <libcamera/framebuffer.h>
+
+#include "buffer_cache.h"
+
+using namespace libcamera;
+
+/**
+ * \class BufferCache
+ * \brief Keep frame buffers mapped for the whole capture session
+ *
+ * Frame buffers are mapped once, right after allocation, and the mappings are
+ * then shared by all the consumers of the frames. This avoids mapping and
+ * unmapping buffers for every frame, and lets sinks read the pixels straight
+ * from the buffer memory.
+ *
+ * The cache must be filled before the capture starts. Lookups don't modify
+ * the cache and can then be performed concurrently from any thread.
+ */
+
+/**
+ * \brief Map a frame buffer
+ * \param[in] buffer The frame buffer
+ * \param[in] mode The mapping access mode
+ *
+ * Mapping a buffer that is already in the cache is a no-op.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int BufferCache::map(const FrameBuffer *buffer, Image::MapMode mode)
+{
+	if (images_.count(buffer))
+		return 0;
+
+	std::unique_ptr<Image> image = Image::fromFrameBuffer(buffer, mode);
+	if (!image)
+		return -ENOMEM;
+
+	images_[buffer] = std::move(image);
+	return 0;
+}
+
+/**
+ * \brief Map all frame buffers allocated for a stream
+ * \param[in] buffers The frame buffers
+ * \param[in] mode The mapping access mode
+ * \return 0 on success or a negative error code otherwise
+ */
+int BufferCache::map(const std::vector<std::unique_ptr<FrameBuffer>> &buffers,
+		     Image::MapMode mode)
+{
+	for (const std::unique_ptr<FrameBuffer> &buffer : buffers) {
+		int ret = map(buffer.get(), mode);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Retrieve the mapping of a frame buffer
+ * \param[in] buffer The frame buffer
+ * \return The mapped image, or nullptr if the buffer isn't mapped
+ */
+const Image *BufferCache::find(const FrameBuffer *buffer) const
+{
+	auto it = images_.find(buffer);
+	return it != images_.end() ? it->second.get() : nullptr;
+}
+
+Image *BufferCache::find(const FrameBuffer *buffer)
+{
+	auto it = images_.find(buffer);
+	return it != images_.end() ? it->second.get() : nullptr;
+}
+
+/**
+ * \brief Unmap all frame buffers
+ */
+void BufferCache::clear()
+{
+	images_.clear();
+}
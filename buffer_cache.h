@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * buffer_cache.h - Persistent mappings of frame buffers
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "image.h"
+
+namespace libcamera {
+class FrameBuffer;
+} /* namespace libcamera */
+
+class BufferCache
+{
+public:
+	int map(const libcamera::FrameBuffer *buffer,
+		Image::MapMode mode = Image::MapMode::ReadOnly);
+	int map(const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers,
+		Image::MapMode mode = Image::MapMode::ReadOnly);
+
+	const Image *find(const libcamera::FrameBuffer *buffer) const;
+	Image *find(const libcamera::FrameBuffer *buffer);
+
+	void clear();
+
+private:
+	std::map<const libcamera::FrameBuffer *, std::unique_ptr<Image>> images_;
+};
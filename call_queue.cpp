@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * call_queue.cpp - Lock-free multi-producer single-consumer queue of calls
+ */
+
+#include "call_queue.h"
+
+/**
+ * \class CallQueue
+ * \brief Queue calls from any thread and run them on a single consumer thread
+ *
+ * Calls are stored in a bounded ring of cells, each holding a callable of up to
+ * kInlineSize bytes in place. Producers reserve cells with a compare-and-swap
+ * on the tail index and publish them through a per-cell sequence number, so
+ * queueing a call takes no lock and allocates no memory.
+ *
+ * When the ring is full, calls are moved to a mutex-protected overflow list
+ * instead of being dropped or blocking the producer. Producers keep using the
+ * overflow list until the consumer has drained it, which preserves the order
+ * of calls queued by a given thread.
+ *
+ * push() can be called from any thread. dispatch() shall only be called from
+ * the consumer thread.
+ */
+
+/**
+ * \param[in] capacity Number of cells in the ring, rounded up to a power of two
+ */
+CallQueue::CallQueue(size_t capacity)
+	: tail_(0), head_(0), overflowed_(false), overflows_(0)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+
+	cells_ = std::make_unique<Cell[]>(size);
+	mask_ = size - 1;
+
+	for (size_t i = 0; i < size; ++i)
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+/**
+ * Calls still queued are destroyed without being run.
+ */
+CallQueue::~CallQueue()
+{
+	while (true) {
+		Cell *cell = &cells_[head_ & mask_];
+		if (cell->sequence.load(std::memory_order_acquire) != head_ + 1)
+			break;
+
+		cell->destroy(cell->storage);
+		head_++;
+	}
+}
+
+CallQueue::Cell *CallQueue::reserve()
+{
+	size_t pos = tail_.load(std::memory_order_relaxed);
+
+	while (true) {
+		Cell *cell = &cells_[pos & mask_];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+		if (!diff) {
+			if (tail_.compare_exchange_weak(pos, pos + 1,
+							std::memory_order_relaxed))
+				return cell;
+		} else if (diff < 0) {
+			/* The consumer hasn't released this cell yet. */
+			return nullptr;
+		} else {
+			pos = tail_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void CallQueue::commit(Cell *cell)
+{
+	size_t pos = cell->sequence.load(std::memory_order_relaxed);
+	cell->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void CallQueue::pushOverflow(std::function<void()> &&func)
+{
+	std::unique_lock<std::mutex> locker(overflowLock_);
+
+	overflow_.push_back(std::move(func));
+	overflowed_.store(true, std::memory_order_release);
+	overflows_.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Run queued calls
+ * \param[in] max Maximum number of calls to run
+ *
+ * Calls are run in the order they have been queued. Calls queued while
+ * dispatching may or may not be run by the same dispatch() invocation.
+ *
+ * \return The number of calls that have been run
+ */
+size_t CallQueue::dispatch(size_t max)
+{
+	size_t count = 0;
+
+	for (; count < max; ++count) {
+		Cell *cell = &cells_[head_ & mask_];
+		if (cell->sequence.load(std::memory_order_acquire) != head_ + 1)
+			break;
+
+		cell->invoke(cell->storage);
+		cell->sequence.store(head_ + mask_ + 1, std::memory_order_release);
+		head_++;
+	}
+
+	if (count == max || !overflowed_.load(std::memory_order_acquire))
+		return count;
+
+	/* The ring is empty, move on to the calls that didn't fit in it. */
+	std::unique_lock<std::mutex> locker(overflowLock_);
+
+	while (count < max && !overflow_.empty()) {
+		std::function<void()> call = std::move(overflow_.front());
+		overflow_.pop_front();
+
+		locker.unlock();
+		call();
+		locker.lock();
+		count++;
+	}
+
+	if (overflow_.empty())
+		overflowed_.store(false, std::memory_order_release);
+
+	return count;
+}
+
+/**
+ * \brief Check if no call is queued
+ *
+ * This function shall only be called from the consumer thread.
+ */
+bool CallQueue::empty() const
+{
+	const Cell *cell = &cells_[head_ & mask_];
+	if (cell->sequence.load(std::memory_order_acquire) == head_ + 1)
+		return false;
+
+	return !overflowed_.load(std::memory_order_acquire);
+}
@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * call_queue.h - Lock-free multi-producer single-consumer queue of calls
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+class CallQueue
+{
+public:
+	/* Maximum size of a callable stored without allocation */
+	static constexpr size_t kInlineSize = 48;
+
+	explicit CallQueue(size_t capacity = 256);
+	~CallQueue();
+
+	template<typename Func>
+	void push(Func &&func)
+	{
+		using Callable = std::decay_t<Func>;
+
+		static_assert(sizeof(Callable) <= kInlineSize &&
+			      alignof(Callable) <= alignof(std::max_align_t),
+			      "Callable too large to be queued without allocation");
+
+		/*
+		 * Once the ring has overflowed, keep queueing to the overflow
+		 * list until it has been drained to preserve ordering.
+		 */
+		Cell *cell = overflowed_.load(std::memory_order_acquire)
+			   ? nullptr : reserve();
+		if (!cell) {
+			pushOverflow(std::function<void()>(std::forward<Func>(func)));
+			return;
+		}
+
+		new (cell->storage) Callable(std::forward<Func>(func));
+		cell->invoke = [](void *storage) {
+			Callable *callable = static_cast<Callable *>(storage);
+			(*callable)();
+			callable->~Callable();
+		};
+		cell->destroy = [](void *storage) {
+			static_cast<Callable *>(storage)->~Callable();
+		};
+
+		commit(cell);
+	}
+
+	size_t dispatch(size_t max);
+	bool empty() const;
+
+	size_t capacity() const { return mask_ + 1; }
+	uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		void (*invoke)(void *storage);
+		void (*destroy)(void *storage);
+		alignas(std::max_align_t) unsigned char storage[kInlineSize];
+	};
+
+	Cell *reserve();
+	void commit(Cell *cell);
+	void pushOverflow(std::function<void()> &&func);
+
+	std::unique_ptr<Cell[]> cells_;
+	size_t mask_;
+
+	/* Producers and consumer indices live on separate cache lines. */
+	alignas(64) std::atomic<size_t> tail_;
+	alignas(64) size_t head_;
+
+	std::atomic<bool> overflowed_;
+	std::atomic<uint64_t> overflows_;
+	std::mutex overflowLock_;
+	std::list<std::function<void()>> overflow_;
+};
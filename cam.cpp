@@ -1,149 +1,258 @@
 #include "cam.hpp"
+#include <signal.h>                     // SIGUSR1
+#include <sys/prctl.h>                  // prctl
+#include <sys/resource.h>               // getrusage
+#include <sys/stat.h>                   // mkdir
+#include <errno.h>                      // EEXIST
+#include <fstream>                      // std::ofstream
+#include <stdlib.h>                     // strtoul
+#include <ctype.h>                      // toupper
+#include <algorithm>                    // std::max
+#include "pixel_convert.h"
+#include "replay_source.h"
+#include "synthetic_source.h"
+
+// Pre-roll mode keeps the last 3 seconds at 30 fps in memory
+static constexpr unsigned int preroll_frames = 90;
+static const char *const preroll_trigger_path = "/tmp/disocamera-trigger";
+// Spans of the capture session when built with -Dtracing=true, open it in https://ui.perfetto.dev
+static const char *const trace_path = "test/trace.json";
+// Outputs are written under this directory, created on startup
+static const char *const output_directory = "test";
+// A daemon prints its status every minute, a soak run more often to catch any growth
+static constexpr std::chrono::seconds status_interval{ 60 };
+static constexpr std::chrono::seconds soak_status_interval{ 2 };
+// Resident memory a soak run may gain once warmed up, from allocator noise
+static constexpr size_t soak_rss_tolerance = 1 << 20;
 
 // Default constructor
-CameraDiso::CameraDiso() {}
+// <encoderWorkers> is the number of threads compressing each still, 0 means one per core
+// <sourceSpec> selects where frames come from :
+//   "" or "camera" for the first camera, "camera:all" for every camera, "camera:0,2" for a subset
+//   or a comma separated list of sources in memory, see createMemorySource()
+// <motionGate> skips the compression and recording of the frames of a static scene
+CameraDiso::CameraDiso(unsigned int encoderWorkers, const std::string &sourceSpec, bool motionGate)
+	: sourceSpec(sourceSpec), encoderWorkers(encoderWorkers), motionGate(motionGate) {}
 
-// Default destructor
-// Probably there's nothing to put in it as I'm using smart pointers
-// For now I prefer letting the actions on camera and cameraManager
-CameraDiso::~CameraDiso()
+/**
+ * @brief Adapts the JPEG quality of the stills to targets instead of the fixed default quality
+ * 
+ * @param target the compressed size per frame and the encode time budget, 0 for none
+ */
+void CameraDiso::setJpegTarget(const JpegRateControl::Target &target)
 {
-	camera->stop();
-	camera->release();
-	camera.reset();
-	cameraManager->stop();
+	jpegTarget = target;
 }
 
+/**
+ * @brief Streams the stills as MJPEG over HTTP instead of writing them, until SIGINT
+ * The first capture is served on "http://localhost:<port>/", the next ones on the following ports
+ * 
+ * @param port the TCP port of the first capture, 0 to write the stills to files
+ */
+void CameraDiso::setHttpPort(uint16_t port)
+{
+	httpPort = port;
+}
 
+/**
+ * @brief Shares the recorded frames with other processes, until SIGINT
+ * The subscribers connect to "<path>", or "<path>-<capture name>" when there are several captures, see FrameSubscriber
+ * 
+ * @param path the path of the socket, empty not to share the frames
+ * @param copy copies the frames to memfds rather than holding the camera buffers until the subscribers are done
+ */
+void CameraDiso::setSharePath(const std::string &path, bool copy)
+{
+	sharePath = path;
+	shareCopy = copy;
+}
 
 /**
- * @brief Handles request completion events : is called when a Slot connected to the `requestComplete` Signal receives something
+ * @brief Writes the raw frames of the sink and tee modes with O_DIRECT, sparing the page cache
+ * Direct writes need block aligned offsets, each frame then goes to a file of its own, "test/frame-NNNNNN.bin"
  * 
- * @param request the completed request notified by the signal
+ * @param direct bypasses the page cache when true, appends the frames to segment files otherwise
  */
-void CameraDiso::requestComplete(libcamera::Request *request)
+void CameraDiso::setRawDirect(bool direct)
 {
-	//std::cout << "\033[1;33m###### Entering 'requestComplete' function\033[0m" << std::endl;
+	rawDirect = direct;
+}
 
-	// If the request got cancelled, do nothing
-	if (request->status() == libcamera::Request::RequestCancelled)
-		return;
+/**
+ * @brief Captures until SIGTERM or SIGINT, with the same sinks, mappings and requests all along, SIGHUP restarts the captures
+ * The status, frames delivered, resident memory and open files, is printed every minute instead of a line per frame
+ * 
+ * @param soakFrames stops after this many frames once the resources stayed flat, or fails, 0 to run until stopped
+ * Stills are written to /dev/null during a soak run, to go through the whole write path without filling the disk
+ */
+void CameraDiso::setDaemon(uint64_t soakFrames)
+{
+	daemon = true;
+	this->soakFrames = soakFrames;
+}
 
-	loop.callLater(std::bind(CameraDiso::processRequest, request, this));
+/**
+ * @brief Captures frames at regular intervals, for timelapses, or bursts of frames at regular intervals, until Ctrl-C
+ * The requests released by the sinks wait for the next tick of a timer instead of being queued again right away
+ * 
+ * @param interval the interval between two ticks, 0 to capture as fast as the source goes
+ * @param frames the frames captured on each tick, the burst is limited to the requests of the source
+ */
+void CameraDiso::setSchedule(std::chrono::microseconds interval, unsigned int frames)
+{
+	scheduleInterval = interval;
+	scheduleFrames = std::max(frames, 1u);
 }
 
 /**
- * @brief Constructs a JPEG buffer from camera frame metadata
+ * @brief Captures a burst of frames back to back, then exits once they are all written
+ * The requests of all the frames are queued at once, the source allocating as many buffers as frames when it can
  * 
- * @param metadata 
- * @return uint8_t* 
+ * @param frames the frames of the burst
+ * @param brackets the exposure time and gain the frames cycle through, an exposure bracketing, none to keep the auto exposure
  */
-void CameraDiso::make_jpeg(const libcamera::FrameMetadata *metadata)
+void CameraDiso::setBurst(unsigned int frames, const std::vector<CaptureBurst::Bracket> &brackets)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = cameraConfig->at(0).size.width;
-	cinfo.image_height = cameraConfig->at(0).size.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, 92, TRUE); 
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	uint8_t* input = (uint8_t*)metadata->planes().data();
-	unsigned int height = cameraConfig->at(0).size.height;
-	int stride = cameraConfig->at(0).stride;
-	int stride2 = stride / 2;
-	std::cout << "\033[1;33m###### starting calculs\033[0m" << std::endl;
-	uint8_t *Y = (uint8_t *)input;
-	uint8_t *U = (uint8_t *)Y + stride * height;
-	uint8_t *V = (uint8_t *)U + stride2 * (height / 2);
-	uint8_t *Y_max = U - stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (height / 2);
-	std::cout << "\033[1;33m###### calculs passed\033[0m" << std::endl;
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < height;)
-	{
-		for (int i = 0; i < 16; i++, Y_row += stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
-
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		std::cout << "\033[1;33m###### About to <write_raw_data> \033[0m" << std::endl;
-		jpeg_write_raw_data(&cinfo, rows, 16);
-		std::cout << "\033[1;33m###### write_raw_data passed\033[0m" << std::endl;
-	}
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-	std::cout << "\033[1;33m###### finished make_jpeg\033[0m" << std::endl;
-	//jpeg_buffer = &buffer;
+	burstFrames = frames;
+	burstBrackets = brackets;
+}
+
+// Default destructor
+// The sources stop and release the cameras, before the camera manager goes away
+CameraDiso::~CameraDiso()
+{
+	captures.clear();
+	if (cameraManager)
+		cameraManager->stop();
+}
+
+/**
+ * @brief Creates a source of frames that doesn't need a camera, to run the sinks on any machine
+ * "synthetic[:WxH][/format][@fps]" generates test frames, 800x600 YUV420 by default, or NV12, YUYV or MJPEG frames
+ * "static[:WxH][/format][@fps]" generates the same frames without motion, as of a static scene
+ * "replay:<prefix>[@fps]" loops over the segments "<prefix>-NNNNNN.raw" recorded by the raw sink
+ * Without a frame rate, or at 0 fps, frames are produced as fast as the sinks release them
+ *
+ * @param spec the source description
+ * @return std::unique_ptr<MemorySource> the source, nullptr if <spec> is invalid
+ */
+static std::unique_ptr<MemorySource> createMemorySource(const std::string &spec)
+{
+	std::string kind = spec;
+	unsigned int fps = 0;
+
+	size_t at = kind.rfind('@');
+	if (at != std::string::npos) {
+		fps = strtoul(kind.c_str() + at + 1, nullptr, 10);
+		kind.resize(at);
+	}
+
+	std::string argument;
+	size_t colon = kind.find(':');
+	if (colon != std::string::npos) {
+		argument = kind.substr(colon + 1);
+		kind.resize(colon);
+	}
+
+	if (kind == "synthetic" || kind == "static") {
+		libcamera::PixelFormat format = libcamera::formats::YUV420;
+		size_t slash = argument.find('/');
+		if (slash != std::string::npos) {
+			std::string name = argument.substr(slash + 1);
+			std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+			format = libcamera::PixelFormat::fromString(name);
+			if (!SyntheticSource::supports(format))
+				return nullptr;
+			argument.resize(slash);
+		}
+		libcamera::Size size(800, 600);
+		if (!argument.empty()) {
+			char *end;
+			size.width = strtoul(argument.c_str(), &end, 10);
+			size.height = *end == 'x' ? strtoul(end + 1, nullptr, 10) : 0;
+			if (size.width < 2 || size.height < 2)
+				return nullptr;
+		}
+		return std::make_unique<SyntheticSource>(size, fps, kind == "synthetic", format);
+	}
+
+	if (kind == "replay" && !argument.empty()) {
+		std::unique_ptr<ReplaySource> replay = std::make_unique<ReplaySource>(fps);
+		if (replay->open(argument) < 0)
+			return nullptr;
+		std::cout << "\033[1;35m###### Replaying \033[0m" << replay->frames() << " frames from " << argument << std::endl;
+		return replay;
+	}
+
+	return nullptr;
+}
+
+
+
+/**
+ * @brief !STATIC! Handles request completion events : is called when a Slot connected to the `requestCompleted` Signal of a source receives something
+ * 
+ * @param request the completed request notified by the signal
+ * @param capture the capture of the source, whose event loop processes the request
+ */
+void CameraDiso::requestComplete(FrameRequest *request, Capture *capture)
+{
+	//std::cout << "\033[1;33m###### Entering 'requestComplete' function\033[0m" << std::endl;
+
+	// Cancelled requests aren't delivered by the source
+	capture->completedAt[request->cookie()] = std::chrono::steady_clock::now();
+	// Time to the first frame, from the requests being queued
+	if (capture->firstFrameAt == PhaseTimer::Clock::time_point()) {
+		capture->firstFrameAt = capture->completedAt[request->cookie()];
+		capture->startup.record("first frame", capture->queuedAt, capture->firstFrameAt);
+	}
+	// Exposure to completion, on the libcamera thread or the thread of a memory source
+	TRACE_SPAN("camera", "capture", request->sequence(), request->timestamp(), trace::now());
+	capture->loop.callLater(std::bind(CameraDiso::processRequest, request, capture));
 }
 
 /**
- * @brief !STATIC! Called during request completion events by the event loop
+ * @brief !STATIC! Called during request completion events by the event loop of the capture
  * 
  * @param request the completed request notified by the signal
- * @param instance the current CameraDiso instance, trick to manipulate <this> in a static member function
+ * @param capture the capture the request belongs to, trick to manipulate its state in a static member function
  */
-void CameraDiso::processRequest(libcamera::Request *request, CameraDiso *instance)
+void CameraDiso::processRequest(FrameRequest *request, Capture *capture)
 {
 	//std::cout << "\033[1;33m###### Entering 'processRequest' function\033[0m" << std::endl;
-	
+	TRACE_SCOPE("camera", "processRequest", request->sequence());
+	capture->framesDelivered++;
+
 	// If the request was treated, the output data is in a map of Streams and Buffers
-	const libcamera::Request::BufferMap &buffers = request->buffers();
-	// Iterating through those buffers
+	const FrameRequest::BufferMap &buffers = request->buffers();
+	// Iterating through those buffers, unless printing would be the bottleneck
+	if (capture->logFrames)
 	for (auto bufferPair : buffers) {
     	libcamera::FrameBuffer *buffer = bufferPair.second;
-    	const libcamera::FrameMetadata &metadata = buffer->metadata();	// retrieving metadatas for instance
+    	const FrameRequest::Metadata &metadata = request->metadata(buffer);	// retrieving metadatas for instance
 		// Displaying informations about them to trace camera activity
-		std::cout << " seq: " << std::setw(6) << std::setfill('0') << metadata.sequence << " bytesused: ";
-		unsigned int nplane = 0;
-		for (const libcamera::FrameMetadata::Plane &plane : metadata.planes())
+		// Formatted apart and printed at once, the loops of the other captures print concurrently
+		std::ostringstream line;
+		line << " " << capture->name << " seq: " << std::setw(6) << std::setfill('0') << metadata.sequence << " bytesused: ";
+		for (unsigned int nplane = 0; nplane < metadata.planes; ++nplane)
 		{
-			std::cout << plane.bytesused;
-			if (++nplane < metadata.planes().size()) std::cout << "/";
-		}
-		std::cout << std::endl;
-
-		// Sink enables to write image data to disk ?
-		// For now there's now interractivity, it'll have to be introduced at the same time as gRPC
-		if (instance->option == option_code_sink) {
-			instance->sink = std::make_unique<FileSink>(instance->streamNames, "test/");
-			instance->sink->configure(*instance->cameraConfig.get());
-			instance->sink->requestProcessed.connect(instance, &CameraDiso::sinkRelease);
-			instance->sink->processRequest(request);
-		}
-		if (instance->option == option_code_still) {
-			std::string filename = "savejpeg_test_#";
-			std::size_t pos = filename.find_first_of('#');
-			std::stringstream ss;
-			ss << metadata.timestamp << "--" << std::setw(6) << std::setfill('0') << metadata.sequence << ".jpg";
-			filename.replace(pos, 1, ss.str());
-			auto f = fopen(filename.c_str(), "w");
-			instance->make_jpeg(&metadata);
-			fwrite(instance->jpeg_buffer, sizeof(uint8_t), 1, f);
-			fclose(f);
+			line << metadata.bytesused[nplane];
+			if (nplane + 1 < metadata.planes) line << "/";
 		}
+		if (request->tag().frames)
+			line << " bracket: " << request->tag().bracket;
+		line << "\n";
+		std::cout << line.str() << std::flush;
    	}
-	// case of a stream, the request and associated buffers are reused
-	if (instance->option == option_code_stream) {
-		request->reuse(libcamera::Request::ReuseBuffers);
-		instance->camera->queueRequest(request);
-	}
+	if (capture->schedule)
+		capture->schedule->completed(request, capture->completedAt[request->cookie()]);
+	if (capture->burst)
+		capture->burst->completed(request, capture->completedAt[request->cookie()]);
+	// The pipeline stages run on the executor, the request comes back through <sinkRelease> once all of them are done
+	// case of a stream, there's no pipeline and the request and associated buffers are reused
+	if (!capture->sink || capture->sink->processRequest(request))
+		sinkRelease(request, capture);
 }
 
 /**
@@ -178,161 +287,944 @@ std::string CameraDiso::getCameraInfos(std::shared_ptr<libcamera::Camera> camera
 }
 
 /**
- * @brief Steams a camera. A default camera will automatically be used, as there's only one for now on the system
+ * @brief Adds a capture for each selected camera
  * 
+ * @param selection "all", or indexes in the list of cameras separated by commas, empty for the first camera
  * @return <int> Classical return value, 0 means OK
- * 
- * Flow :
- * 1/ Camera Manager
- * 2/ Acquire one particular camera
- * 3/ Generate and validate its config + Configure it
- * 4/ Allocate memory for the streaming (frame buffers)
- * 5/ Create requests for every frame buffer
  */
-int8_t CameraDiso::exploitCamera(int8_t option)
+int8_t CameraDiso::addCameras(const std::string &selection)
 {
-	this->option = option;
 	// Creating a camera manager, that will be able to access cameras
+	PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
 	cameraManager = std::make_unique<libcamera::CameraManager>();
 	cameraManager->start();
+	startup.record("manager start", start);
 	std::cout << "\033[1;35m###### Started Camera Manager\033[0m" << std::endl;
 
-	// Selecting camera #0 as default camera
-	std::string cameraId = cameraManager->cameras()[0]->id();
-	camera = cameraManager->get(cameraId);
-
+	std::vector<std::shared_ptr<libcamera::Camera>> cameras = cameraManager->cameras();
 	// Control that the camera present on the system is findable
-	if (cameraManager->cameras().empty()) {
+	if (cameras.empty()) {
 		std::cout << "\033[1;31m###### ERR : No camera identified on the system\033[0m" << std::endl;
-		cameraManager->stop();
 		return 1;
+	}
+
+	std::vector<unsigned int> indexes;
+	if (selection == "all") {
+		for (unsigned int index = 0; index < cameras.size(); ++index)
+			indexes.push_back(index);
+	} else if (selection.empty()) {
+		indexes.push_back(0);		// Selecting camera #0 as default camera
 	} else {
+		const char *next = selection.c_str();
+		while (*next) {
+			char *end;
+			unsigned long index = strtoul(next, &end, 10);
+			if (end == next || index >= cameras.size()) {
+				std::cout << "\033[1;31m###### ERR : No camera \033[0m" << next << std::endl;
+				return 1;
+			}
+			indexes.push_back(index);
+			next = *end == ',' ? end + 1 : end;
+		}
+	}
+
+	for (unsigned int index : indexes) {
+		std::shared_ptr<libcamera::Camera> camera = cameras[index];
 		std::cout << " - " << getCameraInfos(camera) << std::endl;
+
+		start = PhaseTimer::Clock::now();
+		std::unique_ptr<CameraSource> cameraSource = std::make_unique<CameraSource>(camera);
+		if (cameraSource->acquire() < 0) {
+			std::cout << "\033[1;31m###### ERR : Can't acquire the camera\033[0m" << std::endl;
+			return 1;
+		}
+		startup.record("acquire", start);
+
+		std::unique_ptr<Capture> capture = std::make_unique<Capture>();
+		capture->name = "cam" + std::to_string(index);
+		capture->camera = camera;
+		capture->source = std::move(cameraSource);
+		captures.push_back(std::move(capture));
+		std::cout << "\033[1;35m###### Camera acquired\033[0m" << std::endl;
 	}
 
-	camera->acquire();
-	std::cout << "\033[1;35m###### Camera acquired\033[0m" << std::endl;
+	return 0;
+}
 
-	// Generating camera configuration
-	cameraConfig = camera->generateConfiguration( { libcamera::StreamRole::StillCapture } );
+/**
+ * @brief Adds a capture for each source of frames in memory
+ * The sinks run the same way as with cameras
+ * 
+ * @param specs the descriptions of the sources, separated by commas
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::addMemorySources(const std::string &specs)
+{
+	size_t start = 0;
+	while (start <= specs.size()) {
+		size_t end = std::min(specs.find(',', start), specs.size());
+		std::string spec = specs.substr(start, end - start);
+		start = end + 1;
 
-	cameraConfig->at(0).pixelFormat = libcamera::formats::YUV420;
-	cameraConfig->at(0).size.width = 800;
-	cameraConfig->at(0).size.height = 600;
-	//cameraConfig->at(0).stride = 123;		// test, meaningless value
-	cameraConfig->at(0).colorSpace = libcamera::ColorSpace::Jpeg;	// works eventhough VS Code doesn't recognize it
-	cameraConfig->validate();		// adjunsting it so it's recognized
-	camera->configure(cameraConfig.get());
-	std::cout << "\033[1;35m###### Camera configured\033[0m" << std::endl;
-	
-	/*	====================================
-				Preparing the sink
-		====================================*/
-	streamNames.clear();
-	// Filling the map for sink initialization
-	std::cout << "\033[1;35m###### Preparing the sink, registered in <streamNames> :\033[0m" << std::endl;
-	for (unsigned int index = 0; index < cameraConfig->size(); ++index) {
-		libcamera::StreamConfiguration &cfg = cameraConfig->at(index);
-		streamNames[cfg.stream()] = "cam" + cameraId
-					   + "-stream" + std::to_string(index);
-		std::cout << "cam" + cameraId + "-stream" + std::to_string(index) << std::endl;
+		std::unique_ptr<MemorySource> memorySource = createMemorySource(spec);
+		if (!memorySource) {
+			std::cout << "\033[1;31m###### ERR : Invalid frame source \033[0m" << spec << std::endl;
+			return 1;
+		}
+
+		std::unique_ptr<Capture> capture = std::make_unique<Capture>();
+		capture->name = "cam" + std::to_string(captures.size());
+		capture->logFrames = memorySource->throttled();
+		capture->source = std::move(memorySource);
+		std::cout << "\033[1;35m###### Frame source \033[0m" << capture->source->id() << std::endl;
+		captures.push_back(std::move(capture));
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Finds the stream configured for a role
+ * 
+ * @param config the validated configuration, its streams in the order of the roles
+ * @param roles the roles the configuration was generated for
+ * @param role the role to look for
+ * @return <const libcamera::Stream *> the stream, or nullptr to use all streams when the source didn't produce one per role
+ */
+const libcamera::Stream *CameraDiso::findStream(const libcamera::CameraConfiguration &config,
+						const libcamera::StreamRoles &roles, libcamera::StreamRole role)
+{
+	if (config.size() != roles.size() || config.size() < 2)
+		return nullptr;
+
+	for (unsigned int index = 0; index < roles.size(); ++index) {
+		if (roles[index] == role)
+			return config.at(index).stream();
+	}
+
+	return nullptr;
+}
+
+/**
+ * @brief Picks the pixel format of a camera stream, the cheapest for the sinks among the formats the camera offers
+ * MJPEG stills are written as the camera compressed them, without any encoding
+ * Otherwise the default format of the role is native to the camera and kept when the sinks take it, YUV formats are tried in order next
+ * 
+ * @param cfg the stream configuration generated for a role, with the formats the camera offers
+ * @param compressed whether the frames of the stream may be compressed by the camera
+ * @param luma whether the frames need a luma plane, for the motion detection
+ * @return <libcamera::PixelFormat> the format to ask for
+ */
+libcamera::PixelFormat CameraDiso::pickFormat(const libcamera::StreamConfiguration &cfg, bool compressed, bool luma)
+{
+	const std::vector<libcamera::PixelFormat> offered = cfg.formats().pixelformats();
+	auto usable = [&](const libcamera::PixelFormat &format) {
+		if (std::find(offered.begin(), offered.end(), format) == offered.end())
+			return false;
+		if (format == libcamera::formats::MJPEG)
+			return compressed;
+		if (luma)
+			return format == libcamera::formats::YUV420 || format == libcamera::formats::YVU420 ||
+			       format == libcamera::formats::NV12 || format == libcamera::formats::NV21;
+		return convert::canConvertToI420(format);
+	};
+
+	if (usable(libcamera::formats::MJPEG))
+		return libcamera::formats::MJPEG;
+	if (usable(cfg.pixelFormat))
+		return cfg.pixelFormat;
+	for (const libcamera::PixelFormat &format : { libcamera::formats::YUV420, libcamera::formats::NV12, libcamera::formats::NV21,
+						      libcamera::formats::YVU420, libcamera::formats::YUYV, libcamera::formats::UYVY }) {
+		if (usable(format))
+			return format;
+	}
+	// Nothing the sinks know, the validation picks the closest format
+	return libcamera::formats::YUV420;
+}
+
+/**
+ * @brief Generates the configuration of a capture, and validates it
+ * Cameras offer formats and sizes for each role, the ones the sinks handle best are picked, see pickFormat()
+ * The streams a camera validated in the same mode before can be restored from <configCache> instead, skipping that negotiation
+ * 
+ * @param capture the capture, whose <config> is set
+ * @param roles the roles of the streams
+ * @param restore whether to restore the configuration from the cache, false to negotiate it
+ * @return <bool> whether the configuration was generated, false when it isn't cached or the camera doesn't accept it as is anymore
+ */
+bool CameraDiso::generateConfiguration(Capture *capture, const libcamera::StreamRoles &roles, bool restore)
+{
+	FrameSource *source = capture->source.get();
+	PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+	if (restore) {
+		// An empty configuration, the camera doesn't enumerate the formats of any role
+		capture->config = source->generateConfiguration({});
+		if (!capture->config || !configCache.restore(source->id(), configMode(), capture->config.get()))
+			return false;
+	} else {
+		capture->config = source->generateConfiguration(roles);
+		if (!capture->config)
+			return false;
+	}
+	capture->startup.record(restore ? "restore" : "generate", start);
+	std::unique_ptr<libcamera::CameraConfiguration> &cameraConfig = capture->config;
+
+	// The format of memory sources is fixed by the frames they produce
+	// Cameras keep the default size of the role, except for the preview which only needs to be small
+	// Only stills may come compressed from the camera, motion is detected on the preview, or on the only stream
+	if (capture->camera) {
+		for (unsigned int index = 0; index < cameraConfig->size(); ++index) {
+			libcamera::StreamConfiguration &cfg = cameraConfig->at(index);
+			if (!restore) {
+				bool analysed = motionGate && option != option_code_preroll
+						&& (roles.size() == 1 || roles[index] != libcamera::StreamRole::StillCapture);
+				cfg.pixelFormat = pickFormat(cfg, roles[index] == libcamera::StreamRole::StillCapture && !analysed, analysed);
+				if (roles[index] == libcamera::StreamRole::Viewfinder)
+					cfg.size = libcamera::Size(640, 480);
+			}
+			cfg.colorSpace = libcamera::ColorSpace::Jpeg;	// works eventhough VS Code doesn't recognize it
+		}
 	}
-	/*	==================================== */
+	// A burst is queued whole, with a buffer per frame, up to the count the source accepts
+	if (burstFrames && !restore) {
+		for (libcamera::StreamConfiguration &cfg : *cameraConfig)
+			cfg.bufferCount = std::max(cfg.bufferCount, burstFrames);
+	}
+	start = PhaseTimer::Clock::now();
+	libcamera::CameraConfiguration::Status status = cameraConfig->validate();		// adjunsting it so it's recognized
+	capture->startup.record("validate", start);
+	// A camera changing the streams it accepted before has changed since, its configuration is negotiated again
+	if (restore && (status == libcamera::CameraConfiguration::Invalid
+			|| !configCache.matches(source->id(), configMode(), *cameraConfig))) {
+		std::cout << "\033[1;33m###### Cached configuration of \033[0m" << source->id() << " is stale" << std::endl;
+		configCache.erase(source->id(), configMode());
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Configures the source of a capture and its sinks, and allocates its buffers and requests
+ * 
+ * @param capture the capture to prepare
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::prepareCapture(Capture *capture)
+{
+	FrameSource *source = capture->source.get();
 
+	// One stream per role : tee records a small preview stream next to the full resolution stills
+	libcamera::StreamRoles roles;
+	if (option == option_code_still)
+		roles = { libcamera::StreamRole::StillCapture };
+	else if (option == option_code_tee)
+		roles = { libcamera::StreamRole::Viewfinder, libcamera::StreamRole::StillCapture };
+	else if (option == option_code_sink || option == option_code_preroll)
+		roles = { libcamera::StreamRole::VideoRecording };
+	else
+		roles = { libcamera::StreamRole::Viewfinder };
+
+	// Cameras restore the configuration they validated in this mode before, or negotiate it
+	bool cached = capture->camera && generateConfiguration(capture, roles, true);
+	if (!cached && !generateConfiguration(capture, roles, false)) {
+		std::cerr << "\033[1;31m###### ERR : The source can't produce the streams of this mode\033[0m" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<libcamera::CameraConfiguration> &cameraConfig = capture->config;
+
+	PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+	if (source->configure(cameraConfig.get()) < 0) {
+		std::cerr << "\033[1;31m###### ERR : Can't configure the source\033[0m" << std::endl;
+		return 1;
+	}
+	capture->startup.record("configure", start);
+	std::cout << "\033[1;35m###### Camera configured\033[0m" << (cached ? " from the cache" : "") << std::endl;
+	// The next starts skip the negotiation of the configuration the camera accepted
+	if (capture->camera && !cached) {
+		configCache.store(source->id(), configMode(), *cameraConfig);
+		if (configCache.save() < 0)
+			std::cerr << "Can't write the configuration cache " << configCache.path() << std::endl;
+	}
+
+	// The buffers are allocated and mapped while the sinks are created, which allocates the contexts of the encoders and the rings
+	int8_t allocated = 0;
+	std::thread allocation([capture, &allocated]() { allocated = allocateBuffers(capture); });
+	start = PhaseTimer::Clock::now();
+	int8_t ret = prepareSinks(capture, roles);
+	capture->startup.record("sinks", start);
+	allocation.join();
+	if (ret)
+		return ret;
+	if (allocated)
+		return allocated;
+	std::cout << "\033[1;35m###### Allocated and mapped frame buffers\033[0m" << std::endl;
+	// Each stage only maps the buffers of the stream it records
+	if (capture->sink) {
+		for (const libcamera::StreamConfiguration &cfg : *cameraConfig) {
+			for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : source->buffers(cfg.stream()))
+				capture->sink->mapBuffer(cfg.stream(), buffer.get());
+		}
+	}
+	capture->completedAt.resize(source->requests().size());
+	if (scheduleInterval.count())
+		capture->schedule = std::make_unique<CaptureSchedule>(capture->loop, *source, scheduleInterval, scheduleFrames);
+	else if (burstFrames)
+		capture->burst = std::make_unique<CaptureBurst>(*source, burstFrames, burstBrackets);
+
+	// Connecting a Slot to receive the Signals from the source directly in the app
+	source->requestCompleted.connect(capture, [capture](FrameRequest *request) { requestComplete(request, capture); });
+	std::cout << "\033[1;35m###### Connected to requestCompleted\033[0m" << std::endl;
+
+	return 0;
+}
+
+/**
+ * @brief Allocates the buffers of a capture, and maps them once for the whole session
+ * Runs on a thread of its own, while the sinks are created
+ * 
+ * @param capture the capture, whose source is configured
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::allocateBuffers(Capture *capture)
+{
+	FrameSource *source = capture->source.get();
 
 	// The images captured while streaming have to be stored in buffers
-	// Using libcamera's FrameBufferAllocator which determines sizes and types on his own
-	cameraAllocator = std::make_unique<libcamera::FrameBufferAllocator>(camera);
-	std::cout << "\033[1;35m###### <cameraAllocator> OK\033[0m" << std::endl;
-
-	// Stream config is no longer a class member as we need a reference
-	// I'll have to write that in a better way later on
-	libcamera::StreamConfiguration &streamConfig = cameraConfig->at(0);
-	// Retrieving the libcamera::Stream associated with the camera in use
-	//stream = std::make_unique<libcamera::Stream>(streamConfig.stream());
-	std::cout << "\033[1;35m###### <streamConfig> OK\033[0m" << std::endl;
-	//  ~ Control ~
-	if (cameraAllocator->allocate(streamConfig.stream()) < 0) {
+	// The source allocates them, with libcamera's FrameBufferAllocator for the camera, and a request for each of them
+	PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+	if (source->allocate() < 0) {
 		std::cerr << "\033[1;31m###### ERR : Can't allocate buffers\033[0m" << std::endl;
 		return 2;
 	}
-	std::cout << "\033[1;35m###### Allocated frame buffers\033[0m" << std::endl;
+	capture->startup.record("allocate", start);
 
-	const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers = cameraAllocator->buffers(streamConfig.stream());
-	// Creating a request for each frame buffer, that'll be queued to the camera, which will then fill it with images
-	for (unsigned int i = 0; i < buffers.size(); ++i) {
-		std::unique_ptr<libcamera::Request> request = camera->createRequest();	// Initialize a request
-		if (!request)
-		{
-			std::cerr << "\033[1;31m###### ERR : Can't create request\033[0m" << std::endl;
-			return 3;
+	// Mapping every buffer of every stream once for the whole session, sinks read the pixels straight from <mappedBuffers>
+	start = PhaseTimer::Clock::now();
+	for (const libcamera::StreamConfiguration &cfg : *capture->config) {
+		if (capture->mappedBuffers.map(source->buffers(cfg.stream())) < 0) {
+			std::cerr << "\033[1;31m###### ERR : Can't map buffers\033[0m" << std::endl;
+			return 2;
 		}
+	}
+	capture->startup.record("map", start);
 
-		const std::unique_ptr<libcamera::FrameBuffer> &buffer = buffers[i];
-		int ret = request->addBuffer(streamConfig.stream(), buffer.get());	// Adding current buffer to a request
-		if (ret < 0)
-		{
-			std::cerr << "\033[1;31m###### ERR : Can't set buffer for request\033[0m"
-				  << std::endl;
-			return 4;
-		}
+	return 0;
+}
 
-		// No additionnal controls on the request for now (ex. Brightness...)
+/**
+ * @brief Creates the pipeline of a capture and its stages, and configures them for the streams of the capture
+ * 
+ * @param capture the capture, whose source is configured
+ * @param roles the roles of the streams
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::prepareSinks(Capture *capture, const libcamera::StreamRoles &roles)
+{
+	FrameSource *source = capture->source.get();
+	std::unique_ptr<libcamera::CameraConfiguration> &cameraConfig = capture->config;
 
-		requests.push_back(std::move(request));
-	}	// After this loop we got as many <request> objets in "requests" as there were buffers created by the FrameBufferAllocator
-	std::cout << "\033[1;35m###### Filled <requests>\033[0m" << std::endl;
+	capture->streamNames.clear();
+	// Filling the map for sink initialization
+	std::cout << "\033[1;35m###### Preparing the sink, registered in <streamNames> :\033[0m" << std::endl;
+	for (unsigned int index = 0; index < cameraConfig->size(); ++index) {
+		libcamera::StreamConfiguration &cfg = cameraConfig->at(index);
+		capture->streamNames[cfg.stream()] = "cam" + source->id()
+						    + "-stream" + std::to_string(index);
+		std::cout << "cam" + source->id() + "-stream" + std::to_string(index) << " : "
+			  << cfg.size.width << "x" << cfg.size.height << " " << cfg.pixelFormat.toString() << std::endl;
+	}
+	// Stills are taken from the still stream and the other stages record the preview
+	// Memory sources only produce one stream, which then feeds all the stages
+	const libcamera::Stream *stillStream = findStream(*cameraConfig, roles, libcamera::StreamRole::StillCapture);
+	const libcamera::Stream *recordStream = findStream(*cameraConfig, roles, option == option_code_tee ? libcamera::StreamRole::Viewfinder : libcamera::StreamRole::VideoRecording);
+	// Every mode but stream feeds a pipeline, whose stages all get each request
+	// The pipelines of all captures share the executor, which switches between their stages after every few frames
+	if (option != option_code_stream && option != option_code_testing)
+		capture->sink = std::make_unique<Pipeline>(executor);
+	// Motion is detected on the preview stream, before the requests reach the stages
+	// Stills and raw frames of a static scene are then skipped, pre-roll keeps recording everything
+	bool gated = motionGate && capture->sink && option != option_code_preroll;
+	if (gated)
+		capture->motionDetector = capture->sink->setMotionDetector(std::make_unique<MotionDetector>(capture->mappedBuffers), recordStream);
+	// Stills are compressed and written away from the event loop, 2 at a time on the shared executor
+	// A slow encoder skips to the most recent frames rather than holding the camera back,
+	// and only every 10th frame is compressed when raw frames are recorded alongside
+	if (option == option_code_still || option == option_code_tee) {
+		Pipeline::Policy jpegPolicy;
+		jpegPolicy.overflow = Pipeline::Overflow::DropOldest;
+		jpegPolicy.maxQueued = 2;
+		jpegPolicy.budget = std::chrono::milliseconds(300);
+		if (option == option_code_tee)
+			jpegPolicy.keepEvery = 10;
+		jpegPolicy.gated = gated;
+		// Every frame of a burst is compressed, as many at a time as the executor has workers
+		unsigned int jpegWorkers = 2;
+		if (burstFrames) {
+			jpegPolicy.overflow = Pipeline::Overflow::Block;
+			jpegPolicy.maxQueued = 0;
+			jpegPolicy.budget = std::chrono::nanoseconds(0);
+			jpegWorkers = std::max(jpegWorkers, executor.size());
+		}
+		std::string pattern = capture->outputPrefix.empty() ? "" : "savejpeg_" + capture->outputPrefix + "#";
+		if (soakFrames)
+			pattern = "/dev/null";
+		capture->jpegStage = capture->sink->add("jpeg", std::make_unique<JpegSink>(capture->streamNames, capture->mappedBuffers, pattern, jpegWorkers, encoderWorkers, &executor), jpegPolicy, stillStream);
+		// The quality follows the size and encode time targets, when there are some
+		if (jpegTarget.bytesPerFrame || jpegTarget.encodeTime.count())
+			capture->jpegStage->setRateControl(jpegTarget);
+		// Every client gets the same compressed frames, slow clients skip frames rather than holding the encoders back
+		if (httpPort) {
+			unsigned int index = 0;
+			while (captures[index].get() != capture)
+				index++;
+			uint16_t port = httpPort + index;
+			capture->server = std::make_unique<MjpegServer>(capture->loop);
+			if (capture->server->listen(port) < 0) {
+				std::cerr << "\033[1;31m###### ERR : Can't stream on port " << port << "\033[0m" << std::endl;
+				return 1;
+			}
+			capture->jpegStage->setServer(capture->server.get());
+			std::cout << "\033[1;35m###### Streaming MJPEG on \033[0mhttp://localhost:" << port << "/" << std::endl;
+		}
+	}
+	// Raw frames are appended asynchronously to segment files "test/frames-NNNNNN.raw", read back with the rawframes tool,
+	// or with direct I/O staged to aligned buffers and written to a file each, as appends would need padding
+	// One sink for the whole session as writes outlive the requests
+	// Frames the storage can't keep up with are dropped, gaps show up in the sequence numbers
+	if (option == option_code_sink || option == option_code_tee) {
+		Pipeline::Policy rawPolicy;
+		rawPolicy.overflow = Pipeline::Overflow::DropNewest;
+		rawPolicy.maxQueued = 4;
+		rawPolicy.budget = std::chrono::seconds(1);
+		rawPolicy.gated = gated;
+		const libcamera::Stream *stream = recordStream ? recordStream : cameraConfig->at(0).stream();
+		for (const libcamera::StreamConfiguration &cfg : *cameraConfig) {
+			if (cfg.stream() == stream)
+				capture->rawFrameSize = cfg.frameSize;
+		}
+		std::string pattern = "test/" + capture->outputPrefix + (rawDirect ? "frame-#.bin" : "frames.raw");
+		FileSink *fileStage = capture->sink->add("raw", std::make_unique<FileSink>(capture->streamNames, capture->mappedBuffers, pattern, rawDirect), rawPolicy, recordStream);
+		std::cout << "\033[1;35m###### File sink writing through \033[0m" << fileStage->writer() << (rawDirect ? " (O_DIRECT)" : "") << std::endl;
+	}
+	// Pre-roll copies frames to a fixed ring in memory, flushed to "test/preroll-NNNNNN.raw" when triggered
+	if (option == option_code_preroll)
+		capture->prerollStage = capture->sink->add("preroll", std::make_unique<PreRollSink>(capture->mappedBuffers, "test/" + capture->outputPrefix + "preroll", preroll_frames), {}, recordStream);
+	// Other processes read the recorded frames in place, busy subscribers skip frames rather than holding the camera back
+	if (!sharePath.empty() && capture->sink) {
+		std::string path = capture->outputPrefix.empty() ? sharePath : sharePath + "-" + capture->name;
+		capture->shareStage = capture->sink->add("share", std::make_unique<ShareSink>(capture->loop, capture->mappedBuffers, path, shareCopy), {}, recordStream);
+		std::cout << "\033[1;35m###### Sharing frames on \033[0m" << path << (shareCopy ? " (copies)" : "") << std::endl;
+	}
+	if (capture->sink) {
+		capture->sink->configure(*cameraConfig.get());
+		capture->sink->requestProcessed.connect(capture, [capture](FrameRequest *request) { sinkRelease(request, capture); });
+	}
 
-	// Connecting a Slot to receive the Signals from the camera directly in the app
-	camera->requestCompleted.connect(this, &CameraDiso::requestComplete);
-	std::cout << "\033[1;35m###### Connected to requestCompleted\033[0m" << std::endl;
+	return 0;
+}
 
+/**
+ * @brief Starts the sink and the source of a capture, and queues all the requests
+ * 
+ * @param capture the prepared capture
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::startCapture(Capture *capture)
+{
+	FrameSource *source = capture->source.get();
 	int ret;
+	// The phases of the first start are recorded, until the requests are queued
+	bool firstStart = capture->queuedAt == PhaseTimer::Clock::time_point();
 	// Starting the "sink" (still don't know how to translate that)
-	if (sink) {
-		ret = sink->start();
+	// It primes its encoders and creates its first files while the source starts, a camera powering its sensor up
+	int sinkRet = 0;
+	std::thread sinkStart;
+	if (capture->sink)
+		sinkStart = std::thread([capture, firstStart, &sinkRet]() {
+			PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+			sinkRet = capture->sink->start();
+			if (firstStart)
+				capture->startup.record("sink start", start);
+		});
+	// Starting the camera for real
+	PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+	ret = source->start();
+	if (firstStart)
+		capture->startup.record("source start", start);
+	if (sinkStart.joinable())
+		sinkStart.join();
+	if (capture->sink) {
 		std::cout << "\033[1;35m###### Sink started\033[0m" << std::endl;
-		if (ret) {
+		if (sinkRet) {
 			std::cout << "Failed to start frame sink" << std::endl;
+			if (!ret)
+				source->stop();
+			capture->sink->stop();
 			return 5;
 		}
 	}
-	// Starting the camera for real
-	ret = camera->start();
 	if (ret) {
 		std::cout << "Failed to start capture" << std::endl;
-		if (sink)
-			sink->stop();
+		if (capture->sink)
+			capture->sink->stop();
 		return 6;
 	} else {
 		std::cout << "\033[1;35m###### Camera started\033[0m" << std::endl;
 	}
-	// Iterating through requests to assign them to the camera and then get them back in the "requestComplete" function
-	for (std::unique_ptr<libcamera::Request> &request : requests) {
-		ret = camera->queueRequest(request.get());
-		std::cout << "\033[1;35m###### queued Request :  \033[0m" << request->toString() << std::endl;
+	// Iterating through requests to assign them to the source and then get them back in the "requestComplete" function
+	capture->running = true;
+	if (firstStart)
+		capture->queuedAt = PhaseTimer::Clock::now();
+	// A scheduled capture queues them on the ticks of its timer instead, the first one right away
+	if (capture->schedule) {
+		if (capture->schedule->start() < 0) {
+			std::cerr << "Can't start the capture schedule" << std::endl;
+			source->stop();
+			if (capture->sink)
+				capture->sink->stop();
+			return 7;
+		}
+		std::cout << "\033[1;35m###### Capture scheduled\033[0m" << std::endl;
+		return 0;
+	}
+	// A burst queues all its frames, with the controls of their brackets
+	if (capture->burst) {
+		if (capture->burst->start() < 0) {
+			std::cerr << "Can't queue the burst" << std::endl;
+			source->stop();
+			if (capture->sink)
+				capture->sink->stop();
+			return 7;
+		}
+		std::cout << "\033[1;35m###### Burst of \033[0m" << capture->burst->frames() << " frames queued" << std::endl;
+		return 0;
+	}
+	for (const std::unique_ptr<FrameRequest> &request : source->requests()) {
+		ret = source->queueRequest(request.get());
+		std::cout << "\033[1;35m###### queued Request :  \033[0m" << request->cookie() << std::endl;
 		if (ret < 0) {
 			std::cerr << "Can't queue request" << std::endl;
-			camera->stop();
-			if (sink)
-				sink->stop();
+			source->stop();
+			if (capture->sink)
+				capture->sink->stop();
 			return 7;
 		}
 	}
 
-	loop.timeout(1);	// Preparing to capture for 1 second
-	std::cout << "\033[1;35m###### Loop Timeout OK\033[0m" << std::endl;
-	ret = loop.exec();
-	std::cout << "\033[1;33m###### Capture exited with status : \033[0m" << ret << std::endl;
+	return 0;
+}
+
+/**
+ * @brief Runs the event loop of a capture until its timeout, on the thread of the capture
+ * 
+ * @param capture the started capture
+ */
+void CameraDiso::runCapture(Capture *capture)
+{
+	// Preparing to capture for 1 second, 30 to leave time for triggers, a burst exits once written and only times out if frames are lost
+	if (!continuous())
+		capture->loop.timeout(option == option_code_preroll || capture->burst ? 30 : 1);
+	TRACE_THREAD("event loop " + capture->name);
+	// The kernel delays the timers of the thread by 50 us by default to merge their wakeups, ticks are 1 us late at most
+	if (capture->schedule)
+		prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0);
+	std::chrono::steady_clock::time_point captureStart = std::chrono::steady_clock::now();
+	int ret;
+	while (true) {
+		ret = capture->loop.exec();
+		// No more frames, the requests the sink releases from now on stay idle
+		if (capture->schedule)
+			capture->schedule->stop();
+		capture->running = false;
+		capture->source->stop();
+		if (!capture->restart || stopping)
+			break;
+		capture->restart = false;
+		// A stop requested while restarting may have been consumed by the loop, it's checked again once restarted
+		if (restartCapture(capture) || stopping) {
+			capture->running = false;
+			capture->source->stop();
+			break;
+		}
+	}
+	// A burst is done once its last frame is written, waiting for the sink right away rather than with the other captures
+	if (capture->burst) {
+		if (capture->sink)
+			capture->sink->stop();
+		capture->burst->finished();
+	}
+	capture->captureTime = std::chrono::steady_clock::now() - captureStart;
+	std::cout << "\033[1;33m###### Capture of " << capture->name << " exited with status : \033[0m" << ret << std::endl;
+	{
+		std::unique_lock<std::mutex> locker(runningLock);
+		runningCaptures--;
+	}
+	runningChanged.notify_all();
+}
+
+/**
+ * @brief Starts a stopped capture over, with the configuration, buffers, mappings, requests and sinks it already has
+ * Raw segments are closed by the sinks when they stop, the next frames go to new segments
+ * 
+ * @param capture the capture, whose source has been stopped, on its own thread
+ * @return <int> Classical return value, 0 means OK
+ */
+int8_t CameraDiso::restartCapture(Capture *capture)
+{
+	std::cout << "\033[1;33m###### Restarting capture of \033[0m" << capture->name << std::endl;
+	// Requests completed before the source stopped are still queued to the loop, they go through the sinks first
+	bool drained = false;
+	capture->loop.callLater([capture, &drained]() {
+		drained = true;
+		capture->loop.exit();
+	});
+	while (!drained)
+		capture->loop.exec();
+	capture->restart = false;
+	// Every request is idle once the sink released them all, and queued again when the capture starts
+	if (capture->sink)
+		capture->sink->stop();
+	return startCapture(capture);
+}
+
+/**
+ * @brief Waits for the sink of a capture to be done and prints its statistics
+ * 
+ * @param capture the stopped capture
+ */
+void CameraDiso::reportCapture(Capture *capture)
+{
+	std::cout << "\033[1;35m###### " << capture->name << " (" << capture->source->id() << ") frames delivered : \033[0m"
+		  << capture->framesDelivered.load() << " ("
+		  << std::fixed << std::setprecision(1) << capture->framesDelivered.load() / capture->captureTime.count()
+		  << " fps)" << std::defaultfloat << std::endl;
+	// Waiting for the sink to finish with the requests it still holds
+	if (capture->sink)
+		capture->sink->stop();
+	// Phases of the startup of the capture, up to its first frame and its first still
+	if (capture->jpegStage && capture->jpegStage->firstOutput() != PhaseTimer::Clock::time_point())
+		capture->startup.record("first still", capture->firstFrameAt, capture->jpegStage->firstOutput());
+	std::cout << "\033[1;35m###### Startup of " << capture->name << " :\033[0m" << std::endl;
+	capture->startup.report(std::cout);
+	if (capture->firstFrameAt != PhaseTimer::Clock::time_point()) {
+		auto ms = [](PhaseTimer::Clock::time_point time) {
+			return std::chrono::duration<double, std::milli>(time - PhaseTimer::launch()).count();
+		};
+		std::cout << "\033[1;35m###### Time to first frame : \033[0m" << std::fixed << std::setprecision(1)
+			  << ms(capture->firstFrameAt) << " ms";
+		if (capture->jpegStage && capture->jpegStage->firstOutput() != PhaseTimer::Clock::time_point())
+			std::cout << ", first still : " << ms(capture->jpegStage->firstOutput()) << " ms";
+		std::cout << std::defaultfloat << std::endl;
+	}
+	std::cout << "\033[1;35m###### Request completion to requeue latency : \033[0m";
+	capture->requeueLatency.report(std::cout);
+	if (capture->schedule) {
+		std::cout << "\033[1;35m###### Schedule : \033[0m";
+		capture->schedule->report(std::cout);
+	}
+	if (capture->burst) {
+		std::cout << "\033[1;35m###### Burst : \033[0m";
+		capture->burst->report(std::cout);
+	}
+	// Encoder allocations only happen while warming up, the count must not grow with the number of frames
+	if (capture->jpegStage)
+		std::cout << "\033[1;35m###### JPEG encoder heap allocations : \033[0m"
+			  << capture->jpegStage->allocations() << std::endl;
+	// Stills the camera compressed itself, written without encoding
+	if (capture->jpegStage && (capture->jpegStage->passthrough() || capture->jpegStage->invalid()))
+		std::cout << "\033[1;35m###### MJPEG stills written as captured : \033[0m"
+			  << capture->jpegStage->passthrough() << " invalid : " << capture->jpegStage->invalid() << std::endl;
+	// Achieved size, encode time and quality against the targets
+	if (capture->jpegStage && capture->jpegStage->rateControl()) {
+		std::cout << "\033[1;35m###### JPEG rate control :\033[0m" << std::endl;
+		capture->jpegStage->rateControl()->report(std::cout);
+	}
+	if (capture->server) {
+		std::cout << "\033[1;35m###### MJPEG stream : \033[0m";
+		capture->server->report(std::cout);
+	}
+	if (capture->shareStage) {
+		std::cout << "\033[1;35m###### Shared frames : \033[0m";
+		capture->shareStage->report(std::cout);
+		capture->shareStage->close();
+	}
+	if (capture->prerollStage)
+		std::cout << "\033[1;35m###### Pre-roll frames written : \033[0m" << capture->prerollStage->written()
+			  << " dropped : " << capture->prerollStage->dropped() << std::endl;
+	// Frames of a static scene the stages didn't have to compress or write
+	if (capture->motionDetector) {
+		std::cout << "\033[1;35m###### Motion : \033[0m";
+		capture->motionDetector->report(std::cout);
+		for (const Pipeline::StageStats &stage : capture->sink->stats()) {
+			uint64_t skipped = stage.dropped[Pipeline::DropStatic];
+			std::cout << "\033[1;35m###### Static frames skipped by \033[0m" << stage.name << " : " << skipped;
+			if (stage.name == "raw")
+				std::cout << " (" << skipped * capture->rawFrameSize << " bytes not written)";
+			std::cout << std::endl;
+		}
+	}
+	// Queue depths of the stages, a stage falling behind shows up with a large max
+	if (capture->sink) {
+		std::cout << "\033[1;35m###### Pipeline stages :\033[0m" << std::endl;
+		capture->sink->report(std::cout);
+	}
+}
+
+/**
+ * @brief Steams the selected cameras, or sources in memory, concurrently. The first camera is used by default
+ * 
+ * @return <int> Classical return value, 0 means OK
+ * 
+ * Flow :
+ * 1/ Camera Manager and the selected cameras, or sources of frames in memory
+ * 2/ Generate and validate the config of each one + Configure it
+ * 3/ Allocate memory for the streaming (frame buffers) and a request for every frame buffer
+ * 4/ Run the event loop of every capture on its own thread
+ *
+ * Cameras and memory sources all timestamp frames with CLOCK_MONOTONIC, the frames of different captures can be compared
+ */
+int8_t CameraDiso::exploitCamera(int8_t option)
+{
+	this->option = option;
+	// The output directory and the cache of configurations are ready by the time the first capture is configured,
+	// while the camera manager enumerates the cameras
+	std::thread setup([this]() {
+		PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+		if (mkdir(output_directory, 0755) < 0 && errno != EEXIST)
+			std::cerr << "Can't create the output directory " << output_directory << std::endl;
+		configCache.load(ConfigCache::defaultPath());
+		startup.record("outputs, cache", start);
+	});
+	int8_t ret;
+	if (sourceSpec.empty() || sourceSpec == "camera")
+		ret = addCameras("");
+	else if (sourceSpec.compare(0, 7, "camera:") == 0)
+		ret = addCameras(sourceSpec.substr(7));
+	else
+		ret = addMemorySources(sourceSpec);
+	setup.join();
+	if (ret)
+		return ret;
+
+	// Outputs are told apart by the name of their capture when there are several of them
+	if (captures.size() > 1) {
+		for (std::unique_ptr<Capture> &capture : captures)
+			capture->outputPrefix = capture->name + "-";
+	}
+
+	for (std::unique_ptr<Capture> &capture : captures) {
+		ret = prepareCapture(capture.get());
+		if (ret)
+			return ret;
+	}
+
+	// Stops the captures started so far when one of them fails to start
+	auto stopStarted = [this]() {
+		for (std::unique_ptr<Capture> &capture : captures) {
+			capture->source->stop();
+			if (capture->sink)
+				capture->sink->stop();
+		}
+	};
+	for (std::unique_ptr<Capture> &capture : captures) {
+		ret = startCapture(capture.get());
+		if (ret) {
+			stopStarted();
+			return ret;
+		}
+	}
+
+	// Triggers are handled in the loop of the first capture : SIGUSR1, or any datagram sent to the trigger socket
+	// A trigger flushes the pre-roll rings of all the captures
+	std::vector<PreRollSink *> prerolls;
+	for (std::unique_ptr<Capture> &capture : captures) {
+		if (!capture->prerollStage)
+			continue;
+		std::cout << "\033[1;35m###### Pre-roll ring of \033[0m" << preroll_frames << " frames, "
+			  << capture->prerollStage->memory() << " bytes" << std::endl;
+		prerolls.push_back(capture->prerollStage);
+	}
+	if (!prerolls.empty()) {
+		EventLoop &loop = captures[0]->loop;
+		loop.addSignalEvent(SIGUSR1, [prerolls]() {
+			for (PreRollSink *preroll : prerolls)
+				preroll->trigger();
+		});
+		if (trigger.open(preroll_trigger_path) == 0)
+			loop.addFdEvent(trigger.fd(), EventLoop::Read, [this, prerolls]() {
+				if (!trigger.receive())
+					return;
+				for (PreRollSink *preroll : prerolls)
+					preroll->trigger();
+			});
+	}
+
+	// Streaming, sharing and daemons go on until interrupted, Ctrl-C or SIGTERM stops all the captures
+	// SIGHUP restarts them, each on its own thread
+	if (continuous()) {
+		EventLoop &loop = captures[0]->loop;
+		loop.addSignalEvent(SIGINT, [this]() { stopCaptures(); });
+		loop.addSignalEvent(SIGTERM, [this]() { stopCaptures(); });
+		if (daemon)
+			loop.addSignalEvent(SIGHUP, [this]() {
+				for (std::unique_ptr<Capture> &capture : captures) {
+					Capture *target = capture.get();
+					target->loop.callLater([target]() {
+						target->restart = true;
+						target->loop.exit();
+					});
+				}
+			});
+	}
+
+	// Every capture completes its requests in its own event loop, on its own thread
+	runningCaptures = captures.size();
+	for (std::unique_ptr<Capture> &capture : captures) {
+		// A line per frame would fill the logs of a daemon, the monitor prints the status instead
+		if (daemon)
+			capture->logFrames = false;
+		capture->thread = std::thread(&CameraDiso::runCapture, this, capture.get());
+	}
+	std::cout << "\033[1;35m###### Capturing from \033[0m" << captures.size() << " source(s)" << std::endl;
+	int8_t soakResult = daemon ? monitorCaptures() : 0;
+	for (std::unique_ptr<Capture> &capture : captures)
+		capture->thread.join();
+
+	// Startup phases in milliseconds since the launch of the process, the phases of a capture overlap when run concurrently
+	std::cout << "\033[1;35m###### Startup :\033[0m" << std::endl;
+	startup.report(std::cout);
+	uint64_t framesDelivered = 0;
+	double captureTime = 0;
+	for (std::unique_ptr<Capture> &capture : captures) {
+		reportCapture(capture.get());
+		framesDelivered += capture->framesDelivered;
+		captureTime = std::max(captureTime, capture->captureTime.count());
+	}
+	if (!prerolls.empty())
+		trigger.close();
+	// Aggregated throughput, which grows with the number of captures until the cores are all busy
+	if (captures.size() > 1)
+		std::cout << "\033[1;35m###### Frames delivered by all captures : \033[0m" << framesDelivered << " ("
+			  << std::fixed << std::setprecision(1) << framesDelivered / captureTime
+			  << " fps)" << std::defaultfloat << std::endl;
+	// Per-frame spans of every thread, the rings only hold the last frames of long sessions
+	if (trace::kEnabled) {
+		std::ofstream traceFile(trace_path);
+		trace::write(traceFile);
+		std::cout << "\033[1;35m###### Trace of \033[0m" << trace::recorded()
+			  << " spans written to " << trace_path << std::endl;
+	}
+
+	// CPU time of the whole process, to compare the cost of the sinks between runs
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		std::cout << "\033[1;35m###### CPU time : \033[0muser " << std::fixed << std::setprecision(2)
+			  << usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 << "s system "
+			  << usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 << "s" << std::defaultfloat << std::endl;
 
 	std::cout << "\033[1;35m###### All work done !\033[0m" << std::endl;
+	if (soakResult)
+		return soakResult;
 	
 	// Cleaning that should happen here has been moved in the destructor, safer due to smart pointers I think
 	return 0;
 }
 
-void CameraDiso::sinkRelease(libcamera::Request *request)
+/**
+ * @brief Stops all the captures, from any thread
+ * The loops exit from a queued call, which isn't lost when a capture is between two runs of its loop
+ */
+void CameraDiso::stopCaptures()
 {
-	request->reuse(libcamera::Request::ReuseBuffers);
-	camera->queueRequest(request);
+	stopping = true;
+	for (std::unique_ptr<Capture> &capture : captures) {
+		Capture *target = capture.get();
+		target->loop.callLater([target]() { target->loop.exit(); });
+	}
+}
+
+/**
+ * @brief Prints the status of a daemon periodically until its captures stop, on the main thread
+ * A soak run stops the captures after <soakFrames> frames, and checks that the resident memory and the number of open
+ * files didn't grow since the first tenth of the frames, once the pools and caches have warmed up
+ * 
+ * @return <int> 0, or 8 when a soak run found the resources growing
+ */
+int8_t CameraDiso::monitorCaptures()
+{
+	std::chrono::seconds interval = soakFrames ? soak_status_interval : status_interval;
+	std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	uint64_t lastFrames = 0;
+	ResourceUsage baseline;
+	ResourceUsage usage;
+	bool settled = false;
+
+	std::unique_lock<std::mutex> locker(runningLock);
+	while (runningCaptures) {
+		if (runningChanged.wait_for(locker, interval, [this]() { return !runningCaptures; }))
+			break;
+
+		uint64_t frames = 0;
+		for (std::unique_ptr<Capture> &capture : captures)
+			frames += capture->framesDelivered;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - last;
+		usage = ResourceUsage::sample();
+		std::cout << "\033[1;35m###### Status : \033[0m" << frames << " frames ("
+			  << std::fixed << std::setprecision(1) << (frames - lastFrames) / elapsed.count() << " fps)"
+			  << std::defaultfloat << " RSS " << usage.rss / 1024 << " kB, " << usage.fds << " open files" << std::endl;
+		last = now;
+		lastFrames = frames;
+
+		if (!soakFrames)
+			continue;
+		// The run lasts at least one more sample after the baseline
+		if (!settled) {
+			if (frames >= soakFrames / 10) {
+				baseline = usage;
+				settled = true;
+			}
+		} else if (frames >= soakFrames && !stopping) {
+			stopCaptures();
+		}
+	}
+
+	if (!soakFrames)
+		return 0;
+	if (!settled) {
+		std::cout << "\033[1;31m###### Soak : stopped before warming up\033[0m" << std::endl;
+		return 8;
+	}
+
+	// The last sample was taken while capturing, the captures are stopped now but their sinks still hold their memory
+	bool flat = usage.rss <= baseline.rss + soak_rss_tolerance && usage.fds <= baseline.fds;
+	std::cout << "\033[1;35m###### Soak : \033[0mRSS " << baseline.rss / 1024 << " kB -> " << usage.rss / 1024
+		  << " kB, open files " << baseline.fds << " -> " << usage.fds
+		  << (flat ? " \033[1;32mflat\033[0m" : " \033[1;31mGROWING\033[0m") << std::endl;
+	return flat ? 0 : 8;
+}
+
+/**
+ * @brief !STATIC! Gives a request back to its source once its buffers aren't needed anymore
+ * Can be called from a sink worker thread, source->queueRequest() is thread-safe
+ * 
+ * @param request the request released by a sink, or processed by the event loop
+ * @param capture the capture the request belongs to
+ */
+void CameraDiso::sinkRelease(FrameRequest *request, Capture *capture)
+{
+	// The whole life of the frame, from exposure to requeue, the critical path of the trace
+	TRACE_SPAN("camera", "frame", request->sequence(), request->timestamp(), trace::now());
+	capture->requeueLatency.record(std::chrono::steady_clock::now() - capture->completedAt[request->cookie()]);
+	// Once the capture stopped, released requests stay idle until it starts again
+	// A scheduled capture keeps them until its next tick, a burst queues its next frames and ends with its last one
+	if (capture->schedule)
+		capture->schedule->release(request);
+	else if (capture->burst) {
+		if (capture->burst->release(request))
+			capture->loop.callLater([capture]() { capture->loop.exit(); });
+	}
+	else if (capture->running)
+		capture->source->queueRequest(request);
 }
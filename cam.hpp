@@ -1,49 +1,151 @@
 #include <iostream>                     // std::cout ; std::endl
 #include <string>
+#include <atomic>                       // std::atomic
+#include <condition_variable>           // std::condition_variable
+#include <mutex>                        // std::mutex
 #include <stdint.h>                     // int8_t
 #include <iomanip>                      // std::setw ; std::setfill
+#include <sstream>                      // std::ostringstream
 #include <functional>                   // std::bind
+#include <chrono>                       // std::chrono::steady_clock
+#include <thread>                       // std::thread
 #include <libcamera/libcamera.h>
-#include <jpeglib.h>
+#include "buffer_cache.h"
+#include "camera_source.h"
+#include "capture_burst.h"
+#include "capture_schedule.h"
+#include "config_cache.h"
 #include "file_sink.h"
+#include "jpeg_sink.h"
+#include "memory_source.h"
+#include "mjpeg_server.h"
+#include "motion_detector.h"
+#include "pipeline.h"
+#include "preroll_sink.h"
+#include "share_sink.h"
 #include "event_loop.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "trigger_socket.h"
 
 class CameraDiso
 {
     public:
-        CameraDiso();
+        CameraDiso(unsigned int encoderWorkers = 0, const std::string &sourceSpec = "", bool motionGate = false);
         virtual ~CameraDiso();
+        void setJpegTarget(const JpegRateControl::Target &target);
+        void setHttpPort(uint16_t port);
+        void setSharePath(const std::string &path, bool copy = false);
+        void setRawDirect(bool direct);
+        void setDaemon(uint64_t soakFrames = 0);
+        void setSchedule(std::chrono::microseconds interval, unsigned int frames = 1);
+        void setBurst(unsigned int frames, const std::vector<CaptureBurst::Bracket> &brackets = {});
         int8_t exploitCamera(int8_t option);
 
     protected:
         int8_t option;
 
     private:
+        // Everything about one camera, or one source of frames in memory, captured concurrently with the others
+        // Requests of each capture complete on the thread running its own event loop
+        struct Capture {
+            std::string name;                   // "cam<index>", prefixes the outputs when there are several captures
+            std::string outputPrefix;
+            EventLoop loop;                     // Declared first to outlive the sinks watching sockets from it
+            std::shared_ptr<libcamera::Camera> camera;
+            std::unique_ptr<FrameSource> source;
+            std::unique_ptr<libcamera::CameraConfiguration> config;
+            std::map<const libcamera::Stream *, std::string> streamNames;
+            BufferCache mappedBuffers;
+            std::unique_ptr<Pipeline> sink;
+            JpegSink *jpegStage = nullptr;
+            PreRollSink *prerollStage = nullptr;
+            ShareSink *shareStage = nullptr;
+            MotionDetector *motionDetector = nullptr;
+            unsigned int rawFrameSize = 0;      // Bytes of each frame recorded by the raw stage
+            bool logFrames = true;              // Off when a memory source runs as fast as the sinks go
+
+            std::thread thread;
+            std::unique_ptr<MjpegServer> server;    // Streams the stills, watching its clients from the loop
+            std::unique_ptr<CaptureSchedule> schedule;  // Queues the requests on its ticks instead of as soon as released
+            std::unique_ptr<CaptureBurst> burst;        // Queues the frames of the burst, the capture ends with it
+
+            // Time at which each request completed, indexed by request cookie
+            std::vector<std::chrono::steady_clock::time_point> completedAt;
+            LatencyStats requeueLatency;
+            std::atomic<uint64_t> framesDelivered{ 0 };   // Also read by the monitor of a daemon
+            std::atomic<bool> running{ false }; // Requests are requeued to the source while running only
+            bool restart = false;               // Start over once the loop exits, set from the loop
+            std::chrono::duration<double> captureTime{ 0 };
+
+            // Phases from the configuration to the first frame, the phases of each start are recorded until frames are queued
+            PhaseTimer startup;
+            PhaseTimer::Clock::time_point queuedAt;
+            PhaseTimer::Clock::time_point firstFrameAt;     // Set from the thread completing the requests
+        };
+
         std::string getCameraInfos(std::shared_ptr<libcamera::Camera> camera);
-        void requestComplete(libcamera::Request *request);
-        static void processRequest(libcamera::Request *request, CameraDiso *instance);
-        void sinkRelease(libcamera::Request *request);
-        void make_jpeg(const libcamera::FrameMetadata *metadata);
+        int8_t addCameras(const std::string &selection);
+        int8_t addMemorySources(const std::string &specs);
+        static const libcamera::Stream *findStream(const libcamera::CameraConfiguration &config,
+                                                   const libcamera::StreamRoles &roles, libcamera::StreamRole role);
+        static libcamera::PixelFormat pickFormat(const libcamera::StreamConfiguration &cfg, bool compressed, bool luma);
+        bool generateConfiguration(Capture *capture, const libcamera::StreamRoles &roles, bool restore);
+        int8_t prepareCapture(Capture *capture);
+        int8_t prepareSinks(Capture *capture, const libcamera::StreamRoles &roles);
+        static int8_t allocateBuffers(Capture *capture);
+        int8_t startCapture(Capture *capture);
+        void runCapture(Capture *capture);
+        int8_t restartCapture(Capture *capture);
+        void reportCapture(Capture *capture);
+        void stopCaptures();
+        int8_t monitorCaptures();
+        bool continuous() const { return daemon || httpPort || !sharePath.empty() || scheduleInterval.count(); }
+        // Configurations are cached per mode, the roles and the formats picked depend on it and on the motion gate
+        // and the buffer count on the length of a burst
+        std::string configMode() const
+        {
+            return std::to_string(option) + (motionGate ? "-motion" : "")
+                   + (burstFrames ? "-burst" + std::to_string(burstFrames) : "");
+        }
+        static void requestComplete(FrameRequest *request, Capture *capture);
+        static void processRequest(FrameRequest *request, Capture *capture);
+        static void sinkRelease(FrameRequest *request, Capture *capture);
 
-        std::shared_ptr<libcamera::Camera> camera;
         std::unique_ptr<libcamera::ControlList> cameraProperties;
         std::unique_ptr<libcamera::CameraManager> cameraManager;
-        std::unique_ptr<libcamera::CameraConfiguration> cameraConfig;
-        std::unique_ptr<libcamera::FrameBufferAllocator> cameraAllocator;
-        std::unique_ptr<libcamera::Stream> stream;
-        std::map<const libcamera::Stream *, std::string> streamNames;
-        //std::unique_ptr<libcamera::StreamConfiguration> streamConfig;
-        std::vector<std::unique_ptr<libcamera::Request>> requests;
-        std::unique_ptr<FileSink> sink;
-
-        EventLoop loop;
-        uint8_t* jpeg_buffer;
-        unsigned long jpeg_len;
+        std::string sourceSpec;
+        ThreadPool executor;            // Shared by the stages and encoders of every capture, declared first to outlive them
+        std::vector<std::unique_ptr<Capture>> captures;
+
+        unsigned int encoderWorkers;
+        bool motionGate;
+        JpegRateControl::Target jpegTarget;
+        uint16_t httpPort = 0;          // Stills are streamed over HTTP instead of written when set
+        std::string sharePath;          // Socket other processes receive the frames from when set
+        bool shareCopy = false;
+        bool rawDirect = false;         // Raw frames are written to a file each with O_DIRECT, bypassing the page cache
+        bool daemon = false;            // Runs until SIGTERM, SIGHUP restarts the captures
+        uint64_t soakFrames = 0;        // Frames a soak run lasts, checking the resources stay flat
+        std::chrono::microseconds scheduleInterval{ 0 };    // Frames are captured at this interval when set
+        unsigned int scheduleFrames = 1;
+        unsigned int burstFrames = 0;   // Frames captured back to back before exiting when set
+        std::vector<CaptureBurst::Bracket> burstBrackets;
+        std::atomic<bool> stopping{ false };
+        std::mutex runningLock;         // Captures still running, watched by the monitor of a daemon
+        std::condition_variable runningChanged;
+        unsigned int runningCaptures = 0;
+        TriggerSocket trigger;          // Pre-roll triggers from other processes
+        ConfigCache configCache;        // Configurations the cameras validated, restored instead of negotiated
+        PhaseTimer startup;             // Phases before the captures are prepared
 };
 
 enum {
     option_code_testing     = 0,
     option_code_still       = 1,
     option_code_stream      = 2,
-    option_code_sink        = 3
+    option_code_sink        = 3,
+    option_code_preroll     = 4,
+    option_code_tee         = 5     // Raw frames and JPEG stills from the same requests
 };
\ No newline at end of file
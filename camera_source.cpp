@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * camera_source.cpp - Frame source capturing from a libcamera camera
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+#include "camera_source.h"
+
+using namespace libcamera;
+
+/**
+ * \class CameraSource
+ * \brief Capture frames from a camera
+ *
+ * The source pairs each FrameRequest with a libcamera::Request using the same
+ * buffers. The controls of a FrameRequest are moved to its Request when it is
+ * queued. When the camera completes a request, the metadata of its buffers
+ * and its control metadata are copied to the FrameRequest, which is then
+ * delivered. Cancelled requests are not delivered.
+ *
+ * The camera must be acquired with acquire() before being configured.
+ */
+
+CameraSource::CameraSource(std::shared_ptr<Camera> camera)
+	: camera_(camera), config_(nullptr), acquired_(false), running_(false)
+{
+}
+
+CameraSource::~CameraSource()
+{
+	stop();
+
+	/* The buffers must be freed before the camera is released. */
+	cameraRequests_.clear();
+	allocator_.reset();
+
+	if (acquired_)
+		camera_->release();
+}
+
+/**
+ * \brief Acquire the camera for exclusive use
+ * \return 0 on success or a negative error code otherwise
+ */
+int CameraSource::acquire()
+{
+	int ret = camera_->acquire();
+	if (ret < 0)
+		return ret;
+
+	acquired_ = true;
+	return 0;
+}
+
+std::string CameraSource::id() const
+{
+	return camera_->id();
+}
+
+/**
+ * The camera produces one stream per role, nullptr is returned if it can't
+ * produce them all at the same time.
+ */
+std::unique_ptr<CameraConfiguration>
+CameraSource::generateConfiguration(const StreamRoles &roles)
+{
+	return camera_->generateConfiguration(roles);
+}
+
+int CameraSource::configure(CameraConfiguration *config)
+{
+	int ret = camera_->configure(config);
+	if (ret < 0)
+		return ret;
+
+	config_ = config;
+	return 0;
+}
+
+/**
+ * \brief Allocate the buffers of the configured streams, and the requests
+ *
+ * One request is created per buffer, up to the number of buffers of the
+ * stream with the fewest.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int CameraSource::allocate()
+{
+	if (!config_)
+		return -EINVAL;
+
+	allocator_ = std::make_unique<FrameBufferAllocator>(camera_);
+
+	size_t count = SIZE_MAX;
+	for (const StreamConfiguration &cfg : *config_) {
+		if (allocator_->allocate(cfg.stream()) < 0) {
+			std::cerr << "Can't allocate buffers" << std::endl;
+			return -ENOMEM;
+		}
+
+		count = std::min(count, allocator_->buffers(cfg.stream()).size());
+	}
+
+	requests_.clear();
+	cameraRequests_.clear();
+
+	for (unsigned int i = 0; i < count; ++i) {
+		std::unique_ptr<Request> request = camera_->createRequest(i);
+		if (!request) {
+			std::cerr << "Can't create request" << std::endl;
+			return -ENOMEM;
+		}
+
+		std::unique_ptr<FrameRequest> frame = std::make_unique<FrameRequest>(i);
+
+		for (const StreamConfiguration &cfg : *config_) {
+			FrameBuffer *buffer = allocator_->buffers(cfg.stream())[i].get();
+
+			int ret = request->addBuffer(cfg.stream(), buffer);
+			if (ret < 0) {
+				std::cerr << "Can't set buffer for request" << std::endl;
+				return ret;
+			}
+
+			frame->addBuffer(cfg.stream(), buffer);
+		}
+
+		cameraRequests_.push_back(std::move(request));
+		requests_.push_back(std::move(frame));
+	}
+
+	return 0;
+}
+
+const std::vector<std::unique_ptr<FrameBuffer>> &
+CameraSource::buffers(const Stream *stream) const
+{
+	return allocator_->buffers(const_cast<Stream *>(stream));
+}
+
+int CameraSource::start()
+{
+	camera_->requestCompleted.connect(this, &CameraSource::requestComplete);
+
+	int ret = camera_->start();
+	if (ret < 0) {
+		camera_->requestCompleted.disconnect(this);
+		return ret;
+	}
+
+	running_ = true;
+	return 0;
+}
+
+void CameraSource::stop()
+{
+	if (!running_)
+		return;
+
+	camera_->stop();
+	camera_->requestCompleted.disconnect(this);
+	running_ = false;
+}
+
+/**
+ * Can be called from any thread, Camera::queueRequest() is thread-safe.
+ */
+int CameraSource::queueRequest(FrameRequest *request)
+{
+	Request *cameraRequest = cameraRequests_[request->cookie()].get();
+
+	if (cameraRequest->status() != Request::RequestPending)
+		cameraRequest->reuse(Request::ReuseBuffers);
+
+	if (!request->controls().empty()) {
+		cameraRequest->controls().merge(request->controls());
+		request->controls().clear();
+	}
+
+	return camera_->queueRequest(cameraRequest);
+}
+
+void CameraSource::requestComplete(Request *request)
+{
+	if (request->status() == Request::RequestCancelled)
+		return;
+
+	FrameRequest *frame = requests_[request->cookie()].get();
+
+	for (auto [stream, buffer] : request->buffers()) {
+		const FrameMetadata &metadata = buffer->metadata();
+		FrameRequest::Metadata &frameMetadata = frame->metadata(buffer);
+
+		frameMetadata.sequence = metadata.sequence;
+		frameMetadata.timestamp = metadata.timestamp;
+		frameMetadata.planes = std::min<size_t>(metadata.planes().size(),
+							FrameRequest::kMaxPlanes);
+		for (unsigned int i = 0; i < frameMetadata.planes; ++i)
+			frameMetadata.bytesused[i] = metadata.planes()[i].bytesused;
+	}
+
+	/* Assigning reuses the storage of the list of the previous frame. */
+	frame->controlMetadata() = request->metadata();
+
+	requestCompleted.emit(frame);
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * camera_source.h - Frame source capturing from a libcamera camera
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libcamera/camera.h>
+#include <libcamera/framebuffer_allocator.h>
+#include <libcamera/request.h>
+
+#include "frame_source.h"
+
+class CameraSource : public FrameSource
+{
+public:
+	explicit CameraSource(std::shared_ptr<libcamera::Camera> camera);
+	~CameraSource();
+
+	int acquire();
+
+	std::string id() const override;
+
+	std::unique_ptr<libcamera::CameraConfiguration>
+	generateConfiguration(const libcamera::StreamRoles &roles) override;
+	int configure(libcamera::CameraConfiguration *config) override;
+
+	int allocate() override;
+	const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &
+	buffers(const libcamera::Stream *stream) const override;
+
+	int start() override;
+	void stop() override;
+
+	int queueRequest(FrameRequest *request) override;
+
+private:
+	void requestComplete(libcamera::Request *request);
+
+	std::shared_ptr<libcamera::Camera> camera_;
+	libcamera::CameraConfiguration *config_;
+	std::unique_ptr<libcamera::FrameBufferAllocator> allocator_;
+
+	/* Indexed by cookie, as requests_ */
+	std::vector<std::unique_ptr<libcamera::Request>> cameraRequests_;
+
+	bool acquired_;
+	bool running_;
+};
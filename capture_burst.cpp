@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * capture_burst.cpp - Capture of a burst of frames, bracketing their exposure
+ */
+
+#include <algorithm>
+#include <math.h>
+
+#include <libcamera/control_ids.h>
+
+#include "capture_burst.h"
+#include "frame_request.h"
+#include "frame_source.h"
+
+using namespace libcamera;
+
+/* Whether a setting reported by the source is the one requested, sensors round them */
+static bool applied(double actual, double requested)
+{
+	return !requested || fabs(actual - requested) <= requested * 0.05;
+}
+
+/**
+ * \class CaptureBurst
+ * \brief Capture a number of frames back to back, each with the controls of
+ * its bracket
+ *
+ * The frames cycle through the brackets, frame i being captured with the
+ * exposure time and analogue gain of bracket i modulo the number of brackets.
+ * The auto exposure is disabled for the brackets setting an exposure time.
+ * Each request carries its controls and is tagged with its position in the
+ * burst and its bracket, for the stages to tell the frames apart.
+ *
+ * All the frames are queued when the burst starts, the sensor thus captures
+ * them at its full rate without waiting for the sinks. A source with fewer
+ * requests than frames gets the remaining frames queued as the sinks release
+ * the first ones.
+ *
+ * The gaps between the timestamps of consecutive frames, the frames the
+ * sensor skipped, and the time to capture and to write the whole burst are
+ * measured. The frames are counted as applied when the source reports the
+ * controls of their bracket in their metadata, a camera may need a few frames
+ * to apply new settings.
+ */
+
+/**
+ * \param[in] source The source to queue the requests to
+ * \param[in] frames The number of frames of the burst
+ * \param[in] brackets The settings of the brackets, none to capture the
+ * frames with the settings of the source
+ */
+CaptureBurst::CaptureBurst(FrameSource &source, unsigned int frames,
+			   const std::vector<Bracket> &brackets)
+	: source_(source), frames_(std::max(frames, 1U)), brackets_(brackets),
+	  queued_(0), released_(0), prequeued_(0), completed_(0), applied_(0),
+	  skipped_(0), lastSequence_(0), lastTimestamp_(0)
+{
+}
+
+/**
+ * \brief Queue the first frames of the burst, as many as the source has
+ * requests
+ * \return 0 on success or a negative error code otherwise
+ */
+int CaptureBurst::start()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	start_ = Clock::now();
+
+	for (const std::unique_ptr<FrameRequest> &request : source_.requests()) {
+		if (queued_ == frames_)
+			break;
+
+		int ret = queue(request.get());
+		if (ret < 0)
+			return ret;
+	}
+
+	prequeued_ = queued_;
+	return 0;
+}
+
+/* Set the controls and the tag of the next frame. The lock shall be held. */
+int CaptureBurst::queue(FrameRequest *request)
+{
+	unsigned int bracket = brackets_.empty() ? 0 : queued_ % brackets_.size();
+	request->tag() = { queued_, bracket, frames_ };
+
+	if (!brackets_.empty()) {
+		ControlList &controls = request->controls();
+		const Bracket &settings = brackets_[bracket];
+		if (settings.exposureTime) {
+			controls.set(controls::AeEnable, false);
+			controls.set(controls::ExposureTime, settings.exposureTime);
+		}
+		if (settings.analogueGain)
+			controls.set(controls::AnalogueGain, settings.analogueGain);
+	}
+
+	int ret = source_.queueRequest(request);
+	if (ret < 0)
+		return ret;
+
+	queued_++;
+	return 0;
+}
+
+/**
+ * \brief Account for a request released by the sinks, and queue it again
+ * for the next frame if the burst isn't fully queued yet
+ *
+ * Can be called from any thread.
+ *
+ * \return True once the sinks released the last frame of the burst
+ */
+bool CaptureBurst::release(FrameRequest *request)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	released_++;
+	/* A frame the source can't take anymore ends the burst early. */
+	if (queued_ < frames_ && queue(request) < 0)
+		frames_ = queued_;
+
+	return released_ == frames_;
+}
+
+/**
+ * \brief Account for a frame of the burst the source completed
+ * \param[in] request The request, processed by the loop
+ * \param[in] time The time the source completed the request at
+ */
+void CaptureBurst::completed(FrameRequest *request, Clock::time_point time)
+{
+	completed_++;
+	lastFrame_ = time;
+
+	unsigned int sequence = request->sequence();
+	uint64_t timestamp = request->timestamp();
+	if (lastTimestamp_) {
+		gaps_.record(std::chrono::nanoseconds(timestamp - lastTimestamp_));
+		if (sequence > lastSequence_ + 1)
+			skipped_ += sequence - lastSequence_ - 1;
+	}
+	lastSequence_ = sequence;
+	lastTimestamp_ = timestamp;
+
+	if (brackets_.empty())
+		return;
+
+	const Bracket &settings = brackets_[request->tag().bracket];
+	const ControlList &metadata = request->controlMetadata();
+	if (applied(metadata.get(controls::ExposureTime), settings.exposureTime) &&
+	    applied(metadata.get(controls::AnalogueGain), settings.analogueGain))
+		applied_++;
+}
+
+/**
+ * \brief Record the time the sinks are done with the burst, once they wrote
+ * every frame
+ */
+void CaptureBurst::finished()
+{
+	finished_ = Clock::now();
+}
+
+/**
+ * \brief Print the timings of the burst, in milliseconds, and the gaps
+ * between its frames, in microseconds
+ */
+void CaptureBurst::report(std::ostream &out) const
+{
+	auto ms = [this](Clock::time_point time) {
+		if (time == Clock::time_point())
+			return 0.0;
+		return std::chrono::duration<double, std::milli>(time - start_).count();
+	};
+
+	out << completed_ << "/" << frames_ << " frames, " << prequeued_
+	    << " prequeued, " << skipped_ << " skipped by the source" << std::endl;
+	out << "  captured in " << ms(lastFrame_) << " ms, written in "
+	    << ms(finished_) << " ms";
+	if (!brackets_.empty())
+		out << ", " << brackets_.size() << " brackets applied to "
+		    << applied_ << " frames";
+	out << std::endl;
+	out << "  frame gaps     ";
+	gaps_.report(out);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * capture_burst.h - Capture of a burst of frames, bracketing their exposure
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+
+#include "stats.h"
+
+class FrameRequest;
+class FrameSource;
+
+class CaptureBurst
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	/* Settings of the frames of a bracket, 0 leaves a control as it is */
+	struct Bracket {
+		int32_t exposureTime;
+		float analogueGain;
+	};
+
+	CaptureBurst(FrameSource &source, unsigned int frames,
+		     const std::vector<Bracket> &brackets = {});
+
+	unsigned int frames() const { return frames_; }
+
+	int start();
+	bool release(FrameRequest *request);
+	void completed(FrameRequest *request, Clock::time_point time);
+	void finished();
+
+	void report(std::ostream &out) const;
+
+private:
+	int queue(FrameRequest *request);
+
+	FrameSource &source_;
+	unsigned int frames_;
+	std::vector<Bracket> brackets_;
+
+	/* Frames queued and released by the sinks, from any thread */
+	std::mutex lock_;
+	unsigned int queued_;
+	unsigned int released_;
+	unsigned int prequeued_;
+
+	Clock::time_point start_;
+	Clock::time_point lastFrame_;
+	Clock::time_point finished_;
+
+	unsigned int completed_;
+	unsigned int applied_;
+	uint64_t skipped_;
+	unsigned int lastSequence_;
+	uint64_t lastTimestamp_;
+	LatencyStats gaps_;
+};
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * capture_schedule.cpp - Capture of frames at scheduled times
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "capture_schedule.h"
+#include "event_loop.h"
+#include "frame_request.h"
+#include "frame_source.h"
+
+/**
+ * \class CaptureSchedule
+ * \brief Queue requests to a source at regular intervals, for timelapses and
+ * periodic bursts
+ *
+ * The requests released by the sinks stay idle, instead of going straight back
+ * to the source, until the next tick of a timer of the event loop queues
+ * \a frames of them. The source captures them as soon as it can, the next frame
+ * of the sensor for a camera. A tick finding no idle request, the sinks still
+ * holding them all, misses its frames rather than delaying the next ticks.
+ *
+ * The timer is armed to absolute times, ticks thus don't drift when some of
+ * them run late. The lateness of the ticks, the latency from a tick to its
+ * first frame, and the error of the intervals between the timestamps of the
+ * first frames of the ticks, are measured.
+ *
+ * The schedule is started and stopped from the thread of the loop, or while
+ * the loop isn't running. release() may be called from any thread.
+ */
+
+/**
+ * \param[in] loop The event loop the ticks run in, and the requests complete in
+ * \param[in] source The source to queue the requests to
+ * \param[in] interval The interval between two ticks
+ * \param[in] frames The number of frames captured on each tick
+ */
+CaptureSchedule::CaptureSchedule(EventLoop &loop, FrameSource &source,
+				 std::chrono::microseconds interval,
+				 unsigned int frames)
+	: loop_(loop), source_(source), interval_(interval), frames_(frames),
+	  timer_(0), nextTick_(0), lastFrameTick_(0), lastFrameTimestamp_(0),
+	  ticks_(0), missedTicks_(0), missedFrames_(0)
+{
+}
+
+CaptureSchedule::~CaptureSchedule()
+{
+	stop();
+}
+
+/**
+ * \brief Start ticking, all the requests of the source being idle
+ *
+ * The first tick is due right away.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int CaptureSchedule::start()
+{
+	const std::vector<std::unique_ptr<FrameRequest>> &requests = source_.requests();
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		idle_.clear();
+		idle_.reserve(requests.size());
+		for (const std::unique_ptr<FrameRequest> &request : requests)
+			idle_.push_back(request.get());
+	}
+
+	slots_.assign(requests.size(), { 0, false });
+	lastFrameTimestamp_ = 0;
+	nextTick_ = 0;
+
+	start_ = Clock::now();
+	timer_ = loop_.addTimer(start_, interval_, [this]() { tick(); });
+
+	return timer_ ? 0 : -ENOMEM;
+}
+
+/**
+ * \brief Stop ticking, the requests queued already still complete
+ */
+void CaptureSchedule::stop()
+{
+	loop_.removeTimer(timer_);
+	timer_ = 0;
+}
+
+/**
+ * \brief Keep a request released by the sinks for the next tick
+ */
+void CaptureSchedule::release(FrameRequest *request)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	idle_.push_back(request);
+}
+
+/**
+ * \brief Account for a request the source completed
+ * \param[in] request The request, processed by the loop
+ * \param[in] time The time the source completed the request at
+ */
+void CaptureSchedule::completed(FrameRequest *request, Clock::time_point time)
+{
+	const Slot &slot = slots_[request->cookie()];
+	latency_.record(time - (start_ + interval_ * slot.tick));
+
+	if (!slot.first)
+		return;
+
+	/* Only the first frames of the ticks are expected at regular intervals. */
+	uint64_t timestamp = request->timestamp();
+	if (lastFrameTimestamp_ && slot.tick > lastFrameTick_) {
+		int64_t expected = std::chrono::nanoseconds(interval_).count()
+				 * (slot.tick - lastFrameTick_);
+		int64_t actual = timestamp - lastFrameTimestamp_;
+		intervalError_.record(std::chrono::nanoseconds(llabs(actual - expected)));
+	}
+
+	lastFrameTick_ = slot.tick;
+	lastFrameTimestamp_ = timestamp;
+}
+
+void CaptureSchedule::tick()
+{
+	/* Expirations the loop was too busy for are merged, catch up on the time. */
+	Clock::time_point now = Clock::now();
+	uint64_t tick = (now - start_) / interval_;
+	lateness_.record(now - (start_ + interval_ * tick));
+
+	if (tick > nextTick_)
+		missedTicks_ += tick - nextTick_;
+	nextTick_ = tick + 1;
+	ticks_++;
+
+	for (unsigned int i = 0; i < frames_; ++i) {
+		FrameRequest *request;
+
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			if (idle_.empty()) {
+				missedFrames_ += frames_ - i;
+				return;
+			}
+
+			request = idle_.back();
+			idle_.pop_back();
+		}
+
+		slots_[request->cookie()] = { tick, i == 0 };
+		if (source_.queueRequest(request) < 0) {
+			missedFrames_++;
+			release(request);
+		}
+	}
+}
+
+/**
+ * \brief Print the number of ticks and the timing statistics, in microseconds
+ */
+void CaptureSchedule::report(std::ostream &out) const
+{
+	out << "every " << interval_.count() << "us, " << frames_ << " frames per tick, "
+	    << ticks_ << " ticks, " << missedTicks_ << " missed, " << missedFrames_
+	    << " frames missed without an idle request" << std::endl;
+	out << "  timer lateness ";
+	lateness_.report(out);
+	out << "  tick to frame  ";
+	latency_.report(out);
+	out << "  interval error ";
+	intervalError_.report(out);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * capture_schedule.h - Capture of frames at scheduled times
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+
+#include "stats.h"
+
+class EventLoop;
+class FrameRequest;
+class FrameSource;
+
+class CaptureSchedule
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	CaptureSchedule(EventLoop &loop, FrameSource &source,
+			std::chrono::microseconds interval, unsigned int frames = 1);
+	~CaptureSchedule();
+
+	int start();
+	void stop();
+
+	void release(FrameRequest *request);
+	void completed(FrameRequest *request, Clock::time_point time);
+
+	void report(std::ostream &out) const;
+
+private:
+	/* Tick a queued request was captured for, indexed by cookie */
+	struct Slot {
+		uint64_t tick;
+		bool first;
+	};
+
+	void tick();
+
+	EventLoop &loop_;
+	FrameSource &source_;
+	std::chrono::microseconds interval_;
+	unsigned int frames_;
+
+	unsigned int timer_;
+	Clock::time_point start_;
+	uint64_t nextTick_;
+
+	/* Requests released by the sinks, waiting for the next tick */
+	std::mutex lock_;
+	std::vector<FrameRequest *> idle_;
+
+	std::vector<Slot> slots_;
+	uint64_t lastFrameTick_;
+	uint64_t lastFrameTimestamp_;
+
+	uint64_t ticks_;
+	uint64_t missedTicks_;
+	uint64_t missedFrames_;
+	LatencyStats lateness_;
+	LatencyStats latency_;
+	LatencyStats intervalError_;
+};
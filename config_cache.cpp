@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * config_cache.cpp - On-disk cache of validated camera configurations
+ */
+
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcamera/stream.h>
+
+#include "config_cache.h"
+
+using namespace libcamera;
+
+/* Create the directories of a path, as mkdir -p does. */
+static int makeDirectories(const std::string &path)
+{
+	for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+		std::string directory = path.substr(0, slash);
+		if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+			return -errno;
+		if (slash == std::string::npos)
+			return 0;
+	}
+}
+
+/**
+ * \class ConfigCache
+ * \brief Remember the configurations cameras validated, to skip negotiating
+ * them again on the next start
+ *
+ * Negotiating a configuration enumerates the formats and sizes the camera
+ * offers for each role, and picks among them. Once the camera has accepted a
+ * configuration, the format, size and buffer count of its streams are stored
+ * under the id of the camera and a mode, which stands for the roles and
+ * whatever else the choice depends on. The next starts in the same mode add
+ * these streams to an empty configuration instead.
+ *
+ * The cache is a text file, a line per stream. It is only a hint, a camera
+ * that doesn't validate a restored configuration as is gets negotiated again.
+ */
+
+ConfigCache::ConfigCache()
+	: dirty_(false)
+{
+}
+
+/**
+ * \brief Retrieve the path of the cache of the user
+ * \return $XDG_CACHE_HOME/disocamera/configurations, or ~/.cache instead of
+ * $XDG_CACHE_HOME, or an empty path when neither is set
+ */
+std::string ConfigCache::defaultPath()
+{
+	const char *cache = getenv("XDG_CACHE_HOME");
+	if (cache && *cache)
+		return std::string(cache) + "/disocamera/configurations";
+
+	const char *home = getenv("HOME");
+	if (home && *home)
+		return std::string(home) + "/.cache/disocamera/configurations";
+
+	return "";
+}
+
+/**
+ * \brief Read the cache from a file
+ * \param[in] path The path of the file, also written by save()
+ *
+ * A missing file is an empty cache, malformed lines are ignored.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int ConfigCache::load(const std::string &path)
+{
+	path_ = path;
+	entries_.clear();
+	dirty_ = false;
+
+	std::ifstream file(path);
+	if (!file)
+		return errno == ENOENT ? 0 : -errno;
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream fields(line);
+		std::string camera, mode, values;
+		if (!std::getline(fields, camera, '\t') ||
+		    !std::getline(fields, mode, '\t') ||
+		    !std::getline(fields, values))
+			continue;
+
+		Stream stream;
+		unsigned long long modifier;
+		if (sscanf(values.c_str(), "%x %llx %ux%u %u", &stream.fourcc, &modifier,
+			   &stream.width, &stream.height, &stream.bufferCount) != 5 ||
+		    !stream.fourcc || !stream.width || !stream.height)
+			continue;
+
+		stream.modifier = modifier;
+		entries_[{ camera, mode }].push_back(stream);
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Write the cache back, if it changed since it was loaded
+ *
+ * The file is replaced atomically, concurrent instances read either version.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int ConfigCache::save()
+{
+	if (!dirty_ || path_.empty())
+		return 0;
+
+	size_t slash = path_.rfind('/');
+	if (slash != std::string::npos && slash > 0) {
+		int ret = makeDirectories(path_.substr(0, slash));
+		if (ret < 0)
+			return ret;
+	}
+
+	const std::string temporary = path_ + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::trunc);
+		for (const auto &[key, streams] : entries_) {
+			for (const Stream &stream : streams) {
+				char values[96];
+				snprintf(values, sizeof(values), "%08x %llx %ux%u %u",
+					 stream.fourcc,
+					 static_cast<unsigned long long>(stream.modifier),
+					 stream.width, stream.height, stream.bufferCount);
+				file << key.first << '\t' << key.second << '\t'
+				     << values << '\n';
+			}
+		}
+
+		if (!file.flush()) {
+			unlink(temporary.c_str());
+			return -EIO;
+		}
+	}
+
+	if (rename(temporary.c_str(), path_.c_str()) < 0) {
+		int ret = -errno;
+		unlink(temporary.c_str());
+		return ret;
+	}
+
+	dirty_ = false;
+	return 0;
+}
+
+/**
+ * \brief Add the cached streams of a camera to a configuration
+ * \param[in] camera The id of the camera
+ * \param[in] mode The mode the configuration was stored for
+ * \param[out] config An empty configuration generated by the camera
+ *
+ * The configuration still has to be validated before configuring the camera.
+ *
+ * \return True if the configuration was restored, false if none is cached
+ */
+bool ConfigCache::restore(const std::string &camera, const std::string &mode,
+			  CameraConfiguration *config) const
+{
+	auto iter = entries_.find({ camera, mode });
+	if (iter == entries_.end() || !config->empty())
+		return false;
+
+	for (const Stream &stream : iter->second) {
+		StreamConfiguration cfg;
+		cfg.pixelFormat = PixelFormat(stream.fourcc, stream.modifier);
+		cfg.size = Size(stream.width, stream.height);
+		cfg.bufferCount = stream.bufferCount;
+		config->addConfiguration(cfg);
+	}
+
+	return true;
+}
+
+/**
+ * \brief Cache the validated configuration of a camera
+ * \param[in] camera The id of the camera
+ * \param[in] mode The mode the configuration is for
+ * \param[in] config The configuration, as accepted by the camera
+ */
+void ConfigCache::store(const std::string &camera, const std::string &mode,
+			const CameraConfiguration &config)
+{
+	std::vector<Stream> streams;
+	for (const StreamConfiguration &cfg : config)
+		streams.push_back({ cfg.pixelFormat.fourcc(), cfg.pixelFormat.modifier(),
+				    cfg.size.width, cfg.size.height, cfg.bufferCount });
+
+	entries_[{ camera, mode }] = std::move(streams);
+	dirty_ = true;
+}
+
+/**
+ * \brief Check whether a configuration has the cached streams
+ *
+ * A restored configuration the camera adjusted while validating it doesn't
+ * match anymore, the camera or its driver changed since it was cached.
+ *
+ * \return True if the streams of \a config are the cached ones, in order
+ */
+bool ConfigCache::matches(const std::string &camera, const std::string &mode,
+			  const CameraConfiguration &config) const
+{
+	auto iter = entries_.find({ camera, mode });
+	if (iter == entries_.end() || iter->second.size() != config.size())
+		return false;
+
+	unsigned int index = 0;
+	for (const StreamConfiguration &cfg : config) {
+		const Stream &stream = iter->second[index++];
+		if (cfg.pixelFormat != PixelFormat(stream.fourcc, stream.modifier) ||
+		    cfg.size.width != stream.width || cfg.size.height != stream.height ||
+		    cfg.bufferCount != stream.bufferCount)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief Forget the configuration of a camera, once it is stale
+ */
+void ConfigCache::erase(const std::string &camera, const std::string &mode)
+{
+	if (entries_.erase({ camera, mode }))
+		dirty_ = true;
+}
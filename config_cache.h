@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * config_cache.h - On-disk cache of validated camera configurations
+ */
+
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <libcamera/camera.h>
+
+class ConfigCache
+{
+public:
+	ConfigCache();
+
+	static std::string defaultPath();
+
+	int load(const std::string &path);
+	int save();
+
+	bool restore(const std::string &camera, const std::string &mode,
+		     libcamera::CameraConfiguration *config) const;
+	void store(const std::string &camera, const std::string &mode,
+		   const libcamera::CameraConfiguration &config);
+	bool matches(const std::string &camera, const std::string &mode,
+		     const libcamera::CameraConfiguration &config) const;
+	void erase(const std::string &camera, const std::string &mode);
+
+	const std::string &path() const { return path_; }
+	size_t size() const { return entries_.size(); }
+
+private:
+	struct Stream {
+		uint32_t fourcc;
+		uint64_t modifier;
+		unsigned int width;
+		unsigned int height;
+		unsigned int bufferCount;
+	};
+
+	using Key = std::pair<std::string, std::string>;
+
+	std::string path_;
+	/* Streams of each camera and mode, in the order of the roles */
+	std::map<Key, std::vector<Stream>> entries_;
+	bool dirty_;
+};
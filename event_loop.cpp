@@ -5,29 +5,69 @@
  * event_loop.cpp - Event loop based on cam
  */
 #include <iostream>
+#include <mutex>
 #include "event_loop.h"
 
-#include <assert.h>
+#include <algorithm>
+#include <errno.h>
 #include <event2/event.h>
 #include <event2/thread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
-EventLoop *EventLoop::instance_ = nullptr;
+/* Maximum number of calls run before giving other events a chance */
+static constexpr size_t kCallBatchSize = 64;
+
+/**
+ * \class EventLoop
+ * \brief Run handlers for file descriptors, signals, timers and queued calls
+ *
+ * Several loops can exist at the same time, each run by its own thread, for
+ * instance one per camera. Signals can only be watched by one loop at a time.
+ */
 
 EventLoop::EventLoop()
+	: wakeupEvent_(nullptr), wakeupPending_(false), nextTimer_(1)
 {
-	assert(!instance_);
+	/* Locking must be enabled once, before the first event base is created. */
+	static std::once_flag threadsEnabled;
+	std::call_once(threadsEnabled, [] { evthread_use_pthreads(); });
 
-	evthread_use_pthreads();
 	event_ = event_base_new();
-	instance_ = this;
+
+	/*
+	 * Producers signal queued calls through an eventfd watched by the
+	 * event base, which saves breaking out of the loop for every call.
+	 */
+	wakeupFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeupFd_ < 0) {
+		std::cerr << "Failed to create call wakeup eventfd" << std::endl;
+		return;
+	}
+
+	wakeupEvent_ = event_new(event_, wakeupFd_, EV_READ | EV_PERSIST,
+				 &callsPending, this);
+	event_add(wakeupEvent_, nullptr);
 }
 
+/*
+ * libevent_global_shutdown() isn't called, as it would break the other loops
+ * of the process.
+ */
 EventLoop::~EventLoop()
 {
-	instance_ = nullptr;
+	events_.clear();
+	removed_.clear();
+
+	if (wakeupEvent_)
+		event_free(wakeupEvent_);
+	if (wakeupFd_ >= 0)
+		close(wakeupFd_);
 
 	event_base_free(event_);
-	libevent_global_shutdown();
 }
 
 int EventLoop::exec()
@@ -37,6 +77,14 @@ int EventLoop::exec()
 
 	while (!exit_.load(std::memory_order_acquire)) {
 		dispatchCalls();
+
+		/*
+		 * A call may have exited the loop, event_base_loop() would clear
+		 * the break request and wait for the next event.
+		 */
+		if (exit_.load(std::memory_order_acquire))
+			break;
+
 		event_base_loop(event_, EVLOOP_NO_EXIT_ON_EMPTY);
 	}
 
@@ -56,44 +104,281 @@ void EventLoop::interrupt()
 }
 
 
-void EventLoop::timeoutTriggered(int fd, short event, void *arg)
+/**
+ * \brief Exit the loop after a number of seconds
+ */
+void EventLoop::timeout(unsigned int sec)
 {
-	EventLoop *self = static_cast<EventLoop *>(arg);
-	self->exit();
+	addTimer(std::chrono::seconds(sec), {}, [this]() { exit(); });
 }
 
-void EventLoop::timeout(unsigned int sec)
+/**
+ * \brief Call a handler from the loop at a given time, and periodically after
+ * \param[in] deadline The time of the first call
+ * \param[in] interval The period of the next calls, 0 for a single call
+ * \param[in] handler The function to call
+ *
+ * Timers are timerfds on CLOCK_MONOTONIC, the clock of steady_clock, armed to
+ * absolute times. Periodic calls thus don't drift however late each of them
+ * runs, and the loop sleeps in between. Expirations the loop was too busy to
+ * handle are merged into the next call, a handler catching up shall look at
+ * the time. A deadline in the past calls the handler right away.
+ *
+ * A single call timer is removed once called. A handler may remove its own
+ * timer.
+ *
+ * \return The handle of the timer, or 0 if it couldn't be created
+ */
+unsigned int EventLoop::addTimer(std::chrono::steady_clock::time_point deadline,
+				 std::chrono::microseconds interval,
+				 const std::function<void()> &handler)
 {
-	struct event *ev;
-	struct timeval tv;
+	auto timespecOf = [](std::chrono::nanoseconds ns) {
+		struct timespec ts;
+		ts.tv_sec = ns.count() / 1000000000;
+		ts.tv_nsec = ns.count() % 1000000000;
+		return ts;
+	};
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to create timer" << std::endl;
+		return 0;
+	}
+
+	/* A zero it_value would disarm the timer, the epoch is long past. */
+	struct itimerspec spec;
+	spec.it_value = timespecOf(std::max(deadline.time_since_epoch(),
+					    std::chrono::steady_clock::duration(1)));
+	spec.it_interval = timespecOf(interval);
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+		std::cerr << "Failed to arm timer" << std::endl;
+		close(fd);
+		return 0;
+	}
 
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
-	ev = evtimer_new(event_, &timeoutTriggered, this);
-	evtimer_add(ev, &tv);
+	unsigned int timer = nextTimer_++;
+	bool periodic = interval.count() > 0;
+	std::unique_ptr<Event> event = std::make_unique<Event>(
+		[this, fd, timer, periodic, handler]() {
+			uint64_t expirations;
+			if (read(fd, &expirations, sizeof(expirations)) < 0)
+				return;
+
+			handler();
+
+			if (!periodic)
+				removeTimer(timer);
+		}, fd, Read);
+	event->timer_ = timer;
+
+	event->event_ = event_new(event_, fd, EV_READ | EV_PERSIST,
+				  &EventLoop::Event::dispatch, event.get());
+	if (!event->event_ || event_add(event->event_, nullptr) < 0) {
+		std::cerr << "Failed to add event for timer" << std::endl;
+		return 0;
+	}
+
+	events_.push_back(std::move(event));
+
+	return timer;
+}
+
+/**
+ * \brief Call a handler from the loop after a delay, and periodically after
+ * \param[in] delay The delay before the first call, from now
+ * \param[in] interval The period of the next calls, 0 for a single call
+ * \param[in] handler The function to call
+ *
+ * \sa addTimer(std::chrono::steady_clock::time_point, std::chrono::microseconds,
+ * const std::function<void()> &)
+ *
+ * \return The handle of the timer, or 0 if it couldn't be created
+ */
+unsigned int EventLoop::addTimer(std::chrono::microseconds delay,
+				 std::chrono::microseconds interval,
+				 const std::function<void()> &handler)
+{
+	return addTimer(std::chrono::steady_clock::now() + delay, interval, handler);
 }
 
-void EventLoop::callLater(const std::function<void()> &func)
+/**
+ * \brief Cancel a timer
+ * \param[in] timer The handle of the timer
+ *
+ * The handler isn't called anymore once this function returns. Removing a
+ * timer that already fired its single call, or was removed, does nothing.
+ * This function shall be called from the loop thread.
+ */
+void EventLoop::removeTimer(unsigned int timer)
 {
-	{
-		std::unique_lock<std::mutex> locker(lock_);
-		calls_.push_back(func);
+	for (auto iter = events_.begin(); iter != events_.end(); ++iter) {
+		Event *event = iter->get();
+		if (!timer || event->timer_ != timer)
+			continue;
+
+		/* The handler may be running, free the event later. */
+		event_del(event->event_);
+		removed_.push_back(std::move(*iter));
+		events_.erase(iter);
+		wakeup();
+		return;
 	}
+}
 
-	interrupt();
+/**
+ * \brief Call a handler from the loop whenever a file descriptor is ready
+ * \param[in] fd The file descriptor
+ * \param[in] type The events to wait for
+ * \param[in] handler The function to call
+ */
+void EventLoop::addFdEvent(int fd, EventType type,
+			   const std::function<void()> &handler)
+{
+	std::unique_ptr<Event> event = std::make_unique<Event>(handler, fd, type);
+	short events = (type & Read ? EV_READ : 0)
+		     | (type & Write ? EV_WRITE : 0)
+		     | EV_PERSIST;
+
+	event->event_ = event_new(event_, fd, events, &EventLoop::Event::dispatch,
+				  event.get());
+	if (!event->event_) {
+		std::cerr << "Failed to create event for fd " << fd << std::endl;
+		return;
+	}
+
+	int ret = event_add(event->event_, nullptr);
+	if (ret < 0) {
+		std::cerr << "Failed to add event for fd " << fd << std::endl;
+		return;
+	}
+
+	events_.push_back(std::move(event));
 }
 
-void EventLoop::dispatchCalls()
+/**
+ * \brief Stop calling the handlers added for a file descriptor
+ * \param[in] fd The file descriptor
+ * \param[in] type The events the handlers were added for
+ *
+ * A handler may remove its own event. This function shall be called from the
+ * loop thread, and before the file descriptor is closed.
+ */
+void EventLoop::removeFdEvent(int fd, EventType type)
 {
-	std::unique_lock<std::mutex> locker(lock_);
+	for (auto iter = events_.begin(); iter != events_.end();) {
+		Event *event = iter->get();
+		if (event->fd_ != fd || event->type_ != type) {
+			++iter;
+			continue;
+		}
+
+		/* The handler may be running, free the event later. */
+		event_del(event->event_);
+		removed_.push_back(std::move(*iter));
+		iter = events_.erase(iter);
+	}
 
-	for (auto iter = calls_.begin(); iter != calls_.end(); ) {
-		std::function<void()> call = std::move(*iter);
+	if (!removed_.empty())
+		wakeup();
+}
 
-		iter = calls_.erase(iter);
+/**
+ * \brief Call a handler from the loop whenever a signal is delivered
+ * \param[in] signum The signal number
+ * \param[in] handler The function to call
+ *
+ * The handler runs in the loop thread, not in signal context, so it isn't
+ * restricted to async-signal-safe functions.
+ */
+void EventLoop::addSignalEvent(int signum, const std::function<void()> &handler)
+{
+	std::unique_ptr<Event> event = std::make_unique<Event>(handler);
 
-		locker.unlock();
-		call();
-		locker.lock();
+	event->event_ = evsignal_new(event_, signum, &EventLoop::Event::dispatch,
+				     event.get());
+	if (!event->event_) {
+		std::cerr << "Failed to create event for signal " << signum
+			  << std::endl;
+		return;
 	}
+
+	int ret = event_add(event->event_, nullptr);
+	if (ret < 0) {
+		std::cerr << "Failed to add event for signal " << signum
+			  << std::endl;
+		return;
+	}
+
+	events_.push_back(std::move(event));
+}
+
+EventLoop::Event::Event(const std::function<void()> &callback, int fd,
+		       EventType type)
+	: callback_(callback), event_(nullptr), fd_(fd), type_(type), timer_(0)
+{
+}
+
+EventLoop::Event::~Event()
+{
+	if (event_) {
+		event_del(event_);
+		event_free(event_);
+	}
+
+	if (timer_)
+		close(fd_);
+}
+
+void EventLoop::Event::dispatch(int fd, short events, void *arg)
+{
+	Event *event = static_cast<Event *>(arg);
+
+	event->callback_();
+}
+
+void EventLoop::wakeup()
+{
+	/* Only the first call queued since the last drain signals the loop. */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (wakeupPending_.exchange(true, std::memory_order_seq_cst))
+		return;
+
+	if (wakeupFd_ < 0) {
+		interrupt();
+		return;
+	}
+
+	uint64_t value = 1;
+	if (write(wakeupFd_, &value, sizeof(value)) < 0)
+		interrupt();
+}
+
+void EventLoop::callsPending(int fd, short event, void *arg)
+{
+	EventLoop *self = static_cast<EventLoop *>(arg);
+	uint64_t value;
+
+	if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		std::cerr << "Failed to read call wakeup eventfd" << std::endl;
+
+	self->dispatchCalls();
+}
+
+void EventLoop::dispatchCalls()
+{
+	/*
+	 * Clear the pending flag before draining, so that a call queued while
+	 * dispatching signals the loop again instead of being missed.
+	 */
+	wakeupPending_.store(false, std::memory_order_seq_cst);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	removed_.clear();
+
+	calls_.dispatch(kCallBatchSize);
+
+	/* Leave the rest for the next iteration to avoid starving timers. */
+	if (!calls_.empty() && wakeupEvent_)
+		event_active(wakeupEvent_, EV_READ, 0);
 }
@@ -8,15 +8,25 @@
 #define __SIMPLE_CAM_EVENT_LOOP_H__
 
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <list>
-#include <mutex>
+#include <memory>
+#include <utility>
 
+#include "call_queue.h"
+
+struct event;
 struct event_base;
 
 class EventLoop
 {
 public:
+	enum EventType {
+		Read = 1,
+		Write = 2,
+	};
+
 	EventLoop();
 	~EventLoop();
 
@@ -24,21 +34,63 @@ public:
 	int exec();
 
 	void timeout(unsigned int sec);
-	void callLater(const std::function<void()> &func);
+
+	unsigned int addTimer(std::chrono::steady_clock::time_point deadline,
+			      std::chrono::microseconds interval,
+			      const std::function<void()> &handler);
+	unsigned int addTimer(std::chrono::microseconds delay,
+			      std::chrono::microseconds interval,
+			      const std::function<void()> &handler);
+	void removeTimer(unsigned int timer);
+
+	void addFdEvent(int fd, EventType type,
+			const std::function<void()> &handler);
+	void removeFdEvent(int fd, EventType type);
+	void addSignalEvent(int signum, const std::function<void()> &handler);
+
+	template<typename Func>
+	void callLater(Func &&func)
+	{
+		calls_.push(std::forward<Func>(func));
+		wakeup();
+	}
 
 private:
-	static EventLoop *instance_;
+	struct Event {
+		Event(const std::function<void()> &callback, int fd = -1,
+		      EventType type = Read);
+		~Event();
 
-	static void timeoutTriggered(int fd, short event, void *arg);
+		static void dispatch(int fd, short events, void *arg);
+
+		std::function<void()> callback_;
+		struct event *event_;
+		int fd_;
+		EventType type_;
+		/* Handle of a timer, whose timerfd the event owns, 0 otherwise */
+		unsigned int timer_;
+	};
+
+	static void callsPending(int fd, short event, void *arg);
 
 	struct event_base *event_;
 	std::atomic<bool> exit_;
 	int exitCode_;
 
-	std::list<std::function<void()>> calls_;
-	std::mutex lock_;
+	CallQueue calls_;
+	int wakeupFd_;
+	struct event *wakeupEvent_;
+	std::atomic<bool> wakeupPending_;
+
+	/* Handles of the timers, never reused */
+	unsigned int nextTimer_;
+
+	std::list<std::unique_ptr<Event>> events_;
+	/* Events removed, possibly from their own handler, freed by dispatchCalls() */
+	std::list<std::unique_ptr<Event>> removed_;
 
 	void interrupt();
+	void wakeup();
 	void dispatchCalls();
 };
 
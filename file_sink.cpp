@@ -5,29 +5,88 @@
  * file_sink.cpp - File Sink
  */
 
-#include <assert.h>
+#include <algorithm>
 #include <fcntl.h>
-#include <iomanip>
 #include <iostream>
-#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <libcamera/camera.h>
 
+#include "buffer_cache.h"
 #include "file_sink.h"
 #include "image.h"
+#include "trace.h"
 
 using namespace libcamera;
 
+/* Alignment of buffers, offsets and sizes for O_DIRECT writes */
+static constexpr size_t kDirectAlignment = 4096;
+
+static size_t alignDirect(size_t size)
+{
+	return (size + kDirectAlignment - 1) & ~(kDirectAlignment - 1);
+}
+
+/**
+ * \class FileSink
+ * \brief Write raw frames to files
+ *
+ * Planes are written by a FileWriter, through io_uring when available,
+ * straight from the mapped frame buffers. processRequest() only opens the
+ * output files and queues the writes, the request is then handed back through
+ * the requestProcessed signal, from a writer thread, once its data is on its
+ * way to storage.
+ *
+ * With direct I/O, files are opened with O_DIRECT and the planes are first
+ * copied to a block aligned staging buffer, as the plane offsets within the
+ * frame buffers are not guaranteed to be aligned. The request is then released
+ * right away, and the files are truncated to the payload size once written.
+ * Staging buffers are recycled from one request to the next.
+ *
+ * When the pattern ends with ".raw", frames are instead appended to segment
+ * files managed by a RawWriter, each preceded by a header describing its
+ * format, see raw_format.h. Segments are named after the pattern, with the
+ * segment number inserted before the extension.
+ */
+
+/**
+ * \param[in] streamNames Names of the streams, unused for now
+ * \param[in] buffers Mappings of the frame buffers
+ * \param[in] pattern Output file name pattern, '#' is replaced by the frame
+ * sequence number. Without '#', all frames are appended to the same file, and
+ * with a ".raw" extension to a segmented container
+ * \param[in] direct Bypass the page cache with O_DIRECT
+ */
 FileSink::FileSink(const std::map<const libcamera::Stream *, std::string> &streamNames,
-		   const std::string &pattern)
-	: streamNames_(streamNames), pattern_(pattern)
+		   const BufferCache &buffers, const std::string &pattern,
+		   bool direct)
+	: streamNames_(streamNames), buffers_(buffers), pattern_(pattern),
+	  direct_(direct), appendFd_(-1), appendOffset_(0), pending_(0)
 {
+	if (pattern_.empty() || pattern_.back() == '/')
+		pattern_ += "frame-#.bin";
+
+	const std::string extension = ".raw";
+	if (pattern_.size() > extension.size() &&
+	    !pattern_.compare(pattern_.size() - extension.size(), extension.size(), extension))
+		container_ = std::make_unique<RawWriter>(pattern_.substr(0, pattern_.size() - extension.size()));
+
+	/* Appended frames would have to be padded to the block size. */
+	if (direct_ && pattern_.find_first_of('#') == std::string::npos) {
+		std::cerr << "direct I/O needs one file per frame, disabled"
+			  << std::endl;
+		direct_ = false;
+	}
+
+	writer_ = FileWriter::create();
 }
 
 FileSink::~FileSink()
 {
+	stop();
 }
 
 int FileSink::configure(const libcamera::CameraConfiguration &config)
@@ -36,90 +95,341 @@ int FileSink::configure(const libcamera::CameraConfiguration &config)
 	if (ret < 0)
 		return ret;
 
+	streamConfigs_.clear();
+	for (const StreamConfiguration &cfg : config) {
+		if (selected(cfg.stream()))
+			streamConfigs_[cfg.stream()] = cfg;
+	}
+
 	return 0;
 }
 
-void FileSink::mapBuffer(FrameBuffer *buffer)
+/**
+ * \brief Create the first segment file, when recording to segments
+ */
+int FileSink::start()
 {
-	std::unique_ptr<Image> image =
-		Image::fromFrameBuffer(buffer, Image::MapMode::ReadOnly);
-	assert(image != nullptr);
+	if (container_) {
+		int ret = container_->open();
+		if (ret < 0)
+			return ret;
+	}
 
-	mappedBuffers_[buffer] = std::move(image);
+	return FrameSink::start();
 }
 
-bool FileSink::processRequest(Request *request)
+/**
+ * \brief Wait for all queued writes to complete
+ */
+int FileSink::stop()
 {
-	for (auto [stream, buffer] : request->buffers())
-		writeBuffer(stream, buffer);
+	writer_->wait();
 
-	return true;
+	std::unique_lock<std::mutex> locker(lock_);
+	cond_.wait(locker, [&] { return !pending_; });
+
+	if (appendFd_ >= 0) {
+		close(appendFd_);
+		appendFd_ = -1;
+	}
+
+	if (container_)
+		container_->close();
+
+	return FrameSink::stop();
 }
 
-void FileSink::writeBuffer(const Stream *stream, FrameBuffer *buffer)
+bool FileSink::processRequest(FrameRequest *request)
 {
-	std::string filename;
-	size_t pos;
-	int fd, ret = 0;
-
-	if (!pattern_.empty())
-		filename = pattern_;
-
-	if (filename.empty() || filename.back() == '/')
-		filename += "frame-#.bin";
-
-	pos = filename.find_first_of('#');
-	if (pos != std::string::npos) {
-		std::stringstream ss;
-		/*
-		ss << streamNames_[stream] << "-" << std::setw(6)
-		   << std::setfill('0') << buffer->metadata().sequence;
-		*/
-		ss << "sink_test_" << std::setw(6) << std::setfill('0') << buffer->metadata().sequence;
-		filename.replace(pos, 1, ss.str());
+	FileWriter::Write writes[FileWriter::kMaxWrites];
+	unsigned int count = 0;
+
+	TRACE_SCOPE("raw", "submit", request->sequence());
+
+	Frame *frame = acquireFrame();
+	frame->request = request;
+	frame->files = 0;
+	frame->records = 0;
+	frame->sequence = request->sequence();
+
+	/* Size the staging buffer for all the planes of the request first. */
+	if (direct_) {
+		size_t size = 0;
+		for (auto [stream, buffer] : request->buffers()) {
+			if (!selected(stream))
+				continue;
+
+			const FrameRequest::Metadata &metadata = request->metadata(buffer);
+			for (unsigned int i = 0; i < metadata.planes; ++i)
+				size += metadata.bytesused[i];
+			size = alignDirect(size);
+		}
+
+		if (!stage(frame, size)) {
+			releaseFrame(frame);
+			return true;
+		}
 	}
 
-	fd = open(filename.c_str(), O_CREAT | O_WRONLY |
-		  (pos == std::string::npos ? O_APPEND : O_TRUNC),
-		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	size_t staged = 0;
+
+	for (auto [stream, buffer] : request->buffers()) {
+		if (!selected(stream))
+			continue;
+
+		const Image *image = buffers_.find(buffer);
+		if (!image) {
+			std::cerr << "buffer not mapped" << std::endl;
+			continue;
+		}
+
+		const FrameRequest::Metadata &metadata = request->metadata(buffer);
+
+		if (container_) {
+			queueRecord(frame, stream, metadata, *image, writes, &count);
+			continue;
+		}
+
+		unsigned int planes = metadata.planes;
+		if (frame->files == FileWriter::kMaxWrites ||
+		    count + (direct_ ? 1 : planes) > FileWriter::kMaxWrites) {
+			std::cerr << "too many planes in request" << std::endl;
+			break;
+		}
+
+		uint64_t offset;
+		int fd = openFile(stream, metadata.sequence, &offset);
+		if (fd < 0)
+			continue;
+
+		if (fd != appendFd_)
+			frame->fds[frame->files++] = fd;
+
+		size_t start = staged;
+
+		for (unsigned int i = 0; i < planes; ++i) {
+			unsigned int bytesused = metadata.bytesused[i];
+			Span<const uint8_t> data = image->data(i);
+			size_t length = std::min<size_t>(bytesused, data.size());
+
+			if (bytesused > data.size())
+				std::cerr << "payload size " << bytesused
+					  << " larger than plane size " << data.size()
+					  << std::endl;
+
+			if (direct_) {
+				memcpy(frame->staging.get() + staged, data.data(), length);
+				staged += length;
+				continue;
+			}
+
+			writes[count++] = { fd, offset, data.data(), length };
+			offset += length;
+		}
+
+		if (fd == appendFd_)
+			appendOffset_ = offset;
+
+		if (direct_) {
+			size_t length = staged - start;
+			frame->sizes[frame->files - 1] = length;
+			staged = alignDirect(staged);
+			writes[count++] = { fd, 0, frame->staging.get() + start,
+					    alignDirect(length) };
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		pending_++;
+	}
+
+	TRACE_BEGIN(frame->submitted);
+	writer_->write(writes, count, &FileSink::frameWritten, frame);
+
+	/* Staged data doesn't reference the frame buffers anymore. */
+	return direct_;
+}
+
+void FileSink::frameWritten(void *arg, int result)
+{
+	Frame *frame = static_cast<Frame *>(arg);
+	FileSink *sink = frame->sink;
+
+	TRACE_SPAN("raw", "write", frame->sequence, frame->submitted, trace::now());
+
+	if (result < 0)
+		std::cerr << "write error: " << strerror(-result) << std::endl;
+
+	for (unsigned int i = 0; i < frame->files; ++i) {
+		/* Drop the padding of direct writes. */
+		if (sink->direct_ && ftruncate(frame->fds[i], frame->sizes[i]) < 0)
+			std::cerr << "failed to truncate file: "
+				  << strerror(errno) << std::endl;
+
+		close(frame->fds[i]);
+	}
+
+	for (unsigned int i = 0; i < frame->records; ++i)
+		sink->container_->release(frame->segments[i]);
+
+	FrameRequest *request = frame->request;
+	sink->releaseFrame(frame);
+
+	if (!sink->direct_)
+		sink->requestProcessed.emit(request);
+
+	std::unique_lock<std::mutex> locker(sink->lock_);
+	sink->pending_--;
+	sink->cond_.notify_all();
+}
+
+FileSink::Frame *FileSink::acquireFrame()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (free_.empty()) {
+		frames_.push_back(std::make_unique<Frame>(Frame{
+			this, nullptr, {}, {}, 0,
+			{ nullptr, &::free }, 0, {}, {}, 0, 0, 0 }));
+		return frames_.back().get();
+	}
+
+	Frame *frame = free_.back();
+	free_.pop_back();
+	return frame;
+}
+
+void FileSink::releaseFrame(Frame *frame)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	free_.push_back(frame);
+}
+
+/*
+ * Open the file of a buffer, and return the offset its data shall be written
+ * at. Frames appended to a single file share a descriptor opened once.
+ */
+int FileSink::openFile(const Stream *stream, unsigned int sequence,
+		       uint64_t *offset)
+{
+	size_t pos = pattern_.find_first_of('#');
+
+	if (pos == std::string::npos) {
+		if (appendFd_ < 0) {
+			appendFd_ = open(pattern_.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC,
+					 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			if (appendFd_ == -1) {
+				std::cerr << "failed to open file " << pattern_ << ": "
+					  << strerror(errno) << std::endl;
+				return -1;
+			}
+
+			off_t end = lseek(appendFd_, 0, SEEK_END);
+			appendOffset_ = end < 0 ? 0 : end;
+		}
+
+		*offset = appendOffset_;
+		return appendFd_;
+	}
+
+	/* Build the name in place, to reuse the string storage. */
+	char name[32];
+	snprintf(name, sizeof(name), "sink_test_%06u", sequence);
+
+	filename_ = pattern_;
+	filename_.replace(pos, 1, name);
+
+	int fd = open(filename_.c_str(),
+		      O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC | (direct_ ? O_DIRECT : 0),
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	if (fd == -1) {
-		ret = -errno;
-		std::cerr << "failed to open file " << filename << ": "
-			  << strerror(-ret) << std::endl;
+		std::cerr << "failed to open file " << filename_ << ": "
+			  << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	*offset = 0;
+	return fd;
+}
+
+/* Make sure the staging buffer of a frame can hold size bytes. */
+bool FileSink::stage(Frame *frame, size_t size)
+{
+	if (frame->stagingSize >= size)
+		return true;
+
+	void *staging;
+	if (posix_memalign(&staging, kDirectAlignment, size)) {
+		std::cerr << "failed to allocate staging buffer" << std::endl;
+		return false;
+	}
+
+	frame->staging.reset(static_cast<uint8_t *>(staging));
+	frame->stagingSize = size;
+	return true;
+}
+
+/*
+ * Reserve room for a buffer in the container and queue the writes of its
+ * header and planes. Padding between planes is left as preallocated.
+ */
+void FileSink::queueRecord(Frame *frame, const Stream *stream,
+			   const FrameRequest::Metadata &metadata, const Image &image,
+			   FileWriter::Write *writes, unsigned int *count)
+{
+	unsigned int planes = metadata.planes;
+
+	if (planes > raw::kMaxPlanes || frame->records == FileWriter::kMaxWrites ||
+	    *count + planes + 1 > FileWriter::kMaxWrites) {
+		std::cerr << "too many planes in request" << std::endl;
 		return;
 	}
 
-	Image *image = mappedBuffers_[buffer].get();
+	raw::FrameHeader &header = frame->headers[frame->records];
+	header = {};
+	header.magic = raw::kFrameMagic;
+	header.headerSize = sizeof(header);
+	header.sequence = metadata.sequence;
+	header.timestamp = metadata.timestamp;
+	header.numPlanes = planes;
 
-	for (unsigned int i = 0; i < buffer->planes().size(); ++i) {
-		const FrameMetadata::Plane &meta = buffer->metadata().planes()[i];
+	auto iter = streamConfigs_.find(stream);
+	if (iter != streamConfigs_.end()) {
+		const StreamConfiguration &cfg = iter->second;
+		header.fourcc = cfg.pixelFormat.fourcc();
+		header.modifier = cfg.pixelFormat.modifier();
+		header.width = cfg.size.width;
+		header.height = cfg.size.height;
+		header.stride = cfg.stride;
+	}
 
-		Span<uint8_t> data = image->data(i);
-		std::cout << "\033[1;33m###### FileSink::writeBuffer -> <data> OK\033[0m" << std::endl;
-		unsigned int length = std::min<unsigned int>(meta.bytesused, data.size());
-		std::cout << "\033[1;33m###### FileSink::writeBuffer -> <data> length : \033[0m" << length << std::endl;
+	uint64_t size = sizeof(header);
+	for (unsigned int i = 0; i < planes; ++i) {
+		unsigned int bytesused = metadata.bytesused[i];
+		Span<const uint8_t> data = image.data(i);
 
-		if (meta.bytesused > data.size())
-			std::cerr << "payload size " << meta.bytesused
+		if (bytesused > data.size())
+			std::cerr << "payload size " << bytesused
 				  << " larger than plane size " << data.size()
 				  << std::endl;
-		std::cout << "\033[1;33m###### FileSink::writeBuffer -> Beginning writting\033[0m" << std::endl;
-
-		ret = ::write(fd, data.data(), length);
-		if (ret < 0) {
-			ret = -errno;
-			std::cerr << "write error: " << strerror(-ret)
-				  << std::endl;
-			break;
-		} else if (ret != (int)length) {
-			std::cerr << "write error: only " << ret
-				  << " bytes written instead of "
-				  << length << std::endl;
-			break;
-		}
-		std::cout << "\033[1;33m###### FileSink::writeBuffer -> Image Data written in file : \033[0m" << filename << std::endl;
 
+		header.planeOffset[i] = size;
+		header.planeSize[i] = std::min<size_t>(bytesused, data.size());
+		size += raw::align(header.planeSize[i]);
 	}
-	std::cout << "\033[1;33m###### FileSink::writeBuffer -> Image treatment ended\033[0m" << std::endl;
-	close(fd);
+	header.size = size;
+
+	uint64_t offset;
+	RawWriter::Segment *segment =
+		container_->reserve(size, header.sequence, header.timestamp, &offset);
+	if (!segment)
+		return;
+
+	frame->segments[frame->records++] = segment;
+
+	writes[(*count)++] = { segment->fd, offset, &header, sizeof(header) };
+	for (unsigned int i = 0; i < planes; ++i)
+		writes[(*count)++] = { segment->fd, offset + header.planeOffset[i],
+				       image.data(i).data(), header.planeSize[i] };
 }
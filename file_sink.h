@@ -7,34 +7,93 @@
 
 #pragma once
 
+#include <array>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <libcamera/stream.h>
 
+#include "file_writer.h"
+#include "frame_request.h"
 #include "frame_sink.h"
+#include "raw_writer.h"
 
+class BufferCache;
 class Image;
 
 class FileSink : public FrameSink
 {
 public:
 	FileSink(const std::map<const libcamera::Stream *, std::string> &streamNames,
-		 const std::string &pattern = "");
+		 const BufferCache &buffers, const std::string &pattern = "",
+		 bool direct = false);
 	~FileSink();
 
 	int configure(const libcamera::CameraConfiguration &config) override;
 
-	void mapBuffer(libcamera::FrameBuffer *buffer) override;
+	int start() override;
+	int stop() override;
 
-	bool processRequest(libcamera::Request *request) override;
+	bool processRequest(FrameRequest *request) override;
+
+	const char *writer() const { return writer_->name(); }
 
 private:
-	void writeBuffer(const libcamera::Stream *stream,
-			 libcamera::FrameBuffer *buffer);
+	/* Writes of a request in flight, recycled from one request to the next */
+	struct Frame {
+		FileSink *sink;
+		FrameRequest *request;
+		std::array<int, FileWriter::kMaxWrites> fds;
+		std::array<uint64_t, FileWriter::kMaxWrites> sizes;
+		unsigned int files;
+		std::unique_ptr<uint8_t, void (*)(void *)> staging;
+		size_t stagingSize;
+		std::array<raw::FrameHeader, FileWriter::kMaxWrites> headers;
+		std::array<RawWriter::Segment *, FileWriter::kMaxWrites> segments;
+		unsigned int records;
+
+		/* Frame sequence and submission time, for tracing */
+		unsigned int sequence;
+		uint64_t submitted;
+	};
+
+	static void frameWritten(void *arg, int result);
+
+	Frame *acquireFrame();
+	void releaseFrame(Frame *frame);
+
+	int openFile(const libcamera::Stream *stream, unsigned int sequence,
+		     uint64_t *offset);
+	bool stage(Frame *frame, size_t size);
+	void queueRecord(Frame *frame, const libcamera::Stream *stream,
+			 const FrameRequest::Metadata &metadata, const Image &image,
+			 FileWriter::Write *writes, unsigned int *count);
 
 	std::map<const libcamera::Stream *, std::string> streamNames_;
+	std::map<const libcamera::Stream *, libcamera::StreamConfiguration> streamConfigs_;
+	const BufferCache &buffers_;
 	std::string pattern_;
-	std::map<libcamera::FrameBuffer *, std::unique_ptr<Image>> mappedBuffers_;
+	bool direct_;
+
+	std::string filename_;
+
+	/* File all frames are appended to, when the pattern has no '#' */
+	int appendFd_;
+	uint64_t appendOffset_;
+
+	/* Segmented container, when the pattern ends with ".raw" */
+	std::unique_ptr<RawWriter> container_;
+
+	std::unique_ptr<FileWriter> writer_;
+
+	std::vector<std::unique_ptr<Frame>> frames_;
+	std::vector<Frame *> free_;
+	unsigned int pending_;
+	std::mutex lock_;
+	std::condition_variable cond_;
 };
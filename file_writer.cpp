@@ -0,0 +1,559 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * file_writer.cpp - Asynchronous batched file writer
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#include "file_writer.h"
+#include "thread_pool.h"
+
+/**
+ * \class FileWriter
+ * \brief Write data to files away from the calling thread
+ *
+ * Writes are grouped in batches of up to kMaxWrites writes, typically the
+ * planes of all buffers of a request, and a callback is invoked once all the
+ * writes of a batch have completed. The callback runs on a writer thread, and
+ * receives 0 on success or the first error encountered as a negative errno.
+ *
+ * The data, and the file descriptors, shall stay valid until the callback has
+ * been invoked. The number of batches in flight is bounded, write() blocks
+ * when they are all in use.
+ */
+
+FileWriter::FileWriter(unsigned int batches)
+	: batches_(batches)
+{
+	free_.reserve(batches);
+	for (Batch &batch : batches_)
+		free_.push_back(&batch);
+}
+
+FileWriter::~FileWriter()
+{
+}
+
+/**
+ * \brief Queue a batch of writes
+ * \param[in] writes The writes, at most kMaxWrites
+ * \param[in] count The number of writes
+ * \param[in] callback The function to call once all writes have completed
+ * \param[in] arg The argument passed to \a callback
+ */
+void FileWriter::write(const Write *writes, unsigned int count,
+		       Callback callback, void *arg)
+{
+	Batch *batch;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		cond_.wait(locker, [&] { return !free_.empty(); });
+
+		batch = free_.back();
+		free_.pop_back();
+	}
+
+	batch->count = std::min(count, kMaxWrites);
+	batch->remaining = batch->count;
+	batch->result = 0;
+	batch->callback = callback;
+	batch->arg = arg;
+
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		batch->ops[i].write = writes[i];
+		batch->ops[i].batch = batch;
+	}
+
+	if (!batch->count) {
+		complete(batch);
+		return;
+	}
+
+	queue(batch);
+}
+
+/**
+ * \brief Start all the writes that have been queued but held back for batching
+ */
+void FileWriter::flush()
+{
+	submit();
+}
+
+/**
+ * \brief Wait until all queued batches have completed
+ */
+void FileWriter::wait()
+{
+	flush();
+
+	std::unique_lock<std::mutex> locker(lock_);
+	cond_.wait(locker, [&] { return free_.size() == batches_.size(); });
+}
+
+void FileWriter::complete(Batch *batch)
+{
+	batch->callback(batch->arg, batch->result);
+
+	std::unique_lock<std::mutex> locker(lock_);
+	free_.push_back(batch);
+	cond_.notify_all();
+}
+
+namespace {
+
+/*
+ * Fallback for kernels without io_uring, or when it is disabled by policy.
+ * Each batch is written by one worker of a small thread pool.
+ */
+class ThreadFileWriter : public FileWriter
+{
+public:
+	explicit ThreadFileWriter(unsigned int batches)
+		: FileWriter(batches), pool_(2)
+	{
+	}
+
+	~ThreadFileWriter()
+	{
+		wait();
+	}
+
+	const char *name() const override { return "thread pool"; }
+
+protected:
+	void queue(Batch *batch) override
+	{
+		pool_.submit([this, batch]() { run(batch); });
+	}
+
+private:
+	void run(Batch *batch)
+	{
+		for (unsigned int i = 0; i < batch->count; ++i) {
+			const Write &write = batch->ops[i].write;
+			const uint8_t *data = static_cast<const uint8_t *>(write.data);
+			uint64_t offset = write.offset;
+			size_t length = write.length;
+
+			while (length) {
+				ssize_t ret = pwrite(write.fd, data, length, offset);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				/* Nothing written would be retried forever. */
+				if (ret <= 0) {
+					if (!batch->result)
+						batch->result = ret < 0 ? -errno : -EIO;
+					break;
+				}
+
+				data += ret;
+				offset += ret;
+				length -= ret;
+			}
+		}
+
+		complete(batch);
+	}
+
+	ThreadPool pool_;
+};
+
+/*
+ * Writes go through an io_uring instance, driven with raw system calls to
+ * avoid depending on liburing. The submission queue is large enough to hold
+ * the writes of all batches, so it never fills up.
+ *
+ * To save system calls, writes are only submitted right away when the device
+ * is idle. While writes are in flight, new batches are held back until
+ * kBatchLimit of them have been queued or until the last write in flight
+ * completes, and are then submitted with a single io_uring_enter().
+ *
+ * The reaper thread only waits in io_uring_enter() while writes are in
+ * flight. Should io_uring_enter() fail for good, the writes not submitted yet
+ * are taken back from the ring, all the batches not completed yet fail with
+ * the error, and so do the batches queued afterwards.
+ */
+class UringFileWriter : public FileWriter
+{
+public:
+	explicit UringFileWriter(unsigned int batches)
+		: FileWriter(batches), fd_(-1), sqRing_(MAP_FAILED),
+		  cqRing_(MAP_FAILED), sqes_(static_cast<io_uring_sqe *>(MAP_FAILED)),
+		  prepared_(0), inflight_(0), held_(0), error_(0), stopping_(false)
+	{
+		active_.reserve(batches);
+		completed_.reserve(batches);
+	}
+
+	~UringFileWriter()
+	{
+		if (reaper_.joinable()) {
+			wait();
+
+			{
+				std::unique_lock<std::mutex> locker(lock_);
+				stopping_ = true;
+				reaperCond_.notify_one();
+			}
+
+			reaper_.join();
+		}
+
+		if (sqes_ != MAP_FAILED)
+			munmap(sqes_, sqesSize_);
+		if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+			munmap(cqRing_, cqRingSize_);
+		if (sqRing_ != MAP_FAILED)
+			munmap(sqRing_, sqRingSize_);
+		if (fd_ >= 0)
+			close(fd_);
+	}
+
+	int init();
+
+	const char *name() const override { return "io_uring"; }
+
+protected:
+	void queue(Batch *batch) override;
+	void submit() override;
+
+private:
+	static constexpr unsigned int kBatchLimit = 4;
+
+	static int enter(int fd, unsigned int submit, unsigned int complete,
+			 unsigned int flags)
+	{
+		return syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+			       nullptr, 0);
+	}
+
+	io_uring_sqe *nextSqe();
+	void prepare(Op *op);
+	void submitLocked(std::vector<Batch *> &failed);
+	void fail(int error, std::vector<Batch *> &failed);
+	void reap();
+
+	int fd_;
+
+	void *sqRing_;
+	void *cqRing_;
+	io_uring_sqe *sqes_;
+	size_t sqRingSize_;
+	size_t cqRingSize_;
+	size_t sqesSize_;
+
+	unsigned int *sqTail_;
+	unsigned int sqMask_;
+	unsigned int *sqArray_;
+	unsigned int *cqHead_;
+	unsigned int *cqTail_;
+	unsigned int cqMask_;
+	io_uring_cqe *cqes_;
+
+	/* Protects the rings and the members below */
+	std::mutex lock_;
+	unsigned int prepared_;
+	unsigned int inflight_;
+	unsigned int held_;
+	/* Batches queued and not completed yet */
+	std::vector<Batch *> active_;
+	/* Error io_uring_enter() failed with, the ring isn't used anymore */
+	int error_;
+
+	std::thread reaper_;
+	/* Wakes the reaper up when writes are in flight, or to stop */
+	std::condition_variable reaperCond_;
+	bool stopping_;
+	/* Batches completed by the reaper, owned by the reaper thread */
+	std::vector<Batch *> completed_;
+};
+
+int UringFileWriter::init()
+{
+	io_uring_params params = {};
+
+	/* One entry per write. */
+	fd_ = syscall(__NR_io_uring_setup, batches() * kMaxWrites, &params);
+	if (fd_ < 0)
+		return -errno;
+
+	/* IORING_OP_WRITE is needed, it has been added in v5.6. */
+	size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::unique_ptr<uint8_t[]> buffer = std::make_unique<uint8_t[]>(probeSize);
+	memset(buffer.get(), 0, probeSize);
+
+	io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.get());
+	int ret = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE,
+			  probe, 256);
+	if (ret < 0)
+		return -errno;
+	if (probe->last_op < IORING_OP_WRITE ||
+	    !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		return -ENOTSUP;
+
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+	sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sqRing_ == MAP_FAILED)
+		return -errno;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqRing_ = sqRing_;
+	} else {
+		cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED)
+			return -errno;
+	}
+
+	sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return -errno;
+	sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+	uint8_t *sq = static_cast<uint8_t *>(sqRing_);
+	sqTail_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+	sqMask_ = *reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+	sqArray_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+
+	uint8_t *cq = static_cast<uint8_t *>(cqRing_);
+	cqHead_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+	cqMask_ = *reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	reaper_ = std::thread(&UringFileWriter::reap, this);
+
+	return 0;
+}
+
+io_uring_sqe *UringFileWriter::nextSqe()
+{
+	unsigned int tail = *sqTail_;
+	unsigned int index = tail & sqMask_;
+	io_uring_sqe *sqe = &sqes_[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray_[index] = index;
+	__atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+	prepared_++;
+
+	return sqe;
+}
+
+void UringFileWriter::prepare(Op *op)
+{
+	io_uring_sqe *sqe = nextSqe();
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = op->write.fd;
+	sqe->off = op->write.offset;
+	sqe->addr = reinterpret_cast<uintptr_t>(op->write.data);
+	sqe->len = op->write.length;
+	sqe->user_data = reinterpret_cast<uintptr_t>(op);
+}
+
+/* Submit the prepared writes, with the lock held, failing them on error. */
+void UringFileWriter::submitLocked(std::vector<Batch *> &failed)
+{
+	while (prepared_) {
+		int ret = enter(fd_, prepared_, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			fail(-errno, failed);
+			return;
+		}
+
+		if (!inflight_)
+			reaperCond_.notify_one();
+
+		prepared_ -= ret;
+		inflight_ += ret;
+	}
+
+	held_ = 0;
+}
+
+/*
+ * Give up on the ring, with the lock held. The writes not submitted are taken
+ * back, and the batches not completed are added to \a failed, for the caller
+ * to complete them once the lock is released. The completions of the writes
+ * still in flight are ignored.
+ */
+void UringFileWriter::fail(int error, std::vector<Batch *> &failed)
+{
+	std::cerr << "io_uring failed: " << strerror(-error)
+		  << ", failing the pending writes" << std::endl;
+
+	__atomic_store_n(sqTail_, *sqTail_ - prepared_, __ATOMIC_RELEASE);
+	prepared_ = 0;
+	held_ = 0;
+	error_ = error;
+
+	for (Batch *batch : active_) {
+		if (!batch->result)
+			batch->result = error;
+		failed.push_back(batch);
+	}
+
+	active_.clear();
+}
+
+void UringFileWriter::queue(Batch *batch)
+{
+	std::vector<Batch *> failed;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		if (error_) {
+			batch->result = error_;
+			failed.push_back(batch);
+		} else {
+			active_.push_back(batch);
+			for (unsigned int i = 0; i < batch->count; ++i)
+				prepare(&batch->ops[i]);
+
+			if (!inflight_ || ++held_ >= kBatchLimit)
+				submitLocked(failed);
+		}
+	}
+
+	for (Batch *failedBatch : failed)
+		complete(failedBatch);
+}
+
+void UringFileWriter::submit()
+{
+	std::vector<Batch *> failed;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		submitLocked(failed);
+	}
+
+	for (Batch *batch : failed)
+		complete(batch);
+}
+
+void UringFileWriter::reap()
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			reaperCond_.wait(locker, [this] { return inflight_ || stopping_; });
+			if (!inflight_)
+				return;
+		}
+
+		int ret = enter(fd_, 0, 1, IORING_ENTER_GETEVENTS);
+		int error = ret < 0 ? -errno : 0;
+
+		std::unique_lock<std::mutex> locker(lock_);
+
+		if (error && error != -EINTR) {
+			fail(error, completed_);
+			locker.unlock();
+
+			for (Batch *batch : completed_)
+				complete(batch);
+			return;
+		}
+
+		unsigned int head = *cqHead_;
+		unsigned int tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+		bool resubmit = false;
+
+		for (; head != tail; ++head) {
+			const io_uring_cqe &cqe = cqes_[head & cqMask_];
+			Op *op = reinterpret_cast<Op *>(static_cast<uintptr_t>(cqe.user_data));
+			int res = cqe.res;
+
+			inflight_--;
+
+			/* The batch has failed already. */
+			if (error_)
+				continue;
+
+			Write &write = op->write;
+			Batch *batch = op->batch;
+
+			/* Nothing written would be resubmitted forever. */
+			if (!res && write.length)
+				res = -EIO;
+
+			if (res < 0) {
+				if (!batch->result)
+					batch->result = res;
+			} else if (static_cast<size_t>(res) < write.length) {
+				/* Short write, queue the rest. */
+				write.data = static_cast<const uint8_t *>(write.data) + res;
+				write.offset += res;
+				write.length -= res;
+
+				prepare(op);
+				resubmit = true;
+				continue;
+			}
+
+			if (!--batch->remaining) {
+				auto iter = std::find(active_.begin(), active_.end(), batch);
+				*iter = active_.back();
+				active_.pop_back();
+				completed_.push_back(batch);
+			}
+		}
+
+		__atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+
+		if (resubmit || (!inflight_ && prepared_))
+			submitLocked(completed_);
+
+		locker.unlock();
+
+		for (Batch *batch : completed_)
+			complete(batch);
+		completed_.clear();
+	}
+}
+
+} /* namespace */
+
+/**
+ * \brief Create a file writer
+ * \param[in] batches The maximum number of batches in flight
+ *
+ * An io_uring based writer is used when the kernel supports it, and a thread
+ * pool based writer otherwise.
+ */
+std::unique_ptr<FileWriter> FileWriter::create(unsigned int batches)
+{
+	std::unique_ptr<UringFileWriter> writer =
+		std::make_unique<UringFileWriter>(batches);
+
+	int ret = writer->init();
+	if (!ret)
+		return writer;
+
+	std::cerr << "io_uring unavailable (" << strerror(-ret)
+		  << "), writing from a thread pool" << std::endl;
+
+	return std::make_unique<ThreadFileWriter>(batches);
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * file_writer.h - Asynchronous batched file writer
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class FileWriter
+{
+public:
+	struct Write {
+		int fd;
+		uint64_t offset;
+		const void *data;
+		size_t length;
+	};
+
+	using Callback = void (*)(void *arg, int result);
+
+	/* Maximum number of writes completed by a single callback */
+	static constexpr unsigned int kMaxWrites = 8;
+
+	static std::unique_ptr<FileWriter> create(unsigned int batches = 16);
+	virtual ~FileWriter();
+
+	virtual const char *name() const = 0;
+
+	void write(const Write *writes, unsigned int count,
+		   Callback callback, void *arg);
+	void flush();
+	void wait();
+
+protected:
+	struct Batch;
+
+	struct Op {
+		Write write;
+		Batch *batch;
+	};
+
+	struct Batch {
+		Op ops[kMaxWrites];
+		unsigned int count;
+		unsigned int remaining;
+		int result;
+		Callback callback;
+		void *arg;
+	};
+
+	explicit FileWriter(unsigned int batches);
+
+	unsigned int batches() const { return batches_.size(); }
+
+	virtual void queue(Batch *batch) = 0;
+	virtual void submit() {}
+
+	void complete(Batch *batch);
+
+private:
+	std::vector<Batch> batches_;
+	std::vector<Batch *> free_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+};
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_request.cpp - Buffers of a captured frame, independent of its source
+ */
+
+#include <errno.h>
+
+#include "frame_request.h"
+
+using namespace libcamera;
+
+/**
+ * \class FrameRequest
+ * \brief A set of buffers captured together, with their metadata
+ *
+ * A FrameRequest is what frame sources deliver to the sinks, one per frame.
+ * It plays the role of a libcamera::Request, which can only be created for a
+ * camera, and carries the metadata of its buffers, which only libcamera can
+ * set on a libcamera::FrameBuffer. The source fills the metadata when the
+ * request completes.
+ *
+ * Controls set on a request apply to the frame it is queued for only. The
+ * source consumes them when the request is queued, and reports the controls
+ * the frame was captured with in its control metadata. The tag tells the
+ * stages which frame of a burst, and which bracket, a request captured.
+ *
+ * Buffers are added once, when the source creates its requests. The request
+ * is then reused from frame to frame without allocating memory.
+ */
+
+/**
+ * \param[in] cookie Opaque value identifying the request for its source
+ */
+FrameRequest::FrameRequest(uint64_t cookie)
+	: cookie_(cookie), tag_{}
+{
+}
+
+/**
+ * \brief Add a buffer to the request, for a stream
+ * \return 0 on success, -EEXIST if the request already has a buffer for the
+ * stream
+ */
+int FrameRequest::addBuffer(const Stream *stream, FrameBuffer *buffer)
+{
+	if (!buffers_.emplace(stream, buffer).second)
+		return -EEXIST;
+
+	metadata_[buffer] = {};
+	return 0;
+}
+
+/**
+ * \brief Retrieve the metadata of a buffer of the request
+ *
+ * The \a buffer must have been added to the request.
+ */
+FrameRequest::Metadata &FrameRequest::metadata(const FrameBuffer *buffer)
+{
+	return metadata_.find(buffer)->second;
+}
+
+const FrameRequest::Metadata &FrameRequest::metadata(const FrameBuffer *buffer) const
+{
+	return metadata_.find(buffer)->second;
+}
+
+/**
+ * \brief Retrieve the sequence number of the frame, from its first buffer
+ */
+unsigned int FrameRequest::sequence() const
+{
+	return buffers_.empty() ? 0 : metadata(buffers_.begin()->second).sequence;
+}
+
+/**
+ * \brief Retrieve the capture time of the frame, from its first buffer
+ *
+ * \return The timestamp in nanoseconds on CLOCK_MONOTONIC, 0 if unknown
+ */
+uint64_t FrameRequest::timestamp() const
+{
+	return buffers_.empty() ? 0 : metadata(buffers_.begin()->second).timestamp;
+}
+
+/**
+ * \fn FrameRequest::controls()
+ * \brief Retrieve the controls to capture the next frame with
+ *
+ * The list is emptied by the source when the request is queued.
+ */
+
+/**
+ * \fn FrameRequest::controlMetadata()
+ * \brief Retrieve the controls the frame was captured with, as reported by
+ * the source when the request completed
+ */
+
+/**
+ * \fn FrameRequest::tag()
+ * \brief Retrieve the position of the frame in a burst
+ */
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_request.h - Buffers of a captured frame, independent of its source
+ */
+
+#pragma once
+
+#include <array>
+#include <map>
+#include <stdint.h>
+
+#include <libcamera/controls.h>
+
+namespace libcamera {
+class FrameBuffer;
+class Stream;
+} /* namespace libcamera */
+
+class FrameRequest
+{
+public:
+	using BufferMap = std::map<const libcamera::Stream *, libcamera::FrameBuffer *>;
+
+	static constexpr unsigned int kMaxPlanes = 4;
+
+	struct Metadata {
+		unsigned int sequence;
+		uint64_t timestamp;
+		unsigned int planes;
+		std::array<unsigned int, kMaxPlanes> bytesused;
+	};
+
+	/* Position of the frame in a burst, frames is 0 outside of bursts */
+	struct Tag {
+		unsigned int index;
+		unsigned int bracket;
+		unsigned int frames;
+	};
+
+	explicit FrameRequest(uint64_t cookie = 0);
+
+	uint64_t cookie() const { return cookie_; }
+
+	int addBuffer(const libcamera::Stream *stream, libcamera::FrameBuffer *buffer);
+	const BufferMap &buffers() const { return buffers_; }
+
+	Metadata &metadata(const libcamera::FrameBuffer *buffer);
+	const Metadata &metadata(const libcamera::FrameBuffer *buffer) const;
+
+	unsigned int sequence() const;
+	uint64_t timestamp() const;
+
+	libcamera::ControlList &controls() { return controls_; }
+	libcamera::ControlList &controlMetadata() { return controlMetadata_; }
+	const libcamera::ControlList &controlMetadata() const { return controlMetadata_; }
+
+	Tag &tag() { return tag_; }
+	const Tag &tag() const { return tag_; }
+
+private:
+	uint64_t cookie_;
+	BufferMap buffers_;
+	std::map<const libcamera::FrameBuffer *, Metadata> metadata_;
+
+	libcamera::ControlList controls_;
+	libcamera::ControlList controlMetadata_;
+	Tag tag_;
+};
@@ -19,8 +19,20 @@
  *
  * A frame sink processes whole requests, and is solely responsible for deciding
  * how to handle different frame buffers in case multiple streams are captured.
+ * Requests are FrameRequest instances, delivered by a FrameSource, which carry
+ * the metadata of their buffers.
+ *
+ * A sink can be restricted to one stream with selectStream(), to run for
+ * instance analytics on a small viewfinder stream and encoding on a full
+ * resolution stream of the same camera. Sinks then ignore the configuration
+ * and buffers of the other streams, as reported by selected().
  */
 
+FrameSink::FrameSink()
+	: stream_(nullptr)
+{
+}
+
 FrameSink::~FrameSink()
 {
 }
@@ -30,7 +42,13 @@ int FrameSink::configure([[maybe_unused]] const libcamera::CameraConfiguration &
 	return 0;
 }
 
-void FrameSink::mapBuffer([[maybe_unused]] libcamera::FrameBuffer *buffer)
+/**
+ * \brief Prepare the sink to process a buffer
+ * \param[in] stream The stream the buffer has been allocated for
+ * \param[in] buffer The buffer
+ */
+void FrameSink::mapBuffer([[maybe_unused]] const libcamera::Stream *stream,
+			  [[maybe_unused]] libcamera::FrameBuffer *buffer)
 {
 }
 
@@ -65,3 +83,22 @@ int FrameSink::stop()
  * \return True if the request has been processed synchronously, false if
  * processing has been queued
  */
+
+/**
+ * \brief Retrieve the number of requests the sink can process asynchronously
+ *
+ * A sink whose processRequest() function queues requests for asynchronous
+ * processing may only be able to work on a few of them at a time. Callers
+ * shall then not hand it a request while it holds capacity() requests, and
+ * wait for one of them to be released instead, so that requests wait in the
+ * queue of the caller, where they can be dropped, rather than in the sink.
+ *
+ * The capacity shall not change once the sink has been constructed.
+ *
+ * \return The maximum number of requests held by the sink at a time, 0 for
+ * no limit
+ */
+unsigned int FrameSink::capacity() const
+{
+	return 0;
+}
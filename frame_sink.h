@@ -12,21 +12,37 @@
 namespace libcamera {
 class CameraConfiguration;
 class FrameBuffer;
-class Request;
+class Stream;
 } /* namespace libcamera */
 
+class FrameRequest;
+
 class FrameSink
 {
 public:
+	FrameSink();
 	virtual ~FrameSink();
 
+	void selectStream(const libcamera::Stream *stream) { stream_ = stream; }
+	const libcamera::Stream *stream() const { return stream_; }
+	bool selected(const libcamera::Stream *stream) const
+	{
+		return !stream_ || stream == stream_;
+	}
+
 	virtual int configure(const libcamera::CameraConfiguration &config);
 
-	virtual void mapBuffer(libcamera::FrameBuffer *buffer);
+	virtual void mapBuffer(const libcamera::Stream *stream,
+			       libcamera::FrameBuffer *buffer);
 
 	virtual int start();
 	virtual int stop();
 
-	virtual bool processRequest(libcamera::Request *request) = 0;
-	libcamera::Signal<libcamera::Request *> requestProcessed;
+	virtual bool processRequest(FrameRequest *request) = 0;
+	libcamera::Signal<FrameRequest *> requestProcessed;
+
+	virtual unsigned int capacity() const;
+
+private:
+	const libcamera::Stream *stream_;
 };
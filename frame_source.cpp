@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_source.cpp - Producer of frames for the sinks
+ */
+
+#include "frame_source.h"
+
+/**
+ * \class FrameSource
+ * \brief Abstract class to model a producer of frames
+ *
+ * A FrameSource captures frames into buffers it allocates, following the
+ * libcamera camera model: the configuration generated by the source is
+ * adjusted by the caller and applied with configure(), then allocate() creates
+ * the buffers of each stream and one FrameRequest per buffer, available from
+ * requests().
+ *
+ * Once started, the source fills the buffers of the queued requests, sets
+ * their metadata and emits requestCompleted, possibly from an internal thread.
+ * The request belongs to the caller until it is queued again with
+ * queueRequest().
+ *
+ * The caller maps the buffers for the sinks, which thus consume the frames of
+ * all sources the same way.
+ */
+
+FrameSource::~FrameSource()
+{
+}
+
+/**
+ * \fn FrameSource::id()
+ * \brief Retrieve a name identifying the source, for logs and stream names
+ */
+
+/**
+ * \fn FrameSource::buffers()
+ * \brief Retrieve the buffers allocated for a stream by allocate()
+ */
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_source.h - Producer of frames for the sinks
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libcamera/base/signal.h>
+
+#include <libcamera/stream.h>
+
+#include "frame_request.h"
+
+namespace libcamera {
+class CameraConfiguration;
+class FrameBuffer;
+} /* namespace libcamera */
+
+class FrameSource
+{
+public:
+	virtual ~FrameSource();
+
+	virtual std::string id() const = 0;
+
+	virtual std::unique_ptr<libcamera::CameraConfiguration>
+	generateConfiguration(const libcamera::StreamRoles &roles) = 0;
+	virtual int configure(libcamera::CameraConfiguration *config) = 0;
+
+	virtual int allocate() = 0;
+	virtual const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &
+	buffers(const libcamera::Stream *stream) const = 0;
+	const std::vector<std::unique_ptr<FrameRequest>> &requests() const { return requests_; }
+
+	virtual int start() = 0;
+	virtual void stop() = 0;
+
+	virtual int queueRequest(FrameRequest *request) = 0;
+	libcamera::Signal<FrameRequest *> requestCompleted;
+
+protected:
+	std::vector<std::unique_ptr<FrameRequest>> requests_;
+};
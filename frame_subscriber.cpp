@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_subscriber.cpp - Receive the frames shared by another process
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "frame_subscriber.h"
+
+/* Buffers a publisher may share, a sanity limit on the buffer numbers */
+static constexpr uint32_t kMaxBuffers = 64;
+
+/**
+ * \class FrameSubscriber
+ * \brief Read the frames published by a ShareSink, without copying them
+ *
+ * The subscriber connects to the socket of the publisher, and receives the
+ * frames one at a time with receive(). The planes of a frame point to the
+ * buffer it has been captured to, mapped read-only, and stay valid until the
+ * frame is handed back with release(). The publisher reuses the buffer only
+ * then, a subscriber shall thus release each frame as soon as it is done with
+ * it. A subscriber holding frames skips the next ones, it always receives the
+ * frames in order but not all of them.
+ *
+ * The class doesn't depend on libcamera, and can be linked with analytics
+ * written against the static library only:
+ *
+ *     FrameSubscriber subscriber;
+ *     subscriber.connect("/tmp/disocamera-frames");
+ *
+ *     FrameSubscriber::Frame frame;
+ *     while (subscriber.receive(&frame) == 0) {
+ *         analyse(frame.planes[0], frame.width, frame.height, frame.stride);
+ *         subscriber.release(frame);
+ *     }
+ */
+
+FrameSubscriber::FrameSubscriber()
+	: fd_(-1)
+{
+}
+
+FrameSubscriber::~FrameSubscriber()
+{
+	close();
+}
+
+/**
+ * \brief Connect to a publisher
+ * \param[in] path The path of the socket of the publisher
+ * \return 0 on success or a negative error code otherwise
+ */
+int FrameSubscriber::connect(const std::string &path)
+{
+	struct sockaddr_un addr = {};
+
+	close();
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return -errno;
+
+	if (::connect(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+		int ret = -errno;
+		::close(fd_);
+		fd_ = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Disconnect, which releases all the frames and unmaps the buffers
+ */
+void FrameSubscriber::close()
+{
+	for (std::vector<Mapping> &mappings : buffers_)
+		unmap(mappings);
+	buffers_.clear();
+
+	if (fd_ < 0)
+		return;
+
+	::close(fd_);
+	fd_ = -1;
+}
+
+void FrameSubscriber::unmap(std::vector<Mapping> &mappings)
+{
+	for (Mapping &mapping : mappings)
+		munmap(const_cast<uint8_t *>(mapping.data), mapping.length);
+	mappings.clear();
+}
+
+/* Map the descriptors of a buffer, which are closed once mapped. */
+int FrameSubscriber::map(uint32_t buffer, const int *fds, unsigned int count)
+{
+	int ret = 0;
+
+	if (buffer >= buffers_.size())
+		buffers_.resize(buffer + 1);
+
+	std::vector<Mapping> &mappings = buffers_[buffer];
+	unmap(mappings);
+
+	for (unsigned int i = 0; i < count; ++i) {
+		off_t length = lseek(fds[i], 0, SEEK_END);
+		void *data = length > 0
+			   ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fds[i], 0)
+			   : MAP_FAILED;
+		if (data == MAP_FAILED) {
+			ret = length > 0 ? -errno : -EINVAL;
+			unmap(mappings);
+			break;
+		}
+
+		mappings.push_back({ static_cast<const uint8_t *>(data),
+				     static_cast<size_t>(length) });
+	}
+
+	for (unsigned int i = 0; i < count; ++i)
+		::close(fds[i]);
+
+	return ret;
+}
+
+/**
+ * \brief Wait for the next frame
+ * \param[out] frame The frame
+ * \param[in] timeout The time to wait for, in milliseconds, -1 to wait forever
+ * \return 0 on success, -EAGAIN on timeout, -EPIPE when the publisher went
+ * away, or another negative error code otherwise
+ */
+int FrameSubscriber::receive(Frame *frame, int timeout)
+{
+	share::FrameMessage message;
+	union {
+		char data[CMSG_SPACE(sizeof(int) * share::kMaxPlanes)];
+		struct cmsghdr align;
+	} control;
+
+	if (fd_ < 0)
+		return -ENOTCONN;
+
+	struct pollfd pfd = { fd_, POLLIN, 0 };
+	int ret = poll(&pfd, 1, timeout);
+	if (ret < 0)
+		return -errno;
+	if (!ret)
+		return -EAGAIN;
+
+	struct iovec iov = { &message, sizeof(message) };
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+
+	ssize_t size;
+	do {
+		size = recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC);
+	} while (size < 0 && errno == EINTR);
+
+	if (size < 0)
+		return -errno;
+	if (!size)
+		return -EPIPE;
+
+	int fds[share::kMaxPlanes];
+	unsigned int count = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+	}
+
+	if (size != sizeof(message) || message.magic != share::kFrameMagic ||
+	    message.buffer >= kMaxBuffers || (msg.msg_flags & MSG_CTRUNC) ||
+	    count != message.fds) {
+		for (unsigned int i = 0; i < count; ++i)
+			::close(fds[i]);
+		return -EPROTO;
+	}
+
+	if (count) {
+		ret = map(message.buffer, fds, count);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (message.buffer >= buffers_.size())
+		return -EPROTO;
+
+	const std::vector<Mapping> &mappings = buffers_[message.buffer];
+
+	frame->buffer = message.buffer;
+	frame->sequence = message.sequence;
+	frame->timestamp = message.timestamp;
+	frame->fourcc = message.fourcc;
+	frame->modifier = message.modifier;
+	frame->width = message.width;
+	frame->height = message.height;
+	frame->stride = message.stride;
+	frame->numPlanes = std::min(message.numPlanes, share::kMaxPlanes);
+
+	for (unsigned int i = 0; i < frame->numPlanes; ++i) {
+		uint32_t index = message.planeFd[i];
+		size_t end = static_cast<size_t>(message.planeOffset[i]) + message.planeSize[i];
+		if (index >= mappings.size() || end > mappings[index].length)
+			return -EPROTO;
+
+		frame->planes[i] = mappings[index].data + message.planeOffset[i];
+		frame->planeSize[i] = message.planeSize[i];
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Hand a frame back to the publisher
+ * \return 0 on success or a negative error code otherwise
+ */
+int FrameSubscriber::release(const Frame &frame)
+{
+	share::ReleaseMessage message = {};
+	message.magic = share::kReleaseMagic;
+	message.buffer = frame.buffer;
+	message.sequence = frame.sequence;
+
+	if (send(fd_, &message, sizeof(message), MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * frame_subscriber.h - Receive the frames shared by another process
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "share_format.h"
+
+class FrameSubscriber
+{
+public:
+	struct Frame {
+		uint32_t buffer;
+		uint64_t sequence;
+		uint64_t timestamp;
+		uint32_t fourcc;
+		uint64_t modifier;
+		uint32_t width;
+		uint32_t height;
+		uint32_t stride;
+		unsigned int numPlanes;
+		const uint8_t *planes[share::kMaxPlanes];
+		size_t planeSize[share::kMaxPlanes];
+	};
+
+	FrameSubscriber();
+	~FrameSubscriber();
+
+	FrameSubscriber(const FrameSubscriber &) = delete;
+	FrameSubscriber &operator=(const FrameSubscriber &) = delete;
+
+	int connect(const std::string &path);
+	void close();
+
+	int fd() const { return fd_; }
+
+	int receive(Frame *frame, int timeout = -1);
+	int release(const Frame &frame);
+
+private:
+	struct Mapping {
+		const uint8_t *data;
+		size_t length;
+	};
+
+	void unmap(std::vector<Mapping> &mappings);
+	int map(uint32_t buffer, const int *fds, unsigned int count);
+
+	int fd_;
+	/* Mappings of the descriptors of each buffer */
+	std::vector<std::vector<Mapping>> buffers_;
+};
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_context.cpp - Reusable libjpeg compressor context
+ */
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
+#include <jerror.h>
+
+#include "jpeg_context.h"
+
+namespace {
+
+/* Alignment of the arena allocations, enough for the libjpeg SIMD code. */
+constexpr size_t kAlignment = 64;
+
+constexpr size_t alignUp(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+} /* namespace */
+
+/*
+ * The libjpeg memory manager functions find their private state through
+ * cinfo->mem. Point it back to the libjpeg memory manager for the duration of
+ * the calls forwarded to it.
+ */
+class JpegContext::ParentScope
+{
+public:
+	ParentScope(j_common_ptr cinfo)
+		: cinfo_(cinfo), mem_(cinfo->mem)
+	{
+		cinfo->mem = reinterpret_cast<MemoryManager *>(mem_)->parent;
+	}
+
+	~ParentScope()
+	{
+		cinfo_->mem = mem_;
+	}
+
+	struct jpeg_memory_mgr *operator->() { return cinfo_->mem; }
+
+private:
+	j_common_ptr cinfo_;
+	struct jpeg_memory_mgr *mem_;
+};
+
+/**
+ * \class JpegContext
+ * \brief A libjpeg compressor kept alive across frames
+ *
+ * The JpegContext wraps a jpeg_compress_struct that is created once and reused
+ * for every image it compresses. Parameters are only reset when the image
+ * geometry, quality or restart interval change.
+ *
+ * Compressed data is written by a custom destination manager to an output
+ * buffer owned by the context. The buffer is meant to be sized upfront with
+ * reserve(), using the maxOutputSize() bound, and is only grown if the bound
+ * turns out to be too small.
+ *
+ * libjpeg allocates its per-image working memory from the JPOOL_IMAGE pool and
+ * releases it at the end of each image. The context replaces the image pool
+ * of the libjpeg memory manager with an arena that is kept between images, so
+ * that once the arena has grown to the size needed by the first image, the
+ * following ones don't touch the heap at all. Permanent and virtual array
+ * allocations are forwarded to the libjpeg memory manager.
+ *
+ * Every heap allocation made while compressing is counted, see allocations().
+ */
+
+JpegContext::JpegContext()
+	: width_(0), height_(0), quality_(-1), fastDct_(false), restartInterval_(0),
+	  capacity_(0), size_(0), arena_(nullptr), arenaSize_(0),
+	  arenaUsed_(0), overflowSize_(0), allocations_(0)
+{
+	cinfo_.err = jpeg_std_error(&jerr_);
+	jpeg_create_compress(&cinfo_);
+
+	mem_.pub = *cinfo_.mem;
+	mem_.parent = cinfo_.mem;
+	mem_.context = this;
+	mem_.pub.alloc_small = &JpegContext::allocSmall;
+	mem_.pub.alloc_large = &JpegContext::allocLarge;
+	mem_.pub.alloc_sarray = &JpegContext::allocSarray;
+	mem_.pub.alloc_barray = &JpegContext::allocBarray;
+	mem_.pub.request_virt_sarray = &JpegContext::requestVirtSarray;
+	mem_.pub.request_virt_barray = &JpegContext::requestVirtBarray;
+	mem_.pub.realize_virt_arrays = &JpegContext::realizeVirtArrays;
+	mem_.pub.access_virt_sarray = &JpegContext::accessVirtSarray;
+	mem_.pub.access_virt_barray = &JpegContext::accessVirtBarray;
+	mem_.pub.free_pool = &JpegContext::freePool;
+	mem_.pub.self_destruct = &JpegContext::selfDestruct;
+	cinfo_.mem = &mem_.pub;
+
+	dest_.pub.init_destination = &JpegContext::initDestination;
+	dest_.pub.empty_output_buffer = &JpegContext::emptyOutputBuffer;
+	dest_.pub.term_destination = &JpegContext::termDestination;
+	dest_.context = this;
+	cinfo_.dest = &dest_.pub;
+
+	cinfo_.input_components = 3;
+	cinfo_.in_color_space = JCS_YCbCr;
+}
+
+JpegContext::~JpegContext()
+{
+	jpeg_destroy_compress(&cinfo_);
+	releaseArena();
+	free(arena_);
+}
+
+/**
+ * \brief Compute the largest JPEG stream a YUV420 image can produce
+ * \param[in] width The image width
+ * \param[in] height The image height
+ *
+ * This is the bound used by the TurboJPEG API for 4:2:0 images, it can't be
+ * exceeded whatever the image content and quality.
+ *
+ * \return The maximum size in bytes
+ */
+size_t JpegContext::maxOutputSize(unsigned int width, unsigned int height)
+{
+	return alignUp(width, 16) * alignUp(height, 16) * 3 + 2048;
+}
+
+/**
+ * \brief Preallocate the output buffer
+ * \param[in] size The output buffer size in bytes
+ *
+ * Allocations made by this function aren't counted in allocations().
+ */
+void JpegContext::reserve(size_t size)
+{
+	if (size <= capacity_)
+		return;
+
+	buffer_ = std::make_unique<uint8_t[]>(size);
+	capacity_ = size;
+}
+
+/**
+ * \brief Start compressing an image
+ * \param[in] width The image width
+ * \param[in] height The image height
+ * \param[in] quality The JPEG quality
+ * \param[in] fastDct Use the fast and less accurate integer DCT
+ * \param[in] restartInterval The restart interval in MCUs, 0 to disable
+ * restart markers
+ *
+ * Raw YUV420 data shall then be fed with jpeg_write_raw_data(), and the
+ * compression completed with finish().
+ *
+ * \return The libjpeg compressor
+ */
+struct jpeg_compress_struct *JpegContext::start(unsigned int width,
+						unsigned int height,
+						int quality, bool fastDct,
+						unsigned int restartInterval)
+{
+	if (width != width_ || height != height_ || quality != quality_ ||
+	    fastDct != fastDct_ || restartInterval != restartInterval_) {
+		cinfo_.image_width = width;
+		cinfo_.image_height = height;
+
+		jpeg_set_defaults(&cinfo_);
+		cinfo_.raw_data_in = TRUE;
+		cinfo_.restart_interval = restartInterval;
+		jpeg_set_quality(&cinfo_, quality, TRUE);
+		cinfo_.dct_method = fastDct ? JDCT_IFAST : JDCT_ISLOW;
+
+		width_ = width;
+		height_ = height;
+		quality_ = quality;
+		fastDct_ = fastDct;
+		restartInterval_ = restartInterval;
+	}
+
+	jpeg_start_compress(&cinfo_, TRUE);
+
+	return &cinfo_;
+}
+
+void JpegContext::finish()
+{
+	jpeg_finish_compress(&cinfo_);
+}
+
+/**
+ * \brief Retrieve a DHT segment with the default Huffman tables of libjpeg
+ *
+ * The tables are the example tables of the JPEG standard, the ones implied by
+ * MJPEG streams which don't carry Huffman tables.
+ *
+ * \return The DHT marker segment, with the marker
+ */
+const std::vector<uint8_t> &JpegContext::standardHuffmanTables()
+{
+	static const std::vector<uint8_t> segment = [] {
+		struct jpeg_compress_struct cinfo;
+		struct jpeg_error_mgr jerr;
+
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		cinfo.in_color_space = JCS_YCbCr;
+		cinfo.input_components = 3;
+		jpeg_set_defaults(&cinfo);
+
+		std::vector<uint8_t> data = { 0xff, 0xc4, 0, 0 };
+		const std::pair<JHUFF_TBL *, uint8_t> tables[] = {
+			{ cinfo.dc_huff_tbl_ptrs[0], 0x00 },
+			{ cinfo.ac_huff_tbl_ptrs[0], 0x10 },
+			{ cinfo.dc_huff_tbl_ptrs[1], 0x01 },
+			{ cinfo.ac_huff_tbl_ptrs[1], 0x11 },
+		};
+
+		for (auto [table, id] : tables) {
+			unsigned int count = 0;
+
+			data.push_back(id);
+			for (unsigned int i = 1; i <= 16; ++i) {
+				data.push_back(table->bits[i]);
+				count += table->bits[i];
+			}
+			data.insert(data.end(), table->huffval, table->huffval + count);
+		}
+
+		size_t length = data.size() - 2;
+		data[2] = length >> 8;
+		data[3] = length & 0xff;
+
+		jpeg_destroy_compress(&cinfo);
+		return data;
+	}();
+
+	return segment;
+}
+
+void JpegContext::initDestination(j_compress_ptr cinfo)
+{
+	JpegContext *self = reinterpret_cast<Destination *>(cinfo->dest)->context;
+
+	if (!self->capacity_) {
+		self->reserve(4096);
+		self->allocations_++;
+	}
+
+	cinfo->dest->next_output_byte = self->buffer_.get();
+	cinfo->dest->free_in_buffer = self->capacity_;
+}
+
+/*
+ * Called when the output buffer is full, which only happens if it hasn't been
+ * sized with the worst-case bound. Grow it and keep going.
+ */
+boolean JpegContext::emptyOutputBuffer(j_compress_ptr cinfo)
+{
+	JpegContext *self = reinterpret_cast<Destination *>(cinfo->dest)->context;
+	size_t size = self->capacity_;
+
+	std::unique_ptr<uint8_t[]> buffer = std::make_unique<uint8_t[]>(size * 2);
+	memcpy(buffer.get(), self->buffer_.get(), size);
+	self->buffer_ = std::move(buffer);
+	self->capacity_ = size * 2;
+	self->allocations_++;
+
+	cinfo->dest->next_output_byte = self->buffer_.get() + size;
+	cinfo->dest->free_in_buffer = size;
+
+	return TRUE;
+}
+
+void JpegContext::termDestination(j_compress_ptr cinfo)
+{
+	JpegContext *self = reinterpret_cast<Destination *>(cinfo->dest)->context;
+
+	self->size_ = self->capacity_ - cinfo->dest->free_in_buffer;
+}
+
+void *JpegContext::allocate(size_t size)
+{
+	size = alignUp(size, kAlignment);
+
+	if (arenaUsed_ + size <= arenaSize_) {
+		void *ptr = arena_ + arenaUsed_;
+		arenaUsed_ += size;
+		return ptr;
+	}
+
+	/*
+	 * The arena is too small for this image. Serve the request from the
+	 * heap, the arena will be resized to fit when the pool is released.
+	 */
+	void *ptr = aligned_alloc(kAlignment, size);
+	if (!ptr)
+		return nullptr;
+
+	overflow_.push_back(ptr);
+	overflowSize_ += size;
+	allocations_++;
+
+	return ptr;
+}
+
+void JpegContext::releaseArena()
+{
+	for (void *ptr : overflow_)
+		free(ptr);
+	overflow_.clear();
+
+	arenaUsed_ = 0;
+}
+
+void *JpegContext::allocSmall(j_common_ptr cinfo, int pool, size_t size)
+{
+	MemoryManager *mem = reinterpret_cast<MemoryManager *>(cinfo->mem);
+
+	if (pool != JPOOL_IMAGE)
+		return ParentScope(cinfo)->alloc_small(cinfo, pool, size);
+
+	void *ptr = mem->context->allocate(size);
+	if (!ptr)
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+	return ptr;
+}
+
+void *JpegContext::allocLarge(j_common_ptr cinfo, int pool, size_t size)
+{
+	if (pool != JPOOL_IMAGE)
+		return ParentScope(cinfo)->alloc_large(cinfo, pool, size);
+
+	return allocSmall(cinfo, pool, size);
+}
+
+JSAMPARRAY JpegContext::allocSarray(j_common_ptr cinfo, int pool,
+				    JDIMENSION samplesPerRow, JDIMENSION rows)
+{
+	if (pool != JPOOL_IMAGE)
+		return ParentScope(cinfo)->alloc_sarray(cinfo, pool, samplesPerRow, rows);
+
+	/* Pad rows like libjpeg-turbo does, SIMD routines may overread them. */
+	size_t stride = alignUp(samplesPerRow * sizeof(JSAMPLE), 2 * kAlignment);
+
+	JSAMPARRAY array = static_cast<JSAMPARRAY>(
+		allocSmall(cinfo, pool, rows * sizeof(JSAMPROW)));
+	JSAMPROW data = static_cast<JSAMPROW>(
+		allocSmall(cinfo, pool, rows * stride));
+
+	for (JDIMENSION i = 0; i < rows; ++i)
+		array[i] = data + i * stride / sizeof(JSAMPLE);
+
+	return array;
+}
+
+JBLOCKARRAY JpegContext::allocBarray(j_common_ptr cinfo, int pool,
+				     JDIMENSION blocksPerRow, JDIMENSION rows)
+{
+	if (pool != JPOOL_IMAGE)
+		return ParentScope(cinfo)->alloc_barray(cinfo, pool, blocksPerRow, rows);
+
+	JBLOCKARRAY array = static_cast<JBLOCKARRAY>(
+		allocSmall(cinfo, pool, rows * sizeof(JBLOCKROW)));
+	JBLOCKROW data = static_cast<JBLOCKROW>(
+		allocSmall(cinfo, pool, rows * blocksPerRow * sizeof(JBLOCK)));
+
+	for (JDIMENSION i = 0; i < rows; ++i)
+		array[i] = data + i * blocksPerRow;
+
+	return array;
+}
+
+/* Virtual arrays are only used for multi-scan images, leave them to libjpeg. */
+jvirt_sarray_ptr JpegContext::requestVirtSarray(j_common_ptr cinfo, int pool,
+						boolean preZero,
+						JDIMENSION samplesPerRow,
+						JDIMENSION rows,
+						JDIMENSION maxAccess)
+{
+	return ParentScope(cinfo)->request_virt_sarray(cinfo, pool, preZero,
+						       samplesPerRow, rows,
+						       maxAccess);
+}
+
+jvirt_barray_ptr JpegContext::requestVirtBarray(j_common_ptr cinfo, int pool,
+						boolean preZero,
+						JDIMENSION blocksPerRow,
+						JDIMENSION rows,
+						JDIMENSION maxAccess)
+{
+	return ParentScope(cinfo)->request_virt_barray(cinfo, pool, preZero,
+						       blocksPerRow, rows,
+						       maxAccess);
+}
+
+void JpegContext::realizeVirtArrays(j_common_ptr cinfo)
+{
+	ParentScope(cinfo)->realize_virt_arrays(cinfo);
+}
+
+JSAMPARRAY JpegContext::accessVirtSarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+					 JDIMENSION startRow, JDIMENSION rows,
+					 boolean writable)
+{
+	return ParentScope(cinfo)->access_virt_sarray(cinfo, ptr, startRow,
+						      rows, writable);
+}
+
+JBLOCKARRAY JpegContext::accessVirtBarray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+					  JDIMENSION startRow, JDIMENSION rows,
+					  boolean writable)
+{
+	return ParentScope(cinfo)->access_virt_barray(cinfo, ptr, startRow,
+						      rows, writable);
+}
+
+void JpegContext::freePool(j_common_ptr cinfo, int pool)
+{
+	JpegContext *self = reinterpret_cast<MemoryManager *>(cinfo->mem)->context;
+
+	ParentScope(cinfo)->free_pool(cinfo, pool);
+
+	if (pool != JPOOL_IMAGE)
+		return;
+
+	size_t needed = self->arenaUsed_ + self->overflowSize_;
+	self->releaseArena();
+
+	if (needed > self->arenaSize_) {
+		free(self->arena_);
+		self->arena_ = static_cast<uint8_t *>(aligned_alloc(kAlignment, needed));
+		self->arenaSize_ = self->arena_ ? needed : 0;
+		self->allocations_++;
+	}
+
+	self->overflowSize_ = 0;
+}
+
+void JpegContext::selfDestruct(j_common_ptr cinfo)
+{
+	MemoryManager *mem = reinterpret_cast<MemoryManager *>(cinfo->mem);
+
+	cinfo->mem = mem->parent;
+	cinfo->mem->self_destruct(cinfo);
+}
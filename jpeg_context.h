@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_context.h - Reusable libjpeg compressor context
+ */
+
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <jpeglib.h>
+
+class JpegContext
+{
+public:
+	JpegContext();
+	~JpegContext();
+
+	static size_t maxOutputSize(unsigned int width, unsigned int height);
+
+	void reserve(size_t size);
+
+	struct jpeg_compress_struct *start(unsigned int width, unsigned int height,
+					   int quality, bool fastDct,
+					   unsigned int restartInterval);
+	void finish();
+
+	static const std::vector<uint8_t> &standardHuffmanTables();
+
+	uint8_t *data() { return buffer_.get(); }
+	size_t size() const { return size_; }
+
+	uint64_t allocations() const { return allocations_; }
+
+private:
+	struct Destination {
+		struct jpeg_destination_mgr pub;
+		JpegContext *context;
+	};
+
+	struct MemoryManager {
+		struct jpeg_memory_mgr pub;
+		struct jpeg_memory_mgr *parent;
+		JpegContext *context;
+	};
+
+	class ParentScope;
+
+	static void initDestination(j_compress_ptr cinfo);
+	static boolean emptyOutputBuffer(j_compress_ptr cinfo);
+	static void termDestination(j_compress_ptr cinfo);
+
+	static void *allocSmall(j_common_ptr cinfo, int pool, size_t size);
+	static void *allocLarge(j_common_ptr cinfo, int pool, size_t size);
+	static JSAMPARRAY allocSarray(j_common_ptr cinfo, int pool,
+				      JDIMENSION samplesPerRow, JDIMENSION rows);
+	static JBLOCKARRAY allocBarray(j_common_ptr cinfo, int pool,
+				       JDIMENSION blocksPerRow, JDIMENSION rows);
+	static jvirt_sarray_ptr requestVirtSarray(j_common_ptr cinfo, int pool,
+						  boolean preZero,
+						  JDIMENSION samplesPerRow,
+						  JDIMENSION rows,
+						  JDIMENSION maxAccess);
+	static jvirt_barray_ptr requestVirtBarray(j_common_ptr cinfo, int pool,
+						  boolean preZero,
+						  JDIMENSION blocksPerRow,
+						  JDIMENSION rows,
+						  JDIMENSION maxAccess);
+	static void realizeVirtArrays(j_common_ptr cinfo);
+	static JSAMPARRAY accessVirtSarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+					   JDIMENSION startRow, JDIMENSION rows,
+					   boolean writable);
+	static JBLOCKARRAY accessVirtBarray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+					    JDIMENSION startRow, JDIMENSION rows,
+					    boolean writable);
+	static void freePool(j_common_ptr cinfo, int pool);
+	static void selfDestruct(j_common_ptr cinfo);
+
+	void *allocate(size_t size);
+	void releaseArena();
+
+	struct jpeg_compress_struct cinfo_;
+	struct jpeg_error_mgr jerr_;
+	Destination dest_;
+	MemoryManager mem_;
+
+	unsigned int width_;
+	unsigned int height_;
+	int quality_;
+	bool fastDct_;
+	unsigned int restartInterval_;
+
+	std::unique_ptr<uint8_t[]> buffer_;
+	size_t capacity_;
+	size_t size_;
+
+	uint8_t *arena_;
+	size_t arenaSize_;
+	size_t arenaUsed_;
+	std::vector<void *> overflow_;
+	size_t overflowSize_;
+
+	uint64_t allocations_;
+};
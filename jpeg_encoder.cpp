@@ -0,0 +1,398 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_encoder.cpp - Strip-parallel YUV420 JPEG encoder
+ */
+
+#include <algorithm>
+#include <string.h>
+#include <thread>
+
+#include "jpeg_context.h"
+#include "jpeg_encoder.h"
+#include "thread_pool.h"
+
+namespace {
+
+/* Rows of luma covered by one MCU with 2x2 chroma subsampling */
+constexpr unsigned int kMcuHeight = 16;
+constexpr unsigned int kMcuWidth = 16;
+
+constexpr uint8_t kMarker = 0xff;
+constexpr uint8_t kMarkerRST0 = 0xd0;
+constexpr uint8_t kMarkerRST7 = 0xd7;
+constexpr uint8_t kMarkerSOF0 = 0xc0;
+constexpr uint8_t kMarkerSOF2 = 0xc2;
+constexpr uint8_t kMarkerSOS = 0xda;
+constexpr uint8_t kMarkerEOI = 0xd9;
+
+/*
+ * Walk the marker segments of a JPEG header, patch the frame height in the
+ * SOF segment and return the offset of the first entropy-coded byte.
+ */
+size_t parseHeader(uint8_t *data, size_t size, unsigned int height)
+{
+	size_t pos = 2;
+
+	while (pos + 4 <= size && data[pos] == kMarker) {
+		uint8_t marker = data[pos + 1];
+		size_t length = (data[pos + 2] << 8) | data[pos + 3];
+
+		if (marker >= kMarkerSOF0 && marker <= kMarkerSOF2 && height) {
+			data[pos + 5] = height >> 8;
+			data[pos + 6] = height & 0xff;
+		}
+
+		pos += 2 + length;
+		if (marker == kMarkerSOS)
+			return pos;
+	}
+
+	return 0;
+}
+
+/*
+ * Shift the index of every RSTn marker in an entropy-coded segment. Inside
+ * entropy-coded data a 0xff byte is always followed by either a stuffed 0x00
+ * or a marker, so no false match is possible.
+ */
+void renumberRestarts(uint8_t *data, size_t size, unsigned int offset)
+{
+	uint8_t *end = data + size;
+
+	while (data < end) {
+		data = static_cast<uint8_t *>(memchr(data, kMarker, end - data));
+		if (!data || data + 1 >= end)
+			return;
+
+		uint8_t marker = data[1];
+		if (marker >= kMarkerRST0 && marker <= kMarkerRST7)
+			data[1] = kMarkerRST0 + ((marker - kMarkerRST0 + offset) & 7);
+
+		data += 2;
+	}
+}
+
+} /* namespace */
+
+/**
+ * \class JpegEncoder
+ * \brief Encode planar YUV420 frames to JPEG on several threads
+ *
+ * The frame is split in horizontal strips aligned on MCU rows, and each strip
+ * is compressed independently as a standalone JPEG image. The restart interval
+ * is chosen so that every strip boundary falls on a restart marker, which
+ * resets the DC predictors and lets the entropy-coded segments be concatenated
+ * into a single baseline stream. Quantization and Huffman tables are the same
+ * for every strip, so the header of the first strip, with the frame height
+ * patched, describes the whole image.
+ *
+ * With a single worker the frame is encoded in one pass without restart
+ * markers, producing the same stream as a plain libjpeg compression.
+ *
+ * Frames in other YUV formats, semi-planar or packed, are converted by the
+ * Frame::convert function one MCU row at a time, to a band buffer of the strip
+ * which stays in the CPU cache, right before the row is compressed. The
+ * conversion then runs on the strip workers, and doesn't need a staging copy
+ * of the whole frame.
+ *
+ * Each strip is compressed by its own JpegContext, kept from frame to frame.
+ * Once configure() has sized the context buffers for the frame geometry and a
+ * first frame has been encoded, encode() doesn't allocate memory anymore,
+ * provided that the \a output vector is reused and reserved with
+ * maxOutputSize().
+ */
+
+/**
+ * \param[in] workers Number of threads used to encode a frame, 0 to use one
+ * per CPU core
+ */
+JpegEncoder::JpegEncoder(unsigned int workers)
+	: workers_(workers), quality_(92), fastDct_(false), width_(0), height_(0),
+	  restartInterval_(0), stripIntervals_(1), frame_(nullptr), pending_(0)
+{
+	if (!workers_)
+		workers_ = std::max(1U, std::thread::hardware_concurrency());
+
+	/* The calling thread encodes the first strip itself. */
+	if (workers_ > 1)
+		pool_ = std::make_unique<ThreadPool>(workers_ - 1);
+
+	for (unsigned int i = 0; i < workers_; ++i)
+		contexts_.push_back(std::make_unique<JpegContext>());
+}
+
+JpegEncoder::~JpegEncoder()
+{
+}
+
+/**
+ * \brief Compute the largest JPEG stream a frame can produce
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ * \return The maximum size in bytes
+ */
+size_t JpegEncoder::maxOutputSize(unsigned int width, unsigned int height)
+{
+	return JpegContext::maxOutputSize(width, height);
+}
+
+/**
+ * \brief Prepare the encoder for a frame geometry
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ *
+ * Compute the strip layout and preallocate the output buffer of each strip
+ * with the worst-case compressed size. Calling this function is optional,
+ * encode() configures the encoder when the frame geometry changes.
+ */
+void JpegEncoder::configure(unsigned int width, unsigned int height)
+{
+	if (width == width_ && height == height_)
+		return;
+
+	unsigned int mcuRows = (height + kMcuHeight - 1) / kMcuHeight;
+	unsigned int mcuColumns = (width + kMcuWidth - 1) / kMcuWidth;
+
+	unsigned int count = std::min(workers_, mcuRows);
+	unsigned int stripMcuRows = (mcuRows + count - 1) / count;
+	count = (mcuRows + stripMcuRows - 1) / stripMcuRows;
+
+	/*
+	 * Use one restart interval per strip when it fits in the 16-bit DRI
+	 * field, otherwise restart on every MCU row and renumber the markers of
+	 * each strip when joining them.
+	 */
+	restartInterval_ = 0;
+	stripIntervals_ = 1;
+	if (count > 1) {
+		restartInterval_ = stripMcuRows * mcuColumns;
+		if (restartInterval_ > 0xffff) {
+			restartInterval_ = mcuColumns;
+			stripIntervals_ = stripMcuRows;
+		}
+	}
+
+	strips_.resize(count);
+	for (unsigned int i = 0; i < count; ++i) {
+		Strip &strip = strips_[i];
+		strip.row = i * stripMcuRows * kMcuHeight;
+		strip.rows = std::min(stripMcuRows * kMcuHeight, height - strip.row);
+		strip.band.resize(mcuColumns * kMcuWidth * kMcuHeight * 3 / 2);
+
+		contexts_[i]->reserve(JpegContext::maxOutputSize(width, strip.rows));
+	}
+
+	width_ = width;
+	height_ = height;
+}
+
+/**
+ * \brief Warm the compressors up for the configured frame size
+ *
+ * A row of MCUs of mid-grey is compressed on every strip, and discarded. The
+ * memory libjpeg needs only depends on the frame width, the first frame then
+ * doesn't pay for the allocations and page faults of the compressors.
+ */
+void JpegEncoder::prime()
+{
+	unsigned int stride = (width_ + kMcuWidth - 1) / kMcuWidth * kMcuWidth;
+
+	for (unsigned int i = 0; i < strips_.size(); ++i) {
+		Strip &strip = strips_[i];
+		std::fill(strip.band.begin(), strip.band.end(), 0x80);
+
+		JSAMPROW y_rows[16];
+		JSAMPROW u_rows[8];
+		JSAMPROW v_rows[8];
+		uint8_t *u = strip.band.data() + stride * kMcuHeight;
+		uint8_t *v = u + stride / 2 * kMcuHeight / 2;
+		for (unsigned int j = 0; j < 16; j++)
+			y_rows[j] = strip.band.data() + j * stride;
+		for (unsigned int j = 0; j < 8; j++) {
+			u_rows[j] = u + j * stride / 2;
+			v_rows[j] = v + j * stride / 2;
+		}
+
+		JpegContext *context = contexts_[i].get();
+		struct jpeg_compress_struct *cinfo =
+			context->start(width_, kMcuHeight, quality_, fastDct_,
+				       restartInterval_);
+		JSAMPARRAY planes[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(cinfo, planes, 16);
+		context->finish();
+	}
+}
+
+/**
+ * \brief Compress a frame
+ * \param[in] frame The YUV420 frame to compress
+ * \param[out] output The JPEG stream, resized to the compressed size
+ *
+ * This function blocks until the whole frame is compressed. It is not
+ * reentrant, concurrent encodes need separate JpegEncoder instances.
+ */
+void JpegEncoder::encode(const Frame &frame, std::vector<uint8_t> &output)
+{
+	configure(frame.width, frame.height);
+
+	unsigned int count = strips_.size();
+
+	frame_ = &frame;
+	pending_ = count - 1;
+
+	for (unsigned int i = 1; i < count; ++i)
+		pool_->submit([this, i] { encodeStrip(i); });
+
+	encodeStrip(0);
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		cond_.wait(locker, [this] { return !pending_; });
+	}
+
+	/* Join the strips, dropping all headers but the first one. */
+	output.clear();
+
+	for (unsigned int i = 0; i < count; ++i) {
+		JpegContext *context = contexts_[i].get();
+		uint8_t *data = context->data();
+		size_t start = parseHeader(data, context->size(),
+					   i ? 0 : frame.height);
+		size_t end = context->size() - 2;
+
+		if (i) {
+			unsigned int index = i * stripIntervals_ - 1;
+			output.push_back(kMarker);
+			output.push_back(kMarkerRST0 + (index & 7));
+		} else {
+			start = 0;
+		}
+
+		size_t offset = output.size();
+		output.insert(output.end(), data + start, data + end);
+
+		if (i && stripIntervals_ > 1)
+			renumberRestarts(output.data() + offset, end - start,
+					 i * stripIntervals_);
+	}
+
+	output.push_back(kMarker);
+	output.push_back(kMarkerEOI);
+
+	frame_ = nullptr;
+}
+
+/**
+ * \brief Retrieve the number of heap allocations made while encoding
+ *
+ * The count only includes allocations performed by encode(), it stays
+ * constant in steady state.
+ *
+ * \return The number of allocations since the encoder was created
+ */
+uint64_t JpegEncoder::allocations() const
+{
+	uint64_t count = 0;
+
+	for (const std::unique_ptr<JpegContext> &context : contexts_)
+		count += context->allocations();
+
+	return count;
+}
+
+void JpegEncoder::encodeStrip(unsigned int index)
+{
+	JpegContext *context = contexts_[index].get();
+
+	if (frame_->convert)
+		encodeBands(context, strips_[index]);
+	else
+		encodePlanes(context, strips_[index]);
+
+	context->finish();
+
+	if (!index)
+		return;
+
+	std::unique_lock<std::mutex> locker(lock_);
+	if (!--pending_)
+		cond_.notify_one();
+}
+
+void JpegEncoder::encodePlanes(JpegContext *context, const Strip &strip)
+{
+	const Frame &frame = *frame_;
+
+	struct jpeg_compress_struct *cinfo =
+		context->start(frame.width, strip.rows, quality_, fastDct_,
+			       restartInterval_);
+
+	const uint8_t *Y_max = frame.y + (frame.height - 1) * frame.stride;
+	const uint8_t *U_max = frame.u + (frame.height / 2 - 1) * frame.chromaStride;
+	const uint8_t *V_max = frame.v + (frame.height / 2 - 1) * frame.chromaStride;
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	const uint8_t *Y_row = frame.y + strip.row * frame.stride;
+	const uint8_t *U_row = frame.u + strip.row / 2 * frame.chromaStride;
+	const uint8_t *V_row = frame.v + strip.row / 2 * frame.chromaStride;
+
+	while (cinfo->next_scanline < strip.rows) {
+		for (unsigned int i = 0; i < 16; i++, Y_row += frame.stride)
+			y_rows[i] = const_cast<uint8_t *>(std::min(Y_row, Y_max));
+		for (unsigned int i = 0; i < 8; i++, U_row += frame.chromaStride,
+		     V_row += frame.chromaStride) {
+			u_rows[i] = const_cast<uint8_t *>(std::min(U_row, U_max));
+			v_rows[i] = const_cast<uint8_t *>(std::min(V_row, V_max));
+		}
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(cinfo, rows, 16);
+	}
+}
+
+void JpegEncoder::encodeBands(JpegContext *context, Strip &strip)
+{
+	const Frame &frame = *frame_;
+
+	struct jpeg_compress_struct *cinfo =
+		context->start(frame.width, strip.rows, quality_, fastDct_,
+			       restartInterval_);
+
+	unsigned int stride = (width_ + kMcuWidth - 1) / kMcuWidth * kMcuWidth;
+	Band band;
+	band.y = strip.band.data();
+	band.u = band.y + stride * kMcuHeight;
+	band.v = band.u + stride / 2 * kMcuHeight / 2;
+	band.stride = stride;
+	band.chromaStride = stride / 2;
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	while (cinfo->next_scanline < strip.rows) {
+		unsigned int row = strip.row + cinfo->next_scanline;
+		unsigned int rows = std::min(kMcuHeight, frame.height - row);
+		unsigned int chromaRows = (rows + 1) / 2;
+
+		frame.convert(frame, row, rows, band);
+
+		/* Repeat the last row of the frame to fill the last MCU row. */
+		for (unsigned int i = 0; i < 16; i++) {
+			unsigned int r = std::min(i, rows - 1);
+			y_rows[i] = frame.packed ? band.y + r * band.stride
+				  : const_cast<uint8_t *>(frame.y + (row + r) * frame.stride);
+		}
+		for (unsigned int i = 0; i < 8; i++) {
+			unsigned int r = std::min(i, chromaRows - 1);
+			u_rows[i] = band.u + r * band.chromaStride;
+			v_rows[i] = band.v + r * band.chromaStride;
+		}
+
+		JSAMPARRAY planes[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(cinfo, planes, 16);
+	}
+}
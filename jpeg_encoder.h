@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_encoder.h - Strip-parallel YUV420 JPEG encoder
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+class JpegContext;
+class ThreadPool;
+
+class JpegEncoder
+{
+public:
+	struct Frame;
+
+	/* Rows of a frame converted to planar YUV420 */
+	struct Band {
+		uint8_t *y;
+		uint8_t *u;
+		uint8_t *v;
+		unsigned int stride;
+		unsigned int chromaStride;
+	};
+
+	/* Convert the rows [row, row + rows) of a frame to a band */
+	using Converter = void (*)(const Frame &frame, unsigned int row,
+				   unsigned int rows, const Band &band);
+
+	struct Frame {
+		unsigned int width;
+		unsigned int height;
+
+		const uint8_t *y;
+		const uint8_t *u;
+		const uint8_t *v;
+		unsigned int stride;
+		unsigned int chromaStride;
+
+		/*
+		 * Converter of the frames in other formats than planar YUV420,
+		 * the planes are then laid out as the converter expects. The
+		 * luma rows are read from y, unless the frame is packed and the
+		 * converter fills the luma of the band too.
+		 */
+		Converter convert = nullptr;
+		bool packed = false;
+	};
+
+	explicit JpegEncoder(unsigned int workers = 0);
+	~JpegEncoder();
+
+	unsigned int workers() const { return workers_; }
+
+	int quality() const { return quality_; }
+	void setQuality(int quality) { quality_ = quality; }
+
+	bool fastDct() const { return fastDct_; }
+	void setFastDct(bool fastDct) { fastDct_ = fastDct; }
+
+	static size_t maxOutputSize(unsigned int width, unsigned int height);
+
+	void configure(unsigned int width, unsigned int height);
+	void prime();
+	void encode(const Frame &frame, std::vector<uint8_t> &output);
+
+	uint64_t allocations() const;
+
+private:
+	struct Strip {
+		unsigned int row;
+		unsigned int rows;
+		/* One MCU row of converted frames */
+		std::vector<uint8_t> band;
+	};
+
+	void encodeStrip(unsigned int index);
+	void encodePlanes(JpegContext *context, const Strip &strip);
+	void encodeBands(JpegContext *context, Strip &strip);
+
+	unsigned int workers_;
+	int quality_;
+	bool fastDct_;
+
+	std::unique_ptr<ThreadPool> pool_;
+	std::vector<std::unique_ptr<JpegContext>> contexts_;
+
+	/* Strip layout, computed by configure() */
+	unsigned int width_;
+	unsigned int height_;
+	std::vector<Strip> strips_;
+	unsigned int restartInterval_;
+	unsigned int stripIntervals_;
+
+	/* State of the frame being encoded, shared with the workers */
+	const Frame *frame_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	unsigned int pending_;
+};
@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_rate_control.cpp - JPEG quality control from frame sizes and encode times
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+#include "jpeg_rate_control.h"
+
+/*
+ * Compressed sizes roughly follow scale^-kSizeExponent, scale being the factor
+ * applied by libjpeg to the quantization tables.
+ */
+static constexpr double kSizeExponent = 0.7;
+/* Fraction of the size target aimed at, to absorb the variations of the scene */
+static constexpr double kSizeMargin = 0.95;
+/* Fraction of the estimated quality change applied per frame */
+static constexpr double kSizeGain = 0.5;
+/* Weight of the last frame in the encode time average */
+static constexpr double kTimeWeight = 0.25;
+/* Frames between two changes for the encode time to settle */
+static constexpr unsigned int kTimeSettleFrames = 4;
+
+/**
+ * \class JpegRateControl
+ * \brief Adjust the JPEG quality from frame to frame to meet a target
+ *
+ * The rate control picks the settings of each frame, from the compressed size
+ * and encode time of the previous ones, to meet a compressed size per frame,
+ * and thus a bitrate at a given frame rate, and an encode time budget.
+ *
+ * The size target is treated as a ceiling. The quality that would have kept
+ * the last frame just below the target is estimated from a model of the
+ * compressed size as a function of the libjpeg quantization scale, and the
+ * quality moves part of the way towards it. This converges within a few
+ * frames, while smoothing out the changes of a noisy scene.
+ *
+ * When the average encode time exceeds its budget, the encoder first switches
+ * to the fast integer DCT, then lowers the quality, which reduces the entropy
+ * coding work. The settings are restored one step at a time once the encode
+ * time falls well below the budget. Chroma subsampling is not adjusted, the
+ * frames are compressed from YUV420 with the minimum subsampling of baseline
+ * JPEG already.
+ *
+ * The rate control may be shared by the encoders of concurrent frames, its
+ * functions are thread-safe.
+ */
+
+/**
+ * \param[in] target The targets, a zero target is ignored
+ */
+JpegRateControl::JpegRateControl(const Target &target)
+	: target_(target), fastDct_(false), encodeTime_(0), settle_(0),
+	  frames_(0), totalBytes_(0), maxBytes_(0), bytesOver_(0),
+	  totalEncodeTime_(0), maxEncodeTime_(0), timeOver_(0),
+	  totalQuality_(0), minQuality_(0), maxQuality_(0), fastDctFrames_(0)
+{
+	target_.minQuality = std::clamp(target_.minQuality, 1, 100);
+	target_.maxQuality = std::clamp(target_.maxQuality, target_.minQuality, 100);
+
+	quality_ = target_.maxQuality;
+	timeQuality_ = target_.maxQuality;
+}
+
+/* Quantization table scale of libjpeg for a quality, in percent */
+double JpegRateControl::scale(double quality)
+{
+	return quality < 50 ? 5000 / quality : 200 - 2 * quality;
+}
+
+double JpegRateControl::quality(double scale)
+{
+	return scale <= 100 ? (200 - scale) / 2 : 5000 / scale;
+}
+
+/**
+ * \brief Retrieve the settings to compress the next frame with
+ */
+JpegRateControl::Settings JpegRateControl::settings() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	int quality = std::min(static_cast<int>(std::lround(quality_)), timeQuality_);
+	return { std::clamp(quality, target_.minQuality, target_.maxQuality), fastDct_ };
+}
+
+/**
+ * \brief Account for a compressed frame
+ * \param[in] settings The settings the frame was compressed with
+ * \param[in] bytes The compressed size
+ * \param[in] encodeTime The time spent compressing the frame
+ */
+void JpegRateControl::update(const Settings &settings, size_t bytes,
+			     std::chrono::nanoseconds encodeTime)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	double time = encodeTime.count();
+
+	frames_++;
+	totalBytes_ += bytes;
+	maxBytes_ = std::max(maxBytes_, bytes);
+	totalEncodeTime_ += time;
+	maxEncodeTime_ = std::max(maxEncodeTime_, time);
+	totalQuality_ += settings.quality;
+	minQuality_ = frames_ == 1 ? settings.quality : std::min(minQuality_, settings.quality);
+	maxQuality_ = std::max(maxQuality_, settings.quality);
+	if (settings.fastDct)
+		fastDctFrames_++;
+
+	if (target_.bytesPerFrame && bytes) {
+		if (bytes > target_.bytesPerFrame)
+			bytesOver_++;
+
+		double ratio = bytes / (kSizeMargin * target_.bytesPerFrame);
+		double wanted = quality(scale(settings.quality) * std::pow(ratio, 1 / kSizeExponent));
+
+		quality_ += kSizeGain * (wanted - quality_);
+		quality_ = std::clamp(quality_, static_cast<double>(target_.minQuality),
+				      static_cast<double>(target_.maxQuality));
+	}
+
+	if (!target_.encodeTime.count())
+		return;
+
+	double budget = target_.encodeTime.count();
+	if (time > budget)
+		timeOver_++;
+
+	encodeTime_ = frames_ == 1 ? time : encodeTime_ + kTimeWeight * (time - encodeTime_);
+
+	if (settle_) {
+		settle_--;
+		return;
+	}
+
+	if (encodeTime_ > budget) {
+		if (!fastDct_)
+			fastDct_ = true;
+		else if (timeQuality_ > target_.minQuality)
+			timeQuality_ = std::max(timeQuality_ - 5, target_.minQuality);
+		else
+			return;
+
+		settle_ = kTimeSettleFrames;
+	} else if (encodeTime_ < 0.6 * budget) {
+		if (timeQuality_ < target_.maxQuality)
+			timeQuality_++;
+		else if (fastDct_ && encodeTime_ < 0.5 * budget)
+			fastDct_ = false;
+		else
+			return;
+
+		settle_ = kTimeSettleFrames;
+	}
+}
+
+/**
+ * \brief Print the achieved sizes, encode times and quality against the targets
+ */
+void JpegRateControl::report(std::ostream &out) const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (!frames_) {
+		out << "no frame compressed" << std::endl;
+		return;
+	}
+
+	out << std::fixed << std::setprecision(1);
+
+	out << "size target ";
+	if (target_.bytesPerFrame)
+		out << target_.bytesPerFrame << " B";
+	else
+		out << "none";
+	out << ", achieved mean " << totalBytes_ / frames_ << " B max " << maxBytes_
+	    << " B, " << bytesOver_ << " of " << frames_ << " frames over" << std::endl;
+
+	out << "encode time target ";
+	if (target_.encodeTime.count())
+		out << target_.encodeTime.count() / 1e6 << " ms";
+	else
+		out << "none";
+	out << ", achieved mean " << totalEncodeTime_ / frames_ / 1e6 << " ms max "
+	    << maxEncodeTime_ / 1e6 << " ms, " << timeOver_ << " of " << frames_
+	    << " frames over" << std::endl;
+
+	out << "quality mean " << static_cast<double>(totalQuality_) / frames_
+	    << " (" << minQuality_ << "-" << maxQuality_ << "), fast DCT on "
+	    << fastDctFrames_ << " frames" << std::defaultfloat << std::endl;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_rate_control.h - JPEG quality control from frame sizes and encode times
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+
+class JpegRateControl
+{
+public:
+	struct Target {
+		/* Compressed size of each frame, 0 for no size target */
+		size_t bytesPerFrame = 0;
+		/* Time to compress each frame, 0 for no time budget */
+		std::chrono::nanoseconds encodeTime{ 0 };
+		/* Range of the quality */
+		int minQuality = 30;
+		int maxQuality = 95;
+	};
+
+	struct Settings {
+		int quality;
+		bool fastDct;
+	};
+
+	explicit JpegRateControl(const Target &target);
+
+	const Target &target() const { return target_; }
+
+	Settings settings() const;
+	void update(const Settings &settings, size_t bytes,
+		    std::chrono::nanoseconds encodeTime);
+
+	void report(std::ostream &out) const;
+
+private:
+	static double scale(double quality);
+	static double quality(double scale);
+
+	Target target_;
+
+	mutable std::mutex lock_;
+
+	/* Quality hitting the size target, and the highest the time budget allows */
+	double quality_;
+	int timeQuality_;
+	bool fastDct_;
+
+	/* Moving average of the encode time, in nanoseconds */
+	double encodeTime_;
+	/* Frames to wait for before the next encode time adjustment */
+	unsigned int settle_;
+
+	uint64_t frames_;
+	uint64_t totalBytes_;
+	size_t maxBytes_;
+	uint64_t bytesOver_;
+	double totalEncodeTime_;
+	double maxEncodeTime_;
+	uint64_t timeOver_;
+	uint64_t totalQuality_;
+	int minQuality_;
+	int maxQuality_;
+	uint64_t fastDctFrames_;
+};
@@ -0,0 +1,637 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_sink.cpp - Asynchronous JPEG encoding sink
+ */
+
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+
+#include <libcamera/camera.h>
+#include <libcamera/formats.h>
+
+#include "buffer_cache.h"
+#include "image.h"
+#include "jpeg_context.h"
+#include "jpeg_sink.h"
+#include "mjpeg_server.h"
+#include "pixel_convert.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace libcamera;
+
+namespace {
+
+constexpr uint8_t kMarker = 0xff;
+constexpr uint8_t kMarkerSOI = 0xd8;
+constexpr uint8_t kMarkerDHT = 0xc4;
+constexpr uint8_t kMarkerSOS = 0xda;
+
+/*
+ * Walk the marker segments of a JPEG header, and return the offset of the SOS
+ * marker, or 0 if the header is invalid. \a tables tells if the header carries
+ * Huffman tables.
+ */
+size_t findScan(const uint8_t *data, size_t size, bool *tables)
+{
+	if (size < 4 || data[0] != kMarker || data[1] != kMarkerSOI)
+		return 0;
+
+	size_t pos = 2;
+	*tables = false;
+
+	while (pos + 4 <= size && data[pos] == kMarker) {
+		uint8_t marker = data[pos + 1];
+
+		/* Markers may be preceded by fill bytes. */
+		if (marker == kMarker) {
+			pos++;
+			continue;
+		}
+
+		if (marker == kMarkerSOS)
+			return pos;
+		if (marker == kMarkerDHT)
+			*tables = true;
+
+		pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+	}
+
+	return 0;
+}
+
+/*
+ * Band converters of the JpegEncoder, for the formats other than planar
+ * YUV420. Semi-planar frames have their interleaved chroma plane in u.
+ */
+void convertNV12(const JpegEncoder::Frame &frame, unsigned int row,
+		 unsigned int rows, const JpegEncoder::Band &band)
+{
+	convert::splitChroma({ frame.u + row / 2 * frame.chromaStride, frame.chromaStride },
+			     { band.u, band.chromaStride }, { band.v, band.chromaStride },
+			     frame.width, rows);
+}
+
+void convertNV21(const JpegEncoder::Frame &frame, unsigned int row,
+		 unsigned int rows, const JpegEncoder::Band &band)
+{
+	convert::splitChroma({ frame.u + row / 2 * frame.chromaStride, frame.chromaStride },
+			     { band.v, band.chromaStride }, { band.u, band.chromaStride },
+			     frame.width, rows);
+}
+
+void convertYUYV(const JpegEncoder::Frame &frame, unsigned int row,
+		 unsigned int rows, const JpegEncoder::Band &band)
+{
+	const convert::Plane dst[3] = {
+		{ band.y, band.stride },
+		{ band.u, band.chromaStride },
+		{ band.v, band.chromaStride },
+	};
+	convert::yuyvToI420({ frame.y + row * frame.stride, frame.stride }, dst,
+			    frame.width, rows);
+}
+
+void convertUYVY(const JpegEncoder::Frame &frame, unsigned int row,
+		 unsigned int rows, const JpegEncoder::Band &band)
+{
+	const convert::Plane dst[3] = {
+		{ band.y, band.stride },
+		{ band.u, band.chromaStride },
+		{ band.v, band.chromaStride },
+	};
+	convert::uyvyToI420({ frame.y + row * frame.stride, frame.stride }, dst,
+			    frame.width, rows);
+}
+
+} /* namespace */
+
+/**
+ * \class JpegSink
+ * \brief Compress frames to JPEG files on a pool of worker threads
+ *
+ * The JpegSink processes requests asynchronously: processRequest() only queues
+ * the request to the worker pool and returns false. A worker compresses every
+ * buffer of the request, emits requestProcessed as soon as the pixels have been
+ * consumed so that the request can be requeued to the camera, and then writes
+ * the JPEG files while the camera fills the buffers again.
+ *
+ * Each worker uses its own encoder context, several frames are thus compressed
+ * concurrently. Each frame can additionally be split across \a stripWorkers
+ * threads by the JpegEncoder.
+ *
+ * The workers are either owned by the sink, or borrowed from a pool shared
+ * with other sinks, for instance the sinks of other cameras. The sink then
+ * never has more frames on the pool than it has contexts. It only accepts as
+ * many requests as it has contexts, see capacity(), further requests wait with
+ * the caller, where they can be dropped, so that a camera doesn't flood the
+ * shared pool and frames don't age in the sink.
+ *
+ * Planar YUV frames are compressed straight from the mapped buffers. Other
+ * YUV formats supported by the convert functions are converted by the encoder,
+ * one MCU row at a time, while compressing the frame.
+ *
+ * MJPEG frames, compressed by the camera already, are written as captured,
+ * straight from the mapped buffers, before the buffers are given back to the
+ * camera. The standard Huffman tables are inserted in the frames which lack
+ * them, as the frames of most UVC cameras do.
+ *
+ * Encoder contexts and their output buffers are sized by configure() from the
+ * stream configurations, with the worst-case compressed size, and recycled from
+ * frame to frame. Encoding doesn't allocate memory in steady state, which can
+ * be checked with allocations().
+ *
+ * With an MjpegServer set, frames are streamed instead of written to files.
+ * Each frame is compressed once and its output buffer is shared with all the
+ * clients, the encoders then take their next buffer from a pool, among the
+ * buffers the clients are done with.
+ */
+
+/**
+ * \param[in] streamNames Names of the streams, unused for now
+ * \param[in] buffers Mappings of the frame buffers
+ * \param[in] pattern Output file name pattern, '#' is replaced by the frame
+ * timestamp and sequence number
+ * \param[in] workers Number of frames compressed concurrently, 0 for one per
+ * CPU core, or one per thread of \a pool
+ * \param[in] stripWorkers Number of threads compressing each frame
+ * \param[in] pool Shared thread pool to compress frames on, nullptr for the
+ * sink to create its own workers
+ */
+JpegSink::JpegSink(const std::map<const libcamera::Stream *, std::string> &streamNames,
+		   const BufferCache &buffers, const std::string &pattern,
+		   unsigned int workers, unsigned int stripWorkers,
+		   ThreadPool *pool)
+	: streamNames_(streamNames), buffers_(buffers), pattern_(pattern),
+	  server_(nullptr), passthrough_(0), invalid_(0), pool_(pool),
+	  outputSize_(0), outputAllocations_(0), pending_(0), encoding_(0),
+	  held_(0), waitingHead_(0), waitingCount_(0)
+{
+	if (!pool_) {
+		ownPool_ = std::make_unique<ThreadPool>(workers);
+		pool_ = ownPool_.get();
+	}
+
+	workers_ = workers ? workers : pool_->size();
+
+	for (unsigned int i = 0; i < workers_; ++i)
+		contexts_.push_back(std::make_unique<Context>(stripWorkers));
+
+	waiting_.resize(workers_);
+}
+
+JpegSink::~JpegSink()
+{
+	stop();
+}
+
+int JpegSink::configure(const libcamera::CameraConfiguration &config)
+{
+	int ret = FrameSink::configure(config);
+	if (ret < 0)
+		return ret;
+
+	size_t maxSize = 0;
+	const StreamConfiguration *encoded = nullptr;
+
+	streamConfigs_.clear();
+	for (const StreamConfiguration &cfg : config) {
+		if (!selected(cfg.stream()))
+			continue;
+
+		streamConfigs_[cfg.stream()] = cfg;
+		if (cfg.pixelFormat == formats::MJPEG)
+			continue;
+
+		if (!convert::canConvertToI420(cfg.pixelFormat)) {
+			std::cerr << "unsupported pixel format "
+				  << cfg.pixelFormat.toString() << std::endl;
+			return -EINVAL;
+		}
+
+		maxSize = std::max(maxSize, JpegEncoder::maxOutputSize(cfg.size.width,
+								      cfg.size.height));
+		if (!encoded)
+			encoded = &cfg;
+	}
+
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (streamConfigs_.empty())
+		return -EINVAL;
+
+	outputSize_ = maxSize;
+
+	for (std::unique_ptr<Context> &context : contexts_) {
+		/* Prepare the strip layout for the first, usually only, stream. */
+		if (encoded)
+			context->encoder.configure(encoded->size.width,
+						   encoded->size.height);
+
+		context->outputs.resize(streamConfigs_.size());
+		for (Output &output : context->outputs) {
+			if (!output.data)
+				takeBuffer(output);
+			output.data->reserve(maxSize);
+		}
+	}
+
+	outputAllocations_ = 0;
+
+	return 0;
+}
+
+/**
+ * Prime the encoders for the configured size, the first frames then don't
+ * take longer to compress than the next ones.
+ */
+int JpegSink::start()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	for (std::unique_ptr<Context> &context : contexts_)
+		context->encoder.prime();
+
+	return FrameSink::start();
+}
+
+/**
+ * Wait for all queued requests to be compressed and written.
+ */
+int JpegSink::stop()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	idle_.wait(locker, [this] { return !pending_; });
+
+	return 0;
+}
+
+bool JpegSink::processRequest(FrameRequest *request)
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		/* The caller waits for a request to be released, see capacity(). */
+		assert(held_ < workers_);
+
+		held_++;
+		pending_++;
+
+		/*
+		 * Released requests may still have their output written, hold
+		 * the request until their context is free.
+		 */
+		if (encoding_ == workers_) {
+			waiting_[(waitingHead_ + waitingCount_) % waiting_.size()] = request;
+			waitingCount_++;
+			return false;
+		}
+
+		encoding_++;
+	}
+
+	pool_->submit([this, request] { encodeRequest(request); });
+
+	return false;
+}
+
+void JpegSink::encodeRequest(FrameRequest *request)
+{
+	std::unique_ptr<Context> context;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		/* There are as many contexts as requests encoding, one is free. */
+		context = std::move(contexts_.back());
+		contexts_.pop_back();
+	}
+
+	const FrameRequest::BufferMap &buffers = request->buffers();
+	context->outputs.resize(streamConfigs_.size());
+
+	unsigned int index = 0;
+	for (auto [stream, buffer] : buffers) {
+		auto iter = streamConfigs_.find(stream);
+		if (iter == streamConfigs_.end())
+			continue;
+
+		/* Compressed frames are written before the buffer is released. */
+		if (iter->second.pixelFormat == formats::MJPEG) {
+			writeCompressed(context->outputs[index], buffer,
+					request->metadata(buffer), request->tag());
+			continue;
+		}
+
+		encodeBuffer(context.get(), context->outputs[index++], stream, buffer,
+			     request->metadata(buffer), request->tag());
+	}
+
+	/* The pixels have been consumed, give the buffers back to the camera. */
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		held_--;
+	}
+	requestProcessed.emit(request);
+
+	for (unsigned int i = 0; i < index; ++i) {
+		if (server_)
+			server_->publish(context->outputs[i].data);
+		else
+			writeOutput(context->outputs[i]);
+	}
+
+	FrameRequest *next = nullptr;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		if (firstOutput_ == std::chrono::steady_clock::time_point())
+			firstOutput_ = std::chrono::steady_clock::now();
+		contexts_.push_back(std::move(context));
+		if (!--pending_)
+			idle_.notify_all();
+
+		/* Pass the context on to the oldest waiting request. */
+		if (waitingCount_) {
+			next = waiting_[waitingHead_];
+			waitingHead_ = (waitingHead_ + 1) % waiting_.size();
+			waitingCount_--;
+		} else {
+			encoding_--;
+		}
+	}
+
+	if (next)
+		pool_->submit([this, next] { encodeRequest(next); });
+}
+
+/**
+ * \brief Adapt the quality of the frames to a compressed size and encode time
+ * \param[in] target The targets of the rate control
+ *
+ * The settings of each frame are picked by a JpegRateControl shared by all
+ * the workers, from the frames compressed before. The rate control shall be
+ * set before the sink is started.
+ */
+void JpegSink::setRateControl(const JpegRateControl::Target &target)
+{
+	rateControl_ = std::make_unique<JpegRateControl>(target);
+}
+
+/**
+ * \brief Stream the frames instead of writing them to files
+ * \param[in] server The server to publish the frames to
+ *
+ * The server shall outlive the sink, and be set before the sink is started.
+ */
+void JpegSink::setServer(MjpegServer *server)
+{
+	server_ = server;
+}
+
+/**
+ * \brief Retrieve the time the first frame was written, or published
+ * \return The time, or the epoch of the clock if no frame was output yet
+ */
+std::chrono::steady_clock::time_point JpegSink::firstOutput() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return firstOutput_;
+}
+
+/**
+ * \brief Retrieve the number of heap allocations made while encoding
+ *
+ * The encoder contexts, and the output buffers added to the pool while
+ * streaming, are accounted for. The count grows while the contexts warm up
+ * when the sink starts, and while the pool grows as clients hold on to more
+ * frames, it stays constant afterwards.
+ * Contexts busy encoding a frame are skipped, call this function after stop()
+ * to get an exact count.
+ *
+ * \return The number of allocations since the sink was created
+ */
+uint64_t JpegSink::allocations() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	uint64_t count = 0;
+
+	for (const std::unique_ptr<Context> &context : contexts_)
+		count += context->encoder.allocations();
+
+	return count + outputAllocations_;
+}
+
+/*
+ * Give an output a buffer no stream client holds, from the pool or a new one.
+ * The lock shall be held.
+ */
+void JpegSink::takeBuffer(Output &output)
+{
+	/* The pool and the output hold the buffer, no client does. */
+	if (output.data && output.data.use_count() <= 2)
+		return;
+
+	for (const std::shared_ptr<std::vector<uint8_t>> &buffer : outputBuffers_) {
+		if (buffer.use_count() == 1) {
+			output.data = buffer;
+			return;
+		}
+	}
+
+	output.data = std::make_shared<std::vector<uint8_t>>();
+	output.data->reserve(outputSize_);
+	outputBuffers_.push_back(output.data);
+	outputAllocations_++;
+}
+
+void JpegSink::encodeBuffer(Context *context, Output &output,
+			    const Stream *stream, FrameBuffer *buffer,
+			    const FrameRequest::Metadata &metadata,
+			    const FrameRequest::Tag &tag)
+{
+	const StreamConfiguration &cfg = streamConfigs_[stream];
+	const Image *image = buffers_.find(buffer);
+	assert(image != nullptr);
+
+	TRACE_SCOPE("jpeg", "encode", metadata.sequence);
+	output.sequence = metadata.sequence;
+	setFilename(output, metadata, tag);
+
+	if (server_) {
+		std::unique_lock<std::mutex> locker(lock_);
+		takeBuffer(output);
+	}
+	std::vector<uint8_t> &data = *output.data;
+
+	const PixelFormat &format = cfg.pixelFormat;
+	convert::ConstPlane planes[3];
+	convert::planesFromImage(*image, format, cfg.stride, cfg.size.height, planes);
+
+	JpegEncoder::Frame frame;
+	frame.width = cfg.size.width;
+	frame.height = cfg.size.height;
+	frame.y = planes[0].data;
+	frame.u = planes[1].data;
+	frame.v = planes[2].data;
+	frame.stride = planes[0].stride;
+	frame.chromaStride = planes[1].stride;
+
+	if (format == formats::YVU420) {
+		std::swap(frame.u, frame.v);
+	} else if (format == formats::NV12) {
+		frame.convert = convertNV12;
+	} else if (format == formats::NV21) {
+		frame.convert = convertNV21;
+	} else if (format == formats::YUYV || format == formats::UYVY) {
+		frame.convert = format == formats::YUYV ? convertYUYV : convertUYVY;
+		frame.packed = true;
+	}
+
+	if (!rateControl_) {
+		context->encoder.encode(frame, data);
+		return;
+	}
+
+	JpegRateControl::Settings settings = rateControl_->settings();
+	context->encoder.setQuality(settings.quality);
+	context->encoder.setFastDct(settings.fastDct);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	context->encoder.encode(frame, data);
+	rateControl_->update(settings, data.size(),
+			     std::chrono::steady_clock::now() - start);
+}
+
+/*
+ * Write an MJPEG frame from the mapped buffer, with the Huffman tables it
+ * relies on when it doesn't carry them.
+ */
+void JpegSink::writeCompressed(Output &output, FrameBuffer *buffer,
+			       const FrameRequest::Metadata &metadata,
+			       const FrameRequest::Tag &tag)
+{
+	const Image *image = buffers_.find(buffer);
+	assert(image != nullptr);
+
+	TRACE_SCOPE("jpeg", "passthrough", metadata.sequence);
+	output.sequence = metadata.sequence;
+	setFilename(output, metadata, tag);
+
+	Span<const uint8_t> plane = image->data(0);
+	size_t size = plane.size();
+	if (metadata.planes)
+		size = std::min<size_t>(size, metadata.bytesused[0]);
+
+	bool tables;
+	size_t scan = findScan(plane.data(), size, &tables);
+	if (!scan) {
+		if (!invalid_++)
+			std::cerr << "invalid MJPEG frame " << metadata.sequence
+				  << ", further ones are only counted" << std::endl;
+		return;
+	}
+
+	const std::vector<uint8_t> &dht = JpegContext::standardHuffmanTables();
+	struct iovec iov[3] = {
+		{ const_cast<uint8_t *>(plane.data()), size },
+	};
+	int count = 1;
+
+	if (!tables) {
+		iov[0].iov_len = scan;
+		iov[1] = { const_cast<uint8_t *>(dht.data()), dht.size() };
+		iov[2] = { const_cast<uint8_t *>(plane.data() + scan), size - scan };
+		count = 3;
+	}
+
+	passthrough_++;
+
+	if (!server_) {
+		writeFile(output.filename, iov, count);
+		return;
+	}
+
+	/* The camera needs the buffer back, the clients get a copy. */
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		takeBuffer(output);
+	}
+
+	std::vector<uint8_t> &data = *output.data;
+	data.clear();
+	for (int i = 0; i < count; ++i) {
+		const uint8_t *base = static_cast<const uint8_t *>(iov[i].iov_base);
+		data.insert(data.end(), base, base + iov[i].iov_len);
+	}
+
+	server_->publish(output.data);
+}
+
+/*
+ * Build the name in place, to reuse the string storage. The frames of a burst
+ * are suffixed with their bracket.
+ */
+void JpegSink::setFilename(Output &output, const FrameRequest::Metadata &metadata,
+			   const FrameRequest::Tag &tag)
+{
+	output.filename = pattern_;
+	if (output.filename.empty() || output.filename.back() == '/')
+		output.filename += "savejpeg_test_#";
+
+	size_t pos = output.filename.find_first_of('#');
+	if (pos != std::string::npos) {
+		char name[64];
+		if (tag.frames)
+			snprintf(name, sizeof(name), "%" PRIu64 "--%06u-b%u.jpg",
+				 metadata.timestamp, metadata.sequence, tag.bracket);
+		else
+			snprintf(name, sizeof(name), "%" PRIu64 "--%06u.jpg",
+				 metadata.timestamp, metadata.sequence);
+		output.filename.replace(pos, 1, name);
+	}
+}
+
+void JpegSink::writeOutput(const Output &output)
+{
+	TRACE_SCOPE("jpeg", "write", output.sequence);
+
+	struct iovec iov = {
+		const_cast<uint8_t *>(output.data->data()), output.data->size()
+	};
+	writeFile(output.filename, &iov, 1);
+}
+
+void JpegSink::writeFile(const std::string &filename, const struct iovec *iov,
+			 int count)
+{
+	int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd == -1) {
+		std::cerr << "failed to open file " << filename << ": "
+			  << strerror(errno) << std::endl;
+		return;
+	}
+
+	size_t size = 0;
+	for (int i = 0; i < count; ++i)
+		size += iov[i].iov_len;
+
+	ssize_t ret = ::writev(fd, iov, count);
+	if (ret < 0)
+		std::cerr << "write error: " << strerror(errno) << std::endl;
+	else if (ret != (ssize_t)size)
+		std::cerr << "write error: only " << ret
+			  << " bytes written instead of " << size << std::endl;
+
+	close(fd);
+}
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * jpeg_sink.h - Asynchronous JPEG encoding sink
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <libcamera/stream.h>
+
+#include "frame_sink.h"
+#include "frame_request.h"
+#include "jpeg_encoder.h"
+#include "jpeg_rate_control.h"
+
+class BufferCache;
+class MjpegServer;
+struct iovec;
+class ThreadPool;
+
+class JpegSink : public FrameSink
+{
+public:
+	JpegSink(const std::map<const libcamera::Stream *, std::string> &streamNames,
+		 const BufferCache &buffers, const std::string &pattern = "",
+		 unsigned int workers = 0, unsigned int stripWorkers = 1,
+		 ThreadPool *pool = nullptr);
+	~JpegSink();
+
+	int configure(const libcamera::CameraConfiguration &config) override;
+
+	int start() override;
+	int stop() override;
+
+	bool processRequest(FrameRequest *request) override;
+	unsigned int capacity() const override { return workers_; }
+
+	uint64_t allocations() const;
+	uint64_t passthrough() const { return passthrough_; }
+	uint64_t invalid() const { return invalid_; }
+	std::chrono::steady_clock::time_point firstOutput() const;
+
+	void setRateControl(const JpegRateControl::Target &target);
+	const JpegRateControl *rateControl() const { return rateControl_.get(); }
+
+	void setServer(MjpegServer *server);
+
+private:
+	struct Output {
+		std::string filename;
+		/* Shared with the clients of the server when streaming */
+		std::shared_ptr<std::vector<uint8_t>> data;
+		unsigned int sequence;
+	};
+
+	struct Context {
+		Context(unsigned int stripWorkers)
+			: encoder(stripWorkers)
+		{
+		}
+
+		JpegEncoder encoder;
+		std::vector<Output> outputs;
+	};
+
+	void encodeRequest(FrameRequest *request);
+	void encodeBuffer(Context *context, Output &output,
+			  const libcamera::Stream *stream,
+			  libcamera::FrameBuffer *buffer,
+			  const FrameRequest::Metadata &metadata,
+			  const FrameRequest::Tag &tag);
+	void takeBuffer(Output &output);
+	void writeCompressed(Output &output, libcamera::FrameBuffer *buffer,
+			     const FrameRequest::Metadata &metadata,
+			     const FrameRequest::Tag &tag);
+	void setFilename(Output &output, const FrameRequest::Metadata &metadata,
+			 const FrameRequest::Tag &tag);
+	void writeOutput(const Output &output);
+	void writeFile(const std::string &filename, const struct iovec *iov,
+		       int count);
+
+	std::map<const libcamera::Stream *, std::string> streamNames_;
+	const BufferCache &buffers_;
+	std::string pattern_;
+	std::map<const libcamera::Stream *, libcamera::StreamConfiguration> streamConfigs_;
+
+	std::unique_ptr<JpegRateControl> rateControl_;
+	MjpegServer *server_;
+
+	/* MJPEG frames written as captured, and frames without a JPEG header */
+	std::atomic<uint64_t> passthrough_;
+	std::atomic<uint64_t> invalid_;
+
+	std::unique_ptr<ThreadPool> ownPool_;
+	ThreadPool *pool_;
+
+	mutable std::mutex lock_;
+	std::condition_variable idle_;
+	std::vector<std::unique_ptr<Context>> contexts_;
+	/* Output buffers, free when only referenced here */
+	std::vector<std::shared_ptr<std::vector<uint8_t>>> outputBuffers_;
+	size_t outputSize_;
+	uint64_t outputAllocations_;
+	unsigned int pending_;
+	/* Time the first frame was written or published at */
+	std::chrono::steady_clock::time_point firstOutput_;
+	/* Contexts, and requests being compressed or queued to the pool */
+	unsigned int workers_;
+	unsigned int encoding_;
+	/* Requests not released yet, at most workers_ */
+	unsigned int held_;
+
+	/*
+	 * Ring of requests waiting for a context still writing the output of
+	 * a released request, in arrival order
+	 */
+	std::vector<FrameRequest *> waiting_;
+	size_t waitingHead_;
+	size_t waitingCount_;
+};
@@ -1,8 +1,196 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include "cam.hpp"
 
-int main (void)
+// Usage : disocamera [--motion] [--jpeg-size=<bytes>] [--jpeg-time=<ms>] [--http=<port>] [--share[-copy]=<path>]
+//                    [--direct] [--daemon] [--soak=<frames>] [--schedule=<interval>[x<frames>]]
+//                    [--burst=<frames>[:<exposure>[/<gain>],...]] [--mode=still|sink|preroll|tee] [source]
+// <source> is "synthetic[:WxH][/format][@fps]" or "replay:<prefix>[@fps]" to run without a camera
+// --motion skips the stills and raw frames of a static scene
+// --jpeg-size and --jpeg-time adapt the JPEG quality to a size per still and an encode time
+// --http streams the stills as MJPEG on http://localhost:<port>/ instead of writing them, until Ctrl-C
+// --share publishes the frames to other processes on a Unix socket, see tools/framesub.cpp, until Ctrl-C
+// --share-copy does so from copies, returning the camera buffers right away
+// --direct writes each raw frame of the sink and tee modes to a file of its own with O_DIRECT, bypassing the page cache
+// --daemon captures until SIGTERM, SIGHUP restarts the captures, the status is printed every minute
+// --soak runs as a daemon for that many frames, and fails if the memory or the open files grow
+// --schedule captures a frame, or a burst of frames, every <interval> until Ctrl-C, in ms or with a us, ms or s suffix
+// --burst captures <frames> back to back and exits, cycling through the exposure times in us and gains of the brackets
+// --mode picks what is done with the frames : JPEG stills (the default), raw frames written to test/frames-NNNNNN.raw,
+//        a pre-roll ring flushed to test/preroll-NNNNNN.raw on trigger, or tee : raw preview frames and a still every 10th frame
+// Capture modes of --mode and their banners
+static const struct {
+    const char *name;
+    int8_t option;
+    const char *banner;
+} modes[] = {
+    { "still", option_code_still, "STILL" },
+    { "sink", option_code_sink, "SINK" },
+    { "preroll", option_code_preroll, "PREROLL" },
+    { "tee", option_code_tee, "TEE" },
+};
+
+// Parses a positive decimal number, returns false if it isn't one
+static bool parseCount(const char *spec, unsigned long long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtoull(spec, &end, 10);
+    return end != spec && !*end && *value && *spec != '-' && errno != ERANGE;
+}
+
+// Parses "<interval>[us|ms|s][x<frames>]", returns false if it isn't valid
+static bool parseSchedule(const char *spec, std::chrono::microseconds *interval, unsigned int *frames)
 {
-    CameraDiso *cam = new CameraDiso();
+    char *end;
+    unsigned long long value = strtoull(spec, &end, 10);
+    if (end == spec || !value)
+        return false;
+    if (!strncmp(end, "us", 2)) {
+        *interval = std::chrono::microseconds(value);
+        end += 2;
+    } else if (*end == 's') {
+        *interval = std::chrono::seconds(value);
+        end += 1;
+    } else {
+        *interval = std::chrono::milliseconds(value);
+        if (!strncmp(end, "ms", 2))
+            end += 2;
+    }
+    *frames = 1;
+    if (*end == 'x') {
+        *frames = strtoul(end + 1, &end, 10);
+        if (!*frames)
+            return false;
+    }
+    return !*end;
+}
+
+// Parses "<frames>[:<exposure>[/<gain>],...]", returns false if it isn't valid
+static bool parseBurst(const char *spec, unsigned int *frames, std::vector<CaptureBurst::Bracket> *brackets)
+{
+    char *end;
+    *frames = strtoul(spec, &end, 10);
+    if (end == spec || !*frames)
+        return false;
+    brackets->clear();
+    if (!*end)
+        return true;
+    if (*end != ':')
+        return false;
+    do {
+        CaptureBurst::Bracket bracket = {};
+        const char *field = end + 1;
+        bracket.exposureTime = strtol(field, &end, 10);
+        if (*end == '/')
+            bracket.analogueGain = strtof(end + 1, &end);
+        if (end == field || bracket.exposureTime < 0 || bracket.analogueGain < 0)
+            return false;
+        brackets->push_back(bracket);
+    } while (*end == ',');
+    return !*end;
+}
+
+int main (int argc, char **argv)
+{
+    bool motionGate = false;
+    JpegRateControl::Target jpegTarget;
+    unsigned long httpPort = 0;
+    std::string sharePath;
+    bool shareCopy = false;
+    bool rawDirect = false;
+    bool daemon = false;
+    uint64_t soakFrames = 0;
+    std::chrono::microseconds scheduleInterval{ 0 };
+    unsigned int scheduleFrames = 1;
+    unsigned int burstFrames = 0;
+    std::vector<CaptureBurst::Bracket> burstBrackets;
+    unsigned int mode = 0;
+    const char *source = "";
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--motion"))
+            motionGate = true;
+        else if (!strncmp(argv[i], "--jpeg-size=", 12)) {
+            unsigned long long bytes;
+            if (!parseCount(argv[i] + 12, &bytes)) {
+                std::cerr << "Invalid jpeg size " << argv[i] + 12 << std::endl;
+                return EXIT_FAILURE;
+            }
+            jpegTarget.bytesPerFrame = bytes;
+        }
+        else if (!strncmp(argv[i], "--jpeg-time=", 12)) {
+            unsigned long long ms;
+            if (!parseCount(argv[i] + 12, &ms)) {
+                std::cerr << "Invalid jpeg time " << argv[i] + 12 << std::endl;
+                return EXIT_FAILURE;
+            }
+            jpegTarget.encodeTime = std::chrono::milliseconds(ms);
+        }
+        else if (!strncmp(argv[i], "--http=", 7)) {
+            char *end;
+            httpPort = strtoul(argv[i] + 7, &end, 10);
+            if (end == argv[i] + 7 || *end || !httpPort || httpPort > 65535) {
+                std::cerr << "Invalid http port " << argv[i] + 7 << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strncmp(argv[i], "--share=", 8))
+            sharePath = argv[i] + 8;
+        else if (!strncmp(argv[i], "--share-copy=", 13)) {
+            sharePath = argv[i] + 13;
+            shareCopy = true;
+        }
+        else if (!strcmp(argv[i], "--direct"))
+            rawDirect = true;
+        else if (!strcmp(argv[i], "--daemon"))
+            daemon = true;
+        else if (!strncmp(argv[i], "--soak=", 7)) {
+            unsigned long long frames;
+            if (!parseCount(argv[i] + 7, &frames)) {
+                std::cerr << "Invalid soak frame count " << argv[i] + 7 << std::endl;
+                return EXIT_FAILURE;
+            }
+            soakFrames = frames;
+            daemon = true;
+        }
+        else if (!strncmp(argv[i], "--schedule=", 11)) {
+            if (!parseSchedule(argv[i] + 11, &scheduleInterval, &scheduleFrames)) {
+                std::cerr << "Invalid schedule " << argv[i] + 11 << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strncmp(argv[i], "--burst=", 8)) {
+            if (!parseBurst(argv[i] + 8, &burstFrames, &burstBrackets)) {
+                std::cerr << "Invalid burst " << argv[i] + 8 << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strncmp(argv[i], "--mode=", 7)) {
+            for (mode = 0; mode < std::size(modes); ++mode) {
+                if (!strcmp(argv[i] + 7, modes[mode].name))
+                    break;
+            }
+            if (mode == std::size(modes)) {
+                std::cerr << "Invalid mode " << argv[i] + 7 << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else
+            source = argv[i];
+    }
+
+    CameraDiso *cam = new CameraDiso(0, source, motionGate);
+    cam->setJpegTarget(jpegTarget);
+    cam->setHttpPort(httpPort);
+    cam->setSharePath(sharePath, shareCopy);
+    cam->setRawDirect(rawDirect);
+    if (daemon)
+        cam->setDaemon(soakFrames);
+    if (scheduleInterval.count())
+        cam->setSchedule(scheduleInterval, scheduleFrames);
+    else if (burstFrames)
+        cam->setBurst(burstFrames, burstBrackets);
     int res;
     /*
     if (res != 0) {
@@ -10,8 +198,8 @@ int main (void)
         return EXIT_FAILURE;
     }
     */
-    std::cout << "\033[0;36m.+* EXPLOIT WITH OPTION STILL *+.\033[0m" << std::endl;
-    res = cam->exploitCamera(option_code_still);
+    std::cout << "\033[0;36m.+* EXPLOIT WITH OPTION " << modes[mode].banner << " *+.\033[0m" << std::endl;
+    res = cam->exploitCamera(modes[mode].option);
 
     if (res == 0)
         return EXIT_SUCCESS;
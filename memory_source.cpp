@@ -0,0 +1,390 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * memory_source.cpp - Frame source producing frames in memory
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/udmabuf.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <utility>
+
+#include <libcamera/base/shared_fd.h>
+
+#include "image.h"
+#include "memory_source.h"
+
+using namespace libcamera;
+
+/* Buffers allocated when the configuration doesn't ask for a count */
+static constexpr unsigned int kDefaultBuffers = 4;
+static constexpr unsigned int kMaxBuffers = 16;
+
+class MemorySource::Configuration : public CameraConfiguration
+{
+public:
+	Configuration(const MemorySource::Format &format)
+		: format_(format)
+	{
+	}
+
+	Status validate() override;
+
+private:
+	const MemorySource::Format &format_;
+};
+
+/*
+ * A memory source produces a single stream, in the format of its frames,
+ * which can't be changed.
+ */
+CameraConfiguration::Status MemorySource::Configuration::validate()
+{
+	if (config_.empty())
+		return Invalid;
+
+	Status status = Valid;
+
+	if (config_.size() > 1) {
+		config_.resize(1);
+		status = Adjusted;
+	}
+
+	StreamConfiguration &cfg = config_[0];
+
+	if (cfg.pixelFormat != format_.pixelFormat || cfg.size != format_.size) {
+		cfg.pixelFormat = format_.pixelFormat;
+		cfg.size = format_.size;
+		status = Adjusted;
+	}
+
+	if (!cfg.bufferCount) {
+		cfg.bufferCount = kDefaultBuffers;
+	} else if (cfg.bufferCount > kMaxBuffers) {
+		cfg.bufferCount = kMaxBuffers;
+		status = Adjusted;
+	}
+
+	cfg.stride = format_.stride;
+	cfg.frameSize = 0;
+	for (unsigned int size : format_.planeSizes)
+		cfg.frameSize += size;
+
+	return status;
+}
+
+/**
+ * \class MemorySource
+ * \brief Base class of the sources producing frames without a camera
+ *
+ * A memory source captures a single stream, in a format fixed by the
+ * subclass with setFormat(). Its buffers are allocated in memfds, exported as
+ * dmabufs through udmabuf when the kernel supports it, so that they are
+ * mapped by the sinks like camera buffers.
+ *
+ * Frames are produced by an internal thread, which calls fill() for each
+ * queued request and completes it. At a given frame rate, the thread paces
+ * the frames, and drops the frames it is late for as a sensor does. When the
+ * source is unthrottled, each request is completed as soon as it is queued,
+ * the frame rate is then bounded by the sinks only.
+ *
+ * Frames are timestamped with CLOCK_MONOTONIC when their production starts,
+ * and numbered from 0 when the source starts.
+ *
+ * The source has no sensor to apply controls to. It keeps the controls of the
+ * requests as a camera keeps its settings, from frame to frame, and echoes
+ * them in the control metadata of each frame.
+ */
+
+/**
+ * \param[in] fps The frame rate, 0 to produce frames as fast as they are
+ * consumed
+ */
+MemorySource::MemorySource(unsigned int fps)
+	: interval_(fps ? std::chrono::nanoseconds(1000000000 / fps)
+			: std::chrono::nanoseconds(0)),
+	  bufferCount_(kDefaultBuffers), running_(false), head_(0), count_(0),
+	  sequence_(0)
+{
+}
+
+MemorySource::~MemorySource()
+{
+	stop();
+}
+
+/**
+ * A memory source produces a single stream whatever the roles, which
+ * consumers shall expect when asking for several streams.
+ */
+std::unique_ptr<CameraConfiguration>
+MemorySource::generateConfiguration([[maybe_unused]] const StreamRoles &roles)
+{
+	std::unique_ptr<CameraConfiguration> config =
+		std::make_unique<Configuration>(format_);
+
+	StreamConfiguration cfg;
+	cfg.pixelFormat = format_.pixelFormat;
+	cfg.size = format_.size;
+	config->addConfiguration(cfg);
+	config->validate();
+
+	return config;
+}
+
+/**
+ * The configuration must have been validated.
+ */
+int MemorySource::configure(CameraConfiguration *config)
+{
+	if (config->size() != 1)
+		return -EINVAL;
+
+	StreamConfiguration &cfg = config->at(0);
+	if (cfg.pixelFormat != format_.pixelFormat || cfg.size != format_.size)
+		return -EINVAL;
+
+	bufferCount_ = std::clamp(cfg.bufferCount, 1U, kMaxBuffers);
+	cfg.setStream(&stream_);
+
+	return 0;
+}
+
+int MemorySource::createBuffer(unsigned int index)
+{
+	size_t size = 0;
+	for (unsigned int planeSize : format_.planeSizes)
+		size += planeSize;
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size = (size + pageSize - 1) / pageSize * pageSize;
+
+	int fd = memfd_create("disocamera-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		int ret = -errno;
+		std::cerr << "failed to allocate frame buffer: "
+			  << strerror(-ret) << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return ret;
+	}
+
+	/* Export the memory as a dmabuf when possible, as camera buffers are. */
+	int device = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (device >= 0) {
+		struct udmabuf_create create = {};
+		create.memfd = fd;
+		create.flags = UDMABUF_FLAGS_CLOEXEC;
+		create.size = size;
+
+		int dmabuf = -1;
+		if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+			dmabuf = ioctl(device, UDMABUF_CREATE, &create);
+		if (dmabuf >= 0) {
+			close(fd);
+			fd = dmabuf;
+		}
+
+		close(device);
+	}
+
+	SharedFD shared(std::move(fd));
+
+	std::vector<FrameBuffer::Plane> planes(format_.planeSizes.size());
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < planes.size(); ++i) {
+		planes[i].fd = shared;
+		planes[i].offset = offset;
+		planes[i].length = format_.planeSizes[i];
+		offset += format_.planeSizes[i];
+	}
+
+	std::unique_ptr<FrameBuffer> buffer = std::make_unique<FrameBuffer>(planes, index);
+	std::unique_ptr<Image> image =
+		Image::fromFrameBuffer(buffer.get(), Image::MapMode::ReadWrite);
+	if (!image)
+		return -ENOMEM;
+
+	buffers_.push_back(std::move(buffer));
+	images_.push_back(std::move(image));
+
+	return 0;
+}
+
+/**
+ * \brief Allocate the buffers, and one request per buffer
+ * \return 0 on success or a negative error code otherwise
+ */
+int MemorySource::allocate()
+{
+	requests_.clear();
+	images_.clear();
+	buffers_.clear();
+
+	for (unsigned int i = 0; i < bufferCount_; ++i) {
+		int ret = createBuffer(i);
+		if (ret < 0)
+			return ret;
+
+		prepare(i, images_[i].get());
+
+		std::unique_ptr<FrameRequest> request = std::make_unique<FrameRequest>(i);
+		FrameBuffer *buffer = buffers_[i].get();
+		request->addBuffer(&stream_, buffer);
+
+		FrameRequest::Metadata &metadata = request->metadata(buffer);
+		metadata.planes = std::min<size_t>(format_.planeSizes.size(),
+						   FrameRequest::kMaxPlanes);
+		for (unsigned int j = 0; j < metadata.planes; ++j)
+			metadata.bytesused[j] = format_.planeSizes[j];
+
+		requests_.push_back(std::move(request));
+	}
+
+	queue_.assign(bufferCount_, nullptr);
+	head_ = 0;
+	count_ = 0;
+
+	return 0;
+}
+
+const std::vector<std::unique_ptr<FrameBuffer>> &
+MemorySource::buffers([[maybe_unused]] const Stream *stream) const
+{
+	return buffers_;
+}
+
+int MemorySource::start()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	if (running_)
+		return -EBUSY;
+
+	running_ = true;
+	sequence_ = 0;
+	controls_.clear();
+	thread_ = std::thread(&MemorySource::run, this);
+
+	return 0;
+}
+
+/**
+ * Requests queued and not completed yet are dropped, and must be queued again
+ * after the source is restarted.
+ */
+void MemorySource::stop()
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		if (!running_)
+			return;
+
+		running_ = false;
+	}
+
+	cond_.notify_all();
+	thread_.join();
+
+	std::unique_lock<std::mutex> locker(lock_);
+	count_ = 0;
+}
+
+/**
+ * Can be called from any thread.
+ */
+int MemorySource::queueRequest(FrameRequest *request)
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		if (count_ == queue_.size())
+			return -ENOSPC;
+
+		queue_[(head_ + count_) % queue_.size()] = request;
+		count_++;
+	}
+
+	cond_.notify_one();
+	return 0;
+}
+
+/**
+ * \brief Initialize a buffer once it is allocated
+ * \param[in] index The buffer index, also the cookie of its request
+ * \param[in] image The buffer mapped for writing
+ */
+void MemorySource::prepare([[maybe_unused]] unsigned int index,
+			   [[maybe_unused]] Image *image)
+{
+}
+
+/**
+ * \fn MemorySource::fill()
+ * \brief Produce the next frame in a buffer
+ * \param[in] index The buffer index, also the cookie of its request
+ * \param[in] image The buffer mapped for writing
+ * \param[inout] metadata The buffer metadata, with the sequence number,
+ * timestamp and plane sizes already set, which may be overridden
+ */
+
+void MemorySource::run()
+{
+	using Clock = std::chrono::steady_clock;
+
+	Clock::time_point next = Clock::now();
+	std::unique_lock<std::mutex> locker(lock_);
+
+	while (true) {
+		cond_.wait(locker, [&] { return !running_ || count_; });
+		if (!running_)
+			return;
+
+		FrameRequest *request = queue_[head_];
+		head_ = (head_ + 1) % queue_.size();
+		count_--;
+
+		locker.unlock();
+
+		if (interval_.count()) {
+			/* Skip the frames the sinks held the buffers for too long. */
+			Clock::time_point now = Clock::now();
+			while (next + interval_ < now) {
+				next += interval_;
+				sequence_++;
+			}
+
+			std::this_thread::sleep_until(next);
+			next += interval_;
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uint64_t timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+		if (!request->controls().empty()) {
+			for (const auto &[id, value] : request->controls())
+				controls_.set(id, value);
+			request->controls().clear();
+		}
+		request->controlMetadata() = controls_;
+
+		for (auto [stream, buffer] : request->buffers()) {
+			FrameRequest::Metadata &metadata = request->metadata(buffer);
+			metadata.sequence = sequence_;
+			metadata.timestamp = timestamp;
+
+			unsigned int index = request->cookie();
+			fill(index, images_[index].get(), metadata);
+		}
+
+		sequence_++;
+		requestCompleted.emit(request);
+
+		locker.lock();
+	}
+}
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * memory_source.h - Frame source producing frames in memory
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/camera.h>
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/geometry.h>
+#include <libcamera/pixel_format.h>
+#include <libcamera/stream.h>
+
+#include "frame_source.h"
+
+class Image;
+
+class MemorySource : public FrameSource
+{
+public:
+	~MemorySource();
+
+	std::unique_ptr<libcamera::CameraConfiguration>
+	generateConfiguration(const libcamera::StreamRoles &roles) override;
+	int configure(libcamera::CameraConfiguration *config) override;
+
+	int allocate() override;
+	const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &
+	buffers(const libcamera::Stream *stream) const override;
+
+	int start() override;
+	void stop() override;
+
+	int queueRequest(FrameRequest *request) override;
+
+	bool throttled() const { return interval_.count() != 0; }
+
+protected:
+	struct Format {
+		libcamera::PixelFormat pixelFormat;
+		libcamera::Size size;
+		unsigned int stride;
+		std::vector<unsigned int> planeSizes;
+	};
+
+	MemorySource(unsigned int fps);
+
+	void setFormat(const Format &format) { format_ = format; }
+	const Format &format() const { return format_; }
+
+	/* Initialize a buffer once it is allocated */
+	virtual void prepare(unsigned int index, Image *image);
+	/* Produce the next frame in a buffer, and complete its metadata */
+	virtual void fill(unsigned int index, Image *image,
+			  FrameRequest::Metadata &metadata) = 0;
+
+private:
+	class Configuration;
+
+	int createBuffer(unsigned int index);
+	void run();
+
+	Format format_;
+	std::chrono::nanoseconds interval_;
+	unsigned int bufferCount_;
+
+	libcamera::Stream stream_;
+	std::vector<std::unique_ptr<libcamera::FrameBuffer>> buffers_;
+	std::vector<std::unique_ptr<Image>> images_;
+
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool running_;
+
+	/* Ring of queued requests, as large as the number of requests */
+	std::vector<FrameRequest *> queue_;
+	size_t head_;
+	size_t count_;
+
+	unsigned int sequence_;
+	/* Controls of the requests so far, owned by the thread */
+	libcamera::ControlList controls_;
+};
@@ -0,0 +1,360 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * mjpeg_server.cpp - MJPEG streaming over HTTP to local clients
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+
+#include "event_loop.h"
+#include "mjpeg_server.h"
+
+/* Clients beyond this number are refused */
+static constexpr unsigned int kMaxClients = 64;
+/* Longest request header accepted */
+static constexpr size_t kMaxRequest = 4096;
+
+/* The boundary is also announced by the response header. */
+static const char kBoundary[] = "disocamera";
+static const char kResponse[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: multipart/x-mixed-replace; boundary=disocamera\r\n"
+	"Cache-Control: no-cache, no-store\r\n"
+	"Pragma: no-cache\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+static const char kNotFound[] =
+	"HTTP/1.0 404 Not Found\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+static const char kTrailer[] = "\r\n";
+
+/**
+ * \class MjpegServer
+ * \brief Stream JPEG frames to HTTP clients as multipart/x-mixed-replace
+ *
+ * The server runs from an EventLoop, usually the one of the capture. Any
+ * browser, or curl, watches the stream at "http://localhost:<port>/", and
+ * "/stream" is an alias.
+ *
+ * Frames are published already compressed, in reference-counted buffers, and
+ * sent from those buffers to every client, the server never copies them. Each
+ * client holds the part it is sending and the most recent frame to send next.
+ * A client slower than the frame rate skips the frames published while it is
+ * busy, and sockets are never waited for, so that a slow client neither
+ * delays the others nor the capture.
+ *
+ * publish() can be called from any thread, the other functions shall be
+ * called from the loop thread, or once the loop has stopped.
+ */
+
+/**
+ * \param[in] loop The loop watching the sockets
+ */
+MjpegServer::MjpegServer(EventLoop &loop)
+	: loop_(loop), fd_(-1), port_(0), served_(0), published_(0), sent_(0),
+	  skipped_(0), maxClients_(0)
+{
+}
+
+MjpegServer::~MjpegServer()
+{
+	close();
+}
+
+/**
+ * \brief Accept clients on a TCP port
+ * \param[in] port The port, 0 to pick any free port
+ * \param[in] address The local address to listen on
+ * \return 0 on success or a negative error code otherwise
+ */
+int MjpegServer::listen(uint16_t port, const std::string &address)
+{
+	struct sockaddr_in addr = {};
+
+	close();
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+		return -EINVAL;
+
+	fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return -errno;
+
+	int one = 1;
+	setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	socklen_t length = sizeof(addr);
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+	    ::listen(fd_, 16) < 0 ||
+	    getsockname(fd_, reinterpret_cast<struct sockaddr *>(&addr), &length) < 0) {
+		int ret = -errno;
+		std::cerr << "failed to listen on " << address << ":" << port << ": "
+			  << strerror(-ret) << std::endl;
+		::close(fd_);
+		fd_ = -1;
+		return ret;
+	}
+
+	port_ = ntohs(addr.sin_port);
+	loop_.addFdEvent(fd_, EventLoop::Read, [this]() { accept(); });
+
+	return 0;
+}
+
+/**
+ * \brief Disconnect the clients and stop listening
+ */
+void MjpegServer::close()
+{
+	while (!clients_.empty())
+		drop(clients_.back().get());
+
+	if (fd_ < 0)
+		return;
+
+	loop_.removeFdEvent(fd_, EventLoop::Read);
+	::close(fd_);
+	fd_ = -1;
+}
+
+/**
+ * \brief Send a frame to the clients
+ * \param[in] frame The JPEG frame, which shall not be modified anymore
+ *
+ * The clients keep a reference to the frame until it has been sent, the
+ * publisher can tell when the buffer is free again by its use count.
+ */
+void MjpegServer::publish(Frame frame)
+{
+	loop_.callLater([this, frame = std::move(frame)]() mutable {
+		deliver(std::move(frame));
+	});
+}
+
+void MjpegServer::accept()
+{
+	while (true) {
+		int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "failed to accept client: " << strerror(errno)
+					  << std::endl;
+			if (errno != EINTR)
+				return;
+			continue;
+		}
+
+		if (clients_.size() >= kMaxClients) {
+			::close(fd);
+			continue;
+		}
+
+		std::unique_ptr<Client> client = std::make_unique<Client>();
+		client->fd = fd;
+		client->streaming = false;
+		client->started = false;
+		client->blocked = false;
+		client->headSize = 0;
+		client->offset = 0;
+
+		Client *raw = client.get();
+		clients_.push_back(std::move(client));
+		loop_.addFdEvent(fd, EventLoop::Read, [this, raw]() { receive(raw); });
+
+		served_++;
+		maxClients_ = std::max<unsigned int>(maxClients_, clients_.size());
+	}
+}
+
+void MjpegServer::receive(Client *client)
+{
+	char buffer[1024];
+
+	while (true) {
+		ssize_t ret = recv(client->fd, buffer, sizeof(buffer), 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0) {
+			/* The client went away, or failed. */
+			drop(client);
+			return;
+		}
+
+		/* Anything sent after the request is ignored. */
+		if (!client->streaming)
+			client->request.append(buffer, ret);
+	}
+
+	if (client->streaming)
+		return;
+
+	size_t end = client->request.find("\r\n\r\n");
+	if (end == std::string::npos) {
+		if (client->request.size() > kMaxRequest)
+			drop(client);
+		return;
+	}
+
+	const std::string &request = client->request;
+	bool stream = request.compare(0, 6, "GET / ") == 0 ||
+		      request.compare(0, 12, "GET /stream ") == 0;
+	if (!stream) {
+		ssize_t ret = ::send(client->fd, kNotFound, sizeof(kNotFound) - 1,
+				     MSG_NOSIGNAL | MSG_DONTWAIT);
+		(void)ret;
+		drop(client);
+		return;
+	}
+
+	client->streaming = true;
+	client->request.clear();
+	client->request.shrink_to_fit();
+
+	if (latest_)
+		queue(client, latest_);
+}
+
+void MjpegServer::deliver(Frame frame)
+{
+	published_++;
+	latest_ = std::move(frame);
+
+	/* Queueing may drop clients, walk the list by index. */
+	for (size_t i = 0; i < clients_.size();) {
+		Client *client = clients_[i].get();
+		if (client->streaming)
+			queue(client, latest_);
+
+		if (i < clients_.size() && clients_[i].get() == client)
+			++i;
+	}
+}
+
+void MjpegServer::queue(Client *client, Frame frame)
+{
+	/* Replace the frame the client didn't have time to start sending. */
+	if (client->current) {
+		if (client->next)
+			skipped_++;
+		client->next = std::move(frame);
+		return;
+	}
+
+	start(client, std::move(frame));
+	send(client);
+}
+
+/* Prepare the part of a frame, after the response header for the first one. */
+void MjpegServer::start(Client *client, Frame frame)
+{
+	client->current = std::move(frame);
+	client->offset = 0;
+	client->headSize = snprintf(client->head, sizeof(client->head),
+				    "%s--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+				    client->started ? "" : kResponse, kBoundary,
+				    client->current->size());
+	client->started = true;
+}
+
+void MjpegServer::send(Client *client)
+{
+	while (client->current) {
+		const std::vector<uint8_t> &data = *client->current;
+		size_t sizes[3] = { client->headSize, data.size(), sizeof(kTrailer) - 1 };
+		const void *parts[3] = { client->head, data.data(), kTrailer };
+
+		struct iovec iov[3];
+		int count = 0;
+		size_t skip = client->offset;
+		for (unsigned int i = 0; i < 3; ++i) {
+			if (skip >= sizes[i]) {
+				skip -= sizes[i];
+				continue;
+			}
+
+			iov[count].iov_base = const_cast<uint8_t *>(static_cast<const uint8_t *>(parts[i]) + skip);
+			iov[count].iov_len = sizes[i] - skip;
+			count++;
+			skip = 0;
+		}
+
+		struct msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		ssize_t ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				drop(client);
+				return;
+			}
+
+			/* Resume once the socket drains, without waiting for it. */
+			if (!client->blocked) {
+				loop_.addFdEvent(client->fd, EventLoop::Write,
+						 [this, client]() { send(client); });
+				client->blocked = true;
+			}
+			return;
+		}
+
+		client->offset += ret;
+		if (client->offset < sizes[0] + sizes[1] + sizes[2])
+			continue;
+
+		sent_++;
+		client->current.reset();
+		if (!client->next)
+			break;
+
+		start(client, std::move(client->next));
+		client->next.reset();
+	}
+
+	if (client->blocked) {
+		loop_.removeFdEvent(client->fd, EventLoop::Write);
+		client->blocked = false;
+	}
+}
+
+void MjpegServer::drop(Client *client)
+{
+	loop_.removeFdEvent(client->fd, EventLoop::Read);
+	if (client->blocked)
+		loop_.removeFdEvent(client->fd, EventLoop::Write);
+	::close(client->fd);
+
+	auto iter = std::find_if(clients_.begin(), clients_.end(),
+				 [client](const std::unique_ptr<Client> &c) {
+					 return c.get() == client;
+				 });
+	clients_.erase(iter);
+}
+
+/**
+ * \brief Print the clients served and the frames sent and skipped
+ */
+void MjpegServer::report(std::ostream &out) const
+{
+	out << "port " << port_ << ", " << served_ << " clients served, up to "
+	    << maxClients_ << " at once, " << published_ << " frames published, "
+	    << sent_ << " sent, " << skipped_ << " skipped by slow clients"
+	    << std::endl;
+}
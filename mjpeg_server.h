@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * mjpeg_server.h - MJPEG streaming over HTTP to local clients
+ */
+
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class EventLoop;
+
+class MjpegServer
+{
+public:
+	using Frame = std::shared_ptr<const std::vector<uint8_t>>;
+
+	explicit MjpegServer(EventLoop &loop);
+	~MjpegServer();
+
+	int listen(uint16_t port, const std::string &address = "127.0.0.1");
+	void close();
+
+	uint16_t port() const { return port_; }
+
+	void publish(Frame frame);
+
+	void report(std::ostream &out) const;
+
+private:
+	struct Client {
+		int fd;
+		/* HTTP request, until the end of its header */
+		std::string request;
+		bool streaming;
+		/* The response header has been queued */
+		bool started;
+		/* The write event is registered */
+		bool blocked;
+
+		/* Part being sent, and most recent frame to send next */
+		Frame current;
+		Frame next;
+		char head[256];
+		size_t headSize;
+		size_t offset;
+	};
+
+	void accept();
+	void receive(Client *client);
+	void deliver(Frame frame);
+	void queue(Client *client, Frame frame);
+	void start(Client *client, Frame frame);
+	void send(Client *client);
+	void drop(Client *client);
+
+	EventLoop &loop_;
+	int fd_;
+	uint16_t port_;
+
+	std::vector<std::unique_ptr<Client>> clients_;
+	/* Frame new clients start with */
+	Frame latest_;
+
+	uint64_t served_;
+	uint64_t published_;
+	uint64_t sent_;
+	uint64_t skipped_;
+	unsigned int maxClients_;
+};
@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * motion_detector.cpp - Detection of changes between frames on the luma plane
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <stdlib.h>
+
+#include <libcamera/camera.h>
+#include <libcamera/formats.h>
+
+#include "buffer_cache.h"
+#include "frame_request.h"
+#include "image.h"
+#include "motion_detector.h"
+#include "pixel_convert.h"
+
+using namespace libcamera;
+
+/**
+ * \class MotionDetector
+ * \brief Score the change of each frame against the previous ones
+ *
+ * The detector sums the luma plane over a grid of convert::kBlockSize pixel
+ * blocks, straight from the mapped frame buffer, with the vectorized kernels
+ * of the pixel conversions. Only one row out of Config::rowStep is read, and
+ * averaging the pixels of a block filters out the sensor noise.
+ *
+ * The mean luma of each block is compared to a background, the running
+ * average of the previous frames, and the block counts as changed when the
+ * difference exceeds Config::blockThreshold. The mask() of changed blocks and
+ * the score(), the ratio of changed blocks, are updated for each frame. Slow
+ * changes, as of the lighting, are absorbed by the background.
+ *
+ * Motion starts when the score reaches Config::startScore, and stops once the
+ * score stayed below Config::stopScore for Config::holdFrames frames, so that
+ * a scene doesn't flicker between static and moving. The first frame counts
+ * as moving, to record a reference of the scene.
+ *
+ * The detector is a synchronous frame sink, processRequest() analyses the
+ * buffer of the selected stream, or of the first stream with a luma plane,
+ * before returning true.
+ */
+
+/**
+ * \param[in] buffers Mappings of the frame buffers
+ *
+ * Detect motion with the default thresholds.
+ */
+MotionDetector::MotionDetector(const BufferCache &buffers)
+	: MotionDetector(buffers, Config())
+{
+}
+
+/**
+ * \param[in] buffers Mappings of the frame buffers
+ * \param[in] config The thresholds of the detection
+ */
+MotionDetector::MotionDetector(const BufferCache &buffers, const Config &config)
+	: buffers_(buffers), config_(config), analysed_(nullptr), width_(0),
+	  height_(0), stride_(0), columns_(0), rows_(0), samples_(0),
+	  primed_(false), score_(0), moving_(true), quiet_(0), frames_(0),
+	  movingFrames_(0)
+{
+	/* Keep the number of rows summed the same in all blocks. */
+	unsigned int step = std::clamp(config_.rowStep, 1U, convert::kBlockSize);
+	config_.rowStep = 1;
+	while (config_.rowStep * 2 <= step)
+		config_.rowStep *= 2;
+
+	config_.adaptShift = std::min(config_.adaptShift, 8U);
+}
+
+int MotionDetector::configure(const CameraConfiguration &config)
+{
+	int ret = FrameSink::configure(config);
+	if (ret < 0)
+		return ret;
+
+	analysed_ = nullptr;
+
+	for (const StreamConfiguration &cfg : config) {
+		if (!selected(cfg.stream()))
+			continue;
+
+		const PixelFormat &format = cfg.pixelFormat;
+		if (format != formats::YUV420 && format != formats::YVU420 &&
+		    format != formats::NV12 && format != formats::NV21)
+			continue;
+
+		analysed_ = cfg.stream();
+		format_ = format;
+		width_ = cfg.size.width;
+		height_ = cfg.size.height;
+		stride_ = cfg.stride ? cfg.stride : cfg.size.width;
+		break;
+	}
+
+	if (!analysed_) {
+		std::cerr << "motion detection needs a stream with a luma plane"
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	columns_ = width_ / convert::kBlockSize;
+	rows_ = height_ / convert::kBlockSize;
+	samples_ = convert::kBlockSize * (convert::kBlockSize / config_.rowStep);
+
+	if (!columns_ || !rows_) {
+		std::cerr << "frames too small for motion detection" << std::endl;
+		return -EINVAL;
+	}
+
+	sums_.assign(columns_ * rows_, 0);
+	background_.assign(columns_ * rows_, 0);
+	mask_.assign(columns_ * rows_, 0);
+	primed_ = false;
+	moving_ = true;
+	quiet_ = 0;
+
+	return 0;
+}
+
+bool MotionDetector::processRequest(FrameRequest *request)
+{
+	const FrameRequest::BufferMap &buffers = request->buffers();
+	auto iter = buffers.find(analysed_);
+	if (iter == buffers.end())
+		return true;
+
+	const Image *image = buffers_.find(iter->second);
+	if (!image)
+		return true;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	convert::ConstPlane planes[3];
+	if (convert::planesFromImage(*image, format_, stride_, height_, planes) < 0)
+		return true;
+
+	convert::sumBlocks(planes[0], width_, height_, config_.rowStep, sums_.data());
+
+	const int threshold = config_.blockThreshold << 8;
+	unsigned int changed = 0;
+
+	for (unsigned int i = 0; i < sums_.size(); ++i) {
+		int mean = (sums_[i] << 8) / samples_;
+		int delta = mean - background_[i];
+
+		if (!primed_) {
+			background_[i] = mean;
+			mask_[i] = 0;
+			continue;
+		}
+
+		mask_[i] = abs(delta) > threshold;
+		changed += mask_[i];
+
+		/* Round towards the new value, for the background to reach it. */
+		int step = delta >= 0 ? (delta + (1 << config_.adaptShift) - 1) >> config_.adaptShift
+				      : -((-delta + (1 << config_.adaptShift) - 1) >> config_.adaptShift);
+		background_[i] += step;
+	}
+
+	score_ = primed_ ? static_cast<float>(changed) / sums_.size() : 1.0f;
+	primed_ = true;
+
+	if (score_ >= config_.startScore) {
+		moving_ = true;
+		quiet_ = 0;
+	} else if (score_ >= config_.stopScore) {
+		quiet_ = 0;
+	} else if (moving_ && ++quiet_ >= config_.holdFrames) {
+		moving_ = false;
+	}
+
+	frames_++;
+	if (moving_)
+		movingFrames_++;
+
+	latency_.record(std::chrono::steady_clock::now() - start);
+
+	return true;
+}
+
+/**
+ * \brief Print the number of moving frames and the analysis time per frame
+ */
+void MotionDetector::report(std::ostream &out) const
+{
+	out << "moving " << movingFrames_ << " of " << frames_ << " frames, "
+	    << columns_ << "x" << rows_ << " blocks, analysis ";
+	latency_.report(out);
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * motion_detector.h - Detection of changes between frames on the luma plane
+ */
+
+#pragma once
+
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+#include "frame_sink.h"
+#include "stats.h"
+
+class BufferCache;
+
+class MotionDetector : public FrameSink
+{
+public:
+	struct Config {
+		/* Sum one luma row out of rowStep, a power of 2 up to 16 */
+		unsigned int rowStep = 2;
+		/* Change of the mean luma of a block to count it as changed */
+		unsigned int blockThreshold = 8;
+		/* Ratio of changed blocks starting motion */
+		float startScore = 0.01f;
+		/* Ratio of changed blocks below which motion stops, after holdFrames */
+		float stopScore = 0.004f;
+		/* Consecutive quiet frames before motion stops */
+		unsigned int holdFrames = 15;
+		/* The background moves by 1 / 2^adaptShift of the change per frame */
+		unsigned int adaptShift = 2;
+	};
+
+	explicit MotionDetector(const BufferCache &buffers);
+	MotionDetector(const BufferCache &buffers, const Config &config);
+
+	int configure(const libcamera::CameraConfiguration &config) override;
+
+	bool processRequest(FrameRequest *request) override;
+
+	bool moving() const { return moving_; }
+	float score() const { return score_; }
+	const std::vector<uint8_t> &mask() const { return mask_; }
+	unsigned int columns() const { return columns_; }
+	unsigned int rows() const { return rows_; }
+
+	uint64_t frames() const { return frames_; }
+	uint64_t movingFrames() const { return movingFrames_; }
+	const LatencyStats &latency() const { return latency_; }
+
+	void report(std::ostream &out) const;
+
+private:
+	const BufferCache &buffers_;
+	Config config_;
+
+	const libcamera::Stream *analysed_;
+	libcamera::PixelFormat format_;
+	unsigned int width_;
+	unsigned int height_;
+	unsigned int stride_;
+
+	unsigned int columns_;
+	unsigned int rows_;
+	unsigned int samples_;
+
+	std::vector<uint32_t> sums_;
+	/* Mean luma of each block in 8.8 fixed point, 0 before the first frame */
+	std::vector<uint16_t> background_;
+	std::vector<uint8_t> mask_;
+	bool primed_;
+
+	float score_;
+	bool moving_;
+	unsigned int quiet_;
+
+	uint64_t frames_;
+	uint64_t movingFrames_;
+	LatencyStats latency_;
+};
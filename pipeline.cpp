@@ -0,0 +1,500 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pipeline.cpp - Fan-out of requests to concurrent frame sink stages
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <time.h>
+
+#include <libcamera/camera.h>
+
+#include "frame_request.h"
+#include "motion_detector.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+using namespace libcamera;
+
+/* Requests a stage processes before giving the executor back to other stages */
+static constexpr unsigned int kStageBatchSize = 2;
+
+/**
+ * \class Pipeline
+ * \brief Feed each request to several frame sinks concurrently
+ *
+ * A pipeline is a frame sink that hands every request it receives to all its
+ * stages, for instance a raw writer, a JPEG encoder and a preview, and returns
+ * the request through its own requestProcessed signal once the last stage is
+ * done with it. Requests are reference counted, a stage is done with a request
+ * when its processRequest() function returns true or when it emits
+ * requestProcessed.
+ *
+ * Each stage has its own queue. Stages run concurrently on a shared executor,
+ * while a given stage processes its requests one at a time and in order, so
+ * sinks don't need to be reentrant. As a pipeline is itself a frame sink,
+ * pipelines can be nested to build graphs.
+ *
+ * A stage gives its executor thread back after a couple of requests, and is
+ * queued again behind the tasks submitted meanwhile. When pipelines share an
+ * executor, for instance one pipeline per camera, a camera with a busy stage
+ * thus doesn't starve the stages of the other cameras.
+ *
+ * A sink processing requests asynchronously is handed at most as many
+ * requests as its FrameSink::capacity(), the next ones wait in the queue of
+ * the stage until the sink releases one. The policy of the stage thus applies
+ * to the requests the sink can't start processing right away.
+ *
+ * The depth of the queue of each stage, and the number of requests a stage
+ * holds asynchronously, can be monitored with stats().
+ *
+ * Each stage has a Policy deciding how it sheds load when it falls behind,
+ * without affecting the other stages:
+ *
+ * - keepEvery > 1 only queues one request out of keepEvery to the stage.
+ * - When the queue holds maxQueued requests, a new request either waits for
+ *   room (Overflow::Block, which holds up the caller and in turn the camera),
+ *   replaces the oldest queued request (Overflow::DropOldest), or is dropped
+ *   (Overflow::DropNewest).
+ * - A request whose capture, as given by the sensor timestamp of its first
+ *   buffer, is older than the budget when it is queued or when the stage is
+ *   about to process it is dropped. The budget thus bounds the delay from
+ *   capture to the start of processing, recorded in the stage latency stats.
+ * - A gated stage skips the requests while the motion detector of the
+ *   pipeline finds the scene static, see setMotionDetector().
+ *
+ * Requests dropped by a stage are released for this stage only, and counted
+ * per reason.
+ */
+
+/*
+ * Time elapsed since the capture of a request, from the sensor timestamp of
+ * its first buffer, which libcamera takes from CLOCK_MONOTONIC. The duration is
+ * negative when the request carries no timestamp.
+ */
+static std::chrono::nanoseconds age(const FrameRequest *request)
+{
+	uint64_t timestamp = request->timestamp();
+	if (!timestamp)
+		return std::chrono::nanoseconds(-1);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t elapsed = now.tv_sec * 1000000000LL + now.tv_nsec
+			- static_cast<int64_t>(timestamp);
+	return std::chrono::nanoseconds(elapsed);
+}
+
+/**
+ * \param[in] executor Thread pool running the stages, may be shared with
+ * other pipelines
+ */
+Pipeline::Pipeline(ThreadPool &executor)
+	: executor_(executor)
+{
+}
+
+Pipeline::~Pipeline()
+{
+	stop();
+}
+
+/**
+ * \fn Pipeline::add()
+ * \brief Add a stage to the pipeline
+ * \param[in] name Name of the stage, for reports
+ * \param[in] sink The frame sink, owned by the pipeline
+ * \param[in] policy The backpressure policy of the stage
+ * \param[in] stream The stream routed to the stage, nullptr for all streams
+ *
+ * A stage routed to a stream only receives the requests that carry a buffer
+ * for this stream, and its sink only processes this buffer.
+ *
+ * Stages shall be added before the pipeline is configured.
+ *
+ * \return The frame sink
+ */
+
+void Pipeline::addStage(const std::string &name, std::unique_ptr<FrameSink> sink,
+			const Policy &policy, const libcamera::Stream *stream)
+{
+	std::unique_ptr<Stage> stage = std::make_unique<Stage>();
+	Stage *ptr = stage.get();
+
+	stage->pipeline = this;
+	stage->name = name;
+	stage->traceName = trace::intern(name);
+	stage->sink = std::move(sink);
+	stage->sink->selectStream(stream);
+	stage->policy = policy;
+	stage->policy.keepEvery = std::max(policy.keepEvery, 1U);
+	stage->queue.resize(std::max(policy.maxQueued, 8U));
+	stage->head = 0;
+	stage->count = 0;
+	stage->scheduled = false;
+	stage->capacity = stage->sink->capacity();
+	stage->maxQueued = 0;
+	stage->active = 0;
+	stage->processed = 0;
+	stage->received = 0;
+	stage->dropped.fill(0);
+
+	stage->sink->requestProcessed.connect(this, [this, ptr](FrameRequest *request) {
+		release(ptr, request);
+	});
+
+	stages_.push_back(std::move(stage));
+}
+
+/**
+ * \brief Gate stages on the motion in the frames
+ * \param[in] detector The motion detector, owned by the pipeline
+ * \param[in] stream The stream analysed by the detector, nullptr for the
+ * first stream it supports
+ *
+ * The detector analyses each request in processRequest(), before the request
+ * is queued to the stages, so that the stages with a gated policy skip static
+ * frames without ever being scheduled. The analysis runs on the caller
+ * thread, and must thus be cheap. Requests without a buffer for the analysed
+ * stream keep the previous decision.
+ *
+ * The detector shall be set before the pipeline is configured.
+ *
+ * \return The detector
+ */
+MotionDetector *Pipeline::setMotionDetector(std::unique_ptr<MotionDetector> detector,
+					    const Stream *stream)
+{
+	detector_ = std::move(detector);
+	detector_->selectStream(stream);
+	return detector_.get();
+}
+
+int Pipeline::configure(const libcamera::CameraConfiguration &config)
+{
+	if (detector_) {
+		int ret = detector_->configure(config);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (std::unique_ptr<Stage> &stage : stages_) {
+		int ret = stage->sink->configure(config);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+void Pipeline::mapBuffer(const Stream *stream, FrameBuffer *buffer)
+{
+	for (std::unique_ptr<Stage> &stage : stages_) {
+		if (stage->sink->selected(stream))
+			stage->sink->mapBuffer(stream, buffer);
+	}
+}
+
+int Pipeline::start()
+{
+	for (std::unique_ptr<Stage> &stage : stages_) {
+		int ret = stage->sink->start();
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Wait for the stages to process their queues, and stop them
+ *
+ * All the requests held by the pipeline are released when this function
+ * returns.
+ */
+int Pipeline::stop()
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		cond_.wait(locker, [&] {
+			return std::none_of(stages_.begin(), stages_.end(),
+					    [](const std::unique_ptr<Stage> &stage) {
+						    return stage->scheduled || stage->count;
+					    });
+		});
+	}
+
+	/* Stopping a sink releases the requests it still holds. */
+	for (std::unique_ptr<Stage> &stage : stages_)
+		stage->sink->stop();
+
+	std::unique_lock<std::mutex> locker(lock_);
+	cond_.wait(locker, [&] { return references_.empty(); });
+
+	return FrameSink::stop();
+}
+
+bool Pipeline::processRequest(FrameRequest *request)
+{
+	if (stages_.empty())
+		return true;
+
+	bool moving = true;
+	if (detector_) {
+		TRACE_SCOPE("pipeline", "motion", request->sequence());
+		detector_->processRequest(request);
+		moving = detector_->moving();
+	}
+
+	const FrameRequest::BufferMap &buffers = request->buffers();
+	auto routed = [&buffers](const Stage *stage) {
+		const Stream *stream = stage->sink->stream();
+		return !stream || buffers.count(stream);
+	};
+
+	unsigned int count = std::count_if(stages_.begin(), stages_.end(),
+					   [&](const std::unique_ptr<Stage> &stage) {
+						   return routed(stage.get());
+					   });
+
+	std::unique_lock<std::mutex> locker(lock_);
+
+	/* Hold an extra reference until the request is queued to all stages. */
+	references_.push_back({ request, count + 1 });
+
+	for (std::unique_ptr<Stage> &stage : stages_) {
+		if (routed(stage.get()))
+			enqueue(stage.get(), request, moving, locker);
+	}
+
+	unref(request, locker);
+
+	return false;
+}
+
+/**
+ * \brief Retrieve the queue depths and activity of the stages
+ */
+std::vector<Pipeline::StageStats> Pipeline::stats() const
+{
+	std::vector<StageStats> stats;
+	std::unique_lock<std::mutex> locker(lock_);
+
+	for (const std::unique_ptr<Stage> &stage : stages_)
+		stats.push_back({ stage->name, static_cast<unsigned int>(stage->count),
+				  stage->maxQueued, stage->active, stage->processed,
+				  stage->dropped });
+
+	return stats;
+}
+
+/**
+ * \brief Print the queue depth, activity, drops and latency of each stage
+ */
+void Pipeline::report(std::ostream &out) const
+{
+	for (const StageStats &stage : stats()) {
+		out << std::setw(10) << stage.name
+		    << " queued " << stage.queued
+		    << " (max " << stage.maxQueued << ")"
+		    << " active " << stage.active
+		    << " processed " << stage.processed
+		    << " dropped";
+
+		for (unsigned int i = 0; i < DropReasonCount; ++i)
+			out << " " << dropReasonName(static_cast<DropReason>(i))
+			    << " " << stage.dropped[i];
+
+		out << std::endl;
+	}
+
+	for (const std::unique_ptr<Stage> &stage : stages_) {
+		out << std::setw(10) << stage->name << " latency ";
+		stage->latency.report(out);
+	}
+}
+
+const char *Pipeline::dropReasonName(DropReason reason)
+{
+	switch (reason) {
+	case DropQueueFull:
+		return "full";
+	case DropDecimated:
+		return "decimated";
+	case DropLate:
+		return "late";
+	case DropStatic:
+		return "static";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Queue a request to a stage, and schedule the stage if it is idle. The
+ * request may be dropped, or wait for room in the queue, as dictated by the
+ * stage policy.
+ */
+void Pipeline::enqueue(Stage *stage, FrameRequest *request, bool moving,
+		       std::unique_lock<std::mutex> &locker)
+{
+	const Policy &policy = stage->policy;
+
+	/* Decimate the moving frames only. */
+	if (policy.gated && !moving) {
+		drop(stage, request, DropStatic, locker);
+		return;
+	}
+
+	if (stage->received++ % policy.keepEvery) {
+		drop(stage, request, DropDecimated, locker);
+		return;
+	}
+
+	if (policy.budget.count() && age(request) > policy.budget) {
+		drop(stage, request, DropLate, locker);
+		return;
+	}
+
+	if (policy.maxQueued && stage->count >= policy.maxQueued) {
+		switch (policy.overflow) {
+		case Overflow::Block:
+			cond_.wait(locker, [&] { return stage->count < policy.maxQueued; });
+			break;
+
+		case Overflow::DropOldest: {
+			FrameRequest *oldest = stage->queue[stage->head];
+			stage->head = (stage->head + 1) % stage->queue.size();
+			stage->count--;
+			drop(stage, oldest, DropQueueFull, locker);
+			break;
+		}
+
+		case Overflow::DropNewest:
+			drop(stage, request, DropQueueFull, locker);
+			return;
+		}
+	}
+
+	/* The queue only grows when more requests are in flight than ever. */
+	if (stage->count == stage->queue.size()) {
+		std::vector<FrameRequest *> queue(stage->queue.size() * 2);
+		for (size_t i = 0; i < stage->count; ++i)
+			queue[i] = stage->queue[(stage->head + i) % stage->queue.size()];
+
+		stage->queue = std::move(queue);
+		stage->head = 0;
+	}
+
+	stage->queue[(stage->head + stage->count) % stage->queue.size()] = request;
+	stage->count++;
+	stage->maxQueued = std::max<unsigned int>(stage->maxQueued, stage->count);
+
+	if (stage->scheduled)
+		return;
+
+	stage->scheduled = true;
+	executor_.submit([this, stage]() { run(stage); });
+}
+
+/* Executor task, process a batch of requests from the queue of a stage. */
+void Pipeline::run(Stage *stage)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	unsigned int batch = 0;
+
+	/* A busy sink schedules the stage again when it releases a request. */
+	while (stage->count && (!stage->capacity || stage->active < stage->capacity)) {
+		/* Yield to the tasks of other stages, and run again after them. */
+		if (batch++ == kStageBatchSize) {
+			executor_.submit([this, stage]() { run(stage); });
+			return;
+		}
+
+		FrameRequest *request = stage->queue[stage->head];
+		stage->head = (stage->head + 1) % stage->queue.size();
+		stage->count--;
+
+		/* Wake up a caller blocked on a full queue. */
+		if (stage->policy.maxQueued)
+			cond_.notify_all();
+
+		std::chrono::nanoseconds delay = age(request);
+		if (stage->policy.budget.count() && delay > stage->policy.budget) {
+			drop(stage, request, DropLate, locker);
+			continue;
+		}
+
+		stage->active++;
+
+		locker.unlock();
+		if (delay.count() >= 0)
+			stage->latency.record(delay);
+
+		bool done;
+		{
+			TRACE_SCOPE("pipeline", stage->traceName, request->sequence());
+			done = stage->sink->processRequest(request);
+		}
+		if (done)
+			release(stage, request);
+		locker.lock();
+	}
+
+	stage->scheduled = false;
+	cond_.notify_all();
+}
+
+/* A stage is done with a request, which may be called from any thread. */
+void Pipeline::release(Stage *stage, FrameRequest *request)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	stage->active--;
+	stage->processed++;
+
+	/* Resume a stage whose sink was full. */
+	if (stage->count && !stage->scheduled) {
+		stage->scheduled = true;
+		executor_.submit([this, stage]() { run(stage); });
+	}
+
+	unref(request, locker);
+}
+
+/* A stage skips a request, which may release it. */
+void Pipeline::drop(Stage *stage, FrameRequest *request, DropReason reason,
+		    std::unique_lock<std::mutex> &locker)
+{
+	stage->dropped[reason]++;
+	unref(request, locker);
+}
+
+void Pipeline::unref(FrameRequest *request, std::unique_lock<std::mutex> &locker)
+{
+	auto iter = std::find_if(references_.begin(), references_.end(),
+				 [request](const Reference &ref) {
+					 return ref.request == request && ref.count;
+				 });
+	if (iter == references_.end() || --iter->count)
+		return;
+
+	locker.unlock();
+	requestProcessed.emit(request);
+	locker.lock();
+
+	/*
+	 * Drop the reference once the signal has been delivered, for stop() to
+	 * wait for it. The request may have been queued again in the meantime,
+	 * look for the released reference.
+	 */
+	iter = std::find_if(references_.begin(), references_.end(),
+			    [request](const Reference &ref) {
+				    return ref.request == request && !ref.count;
+			    });
+	*iter = references_.back();
+	references_.pop_back();
+	cond_.notify_all();
+}
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pipeline.h - Fan-out of requests to concurrent frame sink stages
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame_sink.h"
+#include "stats.h"
+
+class MotionDetector;
+class ThreadPool;
+
+class Pipeline : public FrameSink
+{
+public:
+	enum class Overflow {
+		Block,
+		DropOldest,
+		DropNewest,
+	};
+
+	/* How a stage sheds load when it falls behind */
+	struct Policy {
+		Overflow overflow = Overflow::Block;
+		/* Maximum number of queued requests, 0 for unbounded */
+		unsigned int maxQueued = 0;
+		/* Process one request out of keepEvery */
+		unsigned int keepEvery = 1;
+		/* Maximum delay from capture to processing, 0 for none */
+		std::chrono::nanoseconds budget{ 0 };
+		/* Skip the requests the motion detector finds static */
+		bool gated = false;
+	};
+
+	enum DropReason {
+		DropQueueFull,
+		DropDecimated,
+		DropLate,
+		DropStatic,
+		DropReasonCount,
+	};
+
+	struct StageStats {
+		std::string name;
+		unsigned int queued;
+		unsigned int maxQueued;
+		unsigned int active;
+		uint64_t processed;
+		std::array<uint64_t, DropReasonCount> dropped;
+	};
+
+	explicit Pipeline(ThreadPool &executor);
+	~Pipeline();
+
+	template<typename Sink>
+	Sink *add(const std::string &name, std::unique_ptr<Sink> sink,
+		  const Policy &policy = {},
+		  const libcamera::Stream *stream = nullptr)
+	{
+		Sink *stage = sink.get();
+		addStage(name, std::move(sink), policy, stream);
+		return stage;
+	}
+
+	MotionDetector *setMotionDetector(std::unique_ptr<MotionDetector> detector,
+					  const libcamera::Stream *stream = nullptr);
+
+	int configure(const libcamera::CameraConfiguration &config) override;
+	void mapBuffer(const libcamera::Stream *stream,
+		       libcamera::FrameBuffer *buffer) override;
+
+	int start() override;
+	int stop() override;
+
+	bool processRequest(FrameRequest *request) override;
+
+	std::vector<StageStats> stats() const;
+	void report(std::ostream &out) const;
+
+	static const char *dropReasonName(DropReason reason);
+
+private:
+	struct Stage {
+		Pipeline *pipeline;
+		std::string name;
+		const char *traceName;
+		std::unique_ptr<FrameSink> sink;
+		Policy policy;
+
+		/* Ring of requests waiting for the stage, processed in order */
+		std::vector<FrameRequest *> queue;
+		size_t head;
+		size_t count;
+		bool scheduled;
+		/* Requests the sink holds at most, 0 for no limit */
+		unsigned int capacity;
+
+		unsigned int maxQueued;
+		unsigned int active;
+		uint64_t processed;
+		uint64_t received;
+		std::array<uint64_t, DropReasonCount> dropped;
+
+		/* Delay from capture to the start of processing */
+		LatencyStats latency;
+	};
+
+	struct Reference {
+		FrameRequest *request;
+		unsigned int count;
+	};
+
+	void addStage(const std::string &name, std::unique_ptr<FrameSink> sink,
+		      const Policy &policy, const libcamera::Stream *stream);
+	void enqueue(Stage *stage, FrameRequest *request, bool moving,
+		     std::unique_lock<std::mutex> &locker);
+	void run(Stage *stage);
+	void release(Stage *stage, FrameRequest *request);
+	void drop(Stage *stage, FrameRequest *request, DropReason reason,
+		  std::unique_lock<std::mutex> &locker);
+	void unref(FrameRequest *request, std::unique_lock<std::mutex> &locker);
+
+	ThreadPool &executor_;
+	std::vector<std::unique_ptr<Stage>> stages_;
+	std::unique_ptr<MotionDetector> detector_;
+
+	mutable std::mutex lock_;
+	std::condition_variable cond_;
+	std::vector<Reference> references_;
+};
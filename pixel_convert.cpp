@@ -0,0 +1,461 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert.cpp - Pixel format conversion kernels
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+
+#include <libcamera/formats.h>
+
+#include "image.h"
+#include "pixel_convert.h"
+#include "pixel_convert_kernels.h"
+
+using namespace libcamera;
+
+/**
+ * \namespace convert
+ * \brief Conversions between the YUV and RGB pixel formats used by cameras
+ *
+ * The conversions are built on a small set of row kernels, implemented in
+ * plain C++ as a reference and with SSE2, AVX2 and NEON intrinsics. The best
+ * implementation supported by the CPU is selected at runtime. All
+ * implementations are bit-exact with the scalar reference.
+ *
+ * Conversions read and write planes described by a pointer and a stride, which
+ * lets them operate directly on the mapped frame buffers.
+ *
+ * The same kernels also provide cheap statistics on the luma plane, for the
+ * analysis of frames.
+ */
+
+namespace convert {
+
+namespace {
+
+uint8_t clamp(int value)
+{
+	return std::min(std::max(value, 0), 255);
+}
+
+void splitUVScalar(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	for (unsigned int i = 0; i < width; ++i) {
+		u[i] = uv[2 * i];
+		v[i] = uv[2 * i + 1];
+	}
+}
+
+void packedToYScalar(const uint8_t *src, uint8_t *y, unsigned int width,
+		     unsigned int yOffset)
+{
+	for (unsigned int i = 0; i < width; ++i)
+		y[i] = src[2 * i + yOffset];
+}
+
+void packedToUVScalar(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+		      uint8_t *v, unsigned int width, unsigned int yOffset)
+{
+	unsigned int c = 1 - yOffset;
+
+	for (unsigned int i = 0; i < width / 2; ++i) {
+		u[i] = (src0[4 * i + c] + src1[4 * i + c] + 1) >> 1;
+		v[i] = (src0[4 * i + c + 2] + src1[4 * i + c + 2] + 1) >> 1;
+	}
+}
+
+template<unsigned int R, unsigned int G, unsigned int B, int A>
+void yuvToRgbScalar(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		    uint8_t *dst, unsigned int width)
+{
+	constexpr unsigned int bpp = A < 0 ? 3 : 4;
+
+	for (unsigned int x = 0; x < width; ++x, dst += bpp) {
+		int y64 = y[x] * 64 + 32;
+		int cu = u[x / 2] - 128;
+		int cv = v[x / 2] - 128;
+
+		dst[R] = clamp((y64 + kCoefRV * cv) >> 6);
+		dst[G] = clamp((y64 - kCoefGU * cu - kCoefGV * cv) >> 6);
+		dst[B] = clamp((y64 + kCoefBU * cu) >> 6);
+		if constexpr (A >= 0)
+			dst[A] = 0xff;
+	}
+}
+
+void sumBlocksScalar(const uint8_t *src, uint32_t *sums, unsigned int blocks)
+{
+	for (unsigned int i = 0; i < blocks; ++i, src += kBlockSize) {
+		uint32_t sum = 0;
+		for (unsigned int j = 0; j < kBlockSize; ++j)
+			sum += src[j];
+		sums[i] += sum;
+	}
+}
+
+std::atomic<const Kernels *> activeKernels{ nullptr };
+std::atomic<Isa> activeIsa{ Isa::Scalar };
+
+const Kernels *kernelsFor(Isa isa)
+{
+	switch (isa) {
+	case Isa::Scalar:
+		return &scalarKernels;
+	case Isa::SSE2:
+		return sse2Kernels();
+	case Isa::AVX2:
+		return avx2Kernels();
+	case Isa::NEON:
+		return neonKernels();
+	}
+
+	return nullptr;
+}
+
+const Kernels &kernels()
+{
+	const Kernels *k = activeKernels.load(std::memory_order_acquire);
+	if (k)
+		return *k;
+
+	setIsa(bestIsa());
+	return *activeKernels.load(std::memory_order_acquire);
+}
+
+void copyPlane(const ConstPlane &src, const Plane &dst, unsigned int width,
+	       unsigned int height)
+{
+	for (unsigned int row = 0; row < height; ++row)
+		memcpy(dst.data + row * dst.stride, src.data + row * src.stride, width);
+}
+
+void semiPlanarToI420(const ConstPlane &y, const ConstPlane &uv, uint8_t *u,
+		      unsigned int uStride, uint8_t *v, unsigned int vStride,
+		      const Plane &dstY, unsigned int width, unsigned int height)
+{
+	copyPlane(y, dstY, width, height);
+	splitChroma(uv, { u, uStride }, { v, vStride }, width, height);
+}
+
+void packedToI420(const ConstPlane &src, const Plane dst[3], unsigned int width,
+		  unsigned int height, unsigned int yOffset)
+{
+	const Kernels &k = kernels();
+
+	for (unsigned int row = 0; row < height; row += 2) {
+		const uint8_t *src0 = src.data + row * src.stride;
+		const uint8_t *src1 = row + 1 < height ? src0 + src.stride : src0;
+
+		k.packedToY(src0, dst[0].data + row * dst[0].stride, width, yOffset);
+		if (row + 1 < height)
+			k.packedToY(src1, dst[0].data + (row + 1) * dst[0].stride,
+				    width, yOffset);
+
+		k.packedToUV(src0, src1, dst[1].data + row / 2 * dst[1].stride,
+			     dst[2].data + row / 2 * dst[2].stride, width, yOffset);
+	}
+}
+
+} /* namespace */
+
+const Kernels scalarKernels = {
+	splitUVScalar,
+	packedToYScalar,
+	packedToUVScalar,
+	yuvToRgbScalar<0, 1, 2, -1>,
+	yuvToRgbScalar<2, 1, 0, 3>,
+	sumBlocksScalar,
+};
+
+/**
+ * \brief Retrieve the fastest instruction set supported by the CPU
+ */
+Isa bestIsa()
+{
+	for (Isa isa : { Isa::AVX2, Isa::NEON, Isa::SSE2 }) {
+		if (kernelsFor(isa))
+			return isa;
+	}
+
+	return Isa::Scalar;
+}
+
+/**
+ * \brief Retrieve the instruction set used by the conversions
+ */
+Isa isa()
+{
+	kernels();
+	return activeIsa.load(std::memory_order_relaxed);
+}
+
+/**
+ * \brief Select the instruction set used by the conversions
+ * \param[in] isa The instruction set
+ *
+ * This is meant for benchmarking and validation, the fastest instruction set
+ * is otherwise selected automatically.
+ *
+ * \return True if \a isa is supported and has been selected, false otherwise
+ */
+bool setIsa(Isa isa)
+{
+	const Kernels *k = kernelsFor(isa);
+	if (!k)
+		return false;
+
+	activeIsa.store(isa, std::memory_order_relaxed);
+	activeKernels.store(k, std::memory_order_release);
+	return true;
+}
+
+const char *isaName(Isa isa)
+{
+	switch (isa) {
+	case Isa::Scalar:
+		return "scalar";
+	case Isa::SSE2:
+		return "sse2";
+	case Isa::AVX2:
+		return "avx2";
+	case Isa::NEON:
+		return "neon";
+	}
+
+	return "unknown";
+}
+
+/**
+ * \brief Check if frames in \a format can be converted to I420
+ */
+bool canConvertToI420(const PixelFormat &format)
+{
+	return format == formats::YUV420 || format == formats::YVU420 ||
+	       format == formats::NV12 || format == formats::NV21 ||
+	       format == formats::YUYV || format == formats::UYVY;
+}
+
+/**
+ * \brief Locate the planes of a mapped frame
+ * \param[in] image The mapped frame buffer
+ * \param[in] format The frame pixel format
+ * \param[in] stride The stride of the first plane, as reported by the
+ * StreamConfiguration
+ * \param[in] height The frame height
+ * \param[out] planes The planes, unused entries are set to nullptr
+ *
+ * Multi-planar formats may be exposed by the camera as a single contiguous
+ * plane, in which case the location of the chroma planes is computed from the
+ * stride and height.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int planesFromImage(const Image &image, const PixelFormat &format,
+		    unsigned int stride, unsigned int height, ConstPlane planes[3])
+{
+	planes[0] = { image.data(0).data(), stride };
+	planes[1] = { nullptr, 0 };
+	planes[2] = { nullptr, 0 };
+
+	if (format == formats::YUYV || format == formats::UYVY ||
+	    format == formats::MJPEG)
+		return 0;
+
+	if (format == formats::NV12 || format == formats::NV21) {
+		planes[1].stride = stride;
+		planes[1].data = image.numPlanes() > 1
+			       ? image.data(1).data()
+			       : planes[0].data + stride * height;
+		return 0;
+	}
+
+	if (format == formats::YUV420 || format == formats::YVU420) {
+		unsigned int chromaStride = stride / 2;
+
+		planes[1].stride = chromaStride;
+		planes[2].stride = chromaStride;
+		if (image.numPlanes() >= 3) {
+			planes[1].data = image.data(1).data();
+			planes[2].data = image.data(2).data();
+		} else {
+			planes[1].data = planes[0].data + stride * height;
+			planes[2].data = planes[1].data + chromaStride * ((height + 1) / 2);
+		}
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * \brief Convert a frame to planar YUV 4:2:0
+ * \param[in] format The source pixel format
+ * \param[in] src The source planes
+ * \param[in] dst The Y, U and V destination planes
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ *
+ * Chroma of packed 4:2:2 formats is vertically downsampled by averaging pairs
+ * of rows.
+ *
+ * \return 0 on success or -EINVAL if the format isn't supported
+ */
+int toI420(const PixelFormat &format, const ConstPlane src[3],
+	   const Plane dst[3], unsigned int width, unsigned int height)
+{
+	if (format == formats::YUV420 || format == formats::YVU420) {
+		bool swap = format == formats::YVU420;
+		unsigned int chromaWidth = (width + 1) / 2;
+		unsigned int chromaHeight = (height + 1) / 2;
+
+		copyPlane(src[0], dst[0], width, height);
+		copyPlane(src[1], dst[swap ? 2 : 1], chromaWidth, chromaHeight);
+		copyPlane(src[2], dst[swap ? 1 : 2], chromaWidth, chromaHeight);
+	} else if (format == formats::NV12) {
+		nv12ToI420(src[0], src[1], dst, width, height);
+	} else if (format == formats::NV21) {
+		nv21ToI420(src[0], src[1], dst, width, height);
+	} else if (format == formats::YUYV) {
+		yuyvToI420(src[0], dst, width, height);
+	} else if (format == formats::UYVY) {
+		uyvyToI420(src[0], dst, width, height);
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Extract the luma plane of a YUV frame
+ * \param[in] format The source pixel format
+ * \param[in] src The source planes
+ * \param[in] dst The destination plane
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ * \return 0 on success or -EINVAL if the format isn't supported
+ */
+int extractY(const PixelFormat &format, const ConstPlane src[3],
+	     const Plane &dst, unsigned int width, unsigned int height)
+{
+	if (format == formats::YUYV || format == formats::UYVY) {
+		const Kernels &k = kernels();
+		unsigned int yOffset = format == formats::UYVY ? 1 : 0;
+
+		for (unsigned int row = 0; row < height; ++row)
+			k.packedToY(src[0].data + row * src[0].stride,
+				    dst.data + row * dst.stride, width, yOffset);
+		return 0;
+	}
+
+	if (!canConvertToI420(format))
+		return -EINVAL;
+
+	copyPlane(src[0], dst, width, height);
+	return 0;
+}
+
+void nv12ToI420(const ConstPlane &y, const ConstPlane &uv, const Plane dst[3],
+		unsigned int width, unsigned int height)
+{
+	semiPlanarToI420(y, uv, dst[1].data, dst[1].stride, dst[2].data,
+			 dst[2].stride, dst[0], width, height);
+}
+
+void nv21ToI420(const ConstPlane &y, const ConstPlane &vu, const Plane dst[3],
+		unsigned int width, unsigned int height)
+{
+	semiPlanarToI420(y, vu, dst[2].data, dst[2].stride, dst[1].data,
+			 dst[1].stride, dst[0], width, height);
+}
+
+/**
+ * \brief Split the interleaved chroma plane of a semi-planar 4:2:0 frame
+ * \param[in] uv The chroma plane, in NV12 order
+ * \param[in] u The first chroma destination plane
+ * \param[in] v The second chroma destination plane
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ *
+ * The dimensions are the ones of the luma plane. NV21 chroma is split by
+ * swapping \a u and \a v.
+ */
+void splitChroma(const ConstPlane &uv, const Plane &u, const Plane &v,
+		 unsigned int width, unsigned int height)
+{
+	const Kernels &k = kernels();
+	unsigned int chromaWidth = (width + 1) / 2;
+
+	for (unsigned int row = 0; row < (height + 1) / 2; ++row)
+		k.splitUV(uv.data + row * uv.stride, u.data + row * u.stride,
+			  v.data + row * v.stride, chromaWidth);
+}
+
+void yuyvToI420(const ConstPlane &src, const Plane dst[3],
+		unsigned int width, unsigned int height)
+{
+	packedToI420(src, dst, width, height, 0);
+}
+
+void uyvyToI420(const ConstPlane &src, const Plane dst[3],
+		unsigned int width, unsigned int height)
+{
+	packedToI420(src, dst, width, height, 1);
+}
+
+void i420ToRgb24(const ConstPlane src[3], const Plane &dst,
+		 unsigned int width, unsigned int height)
+{
+	const Kernels &k = kernels();
+
+	for (unsigned int row = 0; row < height; ++row)
+		k.yuvToRgb24(src[0].data + row * src[0].stride,
+			     src[1].data + row / 2 * src[1].stride,
+			     src[2].data + row / 2 * src[2].stride,
+			     dst.data + row * dst.stride, width);
+}
+
+void i420ToBgra(const ConstPlane src[3], const Plane &dst,
+		unsigned int width, unsigned int height)
+{
+	const Kernels &k = kernels();
+
+	for (unsigned int row = 0; row < height; ++row)
+		k.yuvToBgra(src[0].data + row * src[0].stride,
+			    src[1].data + row / 2 * src[1].stride,
+			    src[2].data + row / 2 * src[2].stride,
+			    dst.data + row * dst.stride, width);
+}
+
+/**
+ * \brief Sum the luma of a frame over a grid of blocks
+ * \param[in] y The luma plane
+ * \param[in] width The frame width
+ * \param[in] height The frame height
+ * \param[in] rowStep Only sum one row out of \a rowStep
+ * \param[out] sums The sums, for width / kBlockSize blocks per row of blocks
+ * and height / kBlockSize rows of blocks
+ *
+ * Blocks are kBlockSize pixels wide and high, the partial blocks at the right
+ * and bottom edges are ignored. Skipping rows reduces the memory traffic,
+ * each block sums kBlockSize pixels of kBlockSize / rowStep rows when
+ * \a rowStep divides kBlockSize.
+ */
+void sumBlocks(const ConstPlane &y, unsigned int width, unsigned int height,
+	       unsigned int rowStep, uint32_t *sums)
+{
+	const Kernels &k = kernels();
+	unsigned int columns = width / kBlockSize;
+	unsigned int rows = height / kBlockSize;
+
+	std::fill(sums, sums + columns * rows, 0);
+
+	for (unsigned int row = 0; row < rows * kBlockSize; row += std::max(rowStep, 1U))
+		k.sumBlocks(y.data + row * y.stride, sums + row / kBlockSize * columns,
+			    columns);
+}
+
+} /* namespace convert */
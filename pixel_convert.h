@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert.h - Pixel format conversion kernels
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <libcamera/pixel_format.h>
+
+class Image;
+
+namespace convert {
+
+enum class Isa {
+	Scalar,
+	SSE2,
+	AVX2,
+	NEON,
+};
+
+Isa bestIsa();
+Isa isa();
+bool setIsa(Isa isa);
+const char *isaName(Isa isa);
+
+/* Size of the blocks of sumBlocks(), in pixels */
+constexpr unsigned int kBlockSize = 16;
+
+struct Plane {
+	uint8_t *data;
+	unsigned int stride;
+};
+
+struct ConstPlane {
+	const uint8_t *data;
+	unsigned int stride;
+};
+
+bool canConvertToI420(const libcamera::PixelFormat &format);
+int planesFromImage(const Image &image, const libcamera::PixelFormat &format,
+		    unsigned int stride, unsigned int height, ConstPlane planes[3]);
+
+int toI420(const libcamera::PixelFormat &format, const ConstPlane src[3],
+	   const Plane dst[3], unsigned int width, unsigned int height);
+int extractY(const libcamera::PixelFormat &format, const ConstPlane src[3],
+	     const Plane &dst, unsigned int width, unsigned int height);
+
+void nv12ToI420(const ConstPlane &y, const ConstPlane &uv, const Plane dst[3],
+		unsigned int width, unsigned int height);
+void nv21ToI420(const ConstPlane &y, const ConstPlane &vu, const Plane dst[3],
+		unsigned int width, unsigned int height);
+void splitChroma(const ConstPlane &uv, const Plane &u, const Plane &v,
+		 unsigned int width, unsigned int height);
+void yuyvToI420(const ConstPlane &src, const Plane dst[3],
+		unsigned int width, unsigned int height);
+void uyvyToI420(const ConstPlane &src, const Plane dst[3],
+		unsigned int width, unsigned int height);
+
+void i420ToRgb24(const ConstPlane src[3], const Plane &dst,
+		 unsigned int width, unsigned int height);
+void i420ToBgra(const ConstPlane src[3], const Plane &dst,
+		unsigned int width, unsigned int height);
+
+void sumBlocks(const ConstPlane &y, unsigned int width, unsigned int height,
+	       unsigned int rowStep, uint32_t *sums);
+
+} /* namespace convert */
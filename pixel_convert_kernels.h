@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert_kernels.h - Row kernels of the pixel format conversions
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace convert {
+
+/*
+ * Every implementation of a kernel shall produce exactly the same output as
+ * the scalar reference. Colour conversion uses full range BT.601 (JPEG)
+ * coefficients in 6-bit fixed point, with all intermediate values fitting in
+ * 16 bits so that SIMD implementations can use 16-bit lanes.
+ */
+struct Kernels {
+	/* Deinterleave \a width chroma pairs into two planes */
+	void (*splitUV)(const uint8_t *uv, uint8_t *u, uint8_t *v,
+			unsigned int width);
+	/* Extract luma of \a width pixels from a packed 4:2:2 row */
+	void (*packedToY)(const uint8_t *src, uint8_t *y, unsigned int width,
+			  unsigned int yOffset);
+	/* Average the chroma of two packed 4:2:2 rows of \a width pixels */
+	void (*packedToUV)(const uint8_t *src0, const uint8_t *src1,
+			   uint8_t *u, uint8_t *v, unsigned int width,
+			   unsigned int yOffset);
+	/* Convert a row of \a width 4:2:0 pixels to RGB */
+	void (*yuvToRgb24)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+			   uint8_t *dst, unsigned int width);
+	void (*yuvToBgra)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+			  uint8_t *dst, unsigned int width);
+	/* Add the sums of \a blocks runs of kBlockSize pixels of a row to \a sums */
+	void (*sumBlocks)(const uint8_t *src, uint32_t *sums, unsigned int blocks);
+};
+
+constexpr int kCoefRV = 90;	/* 1.402 * 64 */
+constexpr int kCoefGU = 22;	/* 0.344136 * 64 */
+constexpr int kCoefGV = 46;	/* 0.714136 * 64 */
+constexpr int kCoefBU = 113;	/* 1.772 * 64 */
+
+extern const Kernels scalarKernels;
+
+/* Return nullptr when the instruction set isn't compiled in */
+const Kernels *sse2Kernels();
+const Kernels *avx2Kernels();
+const Kernels *neonKernels();
+
+} /* namespace convert */
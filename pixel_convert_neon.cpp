@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert_neon.cpp - NEON pixel format conversion kernels
+ */
+
+#include "pixel_convert_kernels.h"
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+namespace convert {
+
+namespace {
+
+void splitUVNeon(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	unsigned int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		uint8x16x2_t c = vld2q_u8(uv + 2 * i);
+		vst1q_u8(u + i, c.val[0]);
+		vst1q_u8(v + i, c.val[1]);
+	}
+
+	scalarKernels.splitUV(uv + 2 * i, u + i, v + i, width - i);
+}
+
+void packedToYNeon(const uint8_t *src, uint8_t *y, unsigned int width,
+		   unsigned int yOffset)
+{
+	unsigned int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		uint8x16x2_t c = vld2q_u8(src + 2 * i);
+		vst1q_u8(y + i, c.val[yOffset]);
+	}
+
+	scalarKernels.packedToY(src + 2 * i, y + i, width - i, yOffset);
+}
+
+void packedToUVNeon(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+		    uint8_t *v, unsigned int width, unsigned int yOffset)
+{
+	/* Position of U and V in the Y0 U Y1 V or U Y0 V Y1 macropixels */
+	unsigned int cu = 1 - yOffset;
+	unsigned int cv = cu + 2;
+	unsigned int i = 0;
+
+	for (; i + 32 <= width; i += 32) {
+		uint8x16x4_t a = vld4q_u8(src0 + 2 * i);
+		uint8x16x4_t b = vld4q_u8(src1 + 2 * i);
+
+		vst1q_u8(u + i / 2, vrhaddq_u8(a.val[cu], b.val[cu]));
+		vst1q_u8(v + i / 2, vrhaddq_u8(a.val[cv], b.val[cv]));
+	}
+
+	scalarKernels.packedToUV(src0 + 2 * i, src1 + 2 * i, u + i / 2, v + i / 2,
+				 width - i, yOffset);
+}
+
+/* Compute 8 pixels of one channel in 16-bit lanes and saturate to bytes. */
+inline uint8x8_t yuvChannel(int16x8_t y64, int16x8_t u, int16x8_t v,
+			    int16_t cu, int16_t cv)
+{
+	int16x8_t c = vmlaq_n_s16(y64, u, cu);
+	c = vmlaq_n_s16(c, v, cv);
+	return vqmovun_s16(vshrq_n_s16(c, 6));
+}
+
+/* Compute 16 pixels of R, G and B. */
+inline void yuvToRgb16(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		       uint8x16_t &r, uint8x16_t &g, uint8x16_t &b)
+{
+	uint8x16_t yy = vld1q_u8(y);
+	uint8x8x2_t uu = vzip_u8(vld1_u8(u), vld1_u8(u));
+	uint8x8x2_t vv = vzip_u8(vld1_u8(v), vld1_u8(v));
+
+	uint8x8_t rgb[3][2];
+
+	for (unsigned int i = 0; i < 2; ++i) {
+		uint8x8_t yh = i ? vget_high_u8(yy) : vget_low_u8(yy);
+		int16x8_t y64 = vreinterpretq_s16_u16(vshll_n_u8(yh, 6));
+		y64 = vaddq_s16(y64, vdupq_n_s16(32));
+
+		int16x8_t cu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uu.val[i])),
+					 vdupq_n_s16(128));
+		int16x8_t cv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vv.val[i])),
+					 vdupq_n_s16(128));
+
+		rgb[0][i] = yuvChannel(y64, cu, cv, 0, kCoefRV);
+		rgb[1][i] = yuvChannel(y64, cu, cv, -kCoefGU, -kCoefGV);
+		rgb[2][i] = yuvChannel(y64, cu, cv, kCoefBU, 0);
+	}
+
+	r = vcombine_u8(rgb[0][0], rgb[0][1]);
+	g = vcombine_u8(rgb[1][0], rgb[1][1]);
+	b = vcombine_u8(rgb[2][0], rgb[2][1]);
+}
+
+void yuvToRgb24Neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		    uint8_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t rgb;
+
+		yuvToRgb16(y + x, u + x / 2, v + x / 2, rgb.val[0], rgb.val[1],
+			   rgb.val[2]);
+		vst3q_u8(dst + 3 * x, rgb);
+	}
+
+	scalarKernels.yuvToRgb24(y + x, u + x / 2, v + x / 2, dst + 3 * x, width - x);
+}
+
+void yuvToBgraNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		   uint8_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t bgra;
+
+		yuvToRgb16(y + x, u + x / 2, v + x / 2, bgra.val[2], bgra.val[1],
+			   bgra.val[0]);
+		bgra.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8(dst + 4 * x, bgra);
+	}
+
+	scalarKernels.yuvToBgra(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+void sumBlocksNeon(const uint8_t *src, uint32_t *sums, unsigned int blocks)
+{
+	for (unsigned int i = 0; i < blocks; ++i) {
+		uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(src + 16 * i))));
+		sums[i] += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+	}
+}
+
+const Kernels neon = {
+	splitUVNeon,
+	packedToYNeon,
+	packedToUVNeon,
+	yuvToRgb24Neon,
+	yuvToBgraNeon,
+	sumBlocksNeon,
+};
+
+} /* namespace */
+
+const Kernels *neonKernels()
+{
+	return &neon;
+}
+
+} /* namespace convert */
+
+#else /* __ARM_NEON */
+
+namespace convert {
+
+const Kernels *neonKernels()
+{
+	return nullptr;
+}
+
+} /* namespace convert */
+
+#endif /* __ARM_NEON */
@@ -0,0 +1,467 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert_x86.cpp - SSE2 and AVX2 pixel format conversion kernels
+ */
+
+#include "pixel_convert_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+namespace convert {
+
+namespace {
+
+/* -----------------------------------------------------------------------------
+ * SSE2
+ */
+
+__attribute__((target("sse2")))
+void splitUVSse2(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	unsigned int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + 2 * i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + 2 * i + 16));
+
+		__m128i uu = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+		__m128i vv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(u + i), uu);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(v + i), vv);
+	}
+
+	scalarKernels.splitUV(uv + 2 * i, u + i, v + i, width - i);
+}
+
+/* Keep the even (offset 0) or odd (offset 1) bytes of each 16-bit lane. */
+__attribute__((target("sse2")))
+inline __m128i selectBytes(__m128i x, unsigned int offset)
+{
+	return offset ? _mm_srli_epi16(x, 8)
+		      : _mm_and_si128(x, _mm_set1_epi16(0x00ff));
+}
+
+__attribute__((target("sse2")))
+void packedToYSse2(const uint8_t *src, uint8_t *y, unsigned int width,
+		   unsigned int yOffset)
+{
+	unsigned int i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i + 16));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(y + i),
+				 _mm_packus_epi16(selectBytes(a, yOffset),
+						  selectBytes(b, yOffset)));
+	}
+
+	scalarKernels.packedToY(src + 2 * i, y + i, width - i, yOffset);
+}
+
+__attribute__((target("sse2")))
+void packedToUVSse2(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+		    uint8_t *v, unsigned int width, unsigned int yOffset)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	unsigned int i = 0;
+
+	/* 32 pixels, 64 bytes per row, produce 16 U and 16 V samples. */
+	for (; i + 32 <= width; i += 32) {
+		__m128i c[4];
+
+		for (unsigned int j = 0; j < 4; ++j) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + 2 * i + 16 * j));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + 2 * i + 16 * j));
+			c[j] = selectBytes(_mm_avg_epu8(a, b), 1 - yOffset);
+		}
+
+		/* Interleaved U, V samples */
+		__m128i uv0 = _mm_packus_epi16(c[0], c[1]);
+		__m128i uv1 = _mm_packus_epi16(c[2], c[3]);
+
+		__m128i uu = _mm_packus_epi16(_mm_and_si128(uv0, mask), _mm_and_si128(uv1, mask));
+		__m128i vv = _mm_packus_epi16(_mm_srli_epi16(uv0, 8), _mm_srli_epi16(uv1, 8));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(u + i / 2), uu);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(v + i / 2), vv);
+	}
+
+	scalarKernels.packedToUV(src0 + 2 * i, src1 + 2 * i, u + i / 2, v + i / 2,
+				 width - i, yOffset);
+}
+
+/*
+ * Compute 8 pixels of R, G and B in 16-bit lanes, from luma and chroma
+ * already centred around 0.
+ */
+__attribute__((target("sse2")))
+inline void yuvToRgb8(__m128i y, __m128i u, __m128i v,
+		      __m128i &r, __m128i &g, __m128i &b)
+{
+	__m128i y64 = _mm_add_epi16(_mm_slli_epi16(y, 6), _mm_set1_epi16(32));
+
+	r = _mm_add_epi16(y64, _mm_mullo_epi16(v, _mm_set1_epi16(kCoefRV)));
+	g = _mm_sub_epi16(_mm_sub_epi16(y64, _mm_mullo_epi16(u, _mm_set1_epi16(kCoefGU))),
+			  _mm_mullo_epi16(v, _mm_set1_epi16(kCoefGV)));
+	b = _mm_add_epi16(y64, _mm_mullo_epi16(u, _mm_set1_epi16(kCoefBU)));
+
+	r = _mm_srai_epi16(r, 6);
+	g = _mm_srai_epi16(g, 6);
+	b = _mm_srai_epi16(b, 6);
+}
+
+/* Compute 16 pixels of R, G and B as bytes. */
+__attribute__((target("sse2")))
+inline void yuvToRgb16(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		       __m128i &r, __m128i &g, __m128i &b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(128);
+
+	__m128i yy = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y));
+	__m128i uu = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(u)), zero), bias);
+	__m128i vv = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(v)), zero), bias);
+
+	__m128i rl, gl, bl, rh, gh, bh;
+	yuvToRgb8(_mm_unpacklo_epi8(yy, zero), _mm_unpacklo_epi16(uu, uu),
+		  _mm_unpacklo_epi16(vv, vv), rl, gl, bl);
+	yuvToRgb8(_mm_unpackhi_epi8(yy, zero), _mm_unpackhi_epi16(uu, uu),
+		  _mm_unpackhi_epi16(vv, vv), rh, gh, bh);
+
+	r = _mm_packus_epi16(rl, rh);
+	g = _mm_packus_epi16(gl, gh);
+	b = _mm_packus_epi16(bl, bh);
+}
+
+/* Store 16 pixels as 4-byte c0 c1 c2 c3 quadruplets. */
+__attribute__((target("sse2")))
+inline void store4(uint8_t *dst, __m128i c0, __m128i c1, __m128i c2, __m128i c3)
+{
+	__m128i lo01 = _mm_unpacklo_epi8(c0, c1);
+	__m128i hi01 = _mm_unpackhi_epi8(c0, c1);
+	__m128i lo23 = _mm_unpacklo_epi8(c2, c3);
+	__m128i hi23 = _mm_unpackhi_epi8(c2, c3);
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_unpacklo_epi16(lo01, lo23));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_unpackhi_epi16(lo01, lo23));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 32), _mm_unpacklo_epi16(hi01, hi23));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 48), _mm_unpackhi_epi16(hi01, hi23));
+}
+
+__attribute__((target("sse2")))
+void yuvToRgb24Sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		    uint8_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+	/* SSE2 has no byte shuffle, interleave the 3 channels from memory. */
+	for (; x + 16 <= width; x += 16) {
+		alignas(16) uint8_t rgb[3][16];
+		__m128i r, g, b;
+
+		yuvToRgb16(y + x, u + x / 2, v + x / 2, r, g, b);
+		_mm_store_si128(reinterpret_cast<__m128i *>(rgb[0]), r);
+		_mm_store_si128(reinterpret_cast<__m128i *>(rgb[1]), g);
+		_mm_store_si128(reinterpret_cast<__m128i *>(rgb[2]), b);
+
+		for (unsigned int i = 0; i < 16; ++i) {
+			dst[3 * (x + i)] = rgb[0][i];
+			dst[3 * (x + i) + 1] = rgb[1][i];
+			dst[3 * (x + i) + 2] = rgb[2][i];
+		}
+	}
+
+	scalarKernels.yuvToRgb24(y + x, u + x / 2, v + x / 2, dst + 3 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+void yuvToBgraSse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		   uint8_t *dst, unsigned int width)
+{
+	const __m128i alpha = _mm_set1_epi8(-1);
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i r, g, b;
+
+		yuvToRgb16(y + x, u + x / 2, v + x / 2, r, g, b);
+		store4(dst + 4 * x, b, g, r, alpha);
+	}
+
+	scalarKernels.yuvToBgra(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+void sumBlocksSse2(const uint8_t *src, uint32_t *sums, unsigned int blocks)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (unsigned int i = 0; i < blocks; ++i) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16 * i));
+
+		/* Sums of 8 bytes in the low bits of both 64-bit lanes */
+		__m128i sad = _mm_sad_epu8(x, zero);
+		sums[i] += _mm_cvtsi128_si32(sad)
+			 + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+	}
+}
+
+const Kernels sse2 = {
+	splitUVSse2,
+	packedToYSse2,
+	packedToUVSse2,
+	yuvToRgb24Sse2,
+	yuvToBgraSse2,
+	sumBlocksSse2,
+};
+
+/* -----------------------------------------------------------------------------
+ * AVX2
+ */
+
+/* Undo the per-lane interleaving of the 256-bit pack instructions. */
+__attribute__((target("avx2")))
+inline __m256i pack16(__m256i a, __m256i b)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+inline __m256i selectBytes256(__m256i x, unsigned int offset)
+{
+	return offset ? _mm256_srli_epi16(x, 8)
+		      : _mm256_and_si256(x, _mm256_set1_epi16(0x00ff));
+}
+
+__attribute__((target("avx2")))
+void splitUVAvx2(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	unsigned int i = 0;
+
+	for (; i + 32 <= width; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(uv + 2 * i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(uv + 2 * i + 32));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(u + i),
+				    pack16(selectBytes256(a, 0), selectBytes256(b, 0)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(v + i),
+				    pack16(selectBytes256(a, 1), selectBytes256(b, 1)));
+	}
+
+	splitUVSse2(uv + 2 * i, u + i, v + i, width - i);
+}
+
+__attribute__((target("avx2")))
+void packedToYAvx2(const uint8_t *src, uint8_t *y, unsigned int width,
+		   unsigned int yOffset)
+{
+	unsigned int i = 0;
+
+	for (; i + 32 <= width; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i + 32));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(y + i),
+				    pack16(selectBytes256(a, yOffset),
+					   selectBytes256(b, yOffset)));
+	}
+
+	packedToYSse2(src + 2 * i, y + i, width - i, yOffset);
+}
+
+__attribute__((target("avx2")))
+void packedToUVAvx2(const uint8_t *src0, const uint8_t *src1, uint8_t *u,
+		    uint8_t *v, unsigned int width, unsigned int yOffset)
+{
+	unsigned int i = 0;
+
+	/* 64 pixels, 128 bytes per row, produce 32 U and 32 V samples. */
+	for (; i + 64 <= width; i += 64) {
+		__m256i c[4];
+
+		for (unsigned int j = 0; j < 4; ++j) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src0 + 2 * i + 32 * j));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src1 + 2 * i + 32 * j));
+			c[j] = selectBytes256(_mm256_avg_epu8(a, b), 1 - yOffset);
+		}
+
+		__m256i uv0 = pack16(c[0], c[1]);
+		__m256i uv1 = pack16(c[2], c[3]);
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(u + i / 2),
+				    pack16(selectBytes256(uv0, 0), selectBytes256(uv1, 0)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(v + i / 2),
+				    pack16(selectBytes256(uv0, 1), selectBytes256(uv1, 1)));
+	}
+
+	packedToUVSse2(src0 + 2 * i, src1 + 2 * i, u + i / 2, v + i / 2,
+		       width - i, yOffset);
+}
+
+__attribute__((target("avx2")))
+inline __m256i yuvChannel(__m256i y64, __m256i u, __m256i v, int cu, int cv)
+{
+	__m256i c = _mm256_add_epi16(y64, _mm256_mullo_epi16(u, _mm256_set1_epi16(cu)));
+	c = _mm256_add_epi16(c, _mm256_mullo_epi16(v, _mm256_set1_epi16(cv)));
+	return _mm256_srai_epi16(c, 6);
+}
+
+/* Compute 32 pixels of R, G and B as bytes. */
+__attribute__((target("avx2")))
+inline void yuvToRgb32(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		       __m256i &r, __m256i &g, __m256i &b)
+{
+	const __m256i bias = _mm256_set1_epi16(128);
+	const __m256i round = _mm256_set1_epi16(32);
+
+	__m256i yy = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(y));
+	__m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(u)));
+	__m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(v)));
+
+	/* Reorder 64-bit blocks so that the per-lane unpacks upsample in order. */
+	uu = _mm256_permute4x64_epi64(_mm256_sub_epi16(uu, bias), 0xd8);
+	vv = _mm256_permute4x64_epi64(_mm256_sub_epi16(vv, bias), 0xd8);
+
+	__m256i y64[2] = {
+		_mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy)), 6), round),
+		_mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1)), 6), round),
+	};
+	__m256i u2[2] = { _mm256_unpacklo_epi16(uu, uu), _mm256_unpackhi_epi16(uu, uu) };
+	__m256i v2[2] = { _mm256_unpacklo_epi16(vv, vv), _mm256_unpackhi_epi16(vv, vv) };
+
+	__m256i rr[2], gg[2], bb[2];
+	for (unsigned int i = 0; i < 2; ++i) {
+		rr[i] = yuvChannel(y64[i], u2[i], v2[i], 0, kCoefRV);
+		gg[i] = yuvChannel(y64[i], u2[i], v2[i], -kCoefGU, -kCoefGV);
+		bb[i] = yuvChannel(y64[i], u2[i], v2[i], kCoefBU, 0);
+	}
+
+	r = pack16(rr[0], rr[1]);
+	g = pack16(gg[0], gg[1]);
+	b = pack16(bb[0], bb[1]);
+}
+
+__attribute__((target("avx2")))
+void yuvToRgb24Avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		    uint8_t *dst, unsigned int width)
+{
+	/* Drop the 4th byte of each pixel of an RGBX quadruplet. */
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+					      12, 13, 14, -1, -1, -1, -1);
+	unsigned int x = 0;
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i r, g, b;
+
+		yuvToRgb32(y + x, u + x / 2, v + x / 2, r, g, b);
+
+		alignas(32) uint8_t rgbx[128];
+		store4(rgbx, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g),
+		       _mm256_castsi256_si128(b), _mm_setzero_si128());
+		store4(rgbx + 64, _mm256_extracti128_si256(r, 1),
+		       _mm256_extracti128_si256(g, 1),
+		       _mm256_extracti128_si256(b, 1), _mm_setzero_si128());
+
+		uint8_t *out = dst + 3 * x;
+		for (unsigned int i = 0; i < 8; ++i) {
+			__m128i px = _mm_load_si128(reinterpret_cast<const __m128i *>(rgbx + 16 * i));
+			__m128i packed = _mm_shuffle_epi8(px, shuffle);
+
+			/* 12 bytes per quadruplet, don't write past the row end. */
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(out + 12 * i), packed);
+			uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+			memcpy(out + 12 * i + 8, &tail, sizeof(tail));
+		}
+	}
+
+	yuvToRgb24Sse2(y + x, u + x / 2, v + x / 2, dst + 3 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void yuvToBgraAvx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		   uint8_t *dst, unsigned int width)
+{
+	const __m128i alpha = _mm_set1_epi8(-1);
+	unsigned int x = 0;
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i r, g, b;
+
+		yuvToRgb32(y + x, u + x / 2, v + x / 2, r, g, b);
+
+		store4(dst + 4 * x, _mm256_castsi256_si128(b),
+		       _mm256_castsi256_si128(g), _mm256_castsi256_si128(r), alpha);
+		store4(dst + 4 * x + 64, _mm256_extracti128_si256(b, 1),
+		       _mm256_extracti128_si256(g, 1),
+		       _mm256_extracti128_si256(r, 1), alpha);
+	}
+
+	yuvToBgraSse2(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void sumBlocksAvx2(const uint8_t *src, uint32_t *sums, unsigned int blocks)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int i = 0;
+
+	for (; i + 2 <= blocks; i += 2) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 16 * i));
+
+		/* Fold the two 64-bit sums of each block in its 128-bit lane. */
+		__m256i sad = _mm256_sad_epu8(x, zero);
+		sad = _mm256_add_epi64(sad, _mm256_srli_si256(sad, 8));
+
+		sums[i] += _mm256_cvtsi256_si32(sad);
+		sums[i + 1] += _mm_cvtsi128_si32(_mm256_extracti128_si256(sad, 1));
+	}
+
+	sumBlocksSse2(src + 16 * i, sums + i, blocks - i);
+}
+
+const Kernels avx2 = {
+	splitUVAvx2,
+	packedToYAvx2,
+	packedToUVAvx2,
+	yuvToRgb24Avx2,
+	yuvToBgraAvx2,
+	sumBlocksAvx2,
+};
+
+} /* namespace */
+
+const Kernels *sse2Kernels()
+{
+	return __builtin_cpu_supports("sse2") ? &sse2 : nullptr;
+}
+
+const Kernels *avx2Kernels()
+{
+	return __builtin_cpu_supports("avx2") ? &avx2 : nullptr;
+}
+
+} /* namespace convert */
+
+#else /* __x86_64__ || __i386__ */
+
+namespace convert {
+
+const Kernels *sse2Kernels()
+{
+	return nullptr;
+}
+
+const Kernels *avx2Kernels()
+{
+	return nullptr;
+}
+
+} /* namespace convert */
+
+#endif /* __x86_64__ || __i386__ */
@@ -0,0 +1,335 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * preroll_sink.cpp - Keep the latest frames in memory until triggered
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <libcamera/camera.h>
+
+#include "buffer_cache.h"
+#include "image.h"
+#include "preroll_sink.h"
+#include "trace.h"
+
+using namespace libcamera;
+
+/**
+ * \class PreRollSink
+ * \brief Record the frames captured before a trigger
+ *
+ * The sink copies every frame to a ring of preallocated slots, overwriting the
+ * oldest one, and releases the request right away. The ring holds a fixed
+ * number of frames, and its memory is allocated once by start(), sized from
+ * the largest frame buffer, see memory().
+ *
+ * When trigger() is called, all the frames in the ring that haven't been
+ * recorded yet are pinned and written by a flusher thread, oldest first, to raw
+ * segments named after the prefix, see RawWriter. Each slot holds its frame as
+ * laid out in a segment, so it is written with a single write. Capture goes on
+ * while the ring is flushed, and a slot is released as soon as it has been
+ * written. If capture catches up with a pinned slot, new frames are dropped
+ * until it is released, and counted by dropped().
+ *
+ * The segment is closed once the frames of all pending triggers have been
+ * written.
+ */
+
+/**
+ * \param[in] buffers Mappings of the frame buffers
+ * \param[in] prefix Segment file name prefix
+ * \param[in] frames Number of frames kept in memory
+ */
+PreRollSink::PreRollSink(const BufferCache &buffers, const std::string &prefix,
+			 unsigned int frames)
+	: buffers_(buffers), frames_(std::max(frames, 1U)), slotSize_(0),
+	  arena_(nullptr), head_(0), captured_(0), triggered_(0), dropped_(0),
+	  written_(0), container_(prefix), queueHead_(0), queued_(0),
+	  pinned_(0), exit_(false)
+{
+	writer_ = FileWriter::create();
+	queue_.resize(frames_);
+	flusher_ = std::thread(&PreRollSink::flush, this);
+}
+
+PreRollSink::~PreRollSink()
+{
+	stop();
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		exit_ = true;
+	}
+	cond_.notify_all();
+	flusher_.join();
+
+	if (arena_)
+		munmap(arena_, memory());
+}
+
+int PreRollSink::configure(const libcamera::CameraConfiguration &config)
+{
+	int ret = FrameSink::configure(config);
+	if (ret < 0)
+		return ret;
+
+	streamConfigs_.clear();
+	for (const StreamConfiguration &cfg : config) {
+		if (selected(cfg.stream()))
+			streamConfigs_[cfg.stream()] = cfg;
+	}
+
+	return 0;
+}
+
+/*
+ * Size the slots for the largest buffer, the ring can't be resized once
+ * allocated.
+ */
+void PreRollSink::mapBuffer(const Stream *stream, FrameBuffer *buffer)
+{
+	if (arena_ || !selected(stream))
+		return;
+
+	size_t size = sizeof(raw::FrameHeader);
+	for (const FrameBuffer::Plane &plane : buffer->planes())
+		size += raw::align(plane.length);
+
+	slotSize_ = std::max(slotSize_, size);
+}
+
+/**
+ * \brief Allocate the ring, of memory() bytes
+ */
+int PreRollSink::start()
+{
+	if (arena_)
+		return 0;
+
+	if (!slotSize_) {
+		std::cerr << "no buffer mapped, can't size the pre-roll ring"
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	/* Fault the pages in now rather than while capturing. */
+	void *arena = mmap(nullptr, memory(), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (arena == MAP_FAILED) {
+		int ret = -errno;
+		std::cerr << "failed to allocate " << memory()
+			  << " bytes for the pre-roll ring" << std::endl;
+		return ret;
+	}
+
+	arena_ = arena;
+	slots_.resize(frames_);
+	for (unsigned int i = 0; i < frames_; ++i)
+		slots_[i] = { this, static_cast<uint8_t *>(arena_) + i * slotSize_,
+			      0, false, nullptr };
+
+	return 0;
+}
+
+/**
+ * \brief Wait for the frames of pending triggers to be written
+ */
+int PreRollSink::stop()
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		cond_.wait(locker, [&] { return !pinned_; });
+	}
+
+	writer_->wait();
+	container_.close();
+
+	return FrameSink::stop();
+}
+
+bool PreRollSink::processRequest(FrameRequest *request)
+{
+	if (!arena_)
+		return true;
+
+	for (auto [stream, buffer] : request->buffers()) {
+		if (!selected(stream))
+			continue;
+
+		Slot *slot;
+
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			slot = &slots_[head_];
+			if (slot->pinned) {
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			/* Hide the slot from trigger() while it is overwritten. */
+			slot->number = 0;
+		}
+
+		{
+			const FrameRequest::Metadata &metadata = request->metadata(buffer);
+			TRACE_SCOPE("preroll", "store", metadata.sequence);
+			if (!store(slot, stream, buffer, metadata))
+				continue;
+		}
+
+		std::unique_lock<std::mutex> locker(lock_);
+		slot->number = ++captured_;
+		head_ = (head_ + 1) % frames_;
+	}
+
+	/* The frames have been copied, the buffers can be reused right away. */
+	return true;
+}
+
+/**
+ * \brief Write the frames currently in memory
+ *
+ * Frames already written by a previous trigger are skipped. This function
+ * may be called from any thread.
+ */
+void PreRollSink::trigger()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	unsigned int count = 0;
+
+	/* head_ is the oldest frame once the ring has wrapped around. */
+	for (unsigned int i = 0; i < slots_.size(); ++i) {
+		Slot *slot = &slots_[(head_ + i) % frames_];
+		if (!slot->number || slot->number <= triggered_ || slot->pinned)
+			continue;
+
+		slot->pinned = true;
+		queue_[(queueHead_ + queued_++) % frames_] = slot;
+		pinned_++;
+		count++;
+	}
+
+	triggered_ = captured_;
+
+	std::cout << "Pre-roll triggered, writing " << count << " frames"
+		  << std::endl;
+
+	cond_.notify_all();
+}
+
+bool PreRollSink::store(Slot *slot, const Stream *stream, FrameBuffer *buffer,
+			const FrameRequest::Metadata &metadata)
+{
+	const Image *image = buffers_.find(buffer);
+	if (!image) {
+		std::cerr << "buffer not mapped" << std::endl;
+		return false;
+	}
+
+	unsigned int planes = std::min(metadata.planes, raw::kMaxPlanes);
+
+	raw::FrameHeader *header = reinterpret_cast<raw::FrameHeader *>(slot->data);
+	*header = {};
+	header->magic = raw::kFrameMagic;
+	header->headerSize = sizeof(*header);
+	header->sequence = metadata.sequence;
+	header->timestamp = metadata.timestamp;
+	header->numPlanes = planes;
+
+	auto iter = streamConfigs_.find(stream);
+	if (iter != streamConfigs_.end()) {
+		const StreamConfiguration &cfg = iter->second;
+		header->fourcc = cfg.pixelFormat.fourcc();
+		header->modifier = cfg.pixelFormat.modifier();
+		header->width = cfg.size.width;
+		header->height = cfg.size.height;
+		header->stride = cfg.stride;
+	}
+
+	size_t size = sizeof(*header);
+	for (unsigned int i = 0; i < planes; ++i) {
+		Span<const uint8_t> data = image->data(i);
+		size_t length = std::min<size_t>(metadata.bytesused[i], data.size());
+		length = std::min(length, slotSize_ - size);
+
+		memcpy(slot->data + size, data.data(), length);
+		header->planeOffset[i] = size;
+		header->planeSize[i] = length;
+		size += raw::align(length);
+	}
+	header->size = std::min(size, slotSize_);
+
+	return true;
+}
+
+void PreRollSink::slotWritten(void *arg, int result)
+{
+	Slot *slot = static_cast<Slot *>(arg);
+	PreRollSink *sink = slot->sink;
+
+	if (result < 0)
+		std::cerr << "pre-roll write error: " << strerror(-result)
+			  << std::endl;
+	else
+		sink->written_.fetch_add(1, std::memory_order_relaxed);
+
+	sink->container_.release(slot->segment);
+
+	bool idle;
+	{
+		std::unique_lock<std::mutex> locker(sink->lock_);
+		slot->pinned = false;
+		idle = !--sink->pinned_;
+	}
+	sink->cond_.notify_all();
+
+	/* Close the segment once the pending triggers have been written. */
+	if (idle)
+		sink->container_.close();
+}
+
+/*
+ * Flusher thread, hands pinned slots to the writer, which blocks when too
+ * many writes are in flight.
+ */
+void PreRollSink::flush()
+{
+	TRACE_THREAD("preroll flusher");
+
+	while (true) {
+		Slot *slot;
+
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			cond_.wait(locker, [&] { return exit_ || queued_; });
+			if (!queued_)
+				return;
+
+			slot = queue_[queueHead_];
+			queueHead_ = (queueHead_ + 1) % frames_;
+			queued_--;
+		}
+
+		const raw::FrameHeader *header =
+			reinterpret_cast<const raw::FrameHeader *>(slot->data);
+
+		uint64_t offset;
+		slot->segment = container_.reserve(header->size, header->sequence,
+						   header->timestamp, &offset);
+		if (!slot->segment) {
+			std::unique_lock<std::mutex> locker(lock_);
+			slot->pinned = false;
+			pinned_--;
+			cond_.notify_all();
+			continue;
+		}
+
+		FileWriter::Write write = { slot->segment->fd, offset, slot->data,
+					    header->size };
+		writer_->write(&write, 1, &PreRollSink::slotWritten, slot);
+	}
+}
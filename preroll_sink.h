@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * preroll_sink.h - Keep the latest frames in memory until triggered
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/stream.h>
+
+#include "file_writer.h"
+#include "frame_request.h"
+#include "frame_sink.h"
+#include "raw_writer.h"
+
+class BufferCache;
+
+class PreRollSink : public FrameSink
+{
+public:
+	PreRollSink(const BufferCache &buffers, const std::string &prefix,
+		    unsigned int frames);
+	~PreRollSink();
+
+	int configure(const libcamera::CameraConfiguration &config) override;
+	void mapBuffer(const libcamera::Stream *stream,
+		       libcamera::FrameBuffer *buffer) override;
+
+	int start() override;
+	int stop() override;
+
+	bool processRequest(FrameRequest *request) override;
+
+	void trigger();
+
+	size_t memory() const { return slotSize_ * frames_; }
+	uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+	uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+
+private:
+	/* A frame laid out as in a raw segment, header first */
+	struct Slot {
+		PreRollSink *sink;
+		uint8_t *data;
+		/* Capture order of the frame, 0 when the slot is empty */
+		uint64_t number;
+		bool pinned;
+		RawWriter::Segment *segment;
+	};
+
+	static void slotWritten(void *arg, int result);
+
+	bool store(Slot *slot, const libcamera::Stream *stream,
+		   libcamera::FrameBuffer *buffer,
+		   const FrameRequest::Metadata &metadata);
+	void flush();
+
+	const BufferCache &buffers_;
+	std::map<const libcamera::Stream *, libcamera::StreamConfiguration> streamConfigs_;
+
+	unsigned int frames_;
+	size_t slotSize_;
+	void *arena_;
+	std::vector<Slot> slots_;
+	unsigned int head_;
+	uint64_t captured_;
+	uint64_t triggered_;
+
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> written_;
+
+	RawWriter container_;
+	std::unique_ptr<FileWriter> writer_;
+
+	/* Slots pinned by a trigger, in capture order, waiting to be written */
+	std::mutex lock_;
+	std::condition_variable cond_;
+	std::vector<Slot *> queue_;
+	size_t queueHead_;
+	size_t queued_;
+	unsigned int pinned_;
+	bool exit_;
+	std::thread flusher_;
+};
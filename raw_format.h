@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * raw_format.h - On-disk layout of raw frame segments
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A segment file starts with a SegmentHeader, followed by frames appended back
+ * to back. Each frame is a FrameHeader followed by its planes, every plane and
+ * every frame starting on a kAlignment boundary.
+ *
+ * When the segment is closed, an array of IndexEntry, one per frame in append
+ * order, and an IndexFooter are written after the last frame, and the file is
+ * truncated right after the footer. A segment without footer has not been
+ * closed properly, its frames can still be found by walking the frame headers
+ * until one has no magic.
+ *
+ * All fields are stored in the host byte order.
+ */
+
+namespace raw {
+
+constexpr uint64_t kSegmentMagic = 0x3157415224534944ULL;	/* "DIS$RAW1" */
+constexpr uint32_t kFrameMagic = 0x304d5246;			/* "FRM0" */
+constexpr uint64_t kIndexMagic = 0x3158444924534944ULL;		/* "DIS$IDX1" */
+
+constexpr uint32_t kVersion = 1;
+constexpr uint64_t kAlignment = 64;
+constexpr unsigned int kMaxPlanes = 4;
+
+constexpr uint64_t align(uint64_t size)
+{
+	return (size + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+struct SegmentHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t number;
+	uint32_t reserved[11];
+};
+
+struct FrameHeader {
+	uint32_t magic;
+	uint32_t headerSize;
+	/* Size of the frame, including header and padding */
+	uint64_t size;
+	uint64_t sequence;
+	/* Sensor timestamp, in nanoseconds */
+	uint64_t timestamp;
+	/* libcamera::PixelFormat fourcc and modifier */
+	uint32_t fourcc;
+	uint32_t reserved0;
+	uint64_t modifier;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t numPlanes;
+	/* Plane offsets are relative to the start of the frame */
+	uint32_t planeOffset[kMaxPlanes];
+	uint32_t planeSize[kMaxPlanes];
+	uint32_t reserved[8];
+};
+
+struct IndexEntry {
+	uint64_t sequence;
+	uint64_t timestamp;
+	/* Offset of the frame from the start of the segment */
+	uint64_t offset;
+};
+
+struct IndexFooter {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t indexOffset;
+	uint64_t reserved;
+};
+
+static_assert(sizeof(SegmentHeader) == kAlignment, "Unexpected segment header size");
+static_assert(sizeof(FrameHeader) == 2 * kAlignment, "Unexpected frame header size");
+static_assert(sizeof(IndexEntry) == 24, "Unexpected index entry size");
+static_assert(sizeof(IndexFooter) == 32, "Unexpected index footer size");
+
+} /* namespace raw */
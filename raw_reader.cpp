@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * raw_reader.cpp - Zero-copy access to raw frame segments
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "raw_reader.h"
+
+/**
+ * \class RawSegment
+ * \brief Read frames from a segment written by RawWriter
+ *
+ * The segment file is mapped read-only, and frames and planes are returned as
+ * pointers into the mapping, valid until the segment is closed.
+ *
+ * The index at the end of a closed segment is used in place. Segments that
+ * haven't been closed, for instance after a crash, are indexed by walking the
+ * frame headers instead.
+ *
+ * Looking a frame up by sequence is O(1) when no frame was dropped while
+ * recording the segment, and falls back to a binary search otherwise. Looking
+ * a frame up by timestamp is a binary search.
+ */
+
+RawSegment::RawSegment()
+	: data_(nullptr), length_(0), index_(nullptr), count_(0), dense_(false)
+{
+}
+
+RawSegment::~RawSegment()
+{
+	close();
+}
+
+/**
+ * \brief Map a segment file
+ * \param[in] path The segment file path
+ * \return 0 on success or a negative error code otherwise
+ */
+int RawSegment::open(const std::string &path)
+{
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int ret = -errno;
+		::close(fd);
+		return ret;
+	}
+
+	if (static_cast<size_t>(st.st_size) < sizeof(raw::SegmentHeader)) {
+		::close(fd);
+		return -EINVAL;
+	}
+
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	data_ = static_cast<const uint8_t *>(data);
+	length_ = st.st_size;
+
+	const raw::SegmentHeader *header =
+		reinterpret_cast<const raw::SegmentHeader *>(data_);
+	if (header->magic != raw::kSegmentMagic ||
+	    header->version != raw::kVersion) {
+		close();
+		return -EINVAL;
+	}
+
+	const raw::IndexFooter *footer = nullptr;
+	if (length_ >= sizeof(*header) + sizeof(*footer))
+		footer = reinterpret_cast<const raw::IndexFooter *>(data_ + length_ - sizeof(*footer));
+
+	if (footer && footer->magic == raw::kIndexMagic &&
+	    footer->indexOffset + footer->count * sizeof(raw::IndexEntry) + sizeof(*footer) == length_) {
+		index_ = reinterpret_cast<const raw::IndexEntry *>(data_ + footer->indexOffset);
+		count_ = footer->count;
+	} else {
+		scan();
+	}
+
+	dense_ = count_ &&
+		 entry(count_ - 1).sequence - entry(0).sequence == count_ - 1;
+
+	return 0;
+}
+
+/**
+ * \brief Unmap the segment
+ */
+void RawSegment::close()
+{
+	if (data_)
+		munmap(const_cast<uint8_t *>(data_), length_);
+
+	data_ = nullptr;
+	length_ = 0;
+	index_ = nullptr;
+	entries_.clear();
+	count_ = 0;
+	dense_ = false;
+}
+
+/**
+ * \brief Retrieve a frame by its position in the segment
+ * \return The frame header, or nullptr if \a index is out of range
+ */
+const raw::FrameHeader *RawSegment::frame(size_t index) const
+{
+	if (index >= count_)
+		return nullptr;
+
+	return frameAt(entry(index).offset);
+}
+
+/**
+ * \brief Retrieve a frame by sequence number
+ * \return The frame header, or nullptr if the segment has no such frame
+ */
+const raw::FrameHeader *RawSegment::findSequence(uint64_t sequence) const
+{
+	if (!count_ || sequence < entry(0).sequence)
+		return nullptr;
+
+	if (dense_)
+		return frame(sequence - entry(0).sequence);
+
+	size_t low = 0, high = count_;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (entry(mid).sequence < sequence)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == count_ || entry(low).sequence != sequence)
+		return nullptr;
+
+	return frame(low);
+}
+
+/**
+ * \brief Retrieve the first frame captured at or after a timestamp
+ * \return The frame header, or nullptr if all frames are older
+ */
+const raw::FrameHeader *RawSegment::findTimestamp(uint64_t timestamp) const
+{
+	size_t low = 0, high = count_;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (entry(mid).timestamp < timestamp)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return frame(low);
+}
+
+/**
+ * \brief Retrieve the data of a frame plane
+ * \return The plane data, plane->planeSize[plane] bytes long, or nullptr if
+ * the frame has no such plane
+ */
+const uint8_t *RawSegment::plane(const raw::FrameHeader *frame,
+				 unsigned int plane) const
+{
+	if (plane >= frame->numPlanes || plane >= raw::kMaxPlanes)
+		return nullptr;
+
+	return reinterpret_cast<const uint8_t *>(frame) + frame->planeOffset[plane];
+}
+
+/*
+ * Rebuild the index of a segment that hasn't been closed. The segment is
+ * preallocated with zeros, frames are walked until one has no valid header.
+ */
+void RawSegment::scan()
+{
+	uint64_t offset = sizeof(raw::SegmentHeader);
+
+	while (const raw::FrameHeader *header = frameAt(offset)) {
+		entries_.push_back({ header->sequence, header->timestamp, offset });
+		offset += raw::align(header->size);
+	}
+
+	count_ = entries_.size();
+}
+
+/* Validate the frame at offset, making sure it lies within the mapping. */
+const raw::FrameHeader *RawSegment::frameAt(uint64_t offset) const
+{
+	if (offset > length_ || length_ - offset < sizeof(raw::FrameHeader))
+		return nullptr;
+
+	const raw::FrameHeader *header =
+		reinterpret_cast<const raw::FrameHeader *>(data_ + offset);
+	if (header->magic != raw::kFrameMagic ||
+	    header->size < sizeof(*header) || header->size > length_ - offset ||
+	    header->numPlanes > raw::kMaxPlanes)
+		return nullptr;
+
+	for (unsigned int i = 0; i < header->numPlanes; ++i) {
+		if (static_cast<uint64_t>(header->planeOffset[i]) + header->planeSize[i] > header->size)
+			return nullptr;
+	}
+
+	return header;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * raw_reader.h - Zero-copy access to raw frame segments
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "raw_format.h"
+
+class RawSegment
+{
+public:
+	RawSegment();
+	~RawSegment();
+
+	RawSegment(const RawSegment &) = delete;
+	RawSegment &operator=(const RawSegment &) = delete;
+
+	int open(const std::string &path);
+	void close();
+
+	bool sealed() const { return index_ != nullptr; }
+	size_t size() const { return count_; }
+
+	const raw::FrameHeader *frame(size_t index) const;
+	const raw::FrameHeader *findSequence(uint64_t sequence) const;
+	const raw::FrameHeader *findTimestamp(uint64_t timestamp) const;
+
+	const uint8_t *plane(const raw::FrameHeader *frame, unsigned int plane) const;
+
+private:
+	const raw::IndexEntry &entry(size_t index) const
+	{
+		return index_ ? index_[index] : entries_[index];
+	}
+
+	void scan();
+	const raw::FrameHeader *frameAt(uint64_t offset) const;
+
+	const uint8_t *data_;
+	size_t length_;
+
+	/* Index in the mapped file, or rebuilt by scanning the frames */
+	const raw::IndexEntry *index_;
+	std::vector<raw::IndexEntry> entries_;
+	size_t count_;
+	bool dense_;
+};
@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * raw_writer.cpp - Allocation of frames in raw frame segments
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "raw_writer.h"
+
+/**
+ * \class RawWriter
+ * \brief Lay frames out in preallocated segment files
+ *
+ * The writer hands out space for frames in segment files named
+ * <prefix>-NNNNNN.raw, each preallocated to the segment size with fallocate()
+ * so that appending frames doesn't go through block allocation. The frame data
+ * itself is written by the caller, typically asynchronously, at the offset
+ * returned by reserve(), and the caller shall release() the segment once done.
+ *
+ * When a frame doesn't fit in the current segment, the segment is sealed and a
+ * new one is started. A sealed segment is finalized, with its index written
+ * and its file truncated to the used size, as soon as all frames reserved in
+ * it have been released. See raw_format.h for the file layout.
+ */
+
+/**
+ * \param[in] prefix The segment file name prefix
+ * \param[in] segmentSize The preallocated size of each segment, a frame larger
+ * than that gets a segment of its own
+ */
+RawWriter::RawWriter(const std::string &prefix, uint64_t segmentSize)
+	: prefix_(prefix), segmentSize_(segmentSize), number_(0),
+	  current_(nullptr)
+{
+}
+
+RawWriter::~RawWriter()
+{
+	close();
+}
+
+/**
+ * \brief Create the next segment ahead of the first frame
+ *
+ * Creating and preallocating a segment would otherwise delay the frame that
+ * doesn't fit in the current one, the first frame in particular.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int RawWriter::open()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (!current_)
+		current_ = openSegment();
+
+	return current_ ? 0 : -EIO;
+}
+
+/**
+ * \brief Reserve space for a frame
+ * \param[in] size The frame size, including its header
+ * \param[in] sequence The frame sequence number
+ * \param[in] timestamp The frame timestamp
+ * \param[out] offset The offset of the frame in the segment
+ *
+ * \return The segment the frame shall be written to, or nullptr if no segment
+ * could be created
+ */
+RawWriter::Segment *RawWriter::reserve(uint64_t size, uint64_t sequence,
+				       uint64_t timestamp, uint64_t *offset)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	size = raw::align(size);
+
+	/* Leave room for the index and footer, written when sealing. */
+	if (current_) {
+		uint64_t end = current_->used + size
+			     + (current_->index.size() + 1) * sizeof(raw::IndexEntry)
+			     + sizeof(raw::IndexFooter);
+		if (end > segmentSize_ && !current_->index.empty()) {
+			seal(current_);
+			current_ = nullptr;
+		}
+	}
+
+	if (!current_) {
+		current_ = openSegment();
+		if (!current_)
+			return nullptr;
+	}
+
+	*offset = current_->used;
+	current_->used += size;
+	current_->refs++;
+	current_->index.push_back({ sequence, timestamp, *offset });
+
+	return current_;
+}
+
+/**
+ * \brief Release a frame once it has been written to its segment
+ */
+void RawWriter::release(Segment *segment)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (!--segment->refs && segment->sealed)
+		finalize(segment);
+}
+
+/**
+ * \brief Seal the current segment
+ *
+ * The segment is finalized right away if all its frames have been released,
+ * or when the last one is.
+ */
+void RawWriter::close()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (current_) {
+		seal(current_);
+		current_ = nullptr;
+	}
+}
+
+RawWriter::Segment *RawWriter::openSegment()
+{
+	char name[32];
+	snprintf(name, sizeof(name), "-%06u.raw", number_);
+	filename_ = prefix_;
+	filename_ += name;
+
+	int fd = ::open(filename_.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd == -1) {
+		std::cerr << "failed to open file " << filename_ << ": "
+			  << strerror(errno) << std::endl;
+		return nullptr;
+	}
+
+	/* Not all file systems support preallocation, it is only an optimization. */
+	int ret = fallocate(fd, 0, 0, segmentSize_);
+	if (ret < 0 && errno != EOPNOTSUPP)
+		std::cerr << "failed to preallocate " << filename_ << ": "
+			  << strerror(errno) << std::endl;
+
+	raw::SegmentHeader header = {};
+	header.magic = raw::kSegmentMagic;
+	header.version = raw::kVersion;
+	header.headerSize = sizeof(header);
+	header.number = number_;
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		std::cerr << "failed to write segment header to " << filename_
+			  << std::endl;
+		::close(fd);
+		return nullptr;
+	}
+
+	Segment *segment;
+	if (free_.empty()) {
+		segments_.push_back(std::make_unique<Segment>());
+		segment = segments_.back().get();
+	} else {
+		segment = free_.back();
+		free_.pop_back();
+	}
+
+	segment->fd = fd;
+	segment->number = number_++;
+	segment->used = sizeof(header);
+	segment->refs = 0;
+	segment->sealed = false;
+	segment->index.clear();
+
+	return segment;
+}
+
+void RawWriter::seal(Segment *segment)
+{
+	segment->sealed = true;
+
+	if (!segment->refs)
+		finalize(segment);
+}
+
+void RawWriter::finalize(Segment *segment)
+{
+	raw::IndexFooter footer = {};
+	footer.magic = raw::kIndexMagic;
+	footer.count = segment->index.size();
+	footer.indexOffset = segment->used;
+
+	size_t indexSize = segment->index.size() * sizeof(raw::IndexEntry);
+	uint64_t end = segment->used + indexSize + sizeof(footer);
+
+	if (pwrite(segment->fd, segment->index.data(), indexSize, segment->used) != (ssize_t)indexSize ||
+	    pwrite(segment->fd, &footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer))
+		std::cerr << "failed to write index of segment "
+			  << segment->number << std::endl;
+
+	/* Drop the preallocated space that hasn't been used. */
+	if (ftruncate(segment->fd, end) < 0)
+		std::cerr << "failed to truncate segment " << segment->number
+			  << ": " << strerror(errno) << std::endl;
+
+	::close(segment->fd);
+	segment->fd = -1;
+
+	/* The index storage is kept for the next segment. */
+	free_.push_back(segment);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * raw_writer.h - Allocation of frames in raw frame segments
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "raw_format.h"
+
+class RawWriter
+{
+public:
+	struct Segment {
+		int fd;
+		unsigned int number;
+		uint64_t used;
+		unsigned int refs;
+		bool sealed;
+		std::vector<raw::IndexEntry> index;
+	};
+
+	RawWriter(const std::string &prefix, uint64_t segmentSize = 1ULL << 30);
+	~RawWriter();
+
+	int open();
+	Segment *reserve(uint64_t size, uint64_t sequence, uint64_t timestamp,
+			 uint64_t *offset);
+	void release(Segment *segment);
+	void close();
+
+private:
+	Segment *openSegment();
+	void seal(Segment *segment);
+	void finalize(Segment *segment);
+
+	std::string prefix_;
+	uint64_t segmentSize_;
+	unsigned int number_;
+	std::string filename_;
+
+	std::mutex lock_;
+	Segment *current_;
+	std::vector<std::unique_ptr<Segment>> segments_;
+	std::vector<Segment *> free_;
+};
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * replay_source.cpp - Frame source replaying recorded raw frames
+ */
+
+#include <errno.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+#include <libcamera/geometry.h>
+#include <libcamera/pixel_format.h>
+
+#include "image.h"
+#include "replay_source.h"
+
+using namespace libcamera;
+
+/**
+ * \class ReplaySource
+ * \brief Replay the raw frames recorded by FileSink
+ *
+ * The source reads the segments "<prefix>-NNNNNN.raw", numbered from 0, and
+ * replays their frames in a loop. The format of the stream is the one of the
+ * first frame, frames recorded in another format are skipped.
+ *
+ * Replayed frames keep their recorded sequence numbers, offset on each loop
+ * to keep increasing, so that the gaps of the recording are reproduced. They
+ * are timestamped when replayed.
+ */
+
+/**
+ * \param[in] fps The frame rate, 0 to replay frames as fast as they are
+ * consumed
+ */
+ReplaySource::ReplaySource(unsigned int fps)
+	: MemorySource(fps), span_(0), position_(0)
+{
+}
+
+/**
+ * \brief Map the segments of a recording
+ * \param[in] prefix The prefix of the segment files
+ * \return 0 on success or a negative error code otherwise
+ */
+int ReplaySource::open(const std::string &prefix)
+{
+	segments_.clear();
+	frames_.clear();
+
+	for (unsigned int number = 0;; ++number) {
+		char name[32];
+		snprintf(name, sizeof(name), "-%06u.raw", number);
+
+		std::unique_ptr<RawSegment> segment = std::make_unique<RawSegment>();
+		if (segment->open(prefix + name) < 0)
+			break;
+
+		segments_.push_back(std::move(segment));
+	}
+
+	const raw::FrameHeader *first = nullptr;
+	uint64_t last = 0;
+
+	for (const std::unique_ptr<RawSegment> &segment : segments_) {
+		for (size_t i = 0; i < segment->size(); ++i) {
+			const raw::FrameHeader *header = segment->frame(i);
+			if (!header || !header->numPlanes ||
+			    header->numPlanes > raw::kMaxPlanes)
+				continue;
+
+			if (!first) {
+				first = header;
+			} else if (header->fourcc != first->fourcc ||
+				   header->modifier != first->modifier ||
+				   header->width != first->width ||
+				   header->height != first->height ||
+				   header->stride != first->stride ||
+				   header->numPlanes != first->numPlanes ||
+				   memcmp(header->planeSize, first->planeSize,
+					  sizeof(header->planeSize))) {
+				continue;
+			}
+
+			frames_.push_back({ segment.get(), header });
+			last = header->sequence;
+		}
+	}
+
+	if (!first) {
+		std::cerr << "no frame to replay in " << prefix << std::endl;
+		return -ENOENT;
+	}
+
+	Format format;
+	format.pixelFormat = PixelFormat(first->fourcc, first->modifier);
+	format.size = Size(first->width, first->height);
+	format.stride = first->stride;
+	format.planeSizes.assign(first->planeSize, first->planeSize + first->numPlanes);
+	setFormat(format);
+
+	span_ = last >= first->sequence ? last - first->sequence + 1 : frames_.size();
+	position_ = 0;
+
+	size_t slash = prefix.rfind('/');
+	name_ = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+
+	return 0;
+}
+
+std::string ReplaySource::id() const
+{
+	return "replay-" + name_;
+}
+
+void ReplaySource::fill([[maybe_unused]] unsigned int index, Image *image,
+			FrameRequest::Metadata &metadata)
+{
+	const Frame &frame = frames_[position_ % frames_.size()];
+	uint64_t loop = position_ / frames_.size();
+
+	for (unsigned int i = 0; i < frame.header->numPlanes; ++i)
+		memcpy(image->data(i).data(), frame.segment->plane(frame.header, i),
+		       frame.header->planeSize[i]);
+
+	metadata.sequence = frame.header->sequence + loop * span_;
+	position_++;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * replay_source.h - Frame source replaying recorded raw frames
+ */
+
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "memory_source.h"
+#include "raw_format.h"
+#include "raw_reader.h"
+
+class ReplaySource : public MemorySource
+{
+public:
+	explicit ReplaySource(unsigned int fps);
+
+	int open(const std::string &prefix);
+
+	std::string id() const override;
+	size_t frames() const { return frames_.size(); }
+
+protected:
+	void fill(unsigned int index, Image *image,
+		  FrameRequest::Metadata &metadata) override;
+
+private:
+	struct Frame {
+		const RawSegment *segment;
+		const raw::FrameHeader *header;
+	};
+
+	std::string name_;
+	std::vector<std::unique_ptr<RawSegment>> segments_;
+	std::vector<Frame> frames_;
+
+	/* Sequence numbers spanned by the recording, added on each loop */
+	uint64_t span_;
+	uint64_t position_;
+};
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * share_format.h - Messages exchanged with the frame subscribers
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Frames are shared with other processes over a SOCK_SEQPACKET Unix socket,
+ * one message per frame. The pixels aren't sent, a FrameMessage describes
+ * where they lie in a buffer the subscriber has mapped.
+ *
+ * The first time a buffer is sent to a subscriber, its file descriptors are
+ * attached to the message as SCM_RIGHTS, and the subscriber maps them. The
+ * next frames in the same buffer only carry its number. When a buffer is sent
+ * with descriptors again, they replace the previous ones.
+ *
+ * The publisher doesn't reuse a buffer until the subscriber returns it with a
+ * ReleaseMessage, the subscriber reads the frame in place in the meantime.
+ * Closing the socket releases all the buffers held by the subscriber.
+ *
+ * All fields are stored in the host byte order.
+ */
+
+namespace share {
+
+constexpr uint32_t kFrameMagic = 0x30465344;	/* "DSF0" */
+constexpr uint32_t kReleaseMagic = 0x30525344;	/* "DSR0" */
+
+constexpr unsigned int kMaxPlanes = 4;
+
+struct FrameMessage {
+	uint32_t magic;
+	uint32_t size;
+	/* Buffer holding the frame, and number of descriptors attached */
+	uint32_t buffer;
+	uint32_t fds;
+	uint64_t sequence;
+	/* Sensor timestamp, in nanoseconds */
+	uint64_t timestamp;
+	/* libcamera::PixelFormat fourcc and modifier */
+	uint32_t fourcc;
+	uint32_t reserved0;
+	uint64_t modifier;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t numPlanes;
+	/* Descriptor of each plane, and its location in it */
+	uint32_t planeFd[kMaxPlanes];
+	uint32_t planeOffset[kMaxPlanes];
+	uint32_t planeSize[kMaxPlanes];
+	uint32_t reserved[4];
+};
+
+struct ReleaseMessage {
+	uint32_t magic;
+	uint32_t buffer;
+	uint64_t sequence;
+};
+
+static_assert(sizeof(FrameMessage) == 128, "Unexpected frame message size");
+static_assert(sizeof(ReleaseMessage) == 16, "Unexpected release message size");
+
+} /* namespace share */
@@ -0,0 +1,642 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * share_sink.cpp - Share the frames with other local processes
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libcamera/camera.h>
+#include <libcamera/framebuffer.h>
+
+#include "buffer_cache.h"
+#include "event_loop.h"
+#include "image.h"
+#include "share_sink.h"
+#include "trace.h"
+
+using namespace libcamera;
+
+/*
+ * Frames a subscriber may hold, further frames skip it, so that a slow
+ * subscriber can't starve the camera of buffers.
+ */
+static constexpr unsigned int kMaxHeld = 2;
+static constexpr unsigned int kMaxSubscribers = 16;
+/* Frames in memfds at once, when copying */
+static constexpr unsigned int kMaxCopies = 16;
+/* Alignment of the planes copied to a memfd */
+static constexpr size_t kPlaneAlignment = 64;
+
+/**
+ * \class ShareSink
+ * \brief Publish the frames to other processes without copying them
+ *
+ * Subscribers connect to a Unix socket bound to the path given to the sink,
+ * and receive a message per frame, see share_format.h. The file descriptors of
+ * the frame buffers, dmabufs or memfds, are passed to each subscriber along
+ * with the first frame of each buffer, the subscribers map them and read the
+ * frames in place. The FrameSubscriber class implements the subscriber side.
+ *
+ * A request is held until all the subscribers it was sent to have released it,
+ * and then returned through requestProcessed, to be queued to the camera
+ * again. A subscriber holding too many frames, or whose socket is full, skips
+ * the next frames rather than delaying the capture. When no subscriber is
+ * connected, requests are returned right away.
+ *
+ * In copy mode, frames are copied to a pool of memfds shared the same way,
+ * and requests are returned right away. This trades a copy for subscribers
+ * that can't hold camera buffers, which are usually few, without slowing the
+ * capture down.
+ *
+ * Subscribers are accepted and their releases handled from the event loop,
+ * while frames are published from the thread processing the request.
+ */
+
+/**
+ * \param[in] loop The loop watching the sockets
+ * \param[in] buffers Mappings of the frame buffers, read when copying
+ * \param[in] path The path of the socket, any stale socket is replaced
+ * \param[in] copy Copy the frames to memfds instead of sharing the buffers
+ */
+ShareSink::ShareSink(EventLoop &loop, const BufferCache &buffers,
+		     const std::string &path, bool copy)
+	: loop_(loop), buffers_(buffers), path_(path), copy_(copy), fd_(-1),
+	  frameSize_(0), served_(0), frames_(0), published_(0), sent_(0),
+	  shares_(0), skipped_(0), copies_(0), maxSubscribers_(0)
+{
+}
+
+ShareSink::~ShareSink()
+{
+	close();
+
+	for (std::unique_ptr<Buffer> &buffer : pool_) {
+		if (!buffer->copy)
+			continue;
+
+		munmap(buffer->copy, buffer->copySize);
+		::close(buffer->fds[0]);
+	}
+}
+
+int ShareSink::configure(const CameraConfiguration &config)
+{
+	int ret = FrameSink::configure(config);
+	if (ret < 0)
+		return ret;
+
+	streamConfigs_.clear();
+	for (const StreamConfiguration &cfg : config) {
+		if (selected(cfg.stream()))
+			streamConfigs_[cfg.stream()] = cfg;
+	}
+
+	return 0;
+}
+
+/*
+ * Record the descriptors of each buffer, or size the memfds for the largest
+ * buffer when copying.
+ */
+void ShareSink::mapBuffer(const Stream *stream, FrameBuffer *buffer)
+{
+	if (!selected(stream))
+		return;
+
+	const std::vector<FrameBuffer::Plane> &planes = buffer->planes();
+
+	if (copy_) {
+		size_t size = 0;
+		for (const FrameBuffer::Plane &plane : planes)
+			size += (plane.length + kPlaneAlignment - 1) & ~(kPlaneAlignment - 1);
+
+		frameSize_ = std::max(frameSize_, size);
+		return;
+	}
+
+	std::unique_ptr<Buffer> entry = std::make_unique<Buffer>();
+	entry->index = pool_.size();
+	entry->frameBuffer = buffer;
+	entry->fdCount = 0;
+	entry->planes = std::min<size_t>(planes.size(), share::kMaxPlanes);
+	entry->copy = nullptr;
+	entry->copySize = 0;
+	entry->request = nullptr;
+	entry->sequence = 0;
+	entry->refs = 0;
+
+	/* Planes usually share a descriptor, which is only sent once. */
+	for (unsigned int i = 0; i < entry->planes; ++i) {
+		int fd = planes[i].fd.get();
+		unsigned int j = std::find(entry->fds, entry->fds + entry->fdCount, fd) - entry->fds;
+		if (j == entry->fdCount)
+			entry->fds[entry->fdCount++] = fd;
+
+		entry->planeFd[i] = j;
+		entry->planeOffset[i] = planes[i].offset;
+		entry->planeLength[i] = planes[i].length;
+	}
+
+	std::unique_lock<std::mutex> locker(lock_);
+	pool_.push_back(std::move(entry));
+}
+
+/**
+ * \brief Accept subscribers
+ * \return 0 on success or a negative error code otherwise
+ */
+int ShareSink::start()
+{
+	struct sockaddr_un addr = {};
+
+	if (fd_ >= 0)
+		return 0;
+
+	if (path_.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path_.c_str(), path_.size() + 1);
+
+	fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return -errno;
+
+	unlink(path_.c_str());
+
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+	    listen(fd_, 8) < 0) {
+		int ret = -errno;
+		std::cerr << "failed to bind share socket " << path_ << ": "
+			  << strerror(-ret) << std::endl;
+		::close(fd_);
+		fd_ = -1;
+		return ret;
+	}
+
+	loop_.addFdEvent(fd_, EventLoop::Read, [this]() { accept(); });
+
+	return 0;
+}
+
+/**
+ * \brief Return the requests still held by the subscribers
+ *
+ * The subscribers stay connected, the releases of the frames they were sent
+ * before are ignored.
+ */
+int ShareSink::stop()
+{
+	std::vector<FrameRequest *> requests;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		for (std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+			std::fill(subscriber->holding.begin(), subscriber->holding.end(), false);
+			subscriber->held = 0;
+		}
+
+		for (std::unique_ptr<Buffer> &buffer : pool_) {
+			if (buffer->request)
+				requests.push_back(buffer->request);
+			buffer->request = nullptr;
+			buffer->refs = 0;
+		}
+	}
+
+	release(requests);
+
+	return FrameSink::stop();
+}
+
+/**
+ * \brief Disconnect the subscribers and remove the socket
+ *
+ * This function shall be called from the loop thread, or once the loop has
+ * stopped.
+ */
+void ShareSink::close()
+{
+	while (true) {
+		Subscriber *subscriber;
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			if (subscribers_.empty())
+				break;
+			subscriber = subscribers_.back().get();
+		}
+
+		drop(subscriber);
+	}
+
+	if (fd_ < 0)
+		return;
+
+	loop_.removeFdEvent(fd_, EventLoop::Read);
+	::close(fd_);
+	fd_ = -1;
+	unlink(path_.c_str());
+}
+
+bool ShareSink::processRequest(FrameRequest *request)
+{
+	const Stream *stream = nullptr;
+	FrameBuffer *frameBuffer = nullptr;
+
+	for (auto [s, b] : request->buffers()) {
+		if (selected(s)) {
+			stream = s;
+			frameBuffer = b;
+			break;
+		}
+	}
+
+	if (!frameBuffer)
+		return true;
+
+	const FrameRequest::Metadata &metadata = request->metadata(frameBuffer);
+	Buffer *buffer = nullptr;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		frames_++;
+
+		bool ready = std::any_of(subscribers_.begin(), subscribers_.end(),
+					 [](const std::unique_ptr<Subscriber> &subscriber) {
+						 return subscriber->held < kMaxHeld;
+					 });
+		if (!ready) {
+			if (!subscribers_.empty())
+				skipped_ += subscribers_.size();
+			return true;
+		}
+
+		if (copy_) {
+			buffer = acquireCopy();
+		} else {
+			auto iter = std::find_if(pool_.begin(), pool_.end(),
+						 [frameBuffer](const std::unique_ptr<Buffer> &b) {
+							 return b->frameBuffer == frameBuffer;
+						 });
+			if (iter != pool_.end())
+				buffer = iter->get();
+		}
+
+		if (!buffer)
+			return true;
+
+		/* Keep the buffer while it is being published. */
+		buffer->refs = 1;
+		buffer->sequence = metadata.sequence;
+		buffer->request = copy_ ? nullptr : request;
+	}
+
+	bool copied = true;
+	if (copy_) {
+		TRACE_SCOPE("share", "copy", metadata.sequence);
+		copied = copyFrame(buffer, frameBuffer, metadata);
+	}
+
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (copied) {
+		if (copy_)
+			copies_++;
+		publish(buffer, stream, metadata);
+	}
+
+	/* The request is returned later if a subscriber holds it. */
+	FrameRequest *done = unref(buffer);
+	return copy_ || done == request;
+}
+
+/* Find a free memfd, or add one while there are less than kMaxCopies. */
+ShareSink::Buffer *ShareSink::acquireCopy()
+{
+	for (std::unique_ptr<Buffer> &buffer : pool_) {
+		if (!buffer->refs)
+			return buffer.get();
+	}
+
+	if (pool_.size() >= kMaxCopies || !frameSize_)
+		return nullptr;
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size_t size = (frameSize_ + pageSize - 1) / pageSize * pageSize;
+
+	int fd = memfd_create("disocamera-share", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		std::cerr << "failed to allocate share buffer: " << strerror(errno)
+			  << std::endl;
+		if (fd >= 0)
+			::close(fd);
+		return nullptr;
+	}
+
+	/* Subscribers map the whole memfd, which thus can't shrink. */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+	void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		std::cerr << "failed to map share buffer: " << strerror(errno)
+			  << std::endl;
+		::close(fd);
+		return nullptr;
+	}
+
+	std::unique_ptr<Buffer> buffer = std::make_unique<Buffer>();
+	buffer->index = pool_.size();
+	buffer->frameBuffer = nullptr;
+	buffer->fdCount = 1;
+	buffer->fds[0] = fd;
+	buffer->planes = 0;
+	buffer->copy = static_cast<uint8_t *>(data);
+	buffer->copySize = size;
+	buffer->request = nullptr;
+	buffer->sequence = 0;
+	buffer->refs = 0;
+
+	pool_.push_back(std::move(buffer));
+
+	return pool_.back().get();
+}
+
+bool ShareSink::copyFrame(Buffer *buffer, FrameBuffer *frameBuffer,
+			  const FrameRequest::Metadata &metadata)
+{
+	const Image *image = buffers_.find(frameBuffer);
+	if (!image) {
+		std::cerr << "buffer not mapped" << std::endl;
+		return false;
+	}
+
+	unsigned int planes = std::min<unsigned int>({ metadata.planes, image->numPlanes(),
+						       share::kMaxPlanes });
+	size_t offset = 0;
+
+	for (unsigned int i = 0; i < planes; ++i) {
+		Span<const uint8_t> data = image->data(i);
+		size_t length = std::min<size_t>(metadata.bytesused[i], data.size());
+		length = std::min(length, buffer->copySize - offset);
+
+		memcpy(buffer->copy + offset, data.data(), length);
+		buffer->planeFd[i] = 0;
+		buffer->planeOffset[i] = offset;
+		buffer->planeLength[i] = length;
+		offset = std::min(buffer->copySize,
+				  (offset + length + kPlaneAlignment - 1) & ~(kPlaneAlignment - 1));
+	}
+
+	buffer->planes = planes;
+
+	return true;
+}
+
+/* Send a frame to the subscribers ready for it, with the lock held. */
+void ShareSink::publish(Buffer *buffer, const Stream *stream,
+			const FrameRequest::Metadata &metadata)
+{
+	share::FrameMessage message = {};
+	message.magic = share::kFrameMagic;
+	message.size = sizeof(message);
+	message.buffer = buffer->index;
+	message.sequence = metadata.sequence;
+	message.timestamp = metadata.timestamp;
+
+	auto iter = streamConfigs_.find(stream);
+	if (iter != streamConfigs_.end()) {
+		const StreamConfiguration &cfg = iter->second;
+		message.fourcc = cfg.pixelFormat.fourcc();
+		message.modifier = cfg.pixelFormat.modifier();
+		message.width = cfg.size.width;
+		message.height = cfg.size.height;
+		message.stride = cfg.stride;
+	}
+
+	message.numPlanes = std::min(metadata.planes, buffer->planes);
+	for (unsigned int i = 0; i < message.numPlanes; ++i) {
+		message.planeFd[i] = buffer->planeFd[i];
+		message.planeOffset[i] = buffer->planeOffset[i];
+		message.planeSize[i] = std::min(metadata.bytesused[i], buffer->planeLength[i]);
+	}
+
+	bool published = false;
+
+	for (std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+		if (subscriber->held >= kMaxHeld) {
+			skipped_++;
+			continue;
+		}
+
+		if (subscriber->shared.size() < pool_.size()) {
+			subscriber->shared.resize(pool_.size(), false);
+			subscriber->holding.resize(pool_.size(), false);
+		}
+
+		/* The descriptors go with the first frame of each buffer only. */
+		bool attach = !subscriber->shared[buffer->index];
+		message.fds = attach ? buffer->fdCount : 0;
+
+		struct iovec iov = { &message, sizeof(message) };
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		union {
+			char data[CMSG_SPACE(sizeof(int) * share::kMaxPlanes)];
+			struct cmsghdr align;
+		} control;
+
+		if (attach) {
+			msg.msg_control = control.data;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * buffer->fdCount);
+
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * buffer->fdCount);
+			memcpy(CMSG_DATA(cmsg), buffer->fds, sizeof(int) * buffer->fdCount);
+		}
+
+		/* A full socket skips the frame, a failed one is dropped by receive(). */
+		if (sendmsg(subscriber->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			skipped_++;
+			continue;
+		}
+
+		if (attach) {
+			subscriber->shared[buffer->index] = true;
+			shares_++;
+		}
+
+		subscriber->holding[buffer->index] = true;
+		subscriber->held++;
+		buffer->refs++;
+		sent_++;
+		published = true;
+	}
+
+	if (published)
+		published_++;
+}
+
+/* Drop a reference to a buffer, returning its request once free, with the lock held. */
+FrameRequest *ShareSink::unref(Buffer *buffer)
+{
+	if (!buffer->refs || --buffer->refs)
+		return nullptr;
+
+	FrameRequest *request = buffer->request;
+	buffer->request = nullptr;
+
+	return request;
+}
+
+void ShareSink::release(const std::vector<FrameRequest *> &requests)
+{
+	for (FrameRequest *request : requests)
+		requestProcessed.emit(request);
+}
+
+void ShareSink::accept()
+{
+	while (true) {
+		int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				std::cerr << "failed to accept subscriber: "
+					  << strerror(errno) << std::endl;
+			return;
+		}
+
+		std::unique_ptr<Subscriber> subscriber = std::make_unique<Subscriber>();
+		subscriber->fd = fd;
+		subscriber->held = 0;
+		Subscriber *raw = subscriber.get();
+
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			if (subscribers_.size() >= kMaxSubscribers) {
+				::close(fd);
+				continue;
+			}
+
+			subscribers_.push_back(std::move(subscriber));
+			served_++;
+			maxSubscribers_ = std::max<unsigned int>(maxSubscribers_,
+								 subscribers_.size());
+		}
+
+		loop_.addFdEvent(fd, EventLoop::Read, [this, raw]() { receive(raw); });
+	}
+}
+
+/* Handle the releases sent by a subscriber, or its disconnection. */
+void ShareSink::receive(Subscriber *subscriber)
+{
+	std::vector<FrameRequest *> requests;
+	share::ReleaseMessage message;
+	bool failed = false;
+
+	while (true) {
+		ssize_t ret = recv(subscriber->fd, &message, sizeof(message), MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret != sizeof(message) || message.magic != share::kReleaseMagic) {
+			/* The subscriber went away, or doesn't speak the protocol. */
+			failed = true;
+			break;
+		}
+
+		std::unique_lock<std::mutex> locker(lock_);
+		if (message.buffer >= subscriber->holding.size() ||
+		    !subscriber->holding[message.buffer])
+			continue;
+
+		Buffer *buffer = pool_[message.buffer].get();
+		if (buffer->sequence != message.sequence)
+			continue;
+
+		subscriber->holding[message.buffer] = false;
+		subscriber->held--;
+
+		FrameRequest *request = unref(buffer);
+		if (request)
+			requests.push_back(request);
+	}
+
+	release(requests);
+
+	if (failed)
+		drop(subscriber);
+}
+
+/* Disconnect a subscriber, which releases the frames it holds. */
+void ShareSink::drop(Subscriber *subscriber)
+{
+	std::vector<FrameRequest *> requests;
+
+	loop_.removeFdEvent(subscriber->fd, EventLoop::Read);
+	::close(subscriber->fd);
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		for (unsigned int i = 0; i < subscriber->holding.size(); ++i) {
+			if (!subscriber->holding[i])
+				continue;
+
+			FrameRequest *request = unref(pool_[i].get());
+			if (request)
+				requests.push_back(request);
+		}
+
+		auto iter = std::find_if(subscribers_.begin(), subscribers_.end(),
+					 [subscriber](const std::unique_ptr<Subscriber> &s) {
+						 return s.get() == subscriber;
+					 });
+		subscribers_.erase(iter);
+	}
+
+	release(requests);
+}
+
+/**
+ * \brief Retrieve the number of subscribers connected
+ */
+unsigned int ShareSink::subscribers() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return subscribers_.size();
+}
+
+/**
+ * \brief Print the subscribers served and the frames shared and skipped
+ */
+void ShareSink::report(std::ostream &out) const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	out << path_ << ", " << served_ << " subscribers served, up to "
+	    << maxSubscribers_ << " at once, " << published_ << " of " << frames_
+	    << " frames published, " << sent_ << " sent, " << skipped_
+	    << " skipped by busy subscribers, " << shares_ << " buffers shared";
+	if (copy_)
+		out << ", " << copies_ << " frames copied to " << pool_.size()
+		    << " memfds";
+	out << std::endl;
+}
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * share_sink.h - Share the frames with other local processes
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <libcamera/stream.h>
+
+#include "frame_request.h"
+#include "frame_sink.h"
+#include "share_format.h"
+
+class BufferCache;
+class EventLoop;
+
+class ShareSink : public FrameSink
+{
+public:
+	ShareSink(EventLoop &loop, const BufferCache &buffers,
+		  const std::string &path, bool copy = false);
+	~ShareSink();
+
+	int configure(const libcamera::CameraConfiguration &config) override;
+	void mapBuffer(const libcamera::Stream *stream,
+		       libcamera::FrameBuffer *buffer) override;
+
+	int start() override;
+	int stop() override;
+
+	bool processRequest(FrameRequest *request) override;
+
+	void close();
+
+	const std::string &path() const { return path_; }
+	unsigned int subscribers() const;
+	void report(std::ostream &out) const;
+
+private:
+	/* A camera buffer, or a memfd frames are copied to */
+	struct Buffer {
+		unsigned int index;
+		const libcamera::FrameBuffer *frameBuffer;
+		unsigned int fdCount;
+		int fds[share::kMaxPlanes];
+		unsigned int planes;
+		uint32_t planeFd[share::kMaxPlanes];
+		uint32_t planeOffset[share::kMaxPlanes];
+		uint32_t planeLength[share::kMaxPlanes];
+
+		/* Mapping of the memfd, when copying */
+		uint8_t *copy;
+		size_t copySize;
+
+		/* Frame held by the subscribers, released once refs drops to 0 */
+		FrameRequest *request;
+		uint64_t sequence;
+		unsigned int refs;
+	};
+
+	struct Subscriber {
+		int fd;
+		/* Buffers whose descriptors have been sent, and held buffers */
+		std::vector<bool> shared;
+		std::vector<bool> holding;
+		unsigned int held;
+	};
+
+	void accept();
+	void receive(Subscriber *subscriber);
+	void drop(Subscriber *subscriber);
+
+	Buffer *acquireCopy();
+	bool copyFrame(Buffer *buffer, libcamera::FrameBuffer *frameBuffer,
+		       const FrameRequest::Metadata &metadata);
+	void publish(Buffer *buffer, const libcamera::Stream *stream,
+		     const FrameRequest::Metadata &metadata);
+	FrameRequest *unref(Buffer *buffer);
+	void release(const std::vector<FrameRequest *> &requests);
+
+	EventLoop &loop_;
+	const BufferCache &buffers_;
+	std::string path_;
+	bool copy_;
+	int fd_;
+
+	std::map<const libcamera::Stream *, libcamera::StreamConfiguration> streamConfigs_;
+	size_t frameSize_;
+
+	mutable std::mutex lock_;
+	std::vector<std::unique_ptr<Buffer>> pool_;
+	std::vector<std::unique_ptr<Subscriber>> subscribers_;
+
+	uint64_t served_;
+	uint64_t frames_;
+	uint64_t published_;
+	uint64_t sent_;
+	uint64_t shares_;
+	uint64_t skipped_;
+	uint64_t copies_;
+	unsigned int maxSubscribers_;
+};
@@ -0,0 +1,273 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * stats.cpp - Allocation-free latency statistics, startup phases, and process
+ * resources
+ */
+
+#include <dirent.h>
+#include <iomanip>
+#include <limits>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/**
+ * \class LatencyStats
+ * \brief Accumulate a latency distribution in a fixed-size histogram
+ *
+ * Samples are sorted in log-linear buckets, each power of two being split in
+ * 8 linear sub-buckets, which bounds the percentile error to 12.5% while
+ * keeping record() free of memory allocations. Minimum, maximum and mean are
+ * exact. All functions are thread-safe.
+ */
+
+LatencyStats::LatencyStats()
+{
+	reset();
+}
+
+unsigned int LatencyStats::bucket(uint64_t ns)
+{
+	if (ns < (1U << kSubBits))
+		return ns;
+
+	unsigned int msb = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (msb - kSubBits)) & ((1U << kSubBits) - 1);
+
+	return ((msb - kSubBits + 1) << kSubBits) + sub;
+}
+
+uint64_t LatencyStats::bucketLimit(unsigned int index)
+{
+	if (index < (1U << kSubBits))
+		return index;
+
+	unsigned int msb = (index >> kSubBits) + kSubBits - 1;
+	uint64_t sub = index & ((1U << kSubBits) - 1);
+
+	return ((1ULL << kSubBits | sub) << (msb - kSubBits)) +
+	       (1ULL << (msb - kSubBits)) - 1;
+}
+
+void LatencyStats::record(std::chrono::nanoseconds latency)
+{
+	uint64_t ns = std::max<int64_t>(latency.count(), 0);
+
+	std::unique_lock<std::mutex> locker(lock_);
+
+	histogram_[bucket(ns)]++;
+	count_++;
+	sum_ += ns;
+	min_ = std::min(min_, ns);
+	max_ = std::max(max_, ns);
+}
+
+void LatencyStats::reset()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	histogram_.fill(0);
+	count_ = 0;
+	sum_ = 0;
+	min_ = std::numeric_limits<uint64_t>::max();
+	max_ = 0;
+}
+
+uint64_t LatencyStats::count() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return count_;
+}
+
+std::chrono::nanoseconds LatencyStats::min() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return std::chrono::nanoseconds(count_ ? min_ : 0);
+}
+
+std::chrono::nanoseconds LatencyStats::max() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return std::chrono::nanoseconds(max_);
+}
+
+std::chrono::nanoseconds LatencyStats::mean() const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	return std::chrono::nanoseconds(count_ ? sum_ / count_ : 0);
+}
+
+/**
+ * \brief Estimate a percentile of the distribution
+ * \param[in] p The percentile, between 0 and 100
+ * \return The upper bound of the bucket holding the percentile, clamped to
+ * the exact maximum
+ */
+std::chrono::nanoseconds LatencyStats::percentile(double p) const
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (!count_)
+		return std::chrono::nanoseconds(0);
+
+	uint64_t rank = std::max<uint64_t>(1, p / 100 * count_ + 0.5);
+	uint64_t seen = 0;
+
+	for (unsigned int i = 0; i < kBuckets; ++i) {
+		seen += histogram_[i];
+		if (seen >= rank)
+			return std::chrono::nanoseconds(std::min(bucketLimit(i), max_));
+	}
+
+	return std::chrono::nanoseconds(max_);
+}
+
+/**
+ * \brief Print a one-line summary of the distribution, in microseconds
+ */
+void LatencyStats::report(std::ostream &out) const
+{
+	auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1000.0; };
+
+	out << "count " << count() << std::fixed << std::setprecision(1)
+	    << " min " << us(min()) << "us"
+	    << " p50 " << us(percentile(50)) << "us"
+	    << " p99 " << us(percentile(99)) << "us"
+	    << " max " << us(max()) << "us"
+	    << " mean " << us(mean()) << "us" << std::endl;
+}
+
+/**
+ * \class PhaseTimer
+ * \brief Record the phases of a startup, relative to the launch of the process
+ *
+ * Each phase is recorded with its start and end times, phases running
+ * concurrently on several threads thus show up as overlapping. Up to 24 phases
+ * are kept, without allocating memory, the next ones are ignored. All
+ * functions are thread-safe.
+ */
+
+PhaseTimer::PhaseTimer()
+	: count_(0)
+{
+}
+
+/**
+ * \brief Retrieve the time the process was launched at
+ *
+ * The start time of the process is read from /proc, to the resolution of the
+ * clock ticks, 10ms usually. It accounts for the dynamic linking and static
+ * constructors, which run before main().
+ *
+ * \return The launch time, or the time of the first call if it can't be read
+ */
+PhaseTimer::Clock::time_point PhaseTimer::launch()
+{
+	static const Clock::time_point launched = [] {
+		Clock::time_point now = Clock::now();
+
+		/* The command may contain spaces, the fields follow its last ')'. */
+		char stat[1024];
+		FILE *file = fopen("/proc/self/stat", "r");
+		if (!file)
+			return now;
+		size_t size = fread(stat, 1, sizeof(stat) - 1, file);
+		fclose(file);
+		stat[size] = '\0';
+
+		const char *fields = strrchr(stat, ')');
+		unsigned long long ticks;
+		if (!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+				      "%*u %*u %*d %*d %*d %*d %*d %*d %llu", &ticks) != 1)
+			return now;
+
+		/* The start time counts from boot, suspend included. */
+		struct timespec boot;
+		clock_gettime(CLOCK_BOOTTIME, &boot);
+		std::chrono::nanoseconds uptime = std::chrono::seconds(boot.tv_sec)
+						+ std::chrono::nanoseconds(boot.tv_nsec);
+		std::chrono::nanoseconds started(ticks * 1000000000ULL / sysconf(_SC_CLK_TCK));
+
+		return now - std::max(uptime - started, std::chrono::nanoseconds(0));
+	}();
+
+	return launched;
+}
+
+/**
+ * \brief Record a phase
+ * \param[in] name The name of the phase, a string literal
+ * \param[in] start The time the phase started at
+ * \param[in] end The time the phase ended at
+ */
+void PhaseTimer::record(const char *name, Clock::time_point start,
+			Clock::time_point end)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	if (count_ < kMaxPhases)
+		phases_[count_++] = { name, start, end };
+}
+
+/**
+ * \brief Print the phases, a line each, in milliseconds since the launch
+ */
+void PhaseTimer::report(std::ostream &out) const
+{
+	auto ms = [](Clock::duration duration) {
+		return std::chrono::duration<double, std::milli>(duration).count();
+	};
+
+	std::unique_lock<std::mutex> locker(lock_);
+
+	for (unsigned int i = 0; i < count_; ++i) {
+		const Phase &phase = phases_[i];
+		out << "  " << std::left << std::setw(16) << phase.name << std::right
+		    << std::fixed << std::setprecision(1)
+		    << std::setw(8) << ms(phase.start - launch()) << " -> "
+		    << std::setw(8) << ms(phase.end - launch()) << " ms ("
+		    << ms(phase.end - phase.start) << " ms)" << std::endl;
+	}
+	out << std::defaultfloat;
+}
+
+/**
+ * \struct ResourceUsage
+ * \brief Memory and file descriptors held by the process
+ *
+ * Both are read from /proc, a long running capture samples them periodically
+ * to check that they stay flat once the pools have warmed up.
+ */
+
+/**
+ * \brief Measure the resources currently held by the process
+ */
+ResourceUsage ResourceUsage::sample()
+{
+	ResourceUsage usage;
+
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		unsigned long size, resident;
+		if (fscanf(statm, "%lu %lu", &size, &resident) == 2)
+			usage.rss = resident * sysconf(_SC_PAGESIZE);
+		fclose(statm);
+	}
+
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir) {
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] != '.')
+				usage.fds++;
+		}
+		closedir(dir);
+
+		/* Not counting the descriptor of the directory itself */
+		usage.fds--;
+	}
+
+	return usage;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * stats.h - Allocation-free latency statistics, startup phases, and process
+ * resources
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+
+class LatencyStats
+{
+public:
+	LatencyStats();
+
+	void record(std::chrono::nanoseconds latency);
+	void reset();
+
+	uint64_t count() const;
+	std::chrono::nanoseconds min() const;
+	std::chrono::nanoseconds max() const;
+	std::chrono::nanoseconds mean() const;
+	std::chrono::nanoseconds percentile(double p) const;
+
+	void report(std::ostream &out) const;
+
+private:
+	/* 8 linear sub-buckets for each power of two of nanoseconds */
+	static constexpr unsigned int kSubBits = 3;
+	static constexpr unsigned int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+	static unsigned int bucket(uint64_t ns);
+	static uint64_t bucketLimit(unsigned int index);
+
+	mutable std::mutex lock_;
+	std::array<uint64_t, kBuckets> histogram_;
+	uint64_t count_;
+	uint64_t sum_;
+	uint64_t min_;
+	uint64_t max_;
+};
+
+struct ResourceUsage {
+	/* Resident memory, in bytes */
+	size_t rss = 0;
+	/* Open file descriptors */
+	unsigned int fds = 0;
+
+	static ResourceUsage sample();
+};
+
+class PhaseTimer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	PhaseTimer();
+
+	static Clock::time_point launch();
+
+	void record(const char *name, Clock::time_point start,
+		    Clock::time_point end = Clock::now());
+	void report(std::ostream &out) const;
+
+private:
+	static constexpr unsigned int kMaxPhases = 24;
+
+	struct Phase {
+		const char *name;
+		Clock::time_point start;
+		Clock::time_point end;
+	};
+
+	mutable std::mutex lock_;
+	std::array<Phase, kMaxPhases> phases_;
+	unsigned int count_;
+};
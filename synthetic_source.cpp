@@ -0,0 +1,267 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * synthetic_source.cpp - Frame source generating test frames
+ */
+
+#include <algorithm>
+#include <string.h>
+
+#include <libcamera/formats.h>
+
+#include "image.h"
+#include "jpeg_encoder.h"
+#include "synthetic_source.h"
+
+using namespace libcamera;
+
+/* Height of the moving band, and rows it moves by per frame */
+static constexpr unsigned int kBandHeight = 16;
+static constexpr unsigned int kBandStep = 4;
+
+static constexpr uint8_t kMarkerDHT = 0xc4;
+static constexpr uint8_t kMarkerSOS = 0xda;
+
+/**
+ * \class SyntheticSource
+ * \brief Generate frames without a camera
+ *
+ * Frames show gradients with some noise, so that the JPEG encoder has a
+ * realistic amount of work to do, and a white band moving down one frame
+ * after the other, so that consecutive frames differ. Only the rows under the
+ * band are rewritten for each frame, producing a frame costs little more than
+ * a memcpy of the band.
+ *
+ * Without the band, all frames are the same, as of a static scene.
+ *
+ * Frames are produced in planar YUV420 by default, or in one of the other
+ * formats cameras commonly output. MJPEG frames are compressed once per buffer
+ * when the buffers are allocated, with the band at a different row in each
+ * buffer, and carry no Huffman tables, as the frames of most UVC cameras.
+ */
+
+/**
+ * \param[in] size The frame size, in pixels, with even dimensions
+ * \param[in] fps The frame rate, 0 to produce frames as fast as they are
+ * consumed
+ * \param[in] moving Draw the moving band
+ * \param[in] pixelFormat The format of the frames, one supports() accepts
+ */
+SyntheticSource::SyntheticSource(const Size &size, unsigned int fps, bool moving,
+				 const PixelFormat &pixelFormat)
+	: MemorySource(fps), moving_(moving)
+{
+	unsigned int width = size.width & ~1U;
+	unsigned int height = size.height & ~1U;
+	unsigned int lumaSize = width * height;
+
+	Format format;
+	format.pixelFormat = supports(pixelFormat) ? pixelFormat : formats::YUV420;
+	format.size = Size(width, height);
+	format.stride = width;
+
+	if (format.pixelFormat == formats::NV12) {
+		format.planeSizes = { lumaSize, lumaSize / 2 };
+	} else if (format.pixelFormat == formats::YUYV) {
+		format.stride = width * 2;
+		format.planeSizes = { lumaSize * 2 };
+	} else if (format.pixelFormat == formats::MJPEG) {
+		format.stride = 0;
+		format.planeSizes = { static_cast<unsigned int>(JpegEncoder::maxOutputSize(width, height)) };
+	} else {
+		format.planeSizes = { lumaSize, lumaSize / 4, lumaSize / 4 };
+	}
+
+	setFormat(format);
+}
+
+/**
+ * \brief Check if frames can be generated in a pixel format
+ */
+bool SyntheticSource::supports(const PixelFormat &pixelFormat)
+{
+	return pixelFormat == formats::YUV420 || pixelFormat == formats::NV12 ||
+	       pixelFormat == formats::YUYV || pixelFormat == formats::MJPEG;
+}
+
+std::string SyntheticSource::id() const
+{
+	std::string id = (moving_ ? "synthetic-" : "static-") + format().size.toString();
+	if (format().pixelFormat != formats::YUV420)
+		id += "-" + format().pixelFormat.toString();
+
+	return id;
+}
+
+/* Generate the pattern, the same in all buffers, in planar YUV420. */
+void SyntheticSource::generate()
+{
+	const Size &size = format().size;
+	unsigned int lumaSize = size.width * size.height;
+	unsigned int seed = 1;
+
+	pattern_.resize(lumaSize * 3 / 2);
+	uint8_t *u = pattern_.data() + lumaSize;
+	uint8_t *v = u + lumaSize / 4;
+
+	for (unsigned int row = 0; row < size.height; ++row) {
+		for (unsigned int col = 0; col < size.width; ++col) {
+			seed = seed * 1103515245 + 12345;
+			pattern_[row * size.width + col] = (col + row) / 8 + (seed >> 28);
+		}
+	}
+
+	for (unsigned int row = 0; row < size.height / 2; ++row) {
+		for (unsigned int col = 0; col < size.width / 2; ++col) {
+			u[row * size.width / 2 + col] = 128 + col / 16;
+			v[row * size.width / 2 + col] = 128 - row / 16;
+		}
+	}
+}
+
+/* Draw the band from a row of the first plane. */
+void SyntheticSource::drawBand(uint8_t *data, unsigned int row) const
+{
+	const Size &size = format().size;
+	unsigned int stride = format().stride;
+	unsigned int band = std::min(kBandHeight, size.height);
+
+	for (unsigned int i = row; i < row + band; ++i) {
+		uint8_t *line = data + i * stride;
+
+		if (format().pixelFormat == formats::YUYV) {
+			for (unsigned int col = 0; col < size.width; ++col)
+				line[col * 2] = 235;
+		} else {
+			memset(line, 235, size.width);
+		}
+	}
+}
+
+void SyntheticSource::prepare(unsigned int index, Image *image)
+{
+	const Size &size = format().size;
+	const PixelFormat &pixelFormat = format().pixelFormat;
+	unsigned int lumaSize = size.width * size.height;
+
+	if (pattern_.empty())
+		generate();
+
+	if (bands_.size() <= index) {
+		bands_.resize(index + 1, 0);
+		sizes_.resize(index + 1, 0);
+	}
+	bands_[index] = 0;
+
+	if (pixelFormat == formats::MJPEG) {
+		compress(image, index);
+		return;
+	}
+
+	const uint8_t *y = pattern_.data();
+	const uint8_t *u = y + lumaSize;
+	const uint8_t *v = u + lumaSize / 4;
+	uint8_t *dst = image->data(0).data();
+
+	if (pixelFormat == formats::YUYV) {
+		for (unsigned int row = 0; row < size.height; ++row) {
+			uint8_t *line = dst + row * size.width * 2;
+			unsigned int chroma = row / 2 * size.width / 2;
+
+			for (unsigned int col = 0; col < size.width; col += 2) {
+				line[col * 2] = y[row * size.width + col];
+				line[col * 2 + 1] = u[chroma + col / 2];
+				line[col * 2 + 2] = y[row * size.width + col + 1];
+				line[col * 2 + 3] = v[chroma + col / 2];
+			}
+		}
+	} else if (pixelFormat == formats::NV12) {
+		uint8_t *uv = image->data(1).data();
+
+		memcpy(dst, y, lumaSize);
+		for (unsigned int i = 0; i < lumaSize / 4; ++i) {
+			uv[i * 2] = u[i];
+			uv[i * 2 + 1] = v[i];
+		}
+	} else {
+		memcpy(dst, y, lumaSize);
+		memcpy(image->data(1).data(), u, lumaSize / 4);
+		memcpy(image->data(2).data(), v, lumaSize / 4);
+	}
+
+	if (rows_.empty())
+		rows_.assign(dst, dst + format().stride * size.height);
+}
+
+/* Compress a frame to the buffer, without its Huffman tables. */
+void SyntheticSource::compress(Image *image, unsigned int index)
+{
+	const Size &size = format().size;
+	unsigned int lumaSize = size.width * size.height;
+	std::vector<uint8_t> pixels = pattern_;
+
+	if (moving_) {
+		unsigned int band = std::min(kBandHeight, size.height);
+		unsigned int row = index * kBandHeight % (size.height - band + 1);
+		memset(pixels.data() + row * size.width, 235, band * size.width);
+	}
+
+	JpegEncoder::Frame frame;
+	frame.width = size.width;
+	frame.height = size.height;
+	frame.y = pixels.data();
+	frame.u = frame.y + lumaSize;
+	frame.v = frame.u + lumaSize / 4;
+	frame.stride = size.width;
+	frame.chromaStride = size.width / 2;
+
+	JpegEncoder encoder(1);
+	std::vector<uint8_t> jpeg;
+	encoder.encode(frame, jpeg);
+
+	/* Copy the marker segments but the DHT ones, and the scan. */
+	uint8_t *dst = image->data(0).data();
+	size_t pos = 2;
+	size_t used = 2;
+
+	memcpy(dst, jpeg.data(), 2);
+	while (pos + 4 <= jpeg.size()) {
+		uint8_t marker = jpeg[pos + 1];
+		size_t length = marker == kMarkerSOS ? jpeg.size() - pos
+			      : 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+
+		if (marker != kMarkerDHT) {
+			memcpy(dst + used, jpeg.data() + pos, length);
+			used += length;
+		}
+
+		pos += length;
+	}
+
+	sizes_[index] = used;
+}
+
+void SyntheticSource::fill(unsigned int index, Image *image,
+			   FrameRequest::Metadata &metadata)
+{
+	if (format().pixelFormat == formats::MJPEG) {
+		metadata.bytesused[0] = sizes_[index];
+		return;
+	}
+
+	if (!moving_)
+		return;
+
+	const Size &size = format().size;
+	unsigned int stride = format().stride;
+	uint8_t *data = image->data(0).data();
+	unsigned int band = std::min(kBandHeight, size.height);
+	unsigned int range = size.height - band + 1;
+
+	/* Restore the rows the band covered the last time the buffer was used. */
+	size_t offset = bands_[index] * stride;
+	memcpy(data + offset, rows_.data() + offset, band * stride);
+
+	unsigned int row = (metadata.sequence * kBandStep) % range;
+	drawBand(data, row);
+	bands_[index] = row;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * synthetic_source.h - Frame source generating test frames
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <libcamera/formats.h>
+#include <libcamera/geometry.h>
+#include <libcamera/pixel_format.h>
+
+#include "memory_source.h"
+
+class SyntheticSource : public MemorySource
+{
+public:
+	SyntheticSource(const libcamera::Size &size, unsigned int fps,
+			bool moving = true,
+			const libcamera::PixelFormat &pixelFormat = libcamera::formats::YUV420);
+
+	static bool supports(const libcamera::PixelFormat &pixelFormat);
+
+	std::string id() const override;
+
+protected:
+	void prepare(unsigned int index, Image *image) override;
+	void fill(unsigned int index, Image *image,
+		  FrameRequest::Metadata &metadata) override;
+
+private:
+	void generate();
+	void drawBand(uint8_t *data, unsigned int row) const;
+	void compress(Image *image, unsigned int index);
+
+	bool moving_;
+
+	/* The pattern in planar YUV420 */
+	std::vector<uint8_t> pattern_;
+	/* First plane of the pattern, to restore the rows under the moving band */
+	std::vector<uint8_t> rows_;
+	/* First row of the band drawn in each buffer */
+	std::vector<unsigned int> bands_;
+	/* Size of the MJPEG frame in each buffer */
+	std::vector<unsigned int> sizes_;
+};
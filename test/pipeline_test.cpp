@@ -0,0 +1,493 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pipeline_test.cpp - Backpressure policies of the Pipeline stages
+ *
+ * A stage whose sink is held by the test, or deliberately slow, receives
+ * requests with synthetic sensor timestamps. For each policy, the requests
+ * processed, the drops and their reasons are checked against what was fed,
+ * no request shall be processed past the latency budget of the stage, and
+ * every request shall be released exactly once.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+#include "frame_request.h"
+#include "frame_sink.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+unsigned int failures = 0;
+
+#define CHECK(condition)                                                        \
+	do {                                                                    \
+		if (!(condition)) {                                             \
+			std::cerr << __func__ << ":" << __LINE__ << ": "        \
+				  << #condition << std::endl;                   \
+			failures++;                                             \
+		}                                                               \
+	} while (0)
+
+uint64_t monotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A sink that holds each request until the test opens it, and then takes
+ * delay to process it. The age of the requests when their processing starts
+ * is recorded.
+ */
+class SlowSink : public FrameSink
+{
+public:
+	SlowSink(std::chrono::nanoseconds delay = {}, bool open = true)
+		: delay_(delay), open_(open)
+	{
+	}
+
+	bool processRequest(FrameRequest *request) override
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		processed_.push_back(request->cookie());
+		ages_.push_back(std::chrono::nanoseconds(monotonic() - request->timestamp()));
+		cond_.notify_all();
+
+		cond_.wait(locker, [this] { return open_; });
+		locker.unlock();
+
+		std::this_thread::sleep_for(delay_);
+		return true;
+	}
+
+	void open()
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		open_ = true;
+		cond_.notify_all();
+	}
+
+	/* Wait for the sink to have started processing count requests. */
+	void waitStarted(size_t count)
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		cond_.wait(locker, [&] { return processed_.size() >= count; });
+	}
+
+	std::vector<uint64_t> processed() const
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		return processed_;
+	}
+
+	std::chrono::nanoseconds maxAge() const
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		std::chrono::nanoseconds max{ 0 };
+		for (std::chrono::nanoseconds age : ages_)
+			max = std::max(max, age);
+		return max;
+	}
+
+private:
+	std::chrono::nanoseconds delay_;
+
+	mutable std::mutex lock_;
+	std::condition_variable cond_;
+	bool open_;
+	std::vector<uint64_t> processed_;
+	std::vector<std::chrono::nanoseconds> ages_;
+};
+
+/*
+ * A sink that processes up to capacity requests at a time, each on a thread
+ * of its own for delay, and releases them from there. The age of the requests
+ * when their processing starts, and the requests held, are recorded.
+ */
+class AsyncSink : public FrameSink
+{
+public:
+	AsyncSink(unsigned int capacity, std::chrono::nanoseconds delay)
+		: capacity_(capacity), delay_(delay), held_(0), maxHeld_(0),
+		  maxAge_(0)
+	{
+	}
+
+	bool processRequest(FrameRequest *request) override
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		maxAge_ = std::max(maxAge_, std::chrono::nanoseconds(monotonic() - request->timestamp()));
+		maxHeld_ = std::max(maxHeld_, ++held_);
+
+		threads_.emplace_back([this, request] {
+			std::this_thread::sleep_for(delay_);
+			{
+				std::unique_lock<std::mutex> threadLocker(lock_);
+				held_--;
+			}
+			requestProcessed.emit(request);
+		});
+
+		return false;
+	}
+
+	int stop() override
+	{
+		std::vector<std::thread> threads;
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			threads = std::move(threads_);
+		}
+
+		for (std::thread &thread : threads)
+			thread.join();
+
+		return 0;
+	}
+
+	unsigned int capacity() const override { return capacity_; }
+
+	unsigned int maxHeld() const
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		return maxHeld_;
+	}
+
+	std::chrono::nanoseconds maxAge() const
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		return maxAge_;
+	}
+
+private:
+	unsigned int capacity_;
+	std::chrono::nanoseconds delay_;
+
+	mutable std::mutex lock_;
+	std::vector<std::thread> threads_;
+	unsigned int held_;
+	unsigned int maxHeld_;
+	std::chrono::nanoseconds maxAge_;
+};
+
+/* Requests with a buffer each, the cookies numbering them from 0 */
+template<typename Sink>
+class Fixture
+{
+public:
+	Fixture(unsigned int count, const Pipeline::Policy &policy,
+		std::unique_ptr<Sink> sink)
+		: pool_(1), pipeline_(pool_), released_(count, 0)
+	{
+		for (unsigned int i = 0; i < count; ++i) {
+			buffers_.push_back(std::make_unique<libcamera::FrameBuffer>(
+				std::vector<libcamera::FrameBuffer::Plane>{}));
+			requests_.push_back(std::make_unique<FrameRequest>(i));
+			requests_.back()->addBuffer(&stream_, buffers_.back().get());
+		}
+
+		sink_ = pipeline_.add("slow", std::move(sink), policy);
+		pipeline_.requestProcessed.connect(this, [this](FrameRequest *request) {
+			std::unique_lock<std::mutex> locker(lock_);
+			released_[request->cookie()]++;
+		});
+		pipeline_.start();
+	}
+
+	/* Feed a request captured age ago */
+	void feed(unsigned int index, std::chrono::nanoseconds age = {})
+	{
+		FrameRequest *request = requests_[index].get();
+		request->metadata(buffers_[index].get()).timestamp = monotonic() - age.count();
+		request->metadata(buffers_[index].get()).sequence = index;
+		if (pipeline_.processRequest(request)) {
+			std::unique_lock<std::mutex> locker(lock_);
+			released_[index]++;
+		}
+	}
+
+	Pipeline::StageStats stop()
+	{
+		pipeline_.stop();
+		return pipeline_.stats()[0];
+	}
+
+	/* Every request fed shall have been released once, and only once */
+	bool releasedOnce(unsigned int fed)
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		for (unsigned int i = 0; i < released_.size(); ++i) {
+			if (released_[i] != (i < fed ? 1U : 0U))
+				return false;
+		}
+		return true;
+	}
+
+	Pipeline &pipeline() { return pipeline_; }
+	Sink *sink() { return sink_; }
+
+private:
+	ThreadPool pool_;
+	Pipeline pipeline_;
+	Sink *sink_;
+
+	libcamera::Stream stream_;
+	std::vector<std::unique_ptr<libcamera::FrameBuffer>> buffers_;
+	std::vector<std::unique_ptr<FrameRequest>> requests_;
+
+	std::mutex lock_;
+	std::vector<unsigned int> released_;
+};
+
+uint64_t drops(const Pipeline::StageStats &stats)
+{
+	uint64_t total = 0;
+	for (uint64_t count : stats.dropped)
+		total += count;
+	return total;
+}
+
+/* Requests arriving on a full queue are dropped, the queued ones processed */
+void testDropNewest()
+{
+	Pipeline::Policy policy;
+	policy.overflow = Pipeline::Overflow::DropNewest;
+	policy.maxQueued = 2;
+	Fixture fixture(8, policy, std::make_unique<SlowSink>(0ms, false));
+
+	fixture.feed(0);
+	fixture.sink()->waitStarted(1);
+	for (unsigned int i = 1; i < 8; ++i)
+		fixture.feed(i);
+	fixture.sink()->open();
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->processed() == (std::vector<uint64_t>{ 0, 1, 2 }));
+	CHECK(stats.processed == 3);
+	CHECK(stats.dropped[Pipeline::DropQueueFull] == 5);
+	CHECK(drops(stats) == 5);
+	CHECK(stats.maxQueued == 2);
+	CHECK(fixture.releasedOnce(8));
+}
+
+/* Requests arriving on a full queue replace the oldest queued ones */
+void testDropOldest()
+{
+	Pipeline::Policy policy;
+	policy.overflow = Pipeline::Overflow::DropOldest;
+	policy.maxQueued = 2;
+	Fixture fixture(8, policy, std::make_unique<SlowSink>(0ms, false));
+
+	fixture.feed(0);
+	fixture.sink()->waitStarted(1);
+	for (unsigned int i = 1; i < 8; ++i)
+		fixture.feed(i);
+	fixture.sink()->open();
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->processed() == (std::vector<uint64_t>{ 0, 6, 7 }));
+	CHECK(stats.processed == 3);
+	CHECK(stats.dropped[Pipeline::DropQueueFull] == 5);
+	CHECK(drops(stats) == 5);
+	CHECK(fixture.releasedOnce(8));
+}
+
+/* The caller waits for room in the queue, nothing is dropped */
+void testBlock()
+{
+	Pipeline::Policy policy;
+	policy.overflow = Pipeline::Overflow::Block;
+	policy.maxQueued = 2;
+	Fixture fixture(8, policy, std::make_unique<SlowSink>(0ms, false));
+
+	fixture.feed(0);
+	fixture.sink()->waitStarted(1);
+
+	std::mutex lock;
+	unsigned int fed = 1;
+	std::thread feeder([&]() {
+		for (unsigned int i = 1; i < 8; ++i) {
+			fixture.feed(i);
+			std::unique_lock<std::mutex> locker(lock);
+			fed++;
+		}
+	});
+
+	/* Two requests fit in the queue, the third one holds the caller. */
+	std::this_thread::sleep_for(50ms);
+	{
+		std::unique_lock<std::mutex> locker(lock);
+		CHECK(fed == 3);
+	}
+	CHECK(fixture.pipeline().stats()[0].queued == 2);
+
+	fixture.sink()->open();
+	feeder.join();
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->processed() ==
+	      (std::vector<uint64_t>{ 0, 1, 2, 3, 4, 5, 6, 7 }));
+	CHECK(stats.processed == 8);
+	CHECK(drops(stats) == 0);
+	CHECK(fixture.releasedOnce(8));
+}
+
+/* One request out of keepEvery is processed, whatever the load */
+void testKeepEvery()
+{
+	Pipeline::Policy policy;
+	policy.keepEvery = 3;
+	Fixture fixture(10, policy, std::make_unique<SlowSink>(1ms));
+
+	for (unsigned int i = 0; i < 10; ++i)
+		fixture.feed(i);
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->processed() == (std::vector<uint64_t>{ 0, 3, 6, 9 }));
+	CHECK(stats.processed == 4);
+	CHECK(stats.dropped[Pipeline::DropDecimated] == 6);
+	CHECK(drops(stats) == 6);
+	CHECK(fixture.releasedOnce(10));
+}
+
+/*
+ * Requests older than the budget are dropped, whether they are late when
+ * queued or become late waiting in the queue.
+ */
+void testBudgetDrops()
+{
+	Pipeline::Policy policy;
+	policy.budget = 30ms;
+	Fixture fixture(6, policy, std::make_unique<SlowSink>(0ms, false));
+
+	fixture.feed(0);
+	fixture.sink()->waitStarted(1);
+	fixture.feed(1, 100ms);		/* Late when queued */
+	fixture.feed(2);		/* Late once the sink is done with 0 */
+	fixture.feed(3);
+	std::this_thread::sleep_for(60ms);
+	fixture.sink()->open();
+
+	/* Wait for the queue to drain, a fresh request is then processed. */
+	fixture.pipeline().stop();
+	fixture.feed(4);
+	fixture.feed(5, 200ms);		/* Late when queued */
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->processed() == (std::vector<uint64_t>{ 0, 4 }));
+	CHECK(stats.processed == 2);
+	CHECK(stats.dropped[Pipeline::DropLate] == 4);
+	CHECK(drops(stats) == 4);
+	CHECK(fixture.releasedOnce(6));
+}
+
+/*
+ * A sink slower than the frame rate, with an unbounded queue, only keeps up
+ * thanks to the budget, which bounds the age of the frames it processes.
+ */
+void testBudgetHolds()
+{
+	constexpr unsigned int kFrames = 60;
+	/* Time from the check of the pipeline to the sink, on a loaded machine */
+	constexpr std::chrono::nanoseconds kTolerance = 5ms;
+
+	Pipeline::Policy policy;
+	policy.budget = 30ms;
+	Fixture fixture(kFrames, policy, std::make_unique<SlowSink>(10ms));
+
+	for (unsigned int i = 0; i < kFrames; ++i) {
+		fixture.feed(i);
+		std::this_thread::sleep_for(4ms);
+	}
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->maxAge() <= policy.budget + kTolerance);
+	CHECK(stats.processed + stats.dropped[Pipeline::DropLate] == kFrames);
+	CHECK(stats.dropped[Pipeline::DropLate] > 0);
+	CHECK(drops(stats) == stats.dropped[Pipeline::DropLate]);
+	CHECK(fixture.releasedOnce(kFrames));
+
+	std::cout << "budget 30 ms, sink 10 ms per frame, a frame every 4 ms: "
+		  << stats.processed << " processed, "
+		  << stats.dropped[Pipeline::DropLate] << " late, oldest processed "
+		  << std::chrono::duration<double, std::milli>(fixture.sink()->maxAge()).count()
+		  << " ms" << std::endl;
+}
+
+/*
+ * A sink compressing a couple of frames at a time on threads of its own, as
+ * JpegSink does, is only handed requests it can start processing. The others
+ * wait in the queue of the stage, where the policy of the stills drops them,
+ * and don't age in the sink past the budget.
+ */
+void testAsyncBudget()
+{
+	constexpr unsigned int kFrames = 80;
+	constexpr std::chrono::nanoseconds kTolerance = 5ms;
+
+	Pipeline::Policy policy;
+	policy.overflow = Pipeline::Overflow::DropOldest;
+	policy.maxQueued = 2;
+	policy.budget = 30ms;
+	Fixture fixture(kFrames, policy, std::make_unique<AsyncSink>(2, 20ms));
+
+	for (unsigned int i = 0; i < kFrames; ++i) {
+		fixture.feed(i);
+		std::this_thread::sleep_for(4ms);
+	}
+
+	Pipeline::StageStats stats = fixture.stop();
+	CHECK(fixture.sink()->maxAge() <= policy.budget + kTolerance);
+	CHECK(fixture.sink()->maxHeld() <= 2);
+	CHECK(stats.maxQueued <= 2);
+	CHECK(stats.processed + stats.dropped[Pipeline::DropQueueFull] +
+	      stats.dropped[Pipeline::DropLate] == kFrames);
+	CHECK(stats.dropped[Pipeline::DropQueueFull] > 0);
+	CHECK(drops(stats) == stats.dropped[Pipeline::DropQueueFull] +
+			      stats.dropped[Pipeline::DropLate]);
+	CHECK(fixture.releasedOnce(kFrames));
+
+	std::cout << "budget 30 ms, 2 asynchronous workers 20 ms per frame, a frame every 4 ms: "
+		  << stats.processed << " processed, "
+		  << stats.dropped[Pipeline::DropQueueFull] << " full, "
+		  << stats.dropped[Pipeline::DropLate] << " late, oldest processed "
+		  << std::chrono::duration<double, std::milli>(fixture.sink()->maxAge()).count()
+		  << " ms" << std::endl;
+}
+
+} /* namespace */
+
+int main()
+{
+	testDropNewest();
+	testDropOldest();
+	testBlock();
+	testKeepEvery();
+	testBudgetDrops();
+	testBudgetHolds();
+	testAsyncBudget();
+
+	if (failures) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "all policies hold" << std::endl;
+	return 0;
+}
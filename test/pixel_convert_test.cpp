@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * pixel_convert_test.cpp - Bit-exactness of the SIMD pixel conversions
+ *
+ * Every instruction set the CPU supports is compared byte for byte with the
+ * scalar reference, kernel by kernel and through the plane conversions, for
+ * odd sizes, padded strides and unaligned rows. Buffers are sized exactly, so
+ * that reads and writes past the tails are caught by AddressSanitizer.
+ */
+
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "pixel_convert.h"
+#include "pixel_convert_kernels.h"
+
+using namespace convert;
+
+namespace {
+
+unsigned int failures = 0;
+uint32_t seed = 1;
+
+/* A buffer of exactly size bytes, starting offset bytes into its allocation */
+class Buffer
+{
+public:
+	Buffer(size_t size, unsigned int offset, bool random)
+		: storage_(size + offset), offset_(offset)
+	{
+		for (uint8_t &byte : storage_) {
+			seed = seed * 1103515245 + 12345;
+			byte = random ? seed >> 24 : 0xa5;
+		}
+	}
+
+	uint8_t *data() { return storage_.data() + offset_; }
+	size_t size() const { return storage_.size() - offset_; }
+
+	bool operator==(const Buffer &other) const
+	{
+		return size() == other.size() && (!size() ||
+		       !memcmp(storage_.data() + offset_,
+			       other.storage_.data() + other.offset_, size()));
+	}
+
+private:
+	std::vector<uint8_t> storage_;
+	unsigned int offset_;
+};
+
+void check(bool ok, const char *isa, const char *what, unsigned int width,
+	   unsigned int height = 1, unsigned int offset = 0)
+{
+	if (ok)
+		return;
+
+	std::cerr << isa << " " << what << " differs from scalar for " << width
+		  << "x" << height << " at offset " << offset << std::endl;
+	failures++;
+}
+
+/* Kernels on single rows, every width up to a few vectors and a large one */
+void testKernels(const Kernels &k, const char *name)
+{
+	const Kernels &ref = scalarKernels;
+	std::vector<unsigned int> widths;
+	for (unsigned int width = 1; width <= 130; ++width)
+		widths.push_back(width);
+	widths.push_back(1921);
+
+	for (unsigned int width : widths) {
+		for (unsigned int offset = 0; offset < 4; ++offset) {
+			unsigned int chroma = (width + 1) / 2;
+
+			Buffer uv(2 * width, offset, true);
+			Buffer u0(width, offset, false), v0(width, offset, false);
+			Buffer u1(width, 0, false), v1(width, 0, false);
+			ref.splitUV(uv.data(), u0.data(), v0.data(), width);
+			k.splitUV(uv.data(), u1.data(), v1.data(), width);
+			check(u0 == u1 && v0 == v1, name, "splitUV", width, 1, offset);
+
+			for (unsigned int yOffset = 0; yOffset < 2; ++yOffset) {
+				Buffer src0(2 * width, offset, true);
+				Buffer src1(2 * width, 0, true);
+				Buffer y0(width, offset, false), y1(width, 0, false);
+				ref.packedToY(src0.data(), y0.data(), width, yOffset);
+				k.packedToY(src0.data(), y1.data(), width, yOffset);
+				check(y0 == y1, name, "packedToY", width, 1, offset);
+
+				Buffer pu0(width / 2, offset, false), pv0(width / 2, offset, false);
+				Buffer pu1(width / 2, 0, false), pv1(width / 2, 0, false);
+				ref.packedToUV(src0.data(), src1.data(), pu0.data(), pv0.data(),
+					       width, yOffset);
+				k.packedToUV(src0.data(), src1.data(), pu1.data(), pv1.data(),
+					     width, yOffset);
+				check(pu0 == pu1 && pv0 == pv1, name, "packedToUV", width, 1,
+				      offset);
+			}
+
+			Buffer y(width, offset, true);
+			Buffer u(chroma, 0, true), v(chroma, offset, true);
+			Buffer rgb0(3 * width, offset, false), rgb1(3 * width, 0, false);
+			ref.yuvToRgb24(y.data(), u.data(), v.data(), rgb0.data(), width);
+			k.yuvToRgb24(y.data(), u.data(), v.data(), rgb1.data(), width);
+			check(rgb0 == rgb1, name, "yuvToRgb24", width, 1, offset);
+
+			Buffer bgra0(4 * width, offset, false), bgra1(4 * width, 0, false);
+			ref.yuvToBgra(y.data(), u.data(), v.data(), bgra0.data(), width);
+			k.yuvToBgra(y.data(), u.data(), v.data(), bgra1.data(), width);
+			check(bgra0 == bgra1, name, "yuvToBgra", width, 1, offset);
+
+			unsigned int blocks = width / kBlockSize;
+			Buffer luma(blocks * kBlockSize, offset, true);
+			std::vector<uint32_t> sums0(blocks, 7), sums1(blocks, 7);
+			ref.sumBlocks(luma.data(), sums0.data(), blocks);
+			k.sumBlocks(luma.data(), sums1.data(), blocks);
+			check(sums0 == sums1, name, "sumBlocks", width, 1, offset);
+		}
+	}
+}
+
+/* Outputs of the plane conversions with the active instruction set */
+struct Outputs {
+	std::vector<Buffer> buffers;
+	std::vector<uint32_t> sums;
+};
+
+Outputs convertPlanes(unsigned int width, unsigned int height, unsigned int pad)
+{
+	unsigned int chromaWidth = (width + 1) / 2;
+	unsigned int chromaHeight = (height + 1) / 2;
+	unsigned int yStride = width + pad;
+	unsigned int cStride = chromaWidth + pad;
+	unsigned int packedStride = 2 * width + pad;
+
+	/* The same inputs for every instruction set */
+	seed = width * 1000 + height * 10 + pad;
+	Buffer y(yStride * (height - 1) + width, pad, true);
+	Buffer u(cStride * (chromaHeight - 1) + chromaWidth, 1, true);
+	Buffer v(cStride * (chromaHeight - 1) + chromaWidth, 0, true);
+	Buffer uv((2 * chromaWidth + pad) * (chromaHeight - 1) + 2 * chromaWidth, pad, true);
+	Buffer packed(packedStride * (height - 1) + 2 * width, 3, true);
+	const ConstPlane i420[3] = {
+		{ y.data(), yStride }, { u.data(), cStride }, { v.data(), cStride },
+	};
+
+	Outputs out;
+	auto output = [&](size_t size) -> uint8_t * {
+		out.buffers.emplace_back(size, 0, false);
+		return out.buffers.back().data();
+	};
+
+	/* Planar 4:2:0 destinations, with padding the conversions shall not touch */
+	auto i420Dst = [&](Plane dst[3]) {
+		dst[0] = { output(yStride * height), yStride };
+		dst[1] = { output(cStride * chromaHeight), cStride };
+		dst[2] = { output(cStride * chromaHeight), cStride };
+	};
+
+	Plane dst[3];
+	i420Dst(dst);
+	splitChroma({ uv.data(), 2 * chromaWidth + pad }, dst[1], dst[2], width, height);
+
+	i420Dst(dst);
+	yuyvToI420({ packed.data(), packedStride }, dst, width, height);
+	i420Dst(dst);
+	uyvyToI420({ packed.data(), packedStride }, dst, width, height);
+
+	i420ToRgb24(i420, { output((3 * width + pad) * height), 3 * width + pad },
+		    width, height);
+	i420ToBgra(i420, { output((4 * width + pad) * height), 4 * width + pad },
+		   width, height);
+
+	out.sums.resize((width / kBlockSize) * (height / kBlockSize));
+	sumBlocks({ y.data(), yStride }, width, height, 1, out.sums.data());
+
+	return out;
+}
+
+void testPlanes(Isa isa)
+{
+	const unsigned int sizes[][2] = {
+		{ 1, 1 }, { 2, 2 }, { 3, 5 }, { 17, 33 }, { 31, 7 },
+		{ 33, 17 }, { 63, 65 }, { 97, 31 }, { 129, 67 }, { 641, 35 },
+	};
+
+	for (const auto &size : sizes) {
+		for (unsigned int pad : { 0U, 1U, 13U, 64U }) {
+			setIsa(Isa::Scalar);
+			Outputs ref = convertPlanes(size[0], size[1], pad);
+			setIsa(isa);
+			Outputs out = convertPlanes(size[0], size[1], pad);
+
+			const char *names[] = { "splitChroma", "splitChroma", "splitChroma",
+						"yuyvToI420", "yuyvToI420", "yuyvToI420",
+						"uyvyToI420", "uyvyToI420", "uyvyToI420",
+						"i420ToRgb24", "i420ToBgra" };
+			for (unsigned int i = 0; i < ref.buffers.size(); ++i)
+				check(ref.buffers[i] == out.buffers[i], isaName(isa),
+				      names[i], size[0], size[1], pad);
+			check(ref.sums == out.sums, isaName(isa), "sumBlocks", size[0],
+			      size[1], pad);
+		}
+	}
+}
+
+} /* namespace */
+
+int main()
+{
+	const std::pair<Isa, const Kernels *> isas[] = {
+		{ Isa::SSE2, sse2Kernels() },
+		{ Isa::AVX2, avx2Kernels() },
+		{ Isa::NEON, neonKernels() },
+	};
+
+	unsigned int tested = 0;
+	for (const auto &[isa, kernels] : isas) {
+		if (!kernels) {
+			std::cout << isaName(isa) << ": not supported, skipped" << std::endl;
+			continue;
+		}
+
+		testKernels(*kernels, isaName(isa));
+		testPlanes(isa);
+		tested++;
+
+		std::cout << isaName(isa) << ": compared with scalar" << std::endl;
+	}
+
+	setIsa(bestIsa());
+
+	if (failures) {
+		std::cerr << failures << " mismatches" << std::endl;
+		return 1;
+	}
+
+	std::cout << tested << " instruction sets bit-exact with scalar" << std::endl;
+	return 0;
+}
@@ -0,0 +1,504 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * share_sink_test.cpp - Frames shared between a ShareSink and FrameSubscribers
+ *
+ * A ShareSink publishes frames of memfd backed buffers to FrameSubscribers
+ * connected to a socket in a temporary directory, its event loop running in
+ * a thread of its own. The planes received through SCM_RIGHTS shall match
+ * the frames published, in copy mode and when sharing the buffers, and every
+ * request shall be returned exactly once, whether it is released by the
+ * subscribers, released twice, released with a stale sequence or held by a
+ * subscriber going away.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <libcamera/camera.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+#include "buffer_cache.h"
+#include "event_loop.h"
+#include "frame_request.h"
+#include "frame_subscriber.h"
+#include "share_sink.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+unsigned int failures = 0;
+
+#define CHECK(condition)                                                        \
+	do {                                                                    \
+		if (!(condition)) {                                             \
+			std::cerr << __func__ << ":" << __LINE__ << ": "        \
+				  << #condition << std::endl;                   \
+			failures++;                                             \
+		}                                                               \
+	} while (0)
+
+constexpr unsigned int kWidth = 64;
+constexpr unsigned int kHeight = 48;
+constexpr unsigned int kLumaSize = kWidth * kHeight;
+constexpr unsigned int kChromaSize = kLumaSize / 2;
+
+class Configuration : public libcamera::CameraConfiguration
+{
+public:
+	Status validate() override { return Valid; }
+};
+
+/*
+ * NV12 frames in memfds, a request per buffer, and the count of the
+ * requests returned by the sink, synchronously or through requestProcessed.
+ */
+class Frames
+{
+public:
+	Frames(unsigned int count)
+		: released_(count, 0)
+	{
+		libcamera::StreamConfiguration cfg;
+		cfg.pixelFormat = libcamera::PixelFormat::fromString("NV12");
+		cfg.size = { kWidth, kHeight };
+		cfg.stride = kWidth;
+		cfg.setStream(&stream_);
+		config_.addConfiguration(cfg);
+
+		for (unsigned int i = 0; i < count; ++i) {
+			int fd = memfd_create("share-sink-test", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, kLumaSize + kChromaSize) < 0)
+				abort();
+			fds_.push_back(fd);
+
+			std::vector<libcamera::FrameBuffer::Plane> planes(2);
+			planes[0].fd = libcamera::SharedFD(fd);
+			planes[0].offset = 0;
+			planes[0].length = kLumaSize;
+			planes[1].fd = libcamera::SharedFD(fd);
+			planes[1].offset = kLumaSize;
+			planes[1].length = kChromaSize;
+			buffers_.push_back(std::make_unique<libcamera::FrameBuffer>(planes));
+			cache_.map(buffers_.back().get(), Image::MapMode::ReadWrite);
+
+			requests_.push_back(std::make_unique<FrameRequest>(i));
+			requests_.back()->addBuffer(&stream_, buffers_.back().get());
+		}
+	}
+
+	~Frames()
+	{
+		cache_.clear();
+		for (int fd : fds_)
+			close(fd);
+	}
+
+	void connect(ShareSink &sink)
+	{
+		sink.requestProcessed.connect(this, [this](FrameRequest *request) {
+			std::unique_lock<std::mutex> locker(lock_);
+			released_[request->cookie()]++;
+			cond_.notify_all();
+		});
+
+		sink.configure(config_);
+		for (std::unique_ptr<libcamera::FrameBuffer> &buffer : buffers_)
+			sink.mapBuffer(&stream_, buffer.get());
+	}
+
+	/* Fill a frame with a pattern of its seed, and publish it */
+	bool publish(ShareSink &sink, unsigned int index, uint8_t seed)
+	{
+		fill(index, seed);
+
+		FrameRequest *request = requests_[index].get();
+		FrameRequest::Metadata &metadata = request->metadata(buffers_[index].get());
+		metadata.sequence = sequence_++;
+		metadata.timestamp = 1000000ULL * metadata.sequence;
+		metadata.planes = 2;
+		metadata.bytesused[0] = kLumaSize;
+		metadata.bytesused[1] = kChromaSize;
+
+		bool done = sink.processRequest(request);
+		if (done) {
+			std::unique_lock<std::mutex> locker(lock_);
+			released_[index]++;
+		}
+		return done;
+	}
+
+	void fill(unsigned int index, uint8_t seed)
+	{
+		Image *image = cache_.find(buffers_[index].get());
+		for (unsigned int plane = 0; plane < 2; ++plane) {
+			libcamera::Span<uint8_t> data = image->data(plane);
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = pattern(seed, plane, i);
+		}
+	}
+
+	static uint8_t pattern(uint8_t seed, unsigned int plane, size_t offset)
+	{
+		return seed * 31 + plane * 101 + offset * 7 + (offset >> 8);
+	}
+
+	/* Check the frame received holds the pattern of seed */
+	static bool matches(const FrameSubscriber::Frame &frame, uint8_t seed)
+	{
+		if (frame.numPlanes != 2 || frame.planeSize[0] != kLumaSize ||
+		    frame.planeSize[1] != kChromaSize)
+			return false;
+
+		for (unsigned int plane = 0; plane < 2; ++plane) {
+			for (size_t i = 0; i < frame.planeSize[plane]; ++i) {
+				if (frame.planes[plane][i] != pattern(seed, plane, i))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	const BufferCache &cache() const { return cache_; }
+
+	unsigned int released(unsigned int index)
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		return released_[index];
+	}
+
+	/* Wait for a request to be returned through requestProcessed */
+	bool waitReleased(unsigned int index)
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		return cond_.wait_for(locker, 2s, [&] { return released_[index] > 0; });
+	}
+
+	uint64_t sequence(unsigned int index)
+	{
+		return requests_[index]->metadata(buffers_[index].get()).sequence;
+	}
+
+private:
+	Configuration config_;
+	libcamera::Stream stream_;
+	std::vector<int> fds_;
+	std::vector<std::unique_ptr<libcamera::FrameBuffer>> buffers_;
+	std::vector<std::unique_ptr<FrameRequest>> requests_;
+	BufferCache cache_;
+	uint64_t sequence_ = 0;
+
+	std::mutex lock_;
+	std::condition_variable cond_;
+	std::vector<unsigned int> released_;
+};
+
+/* The event loop of the sink, running in a thread of its own */
+class LoopThread
+{
+public:
+	LoopThread()
+		: thread_([this] { loop_.exec(); })
+	{
+	}
+
+	~LoopThread()
+	{
+		stop();
+	}
+
+	/* The sink may be closed once the loop has stopped. */
+	void stop()
+	{
+		if (!thread_.joinable())
+			return;
+
+		loop_.callLater([this] { loop_.exit(); });
+		thread_.join();
+	}
+
+	EventLoop &loop() { return loop_; }
+
+private:
+	EventLoop loop_;
+	std::thread thread_;
+};
+
+std::string socketPath()
+{
+	char dir[] = "/tmp/share-sink-test-XXXXXX";
+	if (!mkdtemp(dir))
+		abort();
+	return std::string(dir) + "/frames";
+}
+
+void removeSocket(const std::string &path)
+{
+	unlink(path.c_str());
+	rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+
+bool waitSubscribers(const ShareSink &sink, unsigned int count)
+{
+	for (unsigned int i = 0; i < 2000; ++i) {
+		if (sink.subscribers() == count)
+			return true;
+		std::this_thread::sleep_for(1ms);
+	}
+
+	return false;
+}
+
+/*
+ * Frames are copied to memfds and the requests returned right away, the
+ * memfds are reused once released.
+ */
+void testCopy()
+{
+	std::string path = socketPath();
+	Frames frames(4);
+	unsigned int attempts;
+
+	{
+		LoopThread thread;
+		ShareSink sink(thread.loop(), frames.cache(), path, true);
+		frames.connect(sink);
+		CHECK(sink.start() == 0);
+
+		FrameSubscriber subscriber;
+		CHECK(subscriber.connect(path) == 0);
+		CHECK(waitSubscribers(sink, 1));
+
+		/* The frame received is the one published, not the buffer reused. */
+		FrameSubscriber::Frame first;
+		CHECK(frames.publish(sink, 0, 1));
+		frames.fill(0, 2);
+		CHECK(subscriber.receive(&first, 1000) == 0);
+		CHECK(Frames::matches(first, 1));
+		CHECK(first.sequence == frames.sequence(0));
+		CHECK(first.width == kWidth && first.height == kHeight);
+		CHECK(first.stride == kWidth);
+
+		/* A memfd per frame held. */
+		FrameSubscriber::Frame second;
+		CHECK(frames.publish(sink, 1, 3));
+		CHECK(subscriber.receive(&second, 1000) == 0);
+		CHECK(Frames::matches(second, 3));
+		CHECK(second.buffer != first.buffer);
+
+		/* The subscriber holds as many frames as it may, the next is skipped. */
+		FrameSubscriber::Frame frame;
+		CHECK(frames.publish(sink, 2, 4));
+		CHECK(subscriber.receive(&frame, 50) == -EAGAIN);
+
+		/*
+		 * Once the first frame is released, its memfd carries the next
+		 * frame. The release is handled by the loop thread, publish
+		 * until the sink is done with it.
+		 */
+		CHECK(subscriber.release(first) == 0);
+		int ret = -EAGAIN;
+		for (attempts = 0; attempts < 100 && ret == -EAGAIN; ++attempts) {
+			CHECK(frames.publish(sink, 3, 5));
+			ret = subscriber.receive(&frame, 10);
+		}
+		CHECK(ret == 0);
+		CHECK(frame.buffer == first.buffer);
+		CHECK(Frames::matches(frame, 5));
+
+		CHECK(subscriber.release(second) == 0);
+		CHECK(subscriber.release(frame) == 0);
+
+		sink.stop();
+		thread.stop();
+		sink.close();
+	}
+
+	/* Requests never wait for the subscribers in copy mode. */
+	for (unsigned int i = 0; i < 3; ++i)
+		CHECK(frames.released(i) == 1);
+	CHECK(frames.released(3) == attempts);
+
+	removeSocket(path);
+}
+
+/*
+ * Buffers are shared in place, each request is returned once all the
+ * subscribers it was sent to have released it.
+ */
+void testShare()
+{
+	std::string path = socketPath();
+	Frames frames(8);
+
+	{
+		LoopThread thread;
+		ShareSink sink(thread.loop(), frames.cache(), path);
+		frames.connect(sink);
+		CHECK(sink.start() == 0);
+
+		FrameSubscriber subscriber;
+		CHECK(subscriber.connect(path) == 0);
+		CHECK(waitSubscribers(sink, 1));
+
+		/* The planes are read in the camera buffers. */
+		FrameSubscriber::Frame first;
+		CHECK(!frames.publish(sink, 0, 1));
+		CHECK(subscriber.receive(&first, 1000) == 0);
+		CHECK(first.buffer == 0);
+		CHECK(Frames::matches(first, 1));
+
+		FrameSubscriber::Frame second;
+		CHECK(!frames.publish(sink, 1, 2));
+		CHECK(subscriber.receive(&second, 1000) == 0);
+		CHECK(second.buffer == 1);
+		CHECK(Frames::matches(second, 2));
+
+		/* A busy subscriber skips the frame, returned right away. */
+		FrameSubscriber::Frame frame;
+		CHECK(frames.publish(sink, 2, 3));
+		CHECK(subscriber.receive(&frame, 50) == -EAGAIN);
+
+		/* Releasing a frame returns its request. */
+		CHECK(subscriber.release(first) == 0);
+		CHECK(frames.waitReleased(0));
+
+		/*
+		 * Releasing it again, a stale sequence and an unknown buffer
+		 * are ignored. The messages are handled in order, the release
+		 * of the next frame tells they have been.
+		 */
+		FrameSubscriber::Frame stale = second;
+		stale.sequence++;
+		FrameSubscriber::Frame unknown = second;
+		unknown.buffer = 100;
+		CHECK(subscriber.release(first) == 0);
+		CHECK(subscriber.release(stale) == 0);
+		CHECK(subscriber.release(unknown) == 0);
+
+		FrameSubscriber::Frame third;
+		CHECK(!frames.publish(sink, 3, 4));
+		CHECK(subscriber.receive(&third, 1000) == 0);
+		CHECK(Frames::matches(third, 4));
+		CHECK(subscriber.release(third) == 0);
+		CHECK(frames.waitReleased(3));
+		CHECK(frames.released(0) == 1);
+		CHECK(frames.released(1) == 0);
+
+		/* A frame sent to two subscribers waits for both. */
+		FrameSubscriber other;
+		CHECK(other.connect(path) == 0);
+		CHECK(waitSubscribers(sink, 2));
+
+		FrameSubscriber::Frame shared;
+		FrameSubscriber::Frame otherShared;
+		CHECK(!frames.publish(sink, 4, 5));
+		CHECK(subscriber.receive(&shared, 1000) == 0);
+		CHECK(other.receive(&otherShared, 1000) == 0);
+		CHECK(Frames::matches(shared, 5));
+		CHECK(Frames::matches(otherShared, 5));
+
+		/*
+		 * The release of a frame only the first subscriber holds tells
+		 * the previous release has been handled.
+		 */
+		CHECK(subscriber.release(shared) == 0);
+		CHECK(subscriber.release(second) == 0);
+		CHECK(frames.waitReleased(1));
+		CHECK(frames.released(4) == 0);
+
+		/* A subscriber going away releases the frames it holds. */
+		other.close();
+		CHECK(frames.waitReleased(4));
+		CHECK(waitSubscribers(sink, 1));
+
+		CHECK(!frames.publish(sink, 5, 6));
+		CHECK(subscriber.receive(&frame, 1000) == 0);
+		CHECK(Frames::matches(frame, 6));
+		subscriber.close();
+		CHECK(frames.waitReleased(5));
+		CHECK(waitSubscribers(sink, 0));
+
+		/* Without subscribers, requests are returned right away. */
+		CHECK(frames.publish(sink, 6, 7));
+
+		/* Nothing is held anymore, stopping returns nothing twice. */
+		sink.stop();
+		thread.stop();
+		sink.close();
+	}
+
+	for (unsigned int i = 0; i < 7; ++i)
+		CHECK(frames.released(i) == 1);
+	CHECK(frames.released(7) == 0);
+
+	removeSocket(path);
+}
+
+/* Stopping the sink returns the requests held, later releases are ignored. */
+void testStop()
+{
+	std::string path = socketPath();
+	Frames frames(2);
+
+	{
+		LoopThread thread;
+		ShareSink sink(thread.loop(), frames.cache(), path);
+		frames.connect(sink);
+		CHECK(sink.start() == 0);
+
+		FrameSubscriber subscriber;
+		CHECK(subscriber.connect(path) == 0);
+		CHECK(waitSubscribers(sink, 1));
+
+		FrameSubscriber::Frame frame;
+		CHECK(!frames.publish(sink, 0, 1));
+		CHECK(subscriber.receive(&frame, 1000) == 0);
+
+		sink.stop();
+		CHECK(frames.released(0) == 1);
+
+		/* The late release and the disconnection return nothing. */
+		CHECK(subscriber.release(frame) == 0);
+		subscriber.close();
+		CHECK(waitSubscribers(sink, 0));
+
+		thread.stop();
+		sink.close();
+	}
+
+	CHECK(frames.released(0) == 1);
+	CHECK(frames.released(1) == 0);
+
+	removeSocket(path);
+}
+
+} /* namespace */
+
+int main()
+{
+	testCopy();
+	testShare();
+	testStop();
+
+	if (failures) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "frames shared and released once" << std::endl;
+	return 0;
+}
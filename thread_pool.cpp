@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * thread_pool.cpp - Fixed size pool of worker threads
+ */
+
+#include "thread_pool.h"
+
+/**
+ * \class ThreadPool
+ * \brief Run tasks on a fixed set of worker threads
+ *
+ * Tasks are executed in submission order by the first idle worker. The pool
+ * doesn't track task completion, callers that need to wait for a group of
+ * tasks are expected to synchronize on their own.
+ *
+ * Pending tasks are stored in a ring buffer that only grows when it is full,
+ * so submitting a task whose callable fits in the std::function small buffer
+ * doesn't allocate memory in steady state.
+ */
+
+/**
+ * \param[in] workers Number of worker threads, 0 to use one per CPU core
+ */
+ThreadPool::ThreadPool(unsigned int workers)
+	: head_(0), count_(0), stop_(false)
+{
+	if (!workers)
+		workers = std::max(1U, std::thread::hardware_concurrency());
+
+	for (unsigned int i = 0; i < workers; ++i)
+		threads_.emplace_back(&ThreadPool::run, this);
+}
+
+/**
+ * Tasks already queued are still executed before the workers exit.
+ */
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stop_ = true;
+	}
+	cond_.notify_all();
+
+	for (std::thread &thread : threads_)
+		thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+
+		if (count_ == tasks_.size()) {
+			std::vector<std::function<void()>> tasks(std::max<size_t>(16, count_ * 2));
+			for (size_t i = 0; i < count_; ++i)
+				tasks[i] = std::move(tasks_[(head_ + i) % count_]);
+
+			tasks_ = std::move(tasks);
+			head_ = 0;
+		}
+
+		tasks_[(head_ + count_) % tasks_.size()] = std::move(task);
+		count_++;
+	}
+	cond_.notify_one();
+}
+
+void ThreadPool::run()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	while (true) {
+		cond_.wait(locker, [this] { return stop_ || count_; });
+		if (!count_)
+			return;
+
+		std::function<void()> task = std::move(tasks_[head_]);
+		head_ = (head_ + 1) % tasks_.size();
+		count_--;
+
+		locker.unlock();
+		task();
+		locker.lock();
+	}
+}
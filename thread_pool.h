@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * thread_pool.h - Fixed size pool of worker threads
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned int workers = 0);
+	~ThreadPool();
+
+	unsigned int size() const { return threads_.size(); }
+
+	void submit(std::function<void()> task);
+
+private:
+	void run();
+
+	std::vector<std::thread> threads_;
+
+	/* Ring buffer of pending tasks, only grown when full */
+	std::vector<std::function<void()>> tasks_;
+	size_t head_;
+	size_t count_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stop_;
+};
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * framesub.cpp - Receive the frames shared by disocamera
+ *
+ * Usage: framesub <socket> [frames] [hold-ms]
+ *
+ * Each frame is read in place, and its checksum printed. hold-ms keeps each
+ * frame for a while before releasing it, as a slow analysis would.
+ */
+
+#include <chrono>
+#include <ctype.h>
+#include <errno.h>
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#include "frame_subscriber.h"
+
+namespace {
+
+std::string fourccName(uint32_t fourcc)
+{
+	std::string name(4, ' ');
+	for (unsigned int i = 0; i < 4; ++i) {
+		char c = (fourcc >> (i * 8)) & 0xff;
+		name[i] = isprint(c) ? c : '.';
+	}
+
+	return name;
+}
+
+/* Adler-32, reading every byte of the frame. */
+uint32_t checksum(const FrameSubscriber::Frame &frame)
+{
+	uint32_t a = 1, b = 0;
+
+	for (unsigned int i = 0; i < frame.numPlanes; ++i) {
+		for (size_t j = 0; j < frame.planeSize[i]; ++j) {
+			a = (a + frame.planes[i][j]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+
+	return (b << 16) | a;
+}
+
+void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " <socket> [frames] [hold-ms]" << std::endl;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 4) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	unsigned long frames = argc > 2 ? strtoul(argv[2], nullptr, 0) : 0;
+	std::chrono::milliseconds hold(argc > 3 ? strtoul(argv[3], nullptr, 0) : 0);
+
+	FrameSubscriber subscriber;
+	int ret = subscriber.connect(argv[1]);
+	if (ret < 0) {
+		std::cerr << "failed to connect to " << argv[1] << ": "
+			  << strerror(-ret) << std::endl;
+		return 1;
+	}
+
+	std::chrono::steady_clock::time_point start;
+	uint64_t last = 0, skipped = 0;
+	unsigned long received = 0;
+
+	while (!frames || received < frames) {
+		FrameSubscriber::Frame frame;
+		ret = subscriber.receive(&frame);
+		if (ret < 0) {
+			if (ret != -EPIPE)
+				std::cerr << "failed to receive frame: "
+					  << strerror(-ret) << std::endl;
+			break;
+		}
+
+		/* Sequences start over when the capture restarts. */
+		if (!received++)
+			start = std::chrono::steady_clock::now();
+		else if (frame.sequence > last)
+			skipped += frame.sequence - last - 1;
+		last = frame.sequence;
+
+		std::cout << std::setw(8) << frame.sequence
+			  << std::setw(22) << frame.timestamp << "  "
+			  << fourccName(frame.fourcc) << "  "
+			  << frame.width << "x" << frame.height
+			  << " stride " << frame.stride << " planes ";
+		for (unsigned int i = 0; i < frame.numPlanes; ++i)
+			std::cout << (i ? "/" : "") << frame.planeSize[i];
+		std::cout << " buffer " << frame.buffer << " adler32 " << std::hex
+			  << std::setw(8) << std::setfill('0') << checksum(frame)
+			  << std::dec << std::setfill(' ') << std::endl;
+
+		if (hold.count())
+			std::this_thread::sleep_for(hold);
+
+		subscriber.release(frame);
+	}
+
+	if (received > 1) {
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << received << " frames received, " << skipped
+			  << " skipped, " << std::fixed << std::setprecision(1)
+			  << (received - 1) / elapsed.count() << " fps" << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * rawframes.cpp - Inspect raw frame segments and extract frames
+ *
+ * Usage: rawframes info <segment>
+ *        rawframes find <segment> <timestamp-ns>
+ *        rawframes extract <segment> <sequence> <output>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "raw_reader.h"
+
+namespace {
+
+std::string fourccName(uint32_t fourcc)
+{
+	std::string name(4, ' ');
+	for (unsigned int i = 0; i < 4; ++i) {
+		char c = (fourcc >> (i * 8)) & 0xff;
+		name[i] = isprint(c) ? c : '.';
+	}
+
+	return name;
+}
+
+void printFrame(const raw::FrameHeader *frame)
+{
+	std::cout << std::setw(8) << frame->sequence
+		  << std::setw(22) << frame->timestamp << "  "
+		  << fourccName(frame->fourcc) << "  "
+		  << frame->width << "x" << frame->height
+		  << " stride " << frame->stride << " planes ";
+
+	for (unsigned int i = 0; i < frame->numPlanes; ++i)
+		std::cout << (i ? "/" : "") << frame->planeSize[i];
+
+	std::cout << std::endl;
+}
+
+int info(const RawSegment &segment)
+{
+	std::cout << segment.size() << " frames, "
+		  << (segment.sealed() ? "indexed" : "not closed, scanned")
+		  << std::endl;
+
+	for (size_t i = 0; i < segment.size(); ++i)
+		printFrame(segment.frame(i));
+
+	return 0;
+}
+
+int find(const RawSegment &segment, uint64_t timestamp)
+{
+	const raw::FrameHeader *frame = segment.findTimestamp(timestamp);
+	if (!frame) {
+		std::cerr << "no frame at or after " << timestamp << std::endl;
+		return 1;
+	}
+
+	printFrame(frame);
+	return 0;
+}
+
+int extract(const RawSegment &segment, uint64_t sequence, const char *output)
+{
+	const raw::FrameHeader *frame = segment.findSequence(sequence);
+	if (!frame) {
+		std::cerr << "no frame with sequence " << sequence << std::endl;
+		return 1;
+	}
+
+	int fd = open(output, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "failed to open " << output << ": "
+			  << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	/* Planes are written straight from the mapped segment. */
+	for (unsigned int i = 0; i < frame->numPlanes; ++i) {
+		const uint8_t *data = segment.plane(frame, i);
+		size_t length = frame->planeSize[i];
+
+		while (length) {
+			ssize_t ret = write(fd, data, length);
+			if (ret < 0) {
+				std::cerr << "write error: " << strerror(errno)
+					  << std::endl;
+				close(fd);
+				return 1;
+			}
+
+			data += ret;
+			length -= ret;
+		}
+	}
+
+	close(fd);
+	printFrame(frame);
+	return 0;
+}
+
+void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " info <segment>" << std::endl
+		  << "       " << name << " find <segment> <timestamp-ns>" << std::endl
+		  << "       " << name << " extract <segment> <sequence> <output>"
+		  << std::endl;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::string command = argv[1];
+	RawSegment segment;
+
+	int ret = segment.open(argv[2]);
+	if (ret < 0) {
+		std::cerr << "failed to open segment " << argv[2] << ": "
+			  << strerror(-ret) << std::endl;
+		return 1;
+	}
+
+	if (command == "info" && argc == 3)
+		return info(segment);
+	if (command == "find" && argc == 4)
+		return find(segment, strtoull(argv[3], nullptr, 0));
+	if (command == "extract" && argc == 5)
+		return extract(segment, strtoull(argv[3], nullptr, 0), argv[4]);
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * trace.cpp - Per-frame span tracing
+ */
+
+#include <array>
+#include <atomic>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace.h"
+
+/**
+ * \namespace trace
+ * \brief Record timestamped spans of the processing of each frame
+ *
+ * A span covers the processing of one frame by one stage, from the sensor
+ * timestamp to the requeue of the request. Spans are tagged with a category,
+ * a name and the sequence number of the frame, and are timed with
+ * CLOCK_MONOTONIC, which makes them directly comparable to the sensor
+ * timestamps.
+ *
+ * Each thread records its spans in its own ring, without locks: the ring is
+ * only written by its thread, and publishes new events with a release store
+ * of its head. When a ring is full, the oldest events are overwritten, the
+ * rings thus hold the last kRingSize spans of each thread.
+ *
+ * The TRACE_* macros compile to nothing unless the tracing build option is
+ * enabled, tracing has no cost otherwise.
+ *
+ * write() exports the rings in the Chrome trace event JSON format, which opens
+ * in Perfetto (https://ui.perfetto.dev) or chrome://tracing. It must be called
+ * once the traced threads are idle, as events being overwritten while they
+ * are exported would be torn.
+ */
+
+namespace trace {
+
+namespace {
+
+constexpr unsigned int kRingSize = 4096;
+
+struct Ring {
+	std::array<Event, kRingSize> events;
+	std::atomic<uint64_t> head;
+	pid_t tid;
+	std::string name;
+};
+
+struct Registry {
+	std::mutex lock;
+	std::vector<std::unique_ptr<Ring>> rings;
+	std::set<std::string> names;
+};
+
+Registry &registry()
+{
+	static Registry registry;
+	return registry;
+}
+
+/*
+ * Rings are owned by the registry, and outlive their threads so that their
+ * events can still be exported.
+ */
+Ring *threadRing()
+{
+	thread_local Ring *ring = nullptr;
+	if (ring)
+		return ring;
+
+	Registry &reg = registry();
+	std::unique_lock<std::mutex> locker(reg.lock);
+
+	reg.rings.push_back(std::make_unique<Ring>());
+	ring = reg.rings.back().get();
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tid = syscall(SYS_gettid);
+	ring->name = "thread " + std::to_string(ring->tid);
+
+	return ring;
+}
+
+void writeString(std::ostream &out, const char *str)
+{
+	out << '"';
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			out << '\\';
+		out << *str;
+	}
+	out << '"';
+}
+
+} /* namespace */
+
+/**
+ * \brief Record a span in the ring of the calling thread
+ * \param[in] category The stage, must outlive the trace
+ * \param[in] name The step of the stage, must outlive the trace
+ * \param[in] sequence The frame sequence number
+ * \param[in] begin The start of the span, from now()
+ * \param[in] end The end of the span, from now()
+ */
+void record(const char *category, const char *name, uint32_t sequence,
+	    uint64_t begin, uint64_t end)
+{
+	Ring *ring = threadRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+	ring->events[head % kRingSize] = { category, name, sequence, begin, end };
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * \brief Name the calling thread in the exported trace
+ */
+void setThreadName(const std::string &name)
+{
+	Ring *ring = threadRing();
+	Registry &reg = registry();
+	std::unique_lock<std::mutex> locker(reg.lock);
+
+	ring->name = name;
+}
+
+/**
+ * \brief Store a copy of a string for the lifetime of the process
+ *
+ * Span names and categories are recorded as pointers, dynamic names are
+ * interned once to outlive their owner.
+ *
+ * \return A pointer to the interned string
+ */
+const char *intern(const std::string &name)
+{
+	Registry &reg = registry();
+	std::unique_lock<std::mutex> locker(reg.lock);
+
+	return reg.names.insert(name).first->c_str();
+}
+
+/**
+ * \brief Retrieve the number of spans recorded by all threads
+ *
+ * Spans overwritten in full rings are included.
+ */
+uint64_t recorded()
+{
+	Registry &reg = registry();
+	std::unique_lock<std::mutex> locker(reg.lock);
+	uint64_t count = 0;
+
+	for (const std::unique_ptr<Ring> &ring : reg.rings)
+		count += ring->head.load(std::memory_order_acquire);
+
+	return count;
+}
+
+/**
+ * \brief Export the spans held by the rings as Chrome trace event JSON
+ */
+void write(std::ostream &out)
+{
+	Registry &reg = registry();
+	std::unique_lock<std::mutex> locker(reg.lock);
+	pid_t pid = getpid();
+	bool first = true;
+
+	auto separator = [&]() {
+		out << (first ? "\n" : ",\n");
+		first = false;
+	};
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::fixed
+	    << std::setprecision(3);
+
+	for (const std::unique_ptr<Ring> &ring : reg.rings) {
+		separator();
+		out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+		    << ",\"tid\":" << ring->tid << ",\"args\":{\"name\":";
+		writeString(out, ring->name.c_str());
+		out << "}}";
+
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t tail = head > kRingSize ? head - kRingSize : 0;
+
+		for (uint64_t i = tail; i < head; ++i) {
+			const Event &event = ring->events[i % kRingSize];
+			uint64_t duration = event.end > event.begin
+					  ? event.end - event.begin : 0;
+
+			separator();
+			out << "{\"ph\":\"X\",\"cat\":";
+			writeString(out, event.category);
+			out << ",\"name\":";
+			writeString(out, event.name);
+			out << ",\"pid\":" << pid << ",\"tid\":" << ring->tid
+			    << ",\"ts\":" << event.begin / 1000.0
+			    << ",\"dur\":" << duration / 1000.0
+			    << ",\"args\":{\"sequence\":" << event.sequence << "}}";
+		}
+	}
+
+	out << "\n]}" << std::endl;
+}
+
+} /* namespace trace */
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * trace.h - Per-frame span tracing
+ */
+
+#pragma once
+
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+namespace trace {
+
+#ifdef DISOCAMERA_TRACING
+constexpr bool kEnabled = true;
+#else
+constexpr bool kEnabled = false;
+#endif
+
+struct Event {
+	const char *category;
+	const char *name;
+	uint32_t sequence;
+	uint64_t begin;
+	uint64_t end;
+};
+
+/* CLOCK_MONOTONIC, the clock of the libcamera sensor timestamps, in ns */
+inline uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record(const char *category, const char *name, uint32_t sequence,
+	    uint64_t begin, uint64_t end);
+void setThreadName(const std::string &name);
+const char *intern(const std::string &name);
+
+uint64_t recorded();
+void write(std::ostream &out);
+
+class Scope
+{
+public:
+	Scope(const char *category, const char *name, uint32_t sequence)
+		: category_(category), name_(name), sequence_(sequence),
+		  begin_(now())
+	{
+	}
+
+	~Scope()
+	{
+		record(category_, name_, sequence_, begin_, now());
+	}
+
+private:
+	const char *category_;
+	const char *name_;
+	uint32_t sequence_;
+	uint64_t begin_;
+};
+
+} /* namespace trace */
+
+/*
+ * Tracing is compiled out unless DISOCAMERA_TRACING is defined, the arguments
+ * of the macros are then not evaluated.
+ */
+#ifdef DISOCAMERA_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(category, name, sequence) \
+	trace::Scope TRACE_CONCAT(traceScope, __LINE__)(category, name, sequence)
+#define TRACE_SPAN(category, name, sequence, begin, end) \
+	trace::record(category, name, sequence, begin, end)
+#define TRACE_BEGIN(var) ((var) = trace::now())
+#define TRACE_THREAD(name) trace::setThreadName(name)
+#else
+#define TRACE_SCOPE(category, name, sequence) do { } while (0)
+#define TRACE_SPAN(category, name, sequence, begin, end) do { } while (0)
+#define TRACE_BEGIN(var) do { } while (0)
+#define TRACE_THREAD(name) do { } while (0)
+#endif
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * trigger_socket.cpp - Local datagram socket receiving triggers
+ */
+
+#include <errno.h>
+#include <iostream>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trigger_socket.h"
+
+/**
+ * \class TriggerSocket
+ * \brief Receive triggers from other processes
+ *
+ * Any datagram sent to the socket counts as one trigger, its content is
+ * ignored. From a shell:
+ *
+ *     python3 -c 'import socket; socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM).sendto(b"t", "/tmp/disocamera-trigger")'
+ *
+ * The socket is non-blocking, fd() is meant to be watched by an event loop
+ * calling receive() when it is readable.
+ */
+
+TriggerSocket::TriggerSocket()
+	: fd_(-1)
+{
+}
+
+TriggerSocket::~TriggerSocket()
+{
+	close();
+}
+
+/**
+ * \brief Bind the socket to a path, replacing any stale socket
+ * \return 0 on success or a negative error code otherwise
+ */
+int TriggerSocket::open(const std::string &path)
+{
+	struct sockaddr_un addr = {};
+
+	close();
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return -errno;
+
+	unlink(path.c_str());
+
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+		int ret = -errno;
+		std::cerr << "failed to bind trigger socket " << path << ": "
+			  << strerror(-ret) << std::endl;
+		::close(fd_);
+		fd_ = -1;
+		return ret;
+	}
+
+	path_ = path;
+	return 0;
+}
+
+void TriggerSocket::close()
+{
+	if (fd_ < 0)
+		return;
+
+	::close(fd_);
+	fd_ = -1;
+	unlink(path_.c_str());
+}
+
+/**
+ * \brief Consume the pending datagrams
+ * \return The number of triggers received
+ */
+unsigned int TriggerSocket::receive()
+{
+	unsigned int count = 0;
+	char buffer[64];
+
+	while (recv(fd_, buffer, sizeof(buffer), 0) >= 0)
+		count++;
+
+	return count;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * trigger_socket.h - Local datagram socket receiving triggers
+ */
+
+#pragma once
+
+#include <string>
+
+class TriggerSocket
+{
+public:
+	TriggerSocket();
+	~TriggerSocket();
+
+	int open(const std::string &path);
+	void close();
+
+	int fd() const { return fd_; }
+	unsigned int receive();
+
+private:
+	int fd_;
+	std::string path_;
+};